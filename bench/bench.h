@@ -0,0 +1,36 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdio.h>
+#include <time.h>
+
+#include "../src/common.h"
+
+/* Keeps the optimiser from discarding a benchmarked result */
+#define BENCH_KEEP(value) __asm__ volatile("" : : "g"(value) : "memory")
+
+static inline u64 bench_now_ns (void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((u64) now.tv_sec * 1000000000ull) + (u64) now.tv_nsec;
+}
+
+/* Prints one result line: time per operation and throughput */
+static inline void bench_report (const char *name, u64 ops, u64 bytes,
+                                 u64 elapsed_ns) {
+    f64 ns_per_op = (f64) elapsed_ns / (f64) (ops ? ops : 1);
+    f64 mib_per_s = ((f64) bytes / (1024.0 * 1024.0)) /
+                    ((f64) (elapsed_ns ? elapsed_ns : 1) / 1e9);
+    printf("  %-40s %10.1f ns/op %10.1f MiB/s\n", name, ns_per_op, mib_per_s);
+}
+
+void bench_scan(void);
+void bench_jscan(void);
+void bench_jwriter(void);
+void bench_arena(void);
+void bench_rope(void);
+void bench_logging(void);
+void bench_suggest(void);
+void bench_tokenize(void);
+
+#endif  // BENCH_H_
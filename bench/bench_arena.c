@@ -0,0 +1,49 @@
+#include <cjson/cJSON.h>
+#include <string.h>
+
+#include "../src/arena.h"
+#include "bench.h"
+
+#define arena_messages 20000
+
+static const char *did_change =
+    "{\"textDocument\":{\"uri\":\"file:///notes.md\",\"version\":42},"
+    "\"contentChanges\":[{\"range\":{\"start\":{\"line\":10,\"character\":4},"
+    "\"end\":{\"line\":10,\"character\":4}},\"rangeLength\":0,\"text\":\"a\"},"
+    "{\"range\":{\"start\":{\"line\":10,\"character\":5},\"end\":{\"line\":10,"
+    "\"character\":5}},\"rangeLength\":0,\"text\":\"b\"}]}";
+
+static void run (const char *name, arena *a) {
+
+    u64 len = strlen(did_change);
+    u64 start = bench_now_ns();
+
+    for (int i = 0; i < arena_messages; ++i) {
+        arena *previous = arena_use(a);
+        cJSON *params = cJSON_ParseWithLength(did_change, len);
+        BENCH_KEEP(params);
+        cJSON_Delete(params);
+        arena_use(previous);
+        if (a) {
+            arena_reset(a);
+        }
+    }
+
+    bench_report(name, arena_messages, len * arena_messages,
+                 bench_now_ns() - start);
+}
+
+void bench_arena (void) {
+
+    arena_hook_cjson();
+
+    printf("Parsing %d didChange params:\n", arena_messages);
+    run("cJSON on the heap", NULL);
+
+    arena a;
+    arena_init(&a, 0);
+    run("cJSON in a reset arena", &a);
+    printf("  %llu allocations per message, %llu bytes peak\n", a.last_allocs,
+           a.peak_bytes);
+    arena_free(&a);
+}
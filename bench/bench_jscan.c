@@ -0,0 +1,58 @@
+#include <cjson/cJSON.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/jscan.h"
+#include "bench.h"
+
+#define jscan_text_size (4 * 1024 * 1024)
+#define jscan_rounds 20
+
+/* A didOpen of a large Markdown file, as sent when opening it */
+static char *build_did_open (u64 *out_len) {
+
+    const char *line = "Some *markdown* text with a \\\"quote\\\" in it.\\n";
+    u64 line_len = strlen(line);
+    char *buf = malloc(jscan_text_size + 256);
+    u64 len = sprintf(buf,
+                      "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\","
+                      "\"params\":{\"textDocument\":{\"uri\":\"file:///a.md\","
+                      "\"languageId\":\"markdown\",\"version\":1,\"text\":\"");
+
+    while (len + line_len < jscan_text_size) {
+        memcpy(buf + len, line, line_len);
+        len += line_len;
+    }
+    len += sprintf(buf + len, "\"}}}");
+
+    *out_len = len;
+    return buf;
+}
+
+void bench_jscan (void) {
+
+    u64 len = 0;
+    char *msg = build_did_open(&len);
+
+    printf("Reading the method of a %llu byte didOpen:\n", len);
+
+    u64 start = bench_now_ns();
+    for (int round = 0; round < jscan_rounds; ++round) {
+        cJSON *json = cJSON_ParseWithLength(msg, len);
+        BENCH_KEEP(cJSON_GetObjectItem(json, "method"));
+        cJSON_Delete(json);
+    }
+    bench_report("cJSON_ParseWithLength", jscan_rounds, len * jscan_rounds,
+                 bench_now_ns() - start);
+
+    start = bench_now_ns();
+    for (int round = 0; round < jscan_rounds; ++round) {
+        jscan_envelope env;
+        BENCH_KEEP(jscan_peek(msg, len, &env));
+        BENCH_KEEP(env.method);
+    }
+    bench_report("jscan_peek", jscan_rounds, len * jscan_rounds,
+                 bench_now_ns() - start);
+
+    free(msg);
+}
@@ -0,0 +1,111 @@
+#include <cjson/cJSON.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/jwriter.h"
+#include "../src/output.h"
+#include "bench.h"
+
+#define jwriter_items 5000
+#define jwriter_rounds 20
+
+/* A completion list as a spell checker would return it */
+static void label_of (int i, char *label, size_t cap) {
+    snprintf(label, cap, "suggestion-%d \"quoted\"", i);
+}
+
+static u64 reply_cjson (pipeline_output *out) {
+
+    char label[64];
+    cJSON *response = cJSON_CreateObject();
+    cJSON_AddStringToObject(response, "jsonrpc", "2.0");
+    cJSON_AddNumberToObject(response, "id", 12);
+
+    cJSON *result = cJSON_CreateObject();
+    cJSON_AddBoolToObject(result, "isIncomplete", false);
+    cJSON *items = cJSON_CreateArray();
+    for (int i = 0; i < jwriter_items; ++i) {
+        label_of(i, label, sizeof(label));
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "label", label);
+        cJSON_AddNumberToObject(item, "kind", 1);
+        cJSON_AddNumberToObject(item, "sortText", i);
+        cJSON_AddItemToArray(items, item);
+    }
+    cJSON_AddItemToObject(result, "items", items);
+    cJSON_AddItemToObject(response, "result", result);
+
+    /* The old reply path: print, measure, copy into the output */
+    char *printed = cJSON_Print(response);
+    u64 len = strlen(printed);
+    output_queue_reply(out, printed, len);
+
+    free(printed);
+    cJSON_Delete(response);
+    return len;
+}
+
+static u64 reply_jwriter (pipeline_output *out) {
+
+    char label[64];
+    jwriter writer;
+    u64 start = out->len;
+
+    jwriter_begin(&writer, out);
+    jwriter_object_begin(&writer);
+    jwriter_key(&writer, "jsonrpc");
+    jwriter_string(&writer, "2.0", 3);
+    jwriter_key(&writer, "id");
+    jwriter_raw(&writer, "12", 2);
+    jwriter_key(&writer, "result");
+    jwriter_object_begin(&writer);
+    jwriter_key(&writer, "isIncomplete");
+    jwriter_bool(&writer, false);
+    jwriter_key(&writer, "items");
+    jwriter_array_begin(&writer);
+    for (int i = 0; i < jwriter_items; ++i) {
+        label_of(i, label, sizeof(label));
+        jwriter_object_begin(&writer);
+        jwriter_key(&writer, "label");
+        jwriter_cstring(&writer, label);
+        jwriter_key(&writer, "kind");
+        jwriter_int(&writer, 1);
+        jwriter_key(&writer, "sortText");
+        jwriter_int(&writer, i);
+        jwriter_object_end(&writer);
+    }
+    jwriter_array_end(&writer);
+    jwriter_object_end(&writer);
+    jwriter_object_end(&writer);
+    jwriter_end(&writer);
+
+    return out->len - start - OUTPUT_HEADER_MAX;
+}
+
+static void run (const char *name, u64 (*reply)(pipeline_output *)) {
+
+    pipeline_output out;
+    output_init(&out, -1);
+
+    u64 bytes = 0;
+    u64 start = bench_now_ns();
+    for (int round = 0; round < jwriter_rounds; ++round) {
+        bytes += reply(&out);
+        /* Drop the frame instead of writing it */
+        out.len = 0;
+        out.frame_count = 0;
+    }
+    u64 elapsed = bench_now_ns() - start;
+
+    bench_report(name, jwriter_rounds, bytes, elapsed);
+    output_free(&out);
+}
+
+void bench_jwriter (void) {
+
+    printf("Serialising a %d item completion reply:\n", jwriter_items);
+    run("cJSON tree + cJSON_Print + copy", reply_cjson);
+    run("jwriter into the output", reply_jwriter);
+}
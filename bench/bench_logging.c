@@ -0,0 +1,32 @@
+#include "../src/logging.h"
+#include "bench.h"
+
+#define logging_calls 1000000
+/* Enabled calls are flushed in batches so the ring never drops */
+#define logging_batch 512
+
+static const char *text = "Content-Length: 1024, a message body follows";
+
+static void run (const char *name, log_type_e level) {
+
+    log_set_level(level);
+    u64 start = bench_now_ns();
+
+    for (int i = 0; i < logging_calls; ++i) {
+        log_debug("Content read: `%.24s [...]` `%d`", text, i);
+        if (i % logging_batch == 0 && level >= LOG_TYPE_DEBUG) {
+            log_flush();
+        }
+    }
+    log_flush();
+
+    bench_report(name, logging_calls, 0, bench_now_ns() - start);
+}
+
+void bench_logging (void) {
+
+    printf("Logging %d debug lines:\n", logging_calls);
+    run("log_debug, written to /dev/null", LOG_TYPE_ALL);
+    run("log_debug, below the runtime level", LOG_TYPE_INFO);
+    log_set_level(LOG_TYPE_ALL);
+}
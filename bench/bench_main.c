@@ -0,0 +1,23 @@
+#include <stdio.h>
+
+#include "../src/logging.h"
+#include "bench.h"
+
+/* Runs every microbenchmark, build with `make bench DEBUG= SANITIZER=` */
+int main (void) {
+
+    /* Logging would dominate every measurement */
+    yama_log_init_file(fopen("/dev/null", "w"));
+
+    bench_scan();
+    bench_jscan();
+    bench_jwriter();
+    bench_arena();
+    bench_rope();
+    bench_logging();
+    bench_suggest();
+    bench_tokenize();
+
+    log_close_file();
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/rope.h"
+#include "bench.h"
+
+#define rope_doc_size (4 * 1024 * 1024)
+#define rope_edits 20000
+
+/* Typing at scattered places, as a client sends it one key at a time */
+static u64 edit_at (u64 i, u64 len) {
+    return (i * 2654435761ull) % len;
+}
+
+void bench_rope (void) {
+
+    char *flat = malloc(rope_doc_size + rope_edits);
+    for (u64 i = 0; i < rope_doc_size; ++i) {
+        flat[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+    }
+    u64 len = rope_doc_size;
+
+    printf("Inserting %d single characters into a 4 MiB document:\n",
+           rope_edits);
+
+    u64 start = bench_now_ns();
+    for (u64 i = 0; i < rope_edits; ++i) {
+        u64 at = edit_at(i, len);
+        memmove(flat + at + 1, flat + at, len - at);
+        flat[at] = 'x';
+        len++;
+    }
+    BENCH_KEEP(flat);
+    bench_report("memmove in a flat buffer", rope_edits, rope_edits,
+                 bench_now_ns() - start);
+
+    rope r = {0};
+    rope_set(&r, flat, rope_doc_size);
+    len = rope_doc_size;
+
+    start = bench_now_ns();
+    for (u64 i = 0; i < rope_edits; ++i) {
+        rope_insert(&r, edit_at(i, len), "x", 1);
+        len++;
+    }
+    BENCH_KEEP(r.root);
+    bench_report("rope insert", rope_edits, rope_edits,
+                 bench_now_ns() - start);
+
+    start = bench_now_ns();
+    for (u64 i = 0; i < rope_edits; ++i) {
+        BENCH_KEEP(rope_offset_of(&r, (i * 7919) % 65536, 40, ROPE_UTF16));
+    }
+    bench_report("rope line/character to offset", rope_edits, rope_edits,
+                 bench_now_ns() - start);
+
+    start = bench_now_ns();
+    for (u64 i = 0; i < rope_edits; ++i) {
+        BENCH_KEEP(rope_offset_of(&r, (i * 7919) % 65536, 40, ROPE_UTF8));
+    }
+    bench_report("rope line/byte to offset (utf-8)", rope_edits, rope_edits,
+                 bench_now_ns() - start);
+
+    start = bench_now_ns();
+    for (u64 i = 0; i < rope_edits; ++i) {
+        u64 line, character;
+        rope_position_of(&r, edit_at(i, len), ROPE_UTF16, &line,
+                         &character);
+        BENCH_KEEP(line + character);
+    }
+    bench_report("rope offset to line/character", rope_edits, rope_edits,
+                 bench_now_ns() - start);
+
+    /* A snapshot per keystroke makes every edit copy its path */
+    start = bench_now_ns();
+    for (u64 i = 0; i < rope_edits; ++i) {
+        rope snapshot = rope_snapshot(&r);
+        rope_insert(&r, edit_at(i, len), "x", 1);
+        len++;
+        rope_free(&snapshot);
+    }
+    bench_report("rope insert behind a snapshot", rope_edits, rope_edits,
+                 bench_now_ns() - start);
+
+    rope_free(&r);
+    free(flat);
+}
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/pipeline.h"
+#include "../src/scan.h"
+#include "bench.h"
+
+#define scan_messages 20000
+#define scan_rounds 20
+#define legacy_line_size 64
+
+static const char *notification =
+    "{\"jsonrpc\":\"2.0\",\"method\":\"$/progress\",\"params\":"
+    "{\"token\":1,\"value\":{\"kind\":\"report\"}}}";
+
+/* Many small notifications back to back, as an editor pipelines them */
+static char *build_input (u64 *out_len) {
+
+    u64 body_len = strlen(notification);
+    u64 cap = scan_messages * (body_len + 64);
+    char *buf = malloc(cap);
+    u64 len = 0;
+
+    for (int i = 0; i < scan_messages; ++i) {
+        len += snprintf(buf + len, cap - len, "Content-Length: %llu\r\n\r\n%s",
+                        body_len, notification);
+    }
+    *out_len = len;
+    return buf;
+}
+
+/* The framing loop as it was: copy each line out, strcmp for the break and
+   parse the previous line */
+static u64 frame_legacy (const char *buf, u64 len) {
+
+    char prev_line[legacy_line_size] = {0};
+    char line[legacy_line_size] = {0};
+    u64 pos = 0;
+    u64 total = 0;
+
+    while (pos < len) {
+        while (true) {
+            u64 n = 0;
+            while (n < legacy_line_size - 1 && pos < len) {
+                line[n++] = buf[pos++];
+                if (line[n - 1] == '\n') {
+                    break;
+                }
+            }
+            line[n] = '\0';
+            if (strcmp("\r\n", line) == 0) {
+                break;
+            }
+            memcpy(prev_line, line, legacy_line_size);
+        }
+        u64 content_len = pipeline_parse_content_len(prev_line);
+        pos += content_len;
+        total += content_len;
+    }
+    return total;
+}
+
+static u64 frame_scan (const char *buf, u64 len) {
+
+    u64 pos = 0;
+    u64 total = 0;
+
+    while (pos < len) {
+        u64 content_len = 0;
+        i64 body = scan_headers(buf + pos, len - pos, &content_len);
+        if (body < 0) {
+            break;
+        }
+        pos += body + content_len;
+        total += content_len;
+    }
+    return total;
+}
+
+static void run (const char *name, u64 (*frame)(const char *, u64),
+                 const char *buf, u64 len) {
+
+    u64 start = bench_now_ns();
+    for (int round = 0; round < scan_rounds; ++round) {
+        BENCH_KEEP(frame(buf, len));
+    }
+    u64 elapsed = bench_now_ns() - start;
+
+    bench_report(name, (u64) scan_messages * scan_rounds,
+                 len * scan_rounds, elapsed);
+}
+
+void bench_scan (void) {
+
+    u64 len = 0;
+    char *input = build_input(&len);
+
+    printf("Header framing, %d pipelined notifications (%llu bytes):\n",
+           scan_messages, len);
+
+    run("legacy fgets/strcmp/strtol", frame_legacy, input, len);
+
+    const scan_impl impls[] = {SCAN_IMPL_SCALAR, SCAN_IMPL_SSE2,
+                               SCAN_IMPL_AVX2};
+    for (size_t i = 0; i < ARRAY_LENGTH(impls); ++i) {
+        if (scan_use_impl(impls[i]) != impls[i]) {
+            continue;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "scan_headers (%s)",
+                 scan_impl_name(impls[i]));
+        run(name, frame_scan, input, len);
+    }
+    scan_use_impl(SCAN_IMPL_AUTO);
+
+    free(input);
+}
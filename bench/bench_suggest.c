@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/dict.h"
+#include "../src/dict_build.h"
+#include "bench.h"
+
+#define suggest_words 100000
+#define suggest_probes 20000
+/* A scan of every word is slow, a few of the probes are enough */
+#define suggest_brute_probes 200
+#define suggest_top 5
+
+static u64 seed = 7;
+
+static u32 next_random (void) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    return (u32) (seed >> 33);
+}
+
+/* Letters about as often as in English text */
+static char random_letter (void) {
+
+    static const char weighted[] = "eeeeeeeeeeeetttttttttaaaaaaaaoooooooiiiiiii"
+                                   "nnnnnnnssssssrrrrrrhhhhhhllllddddcccuuummm"
+                                   "ffppggwwyybvkxjqz";
+    return weighted[next_random() % (sizeof(weighted) - 1)];
+}
+
+/* One or two typos: a swap, a dropped, an extra or a wrong letter */
+static u64 misspell (const char *word, u64 len, char *out) {
+
+    memcpy(out, word, len);
+    u32 typos = 1 + next_random() % 2;
+    for (u32 t = 0; t < typos && len > 1; ++t) {
+        u64 at = next_random() % len;
+        switch (next_random() % 4) {
+            case 0:
+                if (at + 1 < len) {
+                    char c = out[at];
+                    out[at] = out[at + 1];
+                    out[at + 1] = c;
+                }
+                break;
+            case 1:
+                memmove(out + at, out + at + 1, len - at - 1);
+                len--;
+                break;
+            case 2:
+                memmove(out + at + 1, out + at, len - at);
+                out[at] = random_letter();
+                len++;
+                break;
+            default:
+                out[at] = random_letter();
+                break;
+        }
+    }
+    return len;
+}
+
+/* What the index replaces: the distance to every word */
+static u32 brute_force (const dict_builder *builder, const char *word, u64 len) {
+
+    u32 found = 0;
+    for (u64 i = 0; i < builder->count; ++i) {
+        const dict_word *entry = &builder->words[i];
+        found += dict_distance((const u8 *) word, (u32) len,
+                               (const u8 *) builder->text + entry->offset,
+                               entry->len, DICT_SUGGEST_MAX_DISTANCE) <=
+                 DICT_SUGGEST_MAX_DISTANCE;
+    }
+    return found;
+}
+
+void bench_suggest (void) {
+
+    dict_builder builder = {.suggest_distance = DICT_SUGGEST_MAX_DISTANCE};
+    char word[32];
+    for (int i = 0; i < suggest_words; ++i) {
+        u64 len = 3 + next_random() % 10;
+        for (u64 c = 0; c < len; ++c) {
+            word[c] = random_letter();
+        }
+        /* Roughly Zipf, a few words far more common than the rest */
+        dict_builder_add_counted(&builder, word, len,
+                                 1000000 / (1 + next_random() % 1000));
+    }
+
+    u64 start = bench_now_ns();
+    u64 size;
+    dict_build_stats stats;
+    u8 *image = dict_builder_finish(&builder, &size, &stats);
+    u64 build_ns = bench_now_ns() - start;
+
+    dict d;
+    dict_load(&d, image, size);
+
+    printf("Suggesting for %d typos against %llu words:\n", suggest_probes,
+           stats.unique);
+    printf("  index of %llu postings, %.1f MiB of %.1f MiB, built in %.0f ms\n",
+           stats.postings, (f64) stats.suggest_bytes / (1024.0 * 1024.0),
+           (f64) stats.bytes / (1024.0 * 1024.0), (f64) build_ns / 1e6);
+
+    char (*probes)[32] = malloc(suggest_probes * sizeof(*probes));
+    u64 *probe_lens = malloc(suggest_probes * sizeof(u64));
+    u64 *origins = malloc(suggest_probes * sizeof(u64));
+    for (int i = 0; i < suggest_probes; ++i) {
+        origins[i] = next_random() % builder.count;
+        const dict_word *entry = &builder.words[origins[i]];
+        probe_lens[i] = misspell(builder.text + entry->offset, entry->len,
+                                 probes[i]);
+    }
+
+    dict_suggestion found[suggest_top];
+    u64 hits = 0;
+    start = bench_now_ns();
+    for (int i = 0; i < suggest_probes; ++i) {
+        u32 count = dict_suggest(&d, probes[i], probe_lens[i],
+                                 DICT_SUGGEST_MAX_DISTANCE, found,
+                                 suggest_top);
+        const dict_word *origin = &builder.words[origins[i]];
+        for (u32 s = 0; s < count; ++s) {
+            if (found[s].len == origin->len &&
+                memcmp(found[s].word, builder.text + origin->offset,
+                       origin->len) == 0) {
+                hits++;
+                break;
+            }
+        }
+    }
+    bench_report("delete index, top 5", suggest_probes, 0,
+                 bench_now_ns() - start);
+
+    start = bench_now_ns();
+    for (int i = 0; i < suggest_brute_probes; ++i) {
+        BENCH_KEEP(brute_force(&builder, probes[i], probe_lens[i]));
+    }
+    bench_report("distance to every word", suggest_brute_probes, 0,
+                 bench_now_ns() - start);
+
+    printf("  intended word among the top %d for %.1f%% of typos\n",
+           suggest_top, 100.0 * (f64) hits / suggest_probes);
+
+    free(probes);
+    free(probe_lens);
+    free(origins);
+    free(image);
+    dict_builder_free(&builder);
+}
@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/scan.h"
+#include "../src/tokenize.h"
+#include "bench.h"
+
+#define tokenize_doc_size (4 * 1024 * 1024)
+#define tokenize_rounds 10
+
+static u64 seed = 11;
+
+static u32 next_random (void) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    return (u32) (seed >> 33);
+}
+
+static const char *plain_words[] = {
+    "the",    "server", "reads",     "every",  "document", "and",
+    "checks", "its",    "spelling",  "a",      "word",     "at",
+    "time",   "don't",  "well-known", "into",  "Markdown", "with",
+};
+
+/* The same words typeset: curly quotes, dashes and accented letters */
+static const char *typeset_words[] = {
+    "the",    "server", "reads",     "every",        "document",
+    "and",    "checks", "it\xe2\x80\x99s", "spelling", "\xe2\x80\x94",
+    "word",   "caf\xc3\xa9", "time", "don\xe2\x80\x99t", "well-known",
+    "\xe2\x80\x9cinto\xe2\x80\x9d", "Markdown", "na\xc3\xafve",
+};
+
+/* Paragraphs, headings, lists, code spans and links, as a README has */
+static u64 build_markdown (char *out, u64 size, const char **words,
+                           u64 word_count) {
+
+    u64 len = 0;
+    while (len + 256 < size) {
+        switch (next_random() % 8) {
+            case 0:
+                len += (u64) sprintf(out + len, "## Section %u\n\n",
+                                     next_random() % 100);
+                break;
+            case 1:
+                len += (u64) sprintf(out + len, "- item `code_%u` ",
+                                     next_random() % 1000);
+                break;
+            case 2:
+                len += (u64) sprintf(out + len,
+                                     "[a link](https://example.com/%u) ",
+                                     next_random() % 1000);
+                break;
+            default:
+                break;
+        }
+        u32 sentence = 5 + next_random() % 15;
+        for (u32 w = 0; w < sentence; ++w) {
+            const char *word = words[next_random() % word_count];
+            u64 word_len = strlen(word);
+            memcpy(out + len, word, word_len);
+            len += word_len;
+            out[len++] = ' ';
+        }
+        memcpy(out + len, ".\n", 2);
+        len += 2;
+    }
+    return len;
+}
+
+static void run (const char *doc, u64 len, word_spans *words) {
+
+    const scan_impl impls[] = {SCAN_IMPL_SCALAR, SCAN_IMPL_SSE2,
+                               SCAN_IMPL_AVX2};
+    for (size_t i = 0; i < ARRAY_LENGTH(impls); ++i) {
+        if (scan_use_impl(impls[i]) != impls[i]) {
+            continue;
+        }
+        u64 start = bench_now_ns();
+        for (int round = 0; round < tokenize_rounds; ++round) {
+            BENCH_KEEP(tokenize_words(doc, len, words));
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "tokenize_words (%s)",
+                 scan_impl_name(impls[i]));
+        bench_report(name, tokenize_rounds, len * tokenize_rounds,
+                     bench_now_ns() - start);
+    }
+    scan_use_impl(SCAN_IMPL_AUTO);
+}
+
+void bench_tokenize (void) {
+
+    char *doc = malloc(tokenize_doc_size);
+    word_spans words = {0};
+
+    u64 len = build_markdown(doc, tokenize_doc_size, plain_words,
+                             ARRAY_LENGTH(plain_words));
+    printf("Splitting %llu bytes of ASCII Markdown into words:\n", len);
+    run(doc, len, &words);
+
+    len = build_markdown(doc, tokenize_doc_size, typeset_words,
+                         ARRAY_LENGTH(typeset_words));
+    printf("Splitting %llu bytes of typeset Markdown into words:\n", len);
+    run(doc, len, &words);
+
+    word_spans_free(&words);
+    free(doc);
+}
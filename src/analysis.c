@@ -0,0 +1,91 @@
+#include "analysis.h"
+
+#include <assert.h>
+#include <time.h>
+
+#include "common.h"
+
+#define ns_per_second (1000ull * 1000 * 1000)
+
+/* CLOCK_MONOTONIC in nanoseconds, never 0 */
+u64 analysis_now (void) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64) now.tv_sec * ns_per_second + (u64) now.tv_nsec + 1;
+}
+
+/* Asks for `doc` to be analysed once it has been quiet for the debounce
+   window, pushing back the analysis it is waiting for already */
+void analysis_request (analysis_sched *sched, Document *doc, u64 now) {
+
+    assert(sched && doc);
+
+    sched->requested++;
+    if (doc->analysis_due) {
+        sched->coalesced++;
+    } else {
+        sched->pending++;
+    }
+    doc->analysis_due = now + sched->debounce_ns;
+    sched->active = doc->hash;
+}
+
+/**
+ * analysis_next_due
+ * Finds the earliest deadline. Walks the store, so it is only done while
+ * something is pending.
+ *
+ * Returns: The deadline in analysis_now time, 0 if nothing is pending.
+ **/
+u64 analysis_next_due (analysis_sched *sched, docstore *store) {
+
+    assert(sched && store);
+
+    if (sched->pending == 0) {
+        return 0;
+    }
+
+    u64 next = 0;
+    u64 pending = 0;
+    for (u64 i = 0; i < store->capacity; ++i) {
+        Document *doc = store->slots[i];
+        if (!doc || !doc->analysis_due) {
+            continue;
+        }
+        pending++;
+        if (!next || doc->analysis_due < next) {
+            next = doc->analysis_due;
+        }
+    }
+    /* Forget about documents closed while they were waiting */
+    sched->pending = pending;
+    return next;
+}
+
+/**
+ * analysis_take_due
+ * Collects documents whose deadline has passed and clears their deadline.
+ *
+ * Arguments: `Document **due`, `u64 cap`, where to put them.
+ * Returns: How many were stored, anything past `cap` stays pending.
+ **/
+u64 analysis_take_due (analysis_sched *sched, docstore *store, u64 now,
+                       Document **due, u64 cap) {
+
+    assert(sched && store && (due || cap == 0));
+
+    u64 count = 0;
+    for (u64 i = 0; i < store->capacity && sched->pending > 0 && count < cap;
+         ++i) {
+        Document *doc = store->slots[i];
+        if (!doc || !doc->analysis_due || doc->analysis_due > now) {
+            continue;
+        }
+        doc->analysis_due = 0;
+        sched->pending--;
+        sched->run++;
+        due[count++] = doc;
+    }
+    return count;
+}
@@ -0,0 +1,35 @@
+#ifndef ANALYSIS_H_
+#define ANALYSIS_H_
+
+#include "common.h"
+#include "docstore.h"
+
+/**
+ * Debounced analysis of open documents. Every edit pushes the document's
+ * deadline back by the debounce window, so a burst of didChange
+ * notifications is applied edit by edit but analysed once, at the version
+ * it ends with, after the document has gone quiet.
+ **/
+typedef struct analysis_sched {
+    /* Quiet time before a document is analysed */
+    u64 debounce_ns;
+    /* Documents with a deadline, closed ones are only dropped on a scan */
+    u64 pending;
+    /* Hash of the document edited last, taken to be the one in front */
+    u64 active;
+
+    /* Statistics */
+    /* Opens and edits asking for an analysis */
+    u64 requested;
+    /* Requests folded into an analysis which was pending already */
+    u64 coalesced;
+    u64 run;
+} analysis_sched;
+
+u64 analysis_now(void);
+void analysis_request(analysis_sched *sched, Document *doc, u64 now);
+u64 analysis_next_due(analysis_sched *sched, docstore *store);
+u64 analysis_take_due(analysis_sched *sched, docstore *store, u64 now,
+                      Document **due, u64 cap);
+
+#endif  // ANALYSIS_H_
@@ -0,0 +1,203 @@
+#include "arena.h"
+
+#include <assert.h>
+#include <cjson/cJSON.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "logging.h"
+
+#ifdef NDEBUG
+    #define arena_default_block (64 * 1024)
+#else
+    #define arena_default_block 256
+#endif
+
+#define arena_align (sizeof(max_align_t))
+
+/* The arena cJSON allocates from on this thread, NULL for the heap */
+static _Thread_local arena *current_arena = NULL;
+static pthread_once_t cjson_hooks_once = PTHREAD_ONCE_INIT;
+
+void arena_init (arena *a, u64 block_size) {
+
+    assert(a);
+
+    memset(a, 0, sizeof(*a));
+    a->block_size = block_size;
+}
+
+void arena_free (arena *a) {
+
+    if (!a) {
+        return;
+    }
+
+    arena_block *block = a->blocks;
+    while (block) {
+        arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    a->blocks = NULL;
+}
+
+static arena_block *new_block (u64 cap) {
+
+    arena_block *block = malloc(sizeof(arena_block) + cap);
+    if (!block) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+    block->next = NULL;
+    block->cap = cap;
+    block->used = 0;
+    return block;
+}
+
+/**
+ * arena_alloc
+ * Bumps `size` bytes, aligned for any type, out of the newest block. A new
+ * block at least twice as big as the last one is chained in when it runs
+ * out.
+ *
+ * Returns: The memory, valid until the next arena_reset.
+ **/
+void *arena_alloc (arena *a, u64 size) {
+
+    assert(a);
+
+    u64 rounded = (size + arena_align - 1) & ~(u64) (arena_align - 1);
+    if (rounded == 0) {
+        rounded = arena_align;
+    }
+
+    arena_block *block = a->blocks;
+
+    if (!block || block->cap - block->used < rounded) {
+        u64 cap = a->block_size ? a->block_size : arena_default_block;
+        if (block && cap < block->cap * 2) {
+            cap = block->cap * 2;
+        }
+        while (cap < rounded) {
+            cap *= 2;
+        }
+        arena_block *fresh = new_block(cap);
+        fresh->next = block;
+        a->blocks = block = fresh;
+    }
+
+    void *ptr = (char *) block->data + block->used;
+    block->used += rounded;
+
+    a->allocs++;
+    a->total_allocs++;
+    a->bytes += rounded;
+    if (a->bytes > a->peak_bytes) {
+        a->peak_bytes = a->bytes;
+    }
+    return ptr;
+}
+
+/* Copies `len` bytes into the arena and NUL terminates them */
+char *arena_strndup (arena *a, const char *str, u64 len) {
+
+    char *copy = arena_alloc(a, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/**
+ * arena_reset
+ * Releases everything allocated since the last reset. When the cycle spilled
+ * over into several blocks they are replaced by one which fits all of it, so
+ * the next message of that size needs no new block.
+ **/
+void arena_reset (arena *a) {
+
+    assert(a);
+
+    if (a->blocks && a->blocks->next) {
+        u64 cap = 0;
+        for (arena_block *block = a->blocks; block; block = block->next) {
+            cap += block->cap;
+        }
+        arena_free(a);
+        a->blocks = new_block(cap);
+    } else if (a->blocks) {
+        a->blocks->used = 0;
+    }
+
+    a->last_allocs = a->allocs;
+    a->last_bytes = a->bytes;
+    a->allocs = 0;
+    a->bytes = 0;
+    a->resets++;
+}
+
+bool arena_owns (const arena *a, const void *ptr) {
+
+    assert(a);
+
+    uintptr_t at = (uintptr_t) ptr;
+    for (arena_block *block = a->blocks; block; block = block->next) {
+        uintptr_t start = (uintptr_t) block->data;
+        if (at >= start && at < start + block->cap) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * arena_use
+ * Makes `a` the arena cJSON allocates from on the calling thread.
+ *
+ * Arguments: `arena *a`, the arena, NULL to go back to the heap.
+ * Returns: The arena used before, to be restored by the caller.
+ **/
+arena *arena_use (arena *a) {
+
+    arena *previous = current_arena;
+    current_arena = a;
+    return previous;
+}
+
+arena *arena_current (void) {
+    return current_arena;
+}
+
+static void *cjson_malloc (size_t size) {
+
+    if (current_arena) {
+        return arena_alloc(current_arena, size);
+    }
+    return malloc(size);
+}
+
+/* Arena memory goes away with the reset, everything else was malloc'ed */
+static void cjson_free (void *ptr) {
+
+    if (current_arena && arena_owns(current_arena, ptr)) {
+        return;
+    }
+    free(ptr);
+}
+
+static void install_cjson_hooks (void) {
+
+    cJSON_Hooks hooks = {
+        .malloc_fn = cjson_malloc,
+        .free_fn = cjson_free,
+    };
+    cJSON_InitHooks(&hooks);
+}
+
+/* Routes cJSON's allocations through the current arena, idempotent */
+void arena_hook_cjson (void) {
+    pthread_once(&cjson_hooks_once, install_cjson_hooks);
+}
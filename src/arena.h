@@ -0,0 +1,51 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "common.h"
+
+/* One chunk of arena memory, allocations are bumped out of `data` */
+typedef struct arena_block {
+    struct arena_block *next;
+    u64 cap;
+    u64 used;
+    max_align_t data[];
+} arena_block;
+
+/**
+ * Bump allocator for memory that lives exactly as long as one message.
+ * Nothing is freed individually, arena_reset drops everything at once and
+ * keeps a single block big enough for the largest message seen so far.
+ * A zeroed arena is ready to use.
+ **/
+typedef struct arena {
+    /* Newest block first */
+    arena_block *blocks;
+    u64 block_size;
+
+    /* Since the last reset */
+    u64 allocs;
+    u64 bytes;
+    /* Of the cycle ended by the last reset */
+    u64 last_allocs;
+    u64 last_bytes;
+    /* Over the arena's lifetime */
+    u64 peak_bytes;
+    u64 total_allocs;
+    u64 resets;
+} arena;
+
+void arena_init(arena *a, u64 block_size);
+void arena_free(arena *a);
+void *arena_alloc(arena *a, u64 size);
+char *arena_strndup(arena *a, const char *str, u64 len);
+void arena_reset(arena *a);
+bool arena_owns(const arena *a, const void *ptr);
+
+arena *arena_use(arena *a);
+arena *arena_current(void);
+void arena_hook_cjson(void);
+
+#endif  // ARENA_H_
@@ -0,0 +1,595 @@
+#include "dict.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "dict_format.h"
+#include "logging.h"
+
+/* Longest word a suggestion is looked for, and the longest in the index */
+#define dict_max_word 255
+/* Candidates a suggestion looks at before giving up on the rest */
+#define suggest_seen_cap 2048
+
+/* How a word is folded while it is looked up, so no copy is needed */
+typedef enum dict_fold {
+    FOLD_NONE,
+    /* "Apple" as "apple" */
+    FOLD_FIRST,
+    /* "APPLE" as "apple" */
+    FOLD_ALL,
+    /* "PARIS" as "Paris" */
+    FOLD_TAIL,
+} dict_fold;
+
+static inline u8 ascii_lower (u8 c) {
+    return (c >= 'A' && c <= 'Z') ? (u8) (c + ('a' - 'A')) : c;
+}
+
+static inline bool ascii_upper (u8 c) {
+    return c >= 'A' && c <= 'Z';
+}
+
+const char *dict_status_str (dict_status status) {
+
+    switch (status) {
+        case DICT_OK:
+            return "ok";
+        case DICT_ERR_IO:
+            return "could not be read";
+        case DICT_ERR_FORMAT:
+            return "is not a dictionary";
+        case DICT_ERR_VERSION:
+            return "was built for another version";
+        case DICT_ERR_CHECKSUM:
+            return "is damaged";
+        default:
+            return "unknown error";
+    }
+}
+
+/* Points `d` at the suggestion index in `data`, false if it does not fit
+   in its section */
+static bool load_suggest (dict *d, const u8 *data, u64 len) {
+
+    dict_suggest_header header;
+    if (len < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    if (header.max_distance > DICT_SUGGEST_MAX_DISTANCE ||
+        header.prefix_len != DICT_SUGGEST_PREFIX || header.bucket_count == 0 ||
+        (header.bucket_count & (header.bucket_count - 1)) != 0) {
+        return false;
+    }
+
+    /* Each array in turn, without overflowing on absurd counts */
+    u64 at = sizeof(header);
+    if (header.word_count > (len - at) / sizeof(dict_suggest_word)) {
+        return false;
+    }
+    u64 words_at = at;
+    at += header.word_count * sizeof(dict_suggest_word);
+
+    if (header.bucket_count >= (len - at) / sizeof(u32)) {
+        return false;
+    }
+    u64 buckets_at = at;
+    at += (header.bucket_count + 1) * sizeof(u32);
+
+    if (header.posting_count > (len - at) / sizeof(u32)) {
+        return false;
+    }
+    u64 postings_at = at;
+    at += header.posting_count * sizeof(u32);
+
+    if (header.text_len > len - at) {
+        return false;
+    }
+
+    const u32 *bucket_start = (const u32 *) (data + buckets_at);
+    if (bucket_start[header.bucket_count] != header.posting_count) {
+        return false;
+    }
+
+    d->suggest = (const dict_suggest_header *) data;
+    d->suggest_words = (const dict_suggest_word *) (data + words_at);
+    d->bucket_start = bucket_start;
+    d->postings = (const u32 *) (data + postings_at);
+    d->suggest_text = data + at;
+    return true;
+}
+
+/**
+ * dict_load
+ * Validates a dictionary image and points `d` into it. The header,
+ * version and section table are checked before anything else, then the
+ * checksum and every edge, so lookups never have to bounds check.
+ *
+ * Arguments: `const void *data`, `u64 size`, the image, 8 byte aligned.
+ *            It is borrowed and must outlive `d`.
+ * Returns: DICT_OK, or why the image was refused, leaving `d` zeroed.
+ **/
+dict_status dict_load (dict *d, const void *data, u64 size) {
+
+    assert(d && (data || size == 0));
+
+    memset(d, 0, sizeof(*d));
+
+    const u8 *bytes = data;
+    dict_header header;
+    if (size < sizeof(header)) {
+        return DICT_ERR_FORMAT;
+    }
+    memcpy(&header, bytes, sizeof(header));
+
+    if (memcmp(header.magic, DICT_MAGIC, DICT_MAGIC_LEN) != 0) {
+        return DICT_ERR_FORMAT;
+    }
+    if (header.version != DICT_VERSION) {
+        return DICT_ERR_VERSION;
+    }
+    if (header.file_size != size) {
+        return DICT_ERR_CHECKSUM;
+    }
+    if (header.section_count >
+        (size - sizeof(header)) / sizeof(dict_section)) {
+        return DICT_ERR_FORMAT;
+    }
+
+    const dict_section *sections =
+        (const dict_section *) (bytes + sizeof(header));
+    const dict_section *dawg = NULL;
+    const dict_section *suggest = NULL;
+    for (u32 i = 0; i < header.section_count; ++i) {
+        if (sections[i].offset % 8 != 0 || sections[i].offset > size ||
+            sections[i].length > size - sections[i].offset) {
+            return DICT_ERR_FORMAT;
+        }
+        if (sections[i].kind == DICT_SECTION_DAWG) {
+            dawg = &sections[i];
+        } else if (sections[i].kind == DICT_SECTION_SUGGEST) {
+            suggest = &sections[i];
+        }
+    }
+    if (!dawg || dawg->length % sizeof(u32) != 0 ||
+        dawg->length / sizeof(u32) > DICT_MAX_EDGES) {
+        return DICT_ERR_FORMAT;
+    }
+
+    if (dict_checksum(bytes + sizeof(header), size - sizeof(header)) !=
+        header.checksum) {
+        return DICT_ERR_CHECKSUM;
+    }
+
+    const u32 *edges = (const u32 *) (bytes + dawg->offset);
+    u64 edge_count = dawg->length / sizeof(u32);
+
+    /* Every target is in range and every node ends, so a walk stays in
+       the section whatever the input */
+    if (edge_count > 0 && !(edges[edge_count - 1] & DICT_EDGE_LAST)) {
+        return DICT_ERR_FORMAT;
+    }
+    for (u64 i = 0; i < edge_count; ++i) {
+        if (dict_edge_target(edges[i]) >= edge_count) {
+            return DICT_ERR_FORMAT;
+        }
+    }
+
+    if (suggest &&
+        !load_suggest(d, bytes + suggest->offset, suggest->length)) {
+        memset(d, 0, sizeof(*d));
+        return DICT_ERR_FORMAT;
+    }
+
+    d->data = bytes;
+    d->size = size;
+    d->edges = edges;
+    d->edge_count = edge_count;
+    d->word_count = header.word_count;
+    return DICT_OK;
+}
+
+/**
+ * dict_open
+ * Maps a compiled dictionary read-only and validates it. The mapping is
+ * shared, so the page cache holds one copy for every process using it.
+ *
+ * Returns: DICT_OK, or why it could not be used, leaving `d` zeroed.
+ **/
+dict_status dict_open (dict *d, const char *path) {
+
+    assert(d && path);
+
+    memset(d, 0, sizeof(*d));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return DICT_ERR_IO;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return DICT_ERR_IO;
+    }
+    if ((u64) st.st_size < sizeof(dict_header)) {
+        close(fd);
+        return DICT_ERR_FORMAT;
+    }
+
+    void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    /* The mapping keeps the file alive */
+    close(fd);
+    if (map == MAP_FAILED) {
+        return DICT_ERR_IO;
+    }
+
+    dict_status status = dict_load(d, map, (u64) st.st_size);
+    if (status != DICT_OK) {
+        munmap(map, (size_t) st.st_size);
+        return status;
+    }
+
+    /* Lookups jump around the automaton */
+    madvise(map, (size_t) st.st_size, MADV_RANDOM);
+    d->mapped = true;
+    log_info("Dictionary `%s`: `%llu` words, `%llu` edges, %s suggestions",
+             path, d->word_count, d->edge_count, d->suggest ? "with" : "no");
+    return DICT_OK;
+}
+
+void dict_close (dict *d) {
+
+    if (!d) {
+        return;
+    }
+    if (d->mapped) {
+        munmap((void *) d->data, d->size);
+    }
+    memset(d, 0, sizeof(*d));
+}
+
+static inline u8 fold_byte (u8 c, u64 i, dict_fold fold) {
+
+    switch (fold) {
+        case FOLD_FIRST:
+            return i == 0 ? ascii_lower(c) : c;
+        case FOLD_ALL:
+            return ascii_lower(c);
+        case FOLD_TAIL:
+            return i == 0 ? c : ascii_lower(c);
+        case FOLD_NONE:
+        default:
+            return c;
+    }
+}
+
+/* Walks the automaton along `word`, folded on the fly */
+static bool lookup (const dict *d, const u8 *word, u64 len, dict_fold fold) {
+
+    if (len == 0 || d->edge_count == 0) {
+        return false;
+    }
+
+    u64 node = 0;
+    for (u64 i = 0; i < len; ++i) {
+
+        u8 c = fold_byte(word[i], i, fold);
+        u32 edge = 0;
+        bool found = false;
+
+        /* Labels are sorted, stop at the first one past `c` */
+        for (u64 e = node;; ++e) {
+            edge = d->edges[e];
+            u8 label = dict_edge_label(edge);
+            if (label == c) {
+                found = true;
+                break;
+            }
+            if (label > c || (edge & DICT_EDGE_LAST)) {
+                break;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+        if (i + 1 == len) {
+            return (edge & DICT_EDGE_FINAL) != 0;
+        }
+
+        node = dict_edge_target(edge);
+        if (node == 0) {
+            return false;
+        }
+    }
+    return false;
+}
+
+/* Whether the dictionary has exactly `word` */
+bool dict_contains (const dict *d, const char *word, u64 len) {
+
+    assert(d && (word || len == 0));
+
+    return lookup(d, (const u8 *) word, len, FOLD_NONE);
+}
+
+/**
+ * dict_check
+ * Whether `word` is spelled right, allowing for the capitalisation of
+ * prose: a capitalised word may start a sentence, and a word in capitals
+ * may be any word. Only ASCII letters are folded.
+ **/
+bool dict_check (const dict *d, const char *word, u64 len) {
+
+    assert(d && (word || len == 0));
+
+    const u8 *bytes = (const u8 *) word;
+    if (lookup(d, bytes, len, FOLD_NONE)) {
+        return true;
+    }
+    if (len == 0 || !ascii_upper(bytes[0])) {
+        return false;
+    }
+
+    u64 upper = 0;
+    u64 lower = 0;
+    for (u64 i = 0; i < len; ++i) {
+        upper += ascii_upper(bytes[i]);
+        lower += bytes[i] >= 'a' && bytes[i] <= 'z';
+    }
+
+    if (upper == 1) {
+        return lookup(d, bytes, len, FOLD_FIRST);
+    }
+    /* Mixed case like "CAt" is a typo, not a style */
+    if (lower > 0) {
+        return false;
+    }
+    return lookup(d, bytes, len, FOLD_ALL) || lookup(d, bytes, len, FOLD_TAIL);
+}
+
+static void collect_deletes (const u8 *word, u32 len, u32 from, u32 left,
+                             u64 *hashes, u32 *count) {
+
+    hashes[(*count)++] = dict_delete_hash(word, len);
+    if (left == 0) {
+        return;
+    }
+
+    /* Deleting from `from` on only, so each set of positions is made once */
+    u8 shorter[DICT_SUGGEST_PREFIX];
+    for (u32 i = from; i < len; ++i) {
+        memcpy(shorter, word, i);
+        memcpy(shorter + i, word + i + 1, len - i - 1);
+        collect_deletes(shorter, len - 1, i, left - 1, hashes, count);
+    }
+}
+
+/**
+ * dict_delete_hashes
+ * Hashes every string left by deleting up to `max_distance` bytes from
+ * `prefix`, itself included. Shared by the index builder and the lookup,
+ * which must agree exactly.
+ *
+ * Arguments: `u32 len`, at most DICT_SUGGEST_PREFIX.
+ *            `u64 *hashes`, room for DICT_SUGGEST_MAX_DELETES.
+ * Returns: How many distinct hashes were stored, sorted.
+ **/
+u32 dict_delete_hashes (const u8 *prefix, u32 len, u32 max_distance,
+                        u64 *hashes) {
+
+    assert(len <= DICT_SUGGEST_PREFIX &&
+           max_distance <= DICT_SUGGEST_MAX_DISTANCE);
+
+    u32 count = 0;
+    collect_deletes(prefix, len, 0, max_distance, hashes, &count);
+
+    /* Repeated letters make the same delete more than once */
+    for (u32 i = 1; i < count; ++i) {
+        u64 hash = hashes[i];
+        u32 j = i;
+        for (; j > 0 && hashes[j - 1] > hash; --j) {
+            hashes[j] = hashes[j - 1];
+        }
+        hashes[j] = hash;
+    }
+    u32 unique = 0;
+    for (u32 i = 0; i < count; ++i) {
+        if (unique == 0 || hashes[unique - 1] != hashes[i]) {
+            hashes[unique++] = hashes[i];
+        }
+    }
+    return unique;
+}
+
+static inline u32 min3 (u32 a, u32 b, u32 c) {
+    u32 m = a < b ? a : b;
+    return m < c ? m : c;
+}
+
+/**
+ * dict_distance
+ * Edit distance counting insertions, deletions, substitutions and swaps
+ * of neighbours, in bytes. Gives up as soon as it must exceed
+ * `max_distance`.
+ *
+ * Returns: The distance, `max_distance + 1` for anything further.
+ **/
+u32 dict_distance (const u8 *a, u32 a_len, const u8 *b, u32 b_len,
+                   u32 max_distance) {
+
+    u32 gap = a_len > b_len ? a_len - b_len : b_len - a_len;
+    if (gap > max_distance || a_len > dict_max_word || b_len > dict_max_word) {
+        return max_distance + 1;
+    }
+
+    u32 rows[3][dict_max_word + 1];
+    u32 *before = rows[0];
+    u32 *previous = rows[1];
+    u32 *current = rows[2];
+
+    for (u32 j = 0; j <= b_len; ++j) {
+        previous[j] = j;
+    }
+
+    for (u32 i = 1; i <= a_len; ++i) {
+        current[0] = i;
+        u32 row_min = i;
+        for (u32 j = 1; j <= b_len; ++j) {
+            u32 cost = a[i - 1] != b[j - 1];
+            u32 value = min3(previous[j] + 1, current[j - 1] + 1,
+                             previous[j - 1] + cost);
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] &&
+                a[i - 2] == b[j - 1] && before[j - 2] + 1 < value) {
+                value = before[j - 2] + 1;
+            }
+            current[j] = value;
+            row_min = value < row_min ? value : row_min;
+        }
+        if (row_min > max_distance) {
+            return max_distance + 1;
+        }
+
+        u32 *spare = before;
+        before = previous;
+        previous = current;
+        current = spare;
+    }
+
+    return previous[b_len] > max_distance ? max_distance + 1
+                                          : previous[b_len];
+}
+
+/* Closer first, then more common, then in byte order */
+static bool ranks_before (const dict_suggestion *a, const dict_suggestion *b) {
+
+    if (a->distance != b->distance) {
+        return a->distance < b->distance;
+    }
+    if (a->frequency != b->frequency) {
+        return a->frequency > b->frequency;
+    }
+    u32 len = a->len < b->len ? a->len : b->len;
+    int order = memcmp(a->word, b->word, len);
+    return order ? order < 0 : a->len < b->len;
+}
+
+/* Keeps the best `cap` of the suggestions offered, in rank order */
+static void offer (dict_suggestion *out, u32 *count, u32 cap,
+                   const dict_suggestion *candidate) {
+
+    u32 at = *count;
+    while (at > 0 && ranks_before(candidate, &out[at - 1])) {
+        at--;
+    }
+    if (at >= cap) {
+        return;
+    }
+
+    u32 last = *count < cap ? *count : cap - 1;
+    memmove(out + at + 1, out + at, (last - at) * sizeof(*out));
+    out[at] = *candidate;
+    if (*count < cap) {
+        (*count)++;
+    }
+}
+
+/* Marks word `id` as looked at. False if it was already, or if there is
+   no room left to remember it */
+static bool first_sight (u32 *seen, u32 *seen_count, u32 id) {
+
+    u32 slot = (id * 2654435761u) & (suggest_seen_cap - 1);
+    for (; seen[slot]; slot = (slot + 1) & (suggest_seen_cap - 1)) {
+        if (seen[slot] == id + 1) {
+            return false;
+        }
+    }
+    if (*seen_count * 2 >= suggest_seen_cap) {
+        return false;
+    }
+    seen[slot] = id + 1;
+    (*seen_count)++;
+    return true;
+}
+
+/**
+ * dict_suggest
+ * Finds the words closest to `word` with the delete index: the deletes of
+ * its prefix lead to every word within `max_distance` of it, and only
+ * those are measured. Nothing is allocated.
+ *
+ * Arguments: `dict_suggestion *out`, `u32 cap`, where the best go, best
+ *            first. Their words point into the dictionary.
+ * Returns: How many were stored, 0 without a suggestion index.
+ **/
+u32 dict_suggest (const dict *d, const char *word, u64 len, u32 max_distance,
+                  dict_suggestion *out, u32 cap) {
+
+    assert(d && (word || len == 0) && (out || cap == 0));
+
+    const dict_suggest_header *index = d->suggest;
+    if (!index || cap == 0 || len == 0 || len > dict_max_word) {
+        return 0;
+    }
+    if (max_distance > index->max_distance) {
+        max_distance = index->max_distance;
+    }
+
+    const u8 *bytes = (const u8 *) word;
+    u32 prefix = len < index->prefix_len ? (u32) len : index->prefix_len;
+    u64 hashes[DICT_SUGGEST_MAX_DELETES];
+    u32 hash_count = dict_delete_hashes(bytes, prefix, max_distance, hashes);
+
+    u32 seen[suggest_seen_cap] = {0};
+    u32 seen_count = 0;
+    u32 found = 0;
+    u64 mask = index->bucket_count - 1;
+
+    for (u32 h = 0; h < hash_count; ++h) {
+
+        u64 bucket = hashes[h] & mask;
+        u32 start = d->bucket_start[bucket];
+        u32 end = d->bucket_start[bucket + 1];
+        if (start > end || end > index->posting_count) {
+            continue;
+        }
+
+        for (u32 p = start; p < end; ++p) {
+            u32 id = d->postings[p];
+            if (id >= index->word_count ||
+                !first_sight(seen, &seen_count, id)) {
+                continue;
+            }
+
+            const dict_suggest_word *entry = &d->suggest_words[id];
+            if (entry->offset >= index->text_len ||
+                entry->offset + 1 + (u64) d->suggest_text[entry->offset] >
+                    index->text_len) {
+                continue;
+            }
+            const u8 *candidate = d->suggest_text + entry->offset + 1;
+            u32 candidate_len = d->suggest_text[entry->offset];
+
+            u32 distance = dict_distance(bytes, (u32) len, candidate,
+                                         candidate_len, max_distance);
+            if (distance > max_distance) {
+                continue;
+            }
+            dict_suggestion suggestion = {
+                .word = (const char *) candidate,
+                .len = candidate_len,
+                .distance = distance,
+                .frequency = entry->frequency,
+            };
+            offer(out, &found, cap, &suggestion);
+        }
+    }
+    return found;
+}
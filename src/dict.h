@@ -0,0 +1,68 @@
+#ifndef DICT_H_
+#define DICT_H_
+
+#include <stdbool.h>
+
+#include "common.h"
+#include "dict_format.h"
+
+typedef enum dict_status {
+    DICT_OK = 0,
+    /* The file could not be opened or mapped */
+    DICT_ERR_IO = -1,
+    /* Not a dictionary, or its sections do not fit in it */
+    DICT_ERR_FORMAT = -2,
+    /* A dictionary, written by another version of dictc */
+    DICT_ERR_VERSION = -3,
+    /* Damaged or truncated */
+    DICT_ERR_CHECKSUM = -4,
+} dict_status;
+
+/**
+ * A compiled word list, see dict_format.h. The file is mapped read-only
+ * and shared, so every server using the same dictionary shares its pages,
+ * and lookups walk the mapping directly without allocating. Safe to read
+ * from any number of threads.
+ **/
+typedef struct dict {
+    const u8 *data;
+    u64 size;
+    /* Whether `data` is our mapping, rather than borrowed memory */
+    bool mapped;
+
+    const u32 *edges;
+    u64 edge_count;
+    u64 word_count;
+
+    /* Suggestion index, `suggest` is NULL when the file has none */
+    const dict_suggest_header *suggest;
+    const dict_suggest_word *suggest_words;
+    const u32 *bucket_start;
+    const u32 *postings;
+    const u8 *suggest_text;
+} dict;
+
+/* A word close to the one asked about, pointing into the dictionary */
+typedef struct dict_suggestion {
+    const char *word;
+    u32 len;
+    u32 distance;
+    u32 frequency;
+} dict_suggestion;
+
+dict_status dict_open(dict *d, const char *path);
+dict_status dict_load(dict *d, const void *data, u64 size);
+void dict_close(dict *d);
+const char *dict_status_str(dict_status status);
+
+bool dict_contains(const dict *d, const char *word, u64 len);
+bool dict_check(const dict *d, const char *word, u64 len);
+
+u32 dict_delete_hashes(const u8 *prefix, u32 len, u32 max_distance,
+                       u64 *hashes);
+u32 dict_distance(const u8 *a, u32 a_len, const u8 *b, u32 b_len,
+                  u32 max_distance);
+u32 dict_suggest(const dict *d, const char *word, u64 len, u32 max_distance,
+                 dict_suggestion *out, u32 cap);
+
+#endif  // DICT_H_
@@ -0,0 +1,1283 @@
+#include "dict_build.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "dict.h"
+#include "dict_format.h"
+#include "logging.h"
+
+#ifdef NDEBUG
+    #define builder_initial_words 4096
+    #define builder_initial_text (64 * 1024)
+    #define register_initial_cap 4096
+#else
+    #define builder_initial_words 4
+    #define builder_initial_text 64
+    #define register_initial_cap 4
+#endif
+
+/* Flags a .dic entry may carry, more are ignored */
+#define max_word_flags 64
+/* Longest word an affix can make, stems are at most DICT_BUILD_MAX_WORD */
+#define max_affixed_word (DICT_BUILD_MAX_WORD * 3)
+
+static void *xrealloc (void *ptr, u64 size) {
+
+    void *grown = realloc(ptr, size);
+    if (!grown && size) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+    return grown;
+}
+
+/* Next line of `text` from `*pos` without its line break */
+static bool next_line (const char *text, u64 len, u64 *pos, const char **line,
+                       u64 *line_len) {
+
+    if (*pos >= len) {
+        return false;
+    }
+
+    const char *start = text + *pos;
+    const char *newline = memchr(start, '\n', len - *pos);
+    u64 n = newline ? (u64) (newline - start) : len - *pos;
+
+    *pos += n + (newline ? 1 : 0);
+    if (n > 0 && start[n - 1] == '\r') {
+        n--;
+    }
+    *line = start;
+    *line_len = n;
+    return true;
+}
+
+/* Next run of non blank characters of `line` from `*pos` */
+static bool next_token (const char *line, u64 len, u64 *pos,
+                        const char **token, u64 *token_len) {
+
+    while (*pos < len && (line[*pos] == ' ' || line[*pos] == '\t')) {
+        (*pos)++;
+    }
+    if (*pos >= len) {
+        return false;
+    }
+    u64 start = *pos;
+    while (*pos < len && line[*pos] != ' ' && line[*pos] != '\t') {
+        (*pos)++;
+    }
+    *token = line + start;
+    *token_len = *pos - start;
+    return true;
+}
+
+static bool token_is (const char *token, u64 len, const char *literal) {
+    return len == strlen(literal) && memcmp(token, literal, len) == 0;
+}
+
+/* Decodes one UTF-8 character, a byte which does not start one is taken
+   as it is */
+static u32 utf8_next (const u8 *text, u64 len, u64 *pos) {
+
+    u8 c = text[*pos];
+    u64 need = (c & 0xe0) == 0xc0   ? 2
+               : (c & 0xf0) == 0xe0 ? 3
+               : (c & 0xf8) == 0xf0 ? 4
+                                    : 1;
+    if (need == 1 || *pos + need > len) {
+        (*pos)++;
+        return c;
+    }
+
+    u32 cp = c & (0x7f >> need);
+    for (u64 i = 1; i < need; ++i) {
+        cp = (cp << 6) | (text[*pos + i] & 0x3f);
+    }
+    *pos += need;
+    return cp;
+}
+
+void dict_builder_free (dict_builder *builder) {
+
+    if (!builder) {
+        return;
+    }
+    free(builder->text);
+    free(builder->words);
+    memset(builder, 0, sizeof(*builder));
+}
+
+/* Adds one word, duplicates are only dropped by dict_builder_finish */
+void dict_builder_add (dict_builder *builder, const char *word, u64 len) {
+    dict_builder_add_counted(builder, word, len, 0);
+}
+
+/* Adds one word with how often it occurs, for ranking suggestions. Of
+   duplicates the largest frequency is kept */
+void dict_builder_add_counted (dict_builder *builder, const char *word,
+                               u64 len, u32 frequency) {
+
+    assert(builder && (word || len == 0));
+
+    if (len == 0) {
+        return;
+    }
+    if (len > DICT_BUILD_MAX_WORD) {
+        builder->too_long++;
+        return;
+    }
+
+    if (builder->text_len + len > builder->text_cap) {
+        u64 cap = builder->text_cap ? builder->text_cap : builder_initial_text;
+        while (cap < builder->text_len + len) {
+            cap *= 2;
+        }
+        builder->text = xrealloc(builder->text, cap);
+        builder->text_cap = cap;
+    }
+    if (builder->count == builder->cap) {
+        builder->cap = builder->cap ? builder->cap * 2 : builder_initial_words;
+        builder->words =
+            xrealloc(builder->words, builder->cap * sizeof(dict_word));
+    }
+
+    memcpy(builder->text + builder->text_len, word, len);
+    builder->words[builder->count++] =
+        (dict_word) {.offset = builder->text_len, .len = (u32) len,
+                     .frequency = frequency};
+    builder->text_len += len;
+}
+
+/* The number after a word on a list line, 0 if there is none */
+static u32 parse_frequency (const char *line, u64 len, u64 *pos) {
+
+    const char *token;
+    u64 token_len;
+    if (!next_token(line, len, pos, &token, &token_len)) {
+        return 0;
+    }
+
+    u64 value = 0;
+    for (u64 i = 0; i < token_len; ++i) {
+        if (token[i] < '0' || token[i] > '9') {
+            return 0;
+        }
+        value = value * 10 + (u64) (token[i] - '0');
+        if (value > UINT32_MAX) {
+            return UINT32_MAX;
+        }
+    }
+    return (u32) value;
+}
+
+/**
+ * dict_builder_add_list
+ * Adds a plain word list, one word per line, optionally followed by how
+ * often it occurs, as in frequency lists. Anything else after the word
+ * is ignored, as are blank lines and lines starting with `#`.
+ *
+ * Returns: How many words were added.
+ **/
+u64 dict_builder_add_list (dict_builder *builder, const char *text, u64 len) {
+
+    assert(builder && (text || len == 0));
+
+    u64 added = 0;
+    u64 pos = 0;
+    const char *line;
+    u64 line_len;
+
+    while (next_line(text, len, &pos, &line, &line_len)) {
+        u64 at = 0;
+        const char *word;
+        u64 word_len;
+        if (!next_token(line, line_len, &at, &word, &word_len) ||
+            word[0] == '#') {
+            continue;
+        }
+        dict_builder_add_counted(builder, word, word_len,
+                                 parse_frequency(line, line_len, &at));
+        added++;
+    }
+    return added;
+}
+
+/* Hunspell affixes */
+
+typedef enum flag_mode {
+    /* One byte per flag, the default */
+    FLAG_CHAR,
+    /* `FLAG long`, two bytes per flag */
+    FLAG_LONG,
+    /* `FLAG num`, decimal numbers separated by commas */
+    FLAG_NUM,
+    /* `FLAG UTF-8`, one character per flag */
+    FLAG_UTF8,
+} flag_mode;
+
+/* One position of an affix condition */
+typedef struct affix_unit {
+    /* The characters of a `[...]` class, or the one to match */
+    u32 *chars;
+    u32 count;
+    /* `.`, anything matches */
+    bool any;
+    /* `[^...]` */
+    bool negate;
+} affix_unit;
+
+typedef struct affix_rule {
+    char *strip;
+    u32 strip_len;
+    char *add;
+    u32 add_len;
+    affix_unit *units;
+    u32 unit_count;
+} affix_rule;
+
+/* The rules of one PFX or SFX flag */
+typedef struct affix_class {
+    u32 flag;
+    bool suffix;
+    /* May combine with an affix of the other kind */
+    bool cross;
+    affix_rule *rules;
+    u32 count;
+    /* Rules the header announced */
+    u32 expected;
+} affix_class;
+
+typedef struct affix_set {
+    flag_mode mode;
+
+    affix_class *classes;
+    u32 count;
+    u32 cap;
+
+    /* `AF` flag aliases, .dic entries then give an alias number */
+    u32 *alias_flags;
+    u64 alias_flags_len;
+    u64 *alias_ranges;
+    u32 alias_count;
+    bool alias_header;
+
+    /* 0 when the .aff does not name one */
+    u32 need_affix;
+    u32 forbidden;
+} affix_set;
+
+static void affix_set_free (affix_set *set) {
+
+    for (u32 c = 0; c < set->count; ++c) {
+        affix_class *cls = &set->classes[c];
+        for (u32 r = 0; r < cls->count; ++r) {
+            affix_rule *rule = &cls->rules[r];
+            free(rule->strip);
+            free(rule->add);
+            for (u32 u = 0; u < rule->unit_count; ++u) {
+                free(rule->units[u].chars);
+            }
+            free(rule->units);
+        }
+        free(cls->rules);
+    }
+    free(set->classes);
+    free(set->alias_flags);
+    free(set->alias_ranges);
+}
+
+/**
+ * parse_flags
+ * Reads the flags in `text` the way the .aff says they are written.
+ *
+ * Returns: How many were stored in `flags`, at most `cap`.
+ **/
+static u32 parse_flags (flag_mode mode, const char *text, u64 len, u32 *flags,
+                        u32 cap) {
+
+    const u8 *bytes = (const u8 *) text;
+    u32 count = 0;
+    u64 pos = 0;
+
+    while (pos < len && count < cap) {
+        switch (mode) {
+            case FLAG_LONG:
+                flags[count++] = pos + 1 < len
+                                     ? ((u32) bytes[pos] << 8) | bytes[pos + 1]
+                                     : bytes[pos];
+                pos += 2;
+                break;
+            case FLAG_NUM: {
+                u32 value = 0;
+                while (pos < len && bytes[pos] >= '0' && bytes[pos] <= '9') {
+                    value = value * 10 + (bytes[pos++] - '0');
+                }
+                flags[count++] = value;
+                /* The comma, or whatever else ends the number */
+                pos++;
+                break;
+            }
+            case FLAG_UTF8:
+                flags[count++] = utf8_next(bytes, len, &pos);
+                break;
+            case FLAG_CHAR:
+            default:
+                flags[count++] = bytes[pos++];
+                break;
+        }
+    }
+    return count;
+}
+
+static u32 parse_flag (flag_mode mode, const char *text, u64 len) {
+
+    u32 flag = 0;
+    parse_flags(mode, text, len, &flag, 1);
+    return flag;
+}
+
+/* `0` stands for nothing in the strip and add fields */
+static char *affix_text (const char *text, u64 len, u32 *out_len) {
+
+    if (len == 1 && text[0] == '0') {
+        len = 0;
+    }
+    char *copy = xrealloc(NULL, len + 1);
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    *out_len = (u32) len;
+    return copy;
+}
+
+static void parse_condition (affix_rule *rule, const char *text, u64 len) {
+
+    const u8 *bytes = (const u8 *) text;
+    u64 pos = 0;
+
+    if (len == 1 && text[0] == '.') {
+        return;
+    }
+
+    while (pos < len) {
+        rule->units =
+            xrealloc(rule->units, (rule->unit_count + 1) * sizeof(affix_unit));
+        affix_unit *unit = &rule->units[rule->unit_count++];
+        memset(unit, 0, sizeof(*unit));
+
+        if (bytes[pos] == '.') {
+            unit->any = true;
+            pos++;
+            continue;
+        }
+        if (bytes[pos] != '[') {
+            unit->chars = xrealloc(NULL, sizeof(u32));
+            unit->chars[unit->count++] = utf8_next(bytes, len, &pos);
+            continue;
+        }
+
+        pos++;
+        if (pos < len && bytes[pos] == '^') {
+            unit->negate = true;
+            pos++;
+        }
+        while (pos < len && bytes[pos] != ']') {
+            unit->chars =
+                xrealloc(unit->chars, (unit->count + 1) * sizeof(u32));
+            unit->chars[unit->count++] = utf8_next(bytes, len, &pos);
+        }
+        /* The `]` */
+        pos++;
+    }
+}
+
+static affix_class *find_class (affix_set *set, u32 flag, bool suffix) {
+
+    for (u32 c = set->count; c > 0; --c) {
+        affix_class *cls = &set->classes[c - 1];
+        if (cls->flag == flag && cls->suffix == suffix) {
+            return cls;
+        }
+    }
+    return NULL;
+}
+
+static int compare_classes (const void *a, const void *b) {
+
+    const affix_class *x = a;
+    const affix_class *y = b;
+    if (x->flag != y->flag) {
+        return x->flag < y->flag ? -1 : 1;
+    }
+    return (int) x->suffix - (int) y->suffix;
+}
+
+/* First class with `flag`, the ones after it with the same flag follow */
+static const affix_class *lookup_class (const affix_set *set, u32 flag) {
+
+    u32 lo = 0;
+    u32 hi = set->count;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        if (set->classes[mid].flag < flag) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < set->count && set->classes[lo].flag == flag ? &set->classes[lo]
+                                                            : NULL;
+}
+
+/**
+ * parse_aff
+ * Reads the parts of a .aff needed to list every word: the flag format,
+ * flag aliases, prefixes, suffixes, NEEDAFFIX and FORBIDDENWORD. The text
+ * is taken to be UTF-8, compounding and suggestion settings are ignored.
+ *
+ * Returns: 0, or -1 if a rule is malformed.
+ **/
+static int parse_aff (affix_set *set, const char *aff, u64 aff_len) {
+
+    u64 pos = 0;
+    const char *line;
+    u64 line_len;
+
+    while (next_line(aff, aff_len, &pos, &line, &line_len)) {
+
+        const char *tokens[5];
+        u64 lens[5];
+        u32 n = 0;
+        u64 at = 0;
+        while (n < ARRAY_LENGTH(tokens) &&
+               next_token(line, line_len, &at, &tokens[n], &lens[n])) {
+            n++;
+        }
+        if (n < 2 || tokens[0][0] == '#') {
+            continue;
+        }
+
+        if (token_is(tokens[0], lens[0], "FLAG")) {
+            if (token_is(tokens[1], lens[1], "long")) {
+                set->mode = FLAG_LONG;
+            } else if (token_is(tokens[1], lens[1], "num")) {
+                set->mode = FLAG_NUM;
+            } else if (token_is(tokens[1], lens[1], "UTF-8")) {
+                set->mode = FLAG_UTF8;
+            }
+        } else if (token_is(tokens[0], lens[0], "NEEDAFFIX")) {
+            set->need_affix = parse_flag(set->mode, tokens[1], lens[1]);
+        } else if (token_is(tokens[0], lens[0], "FORBIDDENWORD")) {
+            set->forbidden = parse_flag(set->mode, tokens[1], lens[1]);
+        } else if (token_is(tokens[0], lens[0], "AF")) {
+            /* The first `AF` line is the count, each later one an alias */
+            if (!set->alias_header) {
+                set->alias_header = true;
+                continue;
+            }
+            u32 flags[max_word_flags];
+            u32 count = parse_flags(set->mode, tokens[1], lens[1], flags,
+                                    max_word_flags);
+            set->alias_flags =
+                xrealloc(set->alias_flags,
+                         (set->alias_flags_len + count) * sizeof(u32));
+            memcpy(set->alias_flags + set->alias_flags_len, flags,
+                   count * sizeof(u32));
+            set->alias_ranges =
+                xrealloc(set->alias_ranges,
+                         (set->alias_count + 1) * 2 * sizeof(u64));
+            set->alias_ranges[set->alias_count * 2] = set->alias_flags_len;
+            set->alias_ranges[set->alias_count * 2 + 1] = count;
+            set->alias_count++;
+            set->alias_flags_len += count;
+        } else if (token_is(tokens[0], lens[0], "PFX") ||
+                   token_is(tokens[0], lens[0], "SFX")) {
+
+            bool suffix = tokens[0][0] == 'S';
+            u32 flag = parse_flag(set->mode, tokens[1], lens[1]);
+            affix_class *cls = find_class(set, flag, suffix);
+
+            /* Header: `SFX flag Y count` */
+            if (!cls || cls->count == cls->expected) {
+                if (n < 4) {
+                    log_warn("Malformed affix header `%.*s`", (int) line_len,
+                             line);
+                    return -1;
+                }
+                if (set->count == set->cap) {
+                    set->cap = set->cap ? set->cap * 2 : 16;
+                    set->classes = xrealloc(set->classes,
+                                            set->cap * sizeof(affix_class));
+                }
+                cls = &set->classes[set->count++];
+                memset(cls, 0, sizeof(*cls));
+                cls->flag = flag;
+                cls->suffix = suffix;
+                cls->cross = tokens[2][0] == 'Y';
+                cls->expected = (u32) strtoul(tokens[3], NULL, 10);
+                cls->rules = xrealloc(NULL, (cls->expected + 1) *
+                                                sizeof(affix_rule));
+                continue;
+            }
+
+            /* Rule: `SFX flag strip add condition` */
+            if (n < 4) {
+                log_warn("Malformed affix rule `%.*s`", (int) line_len, line);
+                return -1;
+            }
+            affix_rule *rule = &cls->rules[cls->count++];
+            memset(rule, 0, sizeof(*rule));
+            rule->strip = affix_text(tokens[2], lens[2], &rule->strip_len);
+
+            /* Continuation flags after a `/` are not expanded */
+            const char *slash = memchr(tokens[3], '/', lens[3]);
+            u64 add_len = slash ? (u64) (slash - tokens[3]) : lens[3];
+            rule->add = affix_text(tokens[3], add_len, &rule->add_len);
+
+            if (n >= 5) {
+                parse_condition(rule, tokens[4], lens[4]);
+            }
+        }
+    }
+
+    qsort(set->classes, set->count, sizeof(affix_class), compare_classes);
+    return 0;
+}
+
+static bool unit_matches (const affix_unit *unit, u32 cp) {
+
+    if (unit->any) {
+        return true;
+    }
+    bool found = false;
+    for (u32 i = 0; i < unit->count && !found; ++i) {
+        found = unit->chars[i] == cp;
+    }
+    return found != unit->negate;
+}
+
+/* Whether `rule` may apply to a word of the characters `cps` */
+static bool rule_applies (const affix_rule *rule, bool suffix, const char *word,
+                          u64 len, const u32 *cps, u32 cp_count) {
+
+    if (rule->strip_len >= len || rule->unit_count > cp_count) {
+        return false;
+    }
+
+    const char *stripped =
+        suffix ? word + len - rule->strip_len : word;
+    if (memcmp(stripped, rule->strip, rule->strip_len) != 0) {
+        return false;
+    }
+
+    u32 first = suffix ? cp_count - rule->unit_count : 0;
+    for (u32 i = 0; i < rule->unit_count; ++i) {
+        if (!unit_matches(&rule->units[i], cps[first + i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Writes `word` with `rule` applied to `out`, returns its length, 0 if it
+   does not fit in `cap` */
+static u64 apply_rule (const affix_rule *rule, bool suffix, const char *word,
+                       u64 len, char *out, u64 cap) {
+
+    u64 kept = len - rule->strip_len;
+    if (kept + rule->add_len > cap) {
+        return 0;
+    }
+    if (suffix) {
+        memcpy(out, word, kept);
+        memcpy(out + kept, rule->add, rule->add_len);
+    } else {
+        memcpy(out, rule->add, rule->add_len);
+        memcpy(out + rule->add_len, word + rule->strip_len, kept);
+    }
+    return kept + rule->add_len;
+}
+
+static bool has_flag (const u32 *flags, u32 count, u32 flag) {
+
+    for (u32 i = 0; flag && i < count; ++i) {
+        if (flags[i] == flag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Adds a stem and every word its flags make of it */
+static void expand_stem (dict_builder *builder, const affix_set *set,
+                         const char *stem, u64 len, const u32 *flags,
+                         u32 flag_count) {
+
+    if (has_flag(flags, flag_count, set->forbidden)) {
+        return;
+    }
+    if (!has_flag(flags, flag_count, set->need_affix)) {
+        dict_builder_add(builder, stem, len);
+    }
+    if (len > DICT_BUILD_MAX_WORD) {
+        return;
+    }
+
+    u32 cps[DICT_BUILD_MAX_WORD];
+    u32 cp_count = 0;
+    for (u64 pos = 0; pos < len;) {
+        cps[cp_count++] = utf8_next((const u8 *) stem, len, &pos);
+    }
+
+    char affixed[max_affixed_word];
+    char both[max_affixed_word * 2];
+
+    for (u32 f = 0; f < flag_count; ++f) {
+        const affix_class *cls = lookup_class(set, flags[f]);
+        for (; cls && cls < set->classes + set->count &&
+               cls->flag == flags[f];
+             ++cls) {
+            for (u32 r = 0; r < cls->count; ++r) {
+
+                const affix_rule *rule = &cls->rules[r];
+                if (!rule_applies(rule, cls->suffix, stem, len, cps,
+                                  cp_count)) {
+                    continue;
+                }
+                u64 affixed_len = apply_rule(rule, cls->suffix, stem, len,
+                                             affixed, sizeof(affixed));
+                dict_builder_add(builder, affixed, affixed_len);
+
+                if (!cls->suffix || !cls->cross || affixed_len == 0) {
+                    continue;
+                }
+
+                /* Cross products, a prefix on top of the suffix */
+                for (u32 g = 0; g < flag_count; ++g) {
+                    const affix_class *pfx = lookup_class(set, flags[g]);
+                    for (; pfx && pfx < set->classes + set->count &&
+                           pfx->flag == flags[g];
+                         ++pfx) {
+                        if (pfx->suffix || !pfx->cross) {
+                            continue;
+                        }
+                        for (u32 p = 0; p < pfx->count; ++p) {
+                            if (!rule_applies(&pfx->rules[p], false, affixed,
+                                              affixed_len, cps, cp_count)) {
+                                continue;
+                            }
+                            u64 both_len =
+                                apply_rule(&pfx->rules[p], false, affixed,
+                                           affixed_len, both, sizeof(both));
+                            dict_builder_add(builder, both, both_len);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * dict_builder_add_hunspell
+ * Adds every word of a Hunspell dictionary, expanding the affixes each
+ * stem is flagged with, including prefix and suffix cross products.
+ * Continuation classes, compounding and morphology are not expanded.
+ *
+ * Arguments: `aff`, `dic`, the contents of the .aff and the .dic.
+ * Returns: 0, or -1 if the .aff is malformed.
+ **/
+int dict_builder_add_hunspell (dict_builder *builder, const char *aff,
+                               u64 aff_len, const char *dic, u64 dic_len) {
+
+    assert(builder && (aff || aff_len == 0) && (dic || dic_len == 0));
+
+    affix_set set = {0};
+    if (parse_aff(&set, aff, aff_len) != 0) {
+        affix_set_free(&set);
+        return -1;
+    }
+
+    u64 pos = 0;
+    const char *line;
+    u64 line_len;
+    bool first = true;
+
+    while (next_line(dic, dic_len, &pos, &line, &line_len)) {
+
+        u64 at = 0;
+        const char *entry;
+        u64 entry_len;
+        if (!next_token(line, line_len, &at, &entry, &entry_len)) {
+            continue;
+        }
+        /* The first line is the number of entries */
+        if (first) {
+            first = false;
+            if (entry[0] >= '0' && entry[0] <= '9') {
+                continue;
+            }
+        }
+
+        /* `word/flags`, a `\/` is a slash in the word */
+        u64 word_len = 0;
+        char word[DICT_BUILD_MAX_WORD + 1];
+        u64 i = 0;
+        for (; i < entry_len && entry[i] != '/'; ++i) {
+            if (entry[i] == '\\' && i + 1 < entry_len && entry[i + 1] == '/') {
+                i++;
+            }
+            if (word_len < sizeof(word)) {
+                word[word_len++] = entry[i];
+            }
+        }
+
+        u32 flags[max_word_flags];
+        u32 flag_count = 0;
+        if (i < entry_len) {
+            const char *flag_text = entry + i + 1;
+            u64 flag_len = entry_len - i - 1;
+            if (set.alias_count > 0) {
+                u64 alias = strtoul(flag_text, NULL, 10);
+                if (alias >= 1 && alias <= set.alias_count) {
+                    flag_count = (u32) set.alias_ranges[(alias - 1) * 2 + 1];
+                    memcpy(flags,
+                           set.alias_flags + set.alias_ranges[(alias - 1) * 2],
+                           flag_count * sizeof(u32));
+                }
+            } else {
+                flag_count = parse_flags(set.mode, flag_text, flag_len, flags,
+                                         max_word_flags);
+            }
+        }
+
+        expand_stem(builder, &set, word, word_len, flags, flag_count);
+    }
+
+    affix_set_free(&set);
+    return 0;
+}
+
+/* The automaton */
+
+/* A node of the word being added, still open to new edges */
+typedef struct path_node {
+    bool final;
+    u32 count;
+    u8 labels[256];
+    u32 targets[256];
+} path_node;
+
+/* A node which can no longer change, its edges are in the builder's pool */
+typedef struct frozen_node {
+    u32 first;
+    u32 count;
+    bool final;
+} frozen_node;
+
+/**
+ * Daciuk's incremental construction for sorted input: only the path of
+ * the last word is open, and a node leaving it is replaced by an equal
+ * frozen one or frozen itself. The register finds equal nodes by hash.
+ **/
+typedef struct dawg_builder {
+    frozen_node *nodes;
+    u64 node_count;
+    u64 node_cap;
+
+    u8 *labels;
+    u32 *targets;
+    u64 edge_count;
+    u64 edge_cap;
+
+    /* Node ids plus one, 0 for an empty slot */
+    u32 *table;
+    u64 table_cap;
+} dawg_builder;
+
+static u64 hash_node (bool final, u32 count, const u8 *labels,
+                      const u32 *targets) {
+
+    u64 hash = 14695981039346656037ull ^ (final ? 0x9e3779b97f4a7c15ull : 0);
+    for (u32 i = 0; i < count; ++i) {
+        hash ^= ((u64) targets[i] << 8) | labels[i];
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static bool same_node (const dawg_builder *dawg, u32 id,
+                       const path_node *node) {
+
+    const frozen_node *frozen = &dawg->nodes[id];
+    if (frozen->final != node->final || frozen->count != node->count) {
+        return false;
+    }
+    if (node->count == 0) {
+        return true;
+    }
+    return memcmp(dawg->labels + frozen->first, node->labels, node->count) ==
+               0 &&
+           memcmp(dawg->targets + frozen->first, node->targets,
+                  node->count * sizeof(u32)) == 0;
+}
+
+static void grow_table (dawg_builder *dawg) {
+
+    u64 cap = dawg->table_cap ? dawg->table_cap * 2 : register_initial_cap;
+    u32 *table = xrealloc(NULL, cap * sizeof(u32));
+    memset(table, 0, cap * sizeof(u32));
+
+    for (u64 id = 0; id < dawg->node_count; ++id) {
+        const frozen_node *node = &dawg->nodes[id];
+        u64 slot = hash_node(node->final, node->count,
+                             dawg->labels + node->first,
+                             dawg->targets + node->first) &
+                   (cap - 1);
+        while (table[slot]) {
+            slot = (slot + 1) & (cap - 1);
+        }
+        table[slot] = (u32) id + 1;
+    }
+
+    free(dawg->table);
+    dawg->table = table;
+    dawg->table_cap = cap;
+}
+
+/* Replaces `node` by an equal frozen node, freezing it if there is none */
+static u32 freeze (dawg_builder *dawg, const path_node *node) {
+
+    if ((dawg->node_count + 1) * 2 > dawg->table_cap) {
+        grow_table(dawg);
+    }
+
+    u64 mask = dawg->table_cap - 1;
+    u64 slot = hash_node(node->final, node->count, node->labels,
+                         node->targets) &
+               mask;
+    for (; dawg->table[slot]; slot = (slot + 1) & mask) {
+        if (same_node(dawg, dawg->table[slot] - 1, node)) {
+            return dawg->table[slot] - 1;
+        }
+    }
+
+    if (dawg->node_count == dawg->node_cap) {
+        dawg->node_cap = dawg->node_cap ? dawg->node_cap * 2 : 64;
+        dawg->nodes =
+            xrealloc(dawg->nodes, dawg->node_cap * sizeof(frozen_node));
+    }
+    if (dawg->edge_count + node->count > dawg->edge_cap) {
+        u64 cap = dawg->edge_cap ? dawg->edge_cap : 256;
+        while (cap < dawg->edge_count + node->count) {
+            cap *= 2;
+        }
+        dawg->labels = xrealloc(dawg->labels, cap);
+        dawg->targets = xrealloc(dawg->targets, cap * sizeof(u32));
+        dawg->edge_cap = cap;
+    }
+
+    u32 id = (u32) dawg->node_count++;
+    dawg->nodes[id] = (frozen_node) {
+        .first = (u32) dawg->edge_count,
+        .count = node->count,
+        .final = node->final,
+    };
+    if (node->count) {
+        memcpy(dawg->labels + dawg->edge_count, node->labels, node->count);
+        memcpy(dawg->targets + dawg->edge_count, node->targets,
+               node->count * sizeof(u32));
+        dawg->edge_count += node->count;
+    }
+
+    dawg->table[slot] = id + 1;
+    return id;
+}
+
+static void dawg_free (dawg_builder *dawg) {
+
+    free(dawg->nodes);
+    free(dawg->labels);
+    free(dawg->targets);
+    free(dawg->table);
+}
+
+static const char *sort_text;
+
+static int compare_words (const void *a, const void *b) {
+
+    const dict_word *x = a;
+    const dict_word *y = b;
+    u32 len = x->len < y->len ? x->len : y->len;
+    int order = memcmp(sort_text + x->offset, sort_text + y->offset, len);
+    if (order != 0) {
+        return order;
+    }
+    return x->len < y->len ? -1 : x->len > y->len;
+}
+
+/* Sorts the words and drops duplicates, returns how many are left */
+static u64 sort_unique (dict_builder *builder) {
+
+    if (builder->count < 2) {
+        return builder->count;
+    }
+
+    sort_text = builder->text;
+    qsort(builder->words, builder->count, sizeof(dict_word), compare_words);
+    sort_text = NULL;
+
+    u64 unique = 0;
+    for (u64 i = 0; i < builder->count; ++i) {
+        const dict_word *word = &builder->words[i];
+        if (unique > 0) {
+            const dict_word *last = &builder->words[unique - 1];
+            if (last->len == word->len &&
+                memcmp(builder->text + last->offset,
+                       builder->text + word->offset, word->len) == 0) {
+                if (word->frequency > last->frequency) {
+                    builder->words[unique - 1].frequency = word->frequency;
+                }
+                continue;
+            }
+        }
+        builder->words[unique++] = *word;
+    }
+    return unique;
+}
+
+/* Builds the minimised automaton of the sorted, unique words */
+static u32 build_dawg (dawg_builder *dawg, const dict_builder *builder,
+                       u64 count) {
+
+    path_node *path = xrealloc(NULL, (DICT_BUILD_MAX_WORD + 1) *
+                                         sizeof(path_node));
+    path[0].final = false;
+    path[0].count = 0;
+
+    const char *previous = NULL;
+    u32 previous_len = 0;
+
+    for (u64 w = 0; w <= count; ++w) {
+
+        const char *word = w < count ? builder->text + builder->words[w].offset
+                                     : NULL;
+        u32 len = w < count ? builder->words[w].len : 0;
+
+        u32 prefix = 0;
+        while (word && prefix < len && prefix < previous_len &&
+               word[prefix] == previous[prefix]) {
+            prefix++;
+        }
+
+        /* The rest of the last word can not change any more */
+        for (u32 depth = previous_len; depth > prefix; --depth) {
+            u32 id = freeze(dawg, &path[depth]);
+            path[depth - 1].targets[path[depth - 1].count - 1] = id;
+        }
+        if (!word) {
+            break;
+        }
+
+        for (u32 depth = prefix; depth < len; ++depth) {
+            path_node *node = &path[depth];
+            node->labels[node->count] = (u8) word[depth];
+            node->targets[node->count] = 0;
+            node->count++;
+            path[depth + 1].final = false;
+            path[depth + 1].count = 0;
+        }
+        path[len].final = true;
+
+        previous = word;
+        previous_len = len;
+    }
+
+    u32 root = freeze(dawg, &path[0]);
+    free(path);
+    return root;
+}
+
+/**
+ * layout_edges
+ * Places the nodes breadth first from the root, which lands at edge 0,
+ * and writes their edges in the packed file format. Nodes without edges
+ * take no space, edges into them have target 0.
+ *
+ * Returns: The packed edges, NULL if there are more than the format can
+ *          address.
+ **/
+static u32 *layout_edges (const dawg_builder *dawg, u32 root, u64 *out_count) {
+
+    u32 *position = xrealloc(NULL, dawg->node_count * sizeof(u32));
+    u32 *order = xrealloc(NULL, dawg->node_count * sizeof(u32));
+    memset(position, 0xff, dawg->node_count * sizeof(u32));
+
+    u64 placed = 0;
+    u64 next = dawg->nodes[root].count;
+    u64 ordered = 0;
+    position[root] = 0;
+    order[ordered++] = root;
+
+    while (placed < ordered) {
+        const frozen_node *node = &dawg->nodes[order[placed++]];
+        for (u32 e = 0; e < node->count; ++e) {
+            u32 target = dawg->targets[node->first + e];
+            if (dawg->nodes[target].count == 0 || position[target] != ~0u) {
+                continue;
+            }
+            position[target] = (u32) (next < DICT_MAX_EDGES ? next : 0);
+            next += dawg->nodes[target].count;
+            order[ordered++] = target;
+        }
+    }
+
+    u32 *edges = NULL;
+    if (next <= DICT_MAX_EDGES) {
+        edges = xrealloc(NULL, (next ? next : 1) * sizeof(u32));
+        for (u64 i = 0; i < ordered; ++i) {
+            const frozen_node *node = &dawg->nodes[order[i]];
+            u32 at = position[order[i]];
+            for (u32 e = 0; e < node->count; ++e) {
+                u32 target = dawg->targets[node->first + e];
+                const frozen_node *to = &dawg->nodes[target];
+                edges[at + e] = dict_edge_make(
+                    dawg->labels[node->first + e], to->final,
+                    e + 1 == node->count, to->count ? position[target] : 0);
+            }
+        }
+    }
+
+    free(position);
+    free(order);
+    *out_count = next;
+    return edges;
+}
+
+/* Buckets a word's prefix deletes land in, sorted and distinct */
+static u32 delete_buckets (const dict_builder *builder, const dict_word *word,
+                           u32 max_distance, u64 mask, u64 *buckets) {
+
+    u32 prefix = word->len < DICT_SUGGEST_PREFIX ? word->len
+                                                 : DICT_SUGGEST_PREFIX;
+    u32 count = dict_delete_hashes((const u8 *) builder->text + word->offset,
+                                   prefix, max_distance, buckets);
+
+    for (u32 i = 0; i < count; ++i) {
+        u64 bucket = buckets[i] & mask;
+        u32 j = i;
+        for (; j > 0 && buckets[j - 1] > bucket; --j) {
+            buckets[j] = buckets[j - 1];
+        }
+        buckets[j] = bucket;
+    }
+    u32 unique = 0;
+    for (u32 i = 0; i < count; ++i) {
+        if (unique == 0 || buckets[unique - 1] != buckets[i]) {
+            buckets[unique++] = buckets[i];
+        }
+    }
+    return unique;
+}
+
+/**
+ * build_suggest
+ * Lays out the symmetric delete index of the sorted words, see
+ * dict_format.h. The deletes are made three times over rather than kept:
+ * once to size the table, once to count each bucket and once to fill
+ * them, so nothing but the index itself grows with the word count.
+ *
+ * Returns: The section, to be freed, NULL if it outgrows 32 bit offsets.
+ **/
+static u8 *build_suggest (const dict_builder *builder, u32 max_distance,
+                          u64 *out_len, dict_build_stats *stats) {
+
+    u64 buckets[DICT_SUGGEST_MAX_DELETES];
+    u64 word_count = builder->count;
+
+    u64 text_len = 0;
+    u64 deletes = 0;
+    for (u64 i = 0; i < word_count; ++i) {
+        text_len += 1 + builder->words[i].len;
+        deletes += delete_buckets(builder, &builder->words[i], max_distance,
+                                  ~0ull, buckets);
+    }
+    if (text_len > UINT32_MAX || deletes > UINT32_MAX) {
+        log_err("`%llu` deletes, the suggestion index holds at most `%u`",
+                deletes, UINT32_MAX);
+        return NULL;
+    }
+
+    /* About two postings a bucket, so few words are measured only because
+       their deletes share a bucket with the query's */
+    u64 bucket_count = 1;
+    while (bucket_count * 2 < deletes) {
+        bucket_count *= 2;
+    }
+    u64 mask = bucket_count - 1;
+
+    /* Starts of the buckets, a word filed once in each bucket it reaches */
+    u32 *bucket_start = xrealloc(NULL, (bucket_count + 1) * sizeof(u32));
+    memset(bucket_start, 0, (bucket_count + 1) * sizeof(u32));
+    for (u64 i = 0; i < word_count; ++i) {
+        u32 count = delete_buckets(builder, &builder->words[i], max_distance,
+                                   mask, buckets);
+        for (u32 b = 0; b < count; ++b) {
+            bucket_start[buckets[b] + 1]++;
+        }
+    }
+    for (u64 b = 0; b < bucket_count; ++b) {
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    u64 posting_count = bucket_start[bucket_count];
+
+    dict_suggest_header header = {
+        .max_distance = max_distance,
+        .prefix_len = DICT_SUGGEST_PREFIX,
+        .word_count = word_count,
+        .bucket_count = bucket_count,
+        .posting_count = posting_count,
+        .text_len = text_len,
+    };
+
+    u64 words_at = sizeof(header);
+    u64 buckets_at = words_at + word_count * sizeof(dict_suggest_word);
+    u64 postings_at = buckets_at + (bucket_count + 1) * sizeof(u32);
+    u64 text_at = postings_at + posting_count * sizeof(u32);
+    u64 len = text_at + text_len;
+    u8 *section = xrealloc(NULL, len);
+    memset(section, 0, len);
+
+    memcpy(section, &header, sizeof(header));
+    memcpy(section + buckets_at, bucket_start,
+           (bucket_count + 1) * sizeof(u32));
+    dict_suggest_word *words = (dict_suggest_word *) (section + words_at);
+    u32 *postings = (u32 *) (section + postings_at);
+    u8 *text = section + text_at;
+
+    /* The ids, each bucket's in word order, and the words' text */
+    u32 *fill = bucket_start;
+    u64 at = 0;
+    for (u64 i = 0; i < word_count; ++i) {
+        const dict_word *word = &builder->words[i];
+        words[i] = (dict_suggest_word) {.offset = (u32) at,
+                                        .frequency = word->frequency};
+        text[at] = (u8) word->len;
+        memcpy(text + at + 1, builder->text + word->offset, word->len);
+        at += 1 + word->len;
+
+        u32 count = delete_buckets(builder, word, max_distance, mask, buckets);
+        for (u32 b = 0; b < count; ++b) {
+            postings[fill[buckets[b]]++] = (u32) i;
+        }
+    }
+    free(bucket_start);
+
+    stats->postings = posting_count;
+    stats->suggest_bytes = len;
+    *out_len = len;
+    return section;
+}
+
+/**
+ * dict_builder_finish
+ * Sorts and dedupes the words, builds the minimised automaton, and the
+ * suggestion index if `suggest_distance` asks for one, and lays them out
+ * as a file image, checksum and all. The builder keeps its words, in
+ * sorted order.
+ *
+ * Arguments: `u64 *size`, set to the size of the image.
+ *            `dict_build_stats *stats`, filled in, may be NULL.
+ * Returns: The image, to be freed, NULL if the automaton or the index is
+ *          too large for the format.
+ **/
+u8 *dict_builder_finish (dict_builder *builder, u64 *size,
+                         dict_build_stats *stats) {
+
+    assert(builder && size);
+
+    dict_build_stats local = {0};
+    stats = stats ? stats : &local;
+    memset(stats, 0, sizeof(*stats));
+    stats->words = builder->count;
+    stats->too_long = builder->too_long;
+
+    builder->count = sort_unique(builder);
+    stats->unique = builder->count;
+
+    dawg_builder dawg = {0};
+    u32 root = build_dawg(&dawg, builder, builder->count);
+    stats->nodes = dawg.node_count;
+
+    u64 edge_count;
+    u32 *edges = layout_edges(&dawg, root, &edge_count);
+    dawg_free(&dawg);
+    stats->edges = edge_count;
+    if (!edges) {
+        log_err("`%llu` edges, the format holds at most `%u`", edge_count,
+                DICT_MAX_EDGES);
+        return NULL;
+    }
+
+    u64 suggest_len = 0;
+    u8 *suggest = NULL;
+    if (builder->suggest_distance > 0) {
+        u32 distance = builder->suggest_distance < DICT_SUGGEST_MAX_DISTANCE
+                           ? builder->suggest_distance
+                           : DICT_SUGGEST_MAX_DISTANCE;
+        suggest = build_suggest(builder, distance, &suggest_len, stats);
+        if (!suggest) {
+            free(edges);
+            return NULL;
+        }
+    }
+
+    dict_section sections[2] = {{
+        .kind = DICT_SECTION_DAWG,
+        .length = edge_count * sizeof(u32),
+    }};
+    u32 section_count = suggest ? 2 : 1;
+    u64 data_offset = sizeof(dict_header) + section_count * sizeof(dict_section);
+    sections[0].offset = data_offset;
+    u64 total = data_offset + sections[0].length;
+    if (suggest) {
+        sections[1] = (dict_section) {
+            .kind = DICT_SECTION_SUGGEST,
+            .offset = (total + 7) & ~7ull,
+            .length = suggest_len,
+        };
+        total = sections[1].offset + suggest_len;
+    }
+
+    u8 *image = xrealloc(NULL, total);
+    memset(image, 0, total);
+    memcpy(image + sizeof(dict_header), sections,
+           section_count * sizeof(dict_section));
+    memcpy(image + data_offset, edges, edge_count * sizeof(u32));
+    free(edges);
+    if (suggest) {
+        memcpy(image + sections[1].offset, suggest, suggest_len);
+        free(suggest);
+    }
+
+    dict_header header = {
+        .magic = DICT_MAGIC,
+        .version = DICT_VERSION,
+        .section_count = section_count,
+        .file_size = total,
+        .word_count = builder->count,
+    };
+    header.checksum = dict_checksum(image + sizeof(header),
+                                    total - sizeof(header));
+    memcpy(image, &header, sizeof(header));
+
+    stats->bytes = total;
+    *size = total;
+    return image;
+}
@@ -0,0 +1,64 @@
+#ifndef DICT_BUILD_H_
+#define DICT_BUILD_H_
+
+#include "common.h"
+
+/* Longest word kept, in bytes. Longer ones are counted and skipped */
+#define DICT_BUILD_MAX_WORD 255
+
+/* A word collected so far, in the builder's text */
+typedef struct dict_word {
+    u64 offset;
+    u32 len;
+    /* How common it is, 0 when unknown */
+    u32 frequency;
+} dict_word;
+
+/* What dict_builder_finish made, for dictc to report */
+typedef struct dict_build_stats {
+    /* Words added, duplicates and all */
+    u64 words;
+    u64 unique;
+    /* Words over DICT_BUILD_MAX_WORD */
+    u64 too_long;
+    /* States of the minimised automaton */
+    u64 nodes;
+    u64 edges;
+    /* Suggestion index, 0 when none was built */
+    u64 postings;
+    u64 suggest_bytes;
+    u64 bytes;
+} dict_build_stats;
+
+/**
+ * Collects words from plain lists and Hunspell dictionaries, then builds
+ * the minimised automaton and the file image the server maps, see
+ * dict_format.h. Only used offline by tools/dictc.c and by the tests.
+ * A zeroed builder is ready to use.
+ **/
+typedef struct dict_builder {
+    char *text;
+    u64 text_len;
+    u64 text_cap;
+
+    dict_word *words;
+    u64 count;
+    u64 cap;
+
+    u64 too_long;
+
+    /* Edit distance the suggestion index covers, 0 for no index */
+    u32 suggest_distance;
+} dict_builder;
+
+void dict_builder_free(dict_builder *builder);
+void dict_builder_add(dict_builder *builder, const char *word, u64 len);
+void dict_builder_add_counted(dict_builder *builder, const char *word, u64 len,
+                              u32 frequency);
+u64 dict_builder_add_list(dict_builder *builder, const char *text, u64 len);
+int dict_builder_add_hunspell(dict_builder *builder, const char *aff,
+                              u64 aff_len, const char *dic, u64 dic_len);
+u8 *dict_builder_finish(dict_builder *builder, u64 *size,
+                        dict_build_stats *stats);
+
+#endif  // DICT_BUILD_H_
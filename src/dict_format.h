@@ -0,0 +1,152 @@
+#ifndef DICT_FORMAT_H_
+#define DICT_FORMAT_H_
+
+#include "common.h"
+
+/**
+ * On-disk layout of a compiled dictionary, shared by the loader in
+ * src/dict.c and the compiler in tools/dictc.c. Everything is little
+ * endian and naturally aligned, so the file is used in place once mapped.
+ *
+ *   dict_header                 64 bytes
+ *   dict_section[count]         24 bytes each
+ *   section data                each 8 byte aligned
+ *
+ * The checksum covers every byte after the header.
+ **/
+
+#define DICT_MAGIC "CMPLDICT"
+#define DICT_MAGIC_LEN 8
+#define DICT_VERSION 1
+
+typedef struct dict_header {
+    char magic[DICT_MAGIC_LEN];
+    u32 version;
+    u32 section_count;
+    u64 file_size;
+    u64 checksum;
+    /* Words the automaton accepts */
+    u64 word_count;
+    u8 reserved[24];
+} dict_header;
+
+typedef struct dict_section {
+    u32 kind;
+    u32 reserved;
+    u64 offset;
+    u64 length;
+} dict_section;
+
+typedef enum dict_section_kind {
+    /* Minimised automaton, an array of u32 edges */
+    DICT_SECTION_DAWG = 1,
+    /* Symmetric delete index for suggestions, optional */
+    DICT_SECTION_SUGGEST = 2,
+} dict_section_kind;
+
+/**
+ * A DAWG edge in 32 bits. The edges leaving a node are stored together,
+ * sorted by label, the last one flagged. A node is named by the index of
+ * its first edge; the root's edges start at 0, so target 0 means the edge
+ * leads nowhere.
+ *
+ *   bits 0-7    label, one byte of the UTF-8 word
+ *   bit 8       a word ends with this edge
+ *   bit 9       last edge of its node
+ *   bits 10-31  target node
+ **/
+#define DICT_EDGE_FINAL (1u << 8)
+#define DICT_EDGE_LAST (1u << 9)
+#define DICT_EDGE_TARGET_SHIFT 10
+#define DICT_MAX_EDGES (1u << (32 - DICT_EDGE_TARGET_SHIFT))
+
+#define dict_edge_label(edge) ((u8) ((edge) & 0xff))
+#define dict_edge_target(edge) ((edge) >> DICT_EDGE_TARGET_SHIFT)
+
+static inline u32 dict_edge_make (u8 label, bool final, bool last,
+                                  u32 target) {
+    return (u32) label | (final ? DICT_EDGE_FINAL : 0) |
+           (last ? DICT_EDGE_LAST : 0) | (target << DICT_EDGE_TARGET_SHIFT);
+}
+
+/* Deletes are taken of the first this many bytes of a word */
+#define DICT_SUGGEST_PREFIX 7
+#define DICT_SUGGEST_MAX_DISTANCE 2
+/* Deletes of one prefix at most, 1 + 7 + 21 at distance 2 */
+#define DICT_SUGGEST_MAX_DELETES 32
+
+/**
+ * Symmetric delete index, as in SymSpell. Every word is filed under each
+ * string left by deleting up to `max_distance` bytes from its prefix. A
+ * query looks up the deletes of its own prefix, which reaches every word
+ * within that distance, then measures the real distance to each.
+ *
+ *   dict_suggest_header
+ *   dict_suggest_word    words[word_count]
+ *   u32                  bucket_start[bucket_count + 1]
+ *   u32                  postings[posting_count], word ids
+ *   u8                   text[text_len], each word as a length byte and
+ *                        its bytes
+ *
+ * A delete goes in bucket `dict_delete_hash & (bucket_count - 1)`, whose
+ * word ids are postings[bucket_start[b]] up to postings[bucket_start[b+1]].
+ * Words sharing a bucket only by hash are weeded out by the distance.
+ **/
+typedef struct dict_suggest_header {
+    u32 max_distance;
+    u32 prefix_len;
+    u64 word_count;
+    /* A power of two */
+    u64 bucket_count;
+    u64 posting_count;
+    u64 text_len;
+} dict_suggest_header;
+
+typedef struct dict_suggest_word {
+    u32 offset;
+    /* How common the word is, ties between candidates go to the larger */
+    u32 frequency;
+} dict_suggest_word;
+
+/* FNV-1a with a murmur finaliser, the low bits pick the bucket */
+static inline u64 dict_delete_hash (const u8 *text, u64 len) {
+
+    u64 hash = 14695981039346656037ull;
+    for (u64 i = 0; i < len; ++i) {
+        hash ^= text[i];
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ * dict_checksum
+ * FNV-1a over 64 bit words, then the tail a byte at a time. Only meant to
+ * catch truncated and damaged files, quickly enough to run on every load.
+ **/
+static inline u64 dict_checksum (const u8 *data, u64 len) {
+
+    u64 hash = 14695981039346656037ull;
+    u64 i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        u64 word = 0;
+        for (int b = 0; b < 8; ++b) {
+            word |= (u64) data[i + b] << (8 * b);
+        }
+        hash ^= word;
+        hash *= 1099511628211ull;
+    }
+    for (; i < len; ++i) {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+
+    hash ^= hash >> 33;
+    return hash;
+}
+
+#endif  // DICT_FORMAT_H_
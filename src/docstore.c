@@ -0,0 +1,395 @@
+#include "docstore.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "logging.h"
+
+#ifdef NDEBUG
+    #define docstore_initial_cap 64
+#else
+    #define docstore_initial_cap 4
+#endif
+
+/* FNV-1a with a murmur finaliser, the low bits pick the slot */
+u64 docstore_uri_hash (const char *uri, u64 len) {
+
+    u64 hash = 14695981039346656037ull;
+    for (u64 i = 0; i < len; ++i) {
+        hash ^= (u8) uri[i];
+        hash *= 1099511628211ull;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static char *copy_string (const char *str, u64 len) {
+
+    char *copy = malloc(len + 1);
+    if (!copy) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+    if (len) {
+        memcpy(copy, str, len);
+    }
+    copy[len] = '\0';
+    return copy;
+}
+
+static void free_document (Document *doc) {
+
+    free(doc->uri);
+    free(doc->language_id);
+    rope_free(&doc->text);
+    docstore_snapshot_release(doc->snapshot);
+    atomic_store_explicit(&doc->diagnostics->closed, true,
+                          memory_order_release);
+    docstore_diagnostics_release(doc->diagnostics);
+    free(doc);
+}
+
+void docstore_free (docstore *store) {
+
+    if (!store) {
+        return;
+    }
+    for (u64 i = 0; i < store->capacity; ++i) {
+        if (store->slots[i]) {
+            free_document(store->slots[i]);
+        }
+    }
+    free(store->slots);
+    memset(store, 0, sizeof(*store));
+}
+
+/* Slot holding `uri`, or the empty slot where it would go */
+static u64 probe (const docstore *store, const char *uri, u64 uri_len,
+                  u64 hash) {
+
+    u64 mask = store->capacity - 1;
+    u64 i = hash & mask;
+
+    while (store->slots[i]) {
+        const Document *doc = store->slots[i];
+        if (doc->hash == hash && doc->uri_len == uri_len &&
+            memcmp(doc->uri, uri, uri_len) == 0) {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void grow (docstore *store) {
+
+    u64 old_cap = store->capacity;
+    Document **old_slots = store->slots;
+
+    store->capacity = old_cap ? old_cap * 2 : docstore_initial_cap;
+    store->slots = calloc(store->capacity, sizeof(Document *));
+    if (!store->slots) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+
+    for (u64 i = 0; i < old_cap; ++i) {
+        Document *doc = old_slots[i];
+        if (doc) {
+            store->slots[probe(store, doc->uri, doc->uri_len, doc->hash)] = doc;
+        }
+    }
+    free(old_slots);
+}
+
+/* Nothing found yet, the first analysis checks the whole text */
+static DocDiagnostics *new_diagnostics (i64 version, u64 len) {
+
+    DocDiagnostics *diagnostics = calloc(1, sizeof(DocDiagnostics));
+    if (!diagnostics) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+    atomic_init(&diagnostics->refs, 1);
+    pthread_mutex_init(&diagnostics->lock, NULL);
+    diagnostics->edited_version = version;
+    diagnostics->edited_len = len;
+    atomic_init(&diagnostics->latest_version, version);
+    atomic_init(&diagnostics->closed, false);
+    return diagnostics;
+}
+
+void docstore_diagnostics_release (DocDiagnostics *diagnostics) {
+
+    if (!diagnostics) {
+        return;
+    }
+    if (atomic_fetch_sub_explicit(&diagnostics->refs, 1,
+                                  memory_order_acq_rel) != 1) {
+        return;
+    }
+    pthread_mutex_destroy(&diagnostics->lock);
+    free(diagnostics->spans);
+    free(diagnostics);
+}
+
+/**
+ * docstore_find
+ * Looks up an open document.
+ *
+ * Returns: The document, NULL if `uri` is not open.
+ **/
+Document *docstore_find (docstore *store, const char *uri, u64 uri_len) {
+
+    assert(store && (uri || uri_len == 0));
+
+    if (store->count == 0) {
+        return NULL;
+    }
+    u64 hash = docstore_uri_hash(uri, uri_len);
+    return store->slots[probe(store, uri, uri_len, hash)];
+}
+
+/**
+ * docstore_open
+ * Adds a document, copying everything it is given. Opening a URI which is
+ * already open replaces its contents, as clients sometimes do after a crash.
+ *
+ * Returns: The stored document.
+ **/
+Document *docstore_open (docstore *store, const char *uri, u64 uri_len,
+                         const char *language_id, i64 version,
+                         const char *text, u64 text_len) {
+
+    assert(store && uri && (text || text_len == 0));
+
+    /* Keep the load factor at or below 3/4 */
+    if ((store->count + 1) * 4 > store->capacity * 3) {
+        grow(store);
+    }
+
+    u64 hash = docstore_uri_hash(uri, uri_len);
+    u64 slot = probe(store, uri, uri_len, hash);
+    Document *doc = store->slots[slot];
+
+    if (doc) {
+        log_warn("`%.*s` was opened twice, replacing it.", (int) uri_len, uri);
+        free(doc->language_id);
+    } else {
+        doc = calloc(1, sizeof(Document));
+        if (!doc) {
+            log_err(COMPLAIN_Err_OutOfMem);
+            exit(-1);
+        }
+        doc->uri = copy_string(uri, uri_len);
+        doc->uri_len = uri_len;
+        doc->hash = hash;
+        doc->diagnostics = new_diagnostics(version, text_len);
+        store->slots[slot] = doc;
+        store->count++;
+    }
+
+    doc->language_id =
+        language_id ? copy_string(language_id, strlen(language_id)) : NULL;
+    docstore_set_version(doc, version);
+    docstore_set_text(doc, text, text_len);
+    return doc;
+}
+
+/* Moves a document to `version`, which makes older snapshots stale */
+void docstore_set_version (Document *doc, i64 version) {
+
+    assert(doc);
+
+    doc->version = version;
+    atomic_store_explicit(&doc->diagnostics->latest_version, version,
+                          memory_order_release);
+}
+
+/* Replaces the whole text of a document, all of which is dirty now */
+void docstore_set_text (Document *doc, const char *text, u64 text_len) {
+
+    assert(doc && (text || text_len == 0));
+
+    rope_set(&doc->text, text, text_len);
+    doc->dirty = (dirty_span){.start = 0, .end = text_len, .set = true};
+}
+
+/**
+ * docstore_close
+ * Removes and frees a document. The slots after it are shifted back, so
+ * lookups never have to step over deleted entries.
+ *
+ * Returns: Whether the document was open.
+ **/
+bool docstore_close (docstore *store, const char *uri, u64 uri_len) {
+
+    assert(store && (uri || uri_len == 0));
+
+    if (store->count == 0) {
+        return false;
+    }
+
+    u64 mask = store->capacity - 1;
+    u64 hash = docstore_uri_hash(uri, uri_len);
+    u64 hole = probe(store, uri, uri_len, hash);
+
+    if (!store->slots[hole]) {
+        return false;
+    }
+    free_document(store->slots[hole]);
+    store->slots[hole] = NULL;
+    store->count--;
+
+    /* Move back every following entry whose home is at or before the hole */
+    for (u64 i = (hole + 1) & mask; store->slots[i]; i = (i + 1) & mask) {
+        u64 home = store->slots[i]->hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            store->slots[hole] = store->slots[i];
+            store->slots[i] = NULL;
+            hole = i;
+        }
+    }
+    return true;
+}
+
+/**
+ * docstore_snapshot
+ * Takes a snapshot of the document's current version. Asking again before
+ * the text changes hands out the same one.
+ *
+ * Returns: A new reference, to be given to docstore_snapshot_release.
+ **/
+DocSnapshot *docstore_snapshot (Document *doc) {
+
+    assert(doc);
+
+    DocSnapshot *snapshot = doc->snapshot;
+
+    /* The cached snapshot keeps the old root alive, so an edited text
+       always has a different one */
+    if (snapshot && snapshot->version == doc->version &&
+        snapshot->text.root == doc->text.root) {
+        atomic_fetch_add_explicit(&snapshot->refs, 1, memory_order_relaxed);
+        return snapshot;
+    }
+    docstore_snapshot_release(snapshot);
+
+    snapshot = malloc(sizeof(DocSnapshot));
+    if (!snapshot) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+    /* One reference for the cache, one for the caller */
+    atomic_init(&snapshot->refs, 2);
+    snapshot->uri = copy_string(doc->uri, doc->uri_len);
+    snapshot->uri_len = doc->uri_len;
+    snapshot->version = doc->version;
+    snapshot->text = rope_snapshot(&doc->text);
+    snapshot->diagnostics = doc->diagnostics;
+    atomic_fetch_add_explicit(&doc->diagnostics->refs, 1,
+                              memory_order_relaxed);
+
+    doc->snapshot = snapshot;
+    return snapshot;
+}
+
+void docstore_snapshot_release (DocSnapshot *snapshot) {
+
+    if (!snapshot) {
+        return;
+    }
+    if (atomic_fetch_sub_explicit(&snapshot->refs, 1, memory_order_acq_rel) !=
+        1) {
+        return;
+    }
+    rope_free(&snapshot->text);
+    free(snapshot->uri);
+    docstore_diagnostics_release(snapshot->diagnostics);
+    free(snapshot);
+}
+
+/**
+ * docstore_snapshot_stale
+ * Checks whether results computed from `snapshot` still apply, which they
+ * do not once its document moved to another version or was closed. Safe
+ * on any thread, workers use it to drop what they found for old versions.
+ **/
+bool docstore_snapshot_stale (const DocSnapshot *snapshot) {
+
+    assert(snapshot);
+
+    const DocDiagnostics *shared = snapshot->diagnostics;
+    return atomic_load_explicit(&shared->closed, memory_order_acquire) ||
+           atomic_load_explicit(&shared->latest_version,
+                                memory_order_acquire) != snapshot->version;
+}
+
+/**
+ * docstore_take_dirty
+ * Hands the edits made since the last call over to the document's
+ * diagnostics, ahead of analysing its current version. They are added to
+ * any an analysis has not taken yet, so the diagnostics always know which
+ * part of the latest version handed over differs from what they found.
+ **/
+void docstore_take_dirty (Document *doc) {
+
+    assert(doc);
+
+    DocDiagnostics *diagnostics = doc->diagnostics;
+    dirty_span dirty = doc->dirty;
+    u64 len = rope_length(&doc->text);
+
+    pthread_mutex_lock(&diagnostics->lock);
+    if (dirty.set) {
+        /* The dirty span covers every change, so it replaced all of the
+           text it did not leave alone */
+        u64 inserted = dirty.end - dirty.start;
+        u64 removed = diagnostics->edited_len + inserted - len;
+        dirty_span_edit(&diagnostics->edited, dirty.start, removed, inserted);
+    }
+    diagnostics->edited_version = doc->version;
+    diagnostics->edited_len = len;
+    pthread_mutex_unlock(&diagnostics->lock);
+
+    doc->dirty = (dirty_span){0};
+}
+
+/**
+ * dirty_span_edit
+ * Grows `span` to cover an edit replacing `removed` bytes at `at` with
+ * `inserted` ones, shifting it along when the edit lands before it. A span
+ * kept up to date like this always covers every byte changed since it was
+ * last cleared.
+ **/
+void dirty_span_edit (dirty_span *span, u64 at, u64 removed, u64 inserted) {
+
+    assert(span);
+
+    u64 edit_end = at + removed;
+
+    if (!span->set) {
+        *span = (dirty_span){.start = at, .end = at + inserted, .set = true};
+        return;
+    }
+
+    /* Bytes behind the edit move by the size difference */
+    if (span->start > edit_end) {
+        span->start = span->start - removed + inserted;
+    } else if (span->start > at) {
+        span->start = at;
+    }
+    if (span->end >= edit_end) {
+        span->end = span->end - removed + inserted;
+    } else {
+        span->end = at + inserted;
+    }
+}
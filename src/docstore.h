@@ -0,0 +1,117 @@
+#ifndef DOCSTORE_H_
+#define DOCSTORE_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "common.h"
+#include "rope.h"
+
+/* Part of a document edited since it was last analysed, in the byte
+   offsets of its current text */
+typedef struct dirty_span {
+    u64 start;
+    u64 end;
+    bool set;
+} dirty_span;
+
+/* Where a diagnostic is, in the byte offsets of the text it was found in */
+typedef struct diagnostic_span {
+    u64 start;
+    u64 end;
+} diagnostic_span;
+
+/**
+ * What the last analysis of a document found, kept so the next one only
+ * checks the paragraphs edited in between and shifts everything else.
+ * Shared by a document and its snapshots. Analyses of one document never
+ * run at the same time, so only the edits handed over by the dispatcher
+ * need the lock.
+ **/
+typedef struct DocDiagnostics {
+    _Atomic u32 refs;
+    pthread_mutex_t lock;
+    /* Under `lock`, edits made since `spans` were found, in the offsets of
+       the text at `edited_version`, which is `edited_len` bytes long */
+    dirty_span edited;
+    i64 edited_version;
+    u64 edited_len;
+    /* Sorted, into a text `len` bytes long, meaningless until `valid` */
+    diagnostic_span *spans;
+    u64 count;
+    u64 capacity;
+    u64 len;
+    bool valid;
+    /* Bytes the last analysis checked */
+    u64 checked;
+    /* Version of the document's latest text and whether it was closed,
+       so workers can tell a stale snapshot, see docstore_snapshot_stale */
+    _Atomic i64 latest_version;
+    atomic_bool closed;
+} DocDiagnostics;
+
+/**
+ * A read-only view of a document at one version. Its text shares the
+ * document's chunks, so taking one is cheap, and it may be read and
+ * released on any thread while the document keeps being edited.
+ **/
+typedef struct DocSnapshot {
+    _Atomic u32 refs;
+    char *uri;
+    u64 uri_len;
+    i64 version;
+    rope text;
+    /* The document's, shared with it */
+    DocDiagnostics *diagnostics;
+} DocSnapshot;
+
+/* An open text document, owned by the store */
+typedef struct Document {
+    /* Interned key, owned by the document */
+    char *uri;
+    u64 uri_len;
+    u64 hash;
+    char *language_id;
+    i64 version;
+    rope text;
+    dirty_span dirty;
+    /* CLOCK_MONOTONIC nanoseconds at which it is analysed, 0 for never */
+    u64 analysis_due;
+    /* Last snapshot handed out, reused until the text changes */
+    DocSnapshot *snapshot;
+    DocDiagnostics *diagnostics;
+} Document;
+
+/**
+ * Open documents by URI. Open addressing with linear probing over a power
+ * of two table; slots point at separately allocated documents, so a
+ * `Document *` stays valid until its didClose even when the table grows.
+ * A zeroed store is ready to use.
+ **/
+typedef struct docstore {
+    Document **slots;
+    u64 capacity;
+    u64 count;
+} docstore;
+
+void docstore_free(docstore *store);
+Document *docstore_find(docstore *store, const char *uri, u64 uri_len);
+Document *docstore_open(docstore *store, const char *uri, u64 uri_len,
+                        const char *language_id, i64 version,
+                        const char *text, u64 text_len);
+void docstore_set_text(Document *doc, const char *text, u64 text_len);
+bool docstore_close(docstore *store, const char *uri, u64 uri_len);
+void docstore_set_version(Document *doc, i64 version);
+
+DocSnapshot *docstore_snapshot(Document *doc);
+void docstore_snapshot_release(DocSnapshot *snapshot);
+bool docstore_snapshot_stale(const DocSnapshot *snapshot);
+void docstore_take_dirty(Document *doc);
+void docstore_diagnostics_release(DocDiagnostics *diagnostics);
+
+u64 docstore_uri_hash(const char *uri, u64 uri_len);
+
+void dirty_span_edit(dirty_span *span, u64 at, u64 removed, u64 inserted);
+
+#endif  // DOCSTORE_H_
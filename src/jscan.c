@@ -0,0 +1,393 @@
+#include "jscan.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "common.h"
+#include "scan.h"
+
+static inline u64 skip_ws (const char *buf, u64 len, u64 pos) {
+
+    while (pos < len && (buf[pos] == ' ' || buf[pos] == '\t' ||
+                         buf[pos] == '\n' || buf[pos] == '\r')) {
+        ++pos;
+    }
+    return pos;
+}
+
+/* `pos` is at the opening quote, returns the offset past the closing one */
+static i64 skip_string (const char *buf, u64 len, u64 pos) {
+
+    u64 start = pos + 1;
+    u64 from = start;
+
+    while (from <= len) {
+        const char *quote = scan_find_byte(buf + from, len - from, '"');
+        if (!quote) {
+            return -1;
+        }
+
+        /* Escaped when preceded by an odd number of backslashes */
+        u64 at = quote - buf;
+        u64 slashes = 0;
+        while (at - slashes > start && buf[at - 1 - slashes] == '\\') {
+            ++slashes;
+        }
+        if (slashes % 2 == 0) {
+            return at + 1;
+        }
+        from = at + 1;
+    }
+    return -1;
+}
+
+/**
+ * jscan_skip_value
+ * Steps over one JSON value without building anything. Strings are skipped
+ * with the vectorised byte search, so long document texts cost little more
+ * than a memchr. Only the structure needed to find the end is checked, the
+ * value itself is validated by whoever parses it later.
+ *
+ * Arguments: `const char *buf`, `u64 len`, the text.
+ *            `u64 pos`, offset of the first byte of the value.
+ * Returns: Offset one past the value, -1 if it is truncated or malformed.
+ **/
+i64 jscan_skip_value (const char *buf, u64 len, u64 pos) {
+
+    assert(buf || len == 0);
+
+    if (pos >= len) {
+        return -1;
+    }
+
+    char first = buf[pos];
+
+    if (first == '"') {
+        return skip_string(buf, len, pos);
+    }
+
+    if (first == '{' || first == '[') {
+        u64 depth = 0;
+        while (pos < len) {
+            char c = buf[pos];
+            if (c == '"') {
+                i64 end = skip_string(buf, len, pos);
+                if (end < 0) {
+                    return -1;
+                }
+                pos = end;
+                continue;
+            }
+            if (c == '{' || c == '[') {
+                ++depth;
+            } else if (c == '}' || c == ']') {
+                if (--depth == 0) {
+                    return pos + 1;
+                }
+            }
+            ++pos;
+        }
+        return -1;
+    }
+
+    /* Numbers and literals run until the next delimiter */
+    u64 start = pos;
+    while (pos < len && buf[pos] != ',' && buf[pos] != '}' &&
+           buf[pos] != ']' && buf[pos] != ' ' && buf[pos] != '\t' &&
+           buf[pos] != '\n' && buf[pos] != '\r') {
+        ++pos;
+    }
+    return pos > start ? (i64) pos : -1;
+}
+
+static inline bool key_is (const char *key, u64 key_len, const char *want,
+                           u64 want_len) {
+    return key_len == want_len && memcmp(key, want, want_len) == 0;
+}
+
+/**
+ * jscan_peek
+ * Reads the top level keys of a JSON-RPC message and records where `method`,
+ * `id` and `params` are, skipping over every value. Of duplicated keys the
+ * first one wins, as with cJSON_GetObjectItem.
+ *
+ * Arguments: `const char *buf`, `u64 len`, the message text.
+ *            `jscan_envelope *env`, filled in with slices into `buf`.
+ * Returns: 0 on success, -1 if the text is not a well formed object.
+ **/
+int jscan_peek (const char *buf, u64 len, jscan_envelope *env) {
+
+    assert(env);
+    assert(buf || len == 0);
+
+    memset(env, 0, sizeof(*env));
+
+    u64 pos = skip_ws(buf, len, 0);
+    if (pos >= len || buf[pos] != '{') {
+        return -1;
+    }
+    pos = skip_ws(buf, len, pos + 1);
+
+    if (pos < len && buf[pos] == '}') {
+        return skip_ws(buf, len, pos + 1) == len ? 0 : -1;
+    }
+
+    while (true) {
+
+        if (pos >= len || buf[pos] != '"') {
+            return -1;
+        }
+        i64 key_end = skip_string(buf, len, pos);
+        if (key_end < 0) {
+            return -1;
+        }
+        const char *key = buf + pos + 1;
+        u64 key_len = key_end - pos - 2;
+
+        pos = skip_ws(buf, len, key_end);
+        if (pos >= len || buf[pos] != ':') {
+            return -1;
+        }
+        pos = skip_ws(buf, len, pos + 1);
+
+        i64 value_end = jscan_skip_value(buf, len, pos);
+        if (value_end < 0) {
+            return -1;
+        }
+        u64 value_len = value_end - pos;
+
+        if (key_is(key, key_len, "method", 6) && !env->method) {
+            if (buf[pos] == '"') {
+                env->method = buf + pos + 1;
+                env->method_len = value_len - 2;
+                env->method_escaped =
+                    memchr(env->method, '\\', env->method_len) != NULL;
+            }
+        } else if (key_is(key, key_len, "id", 2) && !env->id) {
+            env->id = buf + pos;
+            env->id_len = value_len;
+        } else if (key_is(key, key_len, "params", 6) && !env->params) {
+            env->params = buf + pos;
+            env->params_len = value_len;
+        }
+
+        pos = skip_ws(buf, len, value_end);
+        if (pos < len && buf[pos] == ',') {
+            pos = skip_ws(buf, len, pos + 1);
+            continue;
+        }
+        if (pos < len && buf[pos] == '}') {
+            return skip_ws(buf, len, pos + 1) == len ? 0 : -1;
+        }
+        return -1;
+    }
+}
+
+/**
+ * jscan_find_key
+ * Looks up one top level key of a JSON object without parsing it, skipping
+ * over the values before it. Keys are compared as written, escapes and all.
+ *
+ * Arguments: `const char *buf`, `u64 len`, the object text.
+ *            `const char *key`, the key to find, NUL terminated.
+ *            `const char **value`, `u64 *value_len`, set to the raw value.
+ * Returns: 1 if the key was found, 0 if not, -1 if the text is malformed
+ *          before the key.
+ **/
+int jscan_find_key (const char *buf, u64 len, const char *key,
+                    const char **value, u64 *value_len) {
+
+    assert(key && value && value_len);
+    assert(buf || len == 0);
+
+    u64 want_len = strlen(key);
+    u64 pos = skip_ws(buf, len, 0);
+    if (pos >= len || buf[pos] != '{') {
+        return -1;
+    }
+    pos = skip_ws(buf, len, pos + 1);
+    if (pos < len && buf[pos] == '}') {
+        return 0;
+    }
+
+    while (true) {
+
+        if (pos >= len || buf[pos] != '"') {
+            return -1;
+        }
+        i64 key_end = skip_string(buf, len, pos);
+        if (key_end < 0) {
+            return -1;
+        }
+        bool match = key_is(buf + pos + 1, key_end - pos - 2, key, want_len);
+
+        pos = skip_ws(buf, len, key_end);
+        if (pos >= len || buf[pos] != ':') {
+            return -1;
+        }
+        pos = skip_ws(buf, len, pos + 1);
+
+        i64 value_end = jscan_skip_value(buf, len, pos);
+        if (value_end < 0) {
+            return -1;
+        }
+        if (match) {
+            *value = buf + pos;
+            *value_len = value_end - pos;
+            return 1;
+        }
+
+        pos = skip_ws(buf, len, value_end);
+        if (pos < len && buf[pos] == ',') {
+            pos = skip_ws(buf, len, pos + 1);
+            continue;
+        }
+        return pos < len && buf[pos] == '}' ? 0 : -1;
+    }
+}
+
+static int hex_value (char c) {
+
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/* Reads the four hex digits at `pos`, -1 if they are not there */
+static i64 read_hex4 (const char *str, u64 len, u64 pos) {
+
+    if (pos + 4 > len) {
+        return -1;
+    }
+
+    i64 unit = 0;
+    for (u64 i = pos; i < pos + 4; ++i) {
+        int digit = hex_value(str[i]);
+        if (digit < 0) {
+            return -1;
+        }
+        unit = (unit << 4) | digit;
+    }
+    return unit;
+}
+
+/* Returns the number of bytes written, 0 if they do not fit */
+static u64 utf8_encode (u32 cp, char *out, u64 cap) {
+
+    if (cp < 0x80 && cap >= 1) {
+        out[0] = (char) cp;
+        return 1;
+    }
+    if (cp >= 0x80 && cp < 0x800 && cap >= 2) {
+        out[0] = (char) (0xC0 | (cp >> 6));
+        out[1] = (char) (0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp >= 0x800 && cp < 0x10000 && cap >= 3) {
+        out[0] = (char) (0xE0 | (cp >> 12));
+        out[1] = (char) (0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char) (0x80 | (cp & 0x3F));
+        return 3;
+    }
+    if (cp >= 0x10000 && cap >= 4) {
+        out[0] = (char) (0xF0 | (cp >> 18));
+        out[1] = (char) (0x80 | ((cp >> 12) & 0x3F));
+        out[2] = (char) (0x80 | ((cp >> 6) & 0x3F));
+        out[3] = (char) (0x80 | (cp & 0x3F));
+        return 4;
+    }
+    return 0;
+}
+
+/**
+ * jscan_unescape
+ * Decodes the escapes of a JSON string body into `out`, which is not NUL
+ * terminated. Surrogate pairs are combined, lone surrogates are rejected.
+ *
+ * Arguments: `const char *str`, `u64 len`, the string without quotes.
+ *            `char *out`, `u64 cap`, destination buffer.
+ * Returns: Decoded length, -1 on a bad escape or if `out` is too small.
+ **/
+i64 jscan_unescape (const char *str, u64 len, char *out, u64 cap) {
+
+    u64 n = 0;
+
+    for (u64 i = 0; i < len; ++i) {
+
+        if (str[i] != '\\') {
+            if (n == cap) {
+                return -1;
+            }
+            out[n++] = str[i];
+            continue;
+        }
+
+        if (++i == len) {
+            return -1;
+        }
+
+        char c;
+        switch (str[i]) {
+            case '"':
+            case '\\':
+            case '/':
+                c = str[i];
+                break;
+            case 'b':
+                c = '\b';
+                break;
+            case 'f':
+                c = '\f';
+                break;
+            case 'n':
+                c = '\n';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'u':
+                {
+                    i64 cp = read_hex4(str, len, i + 1);
+                    i += 4;
+                    if (cp >= 0xD800 && cp < 0xDC00) {
+                        /* High surrogate, its pair must follow */
+                        if (i + 2 >= len || str[i + 1] != '\\' ||
+                            str[i + 2] != 'u') {
+                            return -1;
+                        }
+                        i64 low = read_hex4(str, len, i + 3);
+                        if (low < 0xDC00 || low >= 0xE000) {
+                            return -1;
+                        }
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        i += 6;
+                    } else if (cp < 0 || (cp >= 0xDC00 && cp < 0xE000)) {
+                        return -1;
+                    }
+
+                    u64 count = utf8_encode((u32) cp, out + n, cap - n);
+                    if (count == 0) {
+                        return -1;
+                    }
+                    n += count;
+                    continue;
+                }
+            default:
+                return -1;
+        }
+
+        if (n == cap) {
+            return -1;
+        }
+        out[n++] = c;
+    }
+    return n;
+}
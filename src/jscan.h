@@ -0,0 +1,29 @@
+#ifndef JSCAN_H_
+#define JSCAN_H_
+
+#include <stdbool.h>
+
+#include "common.h"
+
+/* The JSON-RPC envelope of a message, as slices into the message text */
+typedef struct jscan_envelope {
+    /* Contents of the `method` string, without quotes, NULL if absent */
+    const char *method;
+    u64 method_len;
+    /* The method contains escapes and must go through jscan_unescape */
+    bool method_escaped;
+    /* Raw `id` token, a number or a quoted string, NULL if absent */
+    const char *id;
+    u64 id_len;
+    /* Raw `params` value, NULL if absent */
+    const char *params;
+    u64 params_len;
+} jscan_envelope;
+
+int jscan_peek(const char *buf, u64 len, jscan_envelope *env);
+i64 jscan_skip_value(const char *buf, u64 len, u64 pos);
+int jscan_find_key(const char *buf, u64 len, const char *key,
+                   const char **value, u64 *value_len);
+i64 jscan_unescape(const char *str, u64 len, char *out, u64 cap);
+
+#endif  // JSCAN_H_
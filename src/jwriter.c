@@ -0,0 +1,202 @@
+#include "jwriter.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "output.h"
+
+/* Opens a reply frame, the header is backfilled by jwriter_end */
+void jwriter_begin (jwriter *writer, pipeline_output *out) {
+
+    assert(writer && out);
+
+    memset(writer, 0, sizeof(*writer));
+    writer->out = out;
+    output_begin(out);
+}
+
+void jwriter_end (jwriter *writer) {
+
+    assert(writer && writer->depth == 0);
+
+    output_end(writer->out);
+    writer->out = NULL;
+}
+
+/* Emits the separator owed before a value or key at the current level */
+static inline void separate (jwriter *writer) {
+
+    if (writer->after_key) {
+        writer->after_key = false;
+        return;
+    }
+    if (writer->has_items[writer->depth]) {
+        output_append(writer->out, ",", 1);
+    }
+    writer->has_items[writer->depth] = true;
+}
+
+static inline void open_level (jwriter *writer, char bracket) {
+
+    separate(writer);
+    output_append(writer->out, &bracket, 1);
+
+    if (++writer->depth >= JWRITER_MAX_DEPTH) {
+        COMPLAIN_UNREACHABLE("Reply nested too deeply.");
+    }
+    writer->has_items[writer->depth] = false;
+}
+
+static inline void close_level (jwriter *writer, char bracket) {
+
+    assert(writer->depth > 0 && !writer->after_key);
+
+    writer->depth--;
+    output_append(writer->out, &bracket, 1);
+}
+
+void jwriter_object_begin (jwriter *writer) {
+    open_level(writer, '{');
+}
+
+void jwriter_object_end (jwriter *writer) {
+    close_level(writer, '}');
+}
+
+void jwriter_array_begin (jwriter *writer) {
+    open_level(writer, '[');
+}
+
+void jwriter_array_end (jwriter *writer) {
+    close_level(writer, ']');
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* Writes `str` quoted, copying the runs that need no escaping in one go */
+static void write_escaped (pipeline_output *out, const char *str, u64 len) {
+
+    output_append(out, "\"", 1);
+
+    u64 run = 0;
+    for (u64 i = 0; i < len; ++i) {
+
+        u8 c = (u8) str[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        output_append(out, str + run, i - run);
+        run = i + 1;
+
+        char escape[6] = {'\\', 0};
+        u64 escape_len = 2;
+        switch (c) {
+            case '"':
+                escape[1] = '"';
+                break;
+            case '\\':
+                escape[1] = '\\';
+                break;
+            case '\n':
+                escape[1] = 'n';
+                break;
+            case '\r':
+                escape[1] = 'r';
+                break;
+            case '\t':
+                escape[1] = 't';
+                break;
+            case '\b':
+                escape[1] = 'b';
+                break;
+            case '\f':
+                escape[1] = 'f';
+                break;
+            default:
+                memcpy(escape + 1, "u00", 3);
+                escape[4] = hex_digits[c >> 4];
+                escape[5] = hex_digits[c & 0xF];
+                escape_len = 6;
+                break;
+        }
+        output_append(out, escape, escape_len);
+    }
+
+    output_append(out, str + run, len - run);
+    output_append(out, "\"", 1);
+}
+
+void jwriter_key (jwriter *writer, const char *key) {
+
+    assert(writer && key && !writer->after_key);
+
+    separate(writer);
+    write_escaped(writer->out, key, strlen(key));
+    output_append(writer->out, ":", 1);
+    writer->after_key = true;
+}
+
+void jwriter_string (jwriter *writer, const char *str, u64 len) {
+
+    assert(str || len == 0);
+
+    separate(writer);
+    write_escaped(writer->out, str, len);
+}
+
+void jwriter_cstring (jwriter *writer, const char *str) {
+
+    if (!str) {
+        jwriter_null(writer);
+        return;
+    }
+    jwriter_string(writer, str, strlen(str));
+}
+
+void jwriter_int (jwriter *writer, i64 value) {
+
+    /* Digits are produced backwards from the end of the buffer */
+    char digits[24];
+    char *at = digits + sizeof(digits);
+    u64 magnitude = value < 0 ? 0 - (u64) value : (u64) value;
+
+    do {
+        *--at = (char) ('0' + (magnitude % 10));
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0) {
+        *--at = '-';
+    }
+
+    separate(writer);
+    output_append(writer->out, at, digits + sizeof(digits) - at);
+}
+
+void jwriter_bool (jwriter *writer, bool value) {
+
+    separate(writer);
+    if (value) {
+        output_append(writer->out, "true", 4);
+    } else {
+        output_append(writer->out, "false", 5);
+    }
+}
+
+void jwriter_null (jwriter *writer) {
+
+    separate(writer);
+    output_append(writer->out, "null", 4);
+}
+
+/* Copies an already serialised value, such as a request id, verbatim */
+void jwriter_raw (jwriter *writer, const char *raw, u64 len) {
+
+    assert(raw && len > 0);
+
+    separate(writer);
+    output_append(writer->out, raw, len);
+}
@@ -0,0 +1,42 @@
+#ifndef JWRITER_H_
+#define JWRITER_H_
+
+#include <stdbool.h>
+
+#include "common.h"
+#include "output.h"
+
+/* Deepest nesting of objects and arrays a reply may have */
+#define JWRITER_MAX_DEPTH 32
+
+/**
+ * Compact JSON serialiser writing straight into a reply frame of the output
+ * stage. Commas and colons are placed automatically, the caller only emits
+ * keys and values in order.
+ **/
+typedef struct jwriter {
+    pipeline_output *out;
+    u32 depth;
+    /* Last thing written was a key, the next value needs no comma */
+    bool after_key;
+    /* Per level: whether it already holds a member */
+    bool has_items[JWRITER_MAX_DEPTH];
+} jwriter;
+
+void jwriter_begin(jwriter *writer, pipeline_output *out);
+void jwriter_end(jwriter *writer);
+
+void jwriter_object_begin(jwriter *writer);
+void jwriter_object_end(jwriter *writer);
+void jwriter_array_begin(jwriter *writer);
+void jwriter_array_end(jwriter *writer);
+
+void jwriter_key(jwriter *writer, const char *key);
+void jwriter_string(jwriter *writer, const char *str, u64 len);
+void jwriter_cstring(jwriter *writer, const char *str);
+void jwriter_int(jwriter *writer, i64 value);
+void jwriter_bool(jwriter *writer, bool value);
+void jwriter_null(jwriter *writer);
+void jwriter_raw(jwriter *writer, const char *raw, u64 len);
+
+#endif  // JWRITER_H_
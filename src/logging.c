@@ -1,7 +1,11 @@
 
 #include "logging.h"
 
+#include <pthread.h>
+#include <stdalign.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,8 +14,55 @@
 #include <unistd.h>
 
 #define time_buff_size 16
-#define max_time_buf_size 32
-#define log_t_str_max_len 12
+
+#ifdef NDEBUG
+    #define log_ring_len 1024
+#else
+    #define log_ring_len 256
+#endif
+
+/* Longest message kept, longer ones are cut short */
+#define log_text_max 440
+/* How long the flusher lets records gather after writing some */
+#define log_flush_interval_ns (5 * 1000 * 1000)
+/* Formatted records are written out in batches of about this size */
+#define log_batch_size (64 * 1024)
+
+/**
+ * One log call. The message is formatted by the caller, so nothing it
+ * points to has to outlive the call; the rest is formatted by the flusher.
+ **/
+typedef struct log_record {
+    /* CLOCK_MONOTONIC, orders records of different threads */
+    uint64_t time_ns;
+    const char *file;
+    const char *func;
+    uint32_t line;
+    log_type_e type;
+    uint32_t len;
+    char text[log_text_max];
+} log_record;
+
+/**
+ * Records of one thread. Single producer, the thread owning it, and single
+ * consumer, whoever holds `flush_lock`. When it is full records are dropped
+ * and counted, logging never waits. A ring is handed to a new thread once
+ * its owner exits and is never freed.
+ **/
+typedef struct log_ring {
+    struct log_ring *next;
+    atomic_bool owned;
+
+    /* Next record to write out, only written by the consumer */
+    alignas(64) _Atomic uint64_t head;
+    /* Next record to fill, only written by the producer */
+    alignas(64) _Atomic uint64_t tail;
+    _Atomic uint64_t dropped;
+    /* Drops the consumer has reported so far */
+    uint64_t dropped_reported;
+
+    log_record records[log_ring_len];
+} log_ring;
 
 typedef struct {
     FILE *log_file;
@@ -20,6 +71,23 @@ typedef struct {
 
 static yama_log_context log_opts = {0};
 
+atomic_int log_level = COMPLAIN_LOG_LEVEL;
+
+/* Every ring ever made, new ones are pushed to the front */
+static _Atomic(log_ring *) log_rings = NULL;
+static _Thread_local log_ring *thread_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t logging_once = PTHREAD_ONCE_INIT;
+
+/* Held while draining, and while the log file is swapped */
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+/* The flusher waits on `flusher_wake` once the rings are empty, the first
+   record logged after that wakes it */
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+static atomic_bool flusher_idle = false;
+static char flush_buffer[log_batch_size + log_text_max * 2];
+
 static void yama_get_human_time (char *buffer, int buffer_len) {
     // Get current time
     time_t now = time(NULL);
@@ -32,7 +100,7 @@ static void yama_get_human_time (char *buffer, int buffer_len) {
     }
 }
 
-static void yama_log_enable_colours (int enable) {
+void log_enable_color_output (int enable) {
     log_opts.enable_color_output = enable;
 }
 
@@ -52,6 +120,238 @@ const char *yama_get_severity_colour (log_type_e log_type) {
     }
 }
 
+static const char *log_type_name (log_type_e log_type) {
+    switch (log_type) {
+        case LOG_TYPE_INFO:
+            return "INFO";
+        case LOG_TYPE_DEBUG:
+            return "DEBUG";
+        case LOG_TYPE_WARNING:
+            return "WARNING";
+        case LOG_TYPE_ERROR:
+            return "ERROR";
+        case LOG_TYPE_NONE:
+        default:
+            return "";
+    }
+}
+
+static uint64_t log_now (void) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 * 1000 * 1000 + (uint64_t) now.tv_nsec;
+}
+
+/* Appends one formatted record to the batch, must hold `flush_lock` */
+static size_t format_record (char *out, size_t cap, const log_record *record,
+                             int colour) {
+
+    size_t len = 0;
+
+    /* snprintf returns what it would have written, anything cut short
+       stops one byte before the end to leave room for the line feed */
+    if (colour) {
+        len += snprintf(out + len, cap - len, "%s",
+                        yama_get_severity_colour(record->type));
+        len = len < cap - 1 ? len : cap - 1;
+    }
+    len += snprintf(out + len, cap - len, "(%s) %s:%u [%s] ::: ",
+                    log_type_name(record->type), record->file, record->line,
+                    record->func);
+    len = len < cap - 1 ? len : cap - 1;
+    if (len + record->len + 1 < cap) {
+        memcpy(out + len, record->text, record->len);
+        len += record->len;
+    }
+    out[len++] = '\n';
+    if (colour && len < cap) {
+        len += snprintf(out + len, cap - len, "%s", RESET);
+    }
+    return len < cap ? len : cap;
+}
+
+static void write_batch (FILE *file, const char *batch, size_t len) {
+
+    if (len > 0 && fwrite(batch, 1, len, file) != len) {
+        perror("Could not write the log");
+    }
+}
+
+/**
+ * drain_rings
+ * Writes out everything logged so far, oldest first across all threads,
+ * with one write per batch. Must hold `flush_lock`.
+ *
+ * Returns: Whether there was anything to write.
+ **/
+static bool drain_rings (void) {
+
+    FILE *file = log_opts.log_file ? log_opts.log_file : stderr;
+    int colour = log_opts.enable_color_output &&
+                 (file == stdout || file == stderr);
+    size_t used = 0;
+    bool wrote = false;
+
+    /* Drops are reported before whatever got through after them */
+    for (log_ring *ring = atomic_load(&log_rings); ring; ring = ring->next) {
+        uint64_t dropped = atomic_load_explicit(&ring->dropped,
+                                                memory_order_relaxed);
+        if (dropped != ring->dropped_reported) {
+            used += snprintf(flush_buffer + used, sizeof(flush_buffer) - used,
+                             "(WARNING) logging: dropped `%llu` records, the "
+                             "ring of a thread was full\n",
+                             (unsigned long long) (dropped -
+                                                   ring->dropped_reported));
+            ring->dropped_reported = dropped;
+            wrote = true;
+        }
+        if (used >= log_batch_size) {
+            write_batch(file, flush_buffer, used);
+            used = 0;
+        }
+    }
+
+    while (true) {
+
+        /* Merge the rings by time, each one is in order already */
+        log_ring *oldest = NULL;
+        const log_record *next = NULL;
+
+        for (log_ring *ring = atomic_load(&log_rings); ring;
+             ring = ring->next) {
+            uint64_t head =
+                atomic_load_explicit(&ring->head, memory_order_relaxed);
+            if (head ==
+                atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+                continue;
+            }
+            const log_record *record =
+                &ring->records[head & (log_ring_len - 1)];
+            if (!next || record->time_ns < next->time_ns) {
+                oldest = ring;
+                next = record;
+            }
+        }
+        if (!next) {
+            break;
+        }
+
+        used += format_record(flush_buffer + used, sizeof(flush_buffer) - used,
+                              next, colour);
+        wrote = true;
+        atomic_store_explicit(&oldest->head,
+                              atomic_load_explicit(&oldest->head,
+                                                   memory_order_relaxed) +
+                                  1,
+                              memory_order_release);
+
+        if (used >= log_batch_size) {
+            write_batch(file, flush_buffer, used);
+            used = 0;
+        }
+    }
+
+    write_batch(file, flush_buffer, used);
+    fflush(file);
+    return wrote;
+}
+
+static bool rings_empty (void) {
+
+    for (log_ring *ring = atomic_load(&log_rings); ring; ring = ring->next) {
+        if (atomic_load_explicit(&ring->head, memory_order_relaxed) !=
+            atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * log_flusher_thread
+ * Drains the rings every log_flush_interval_ns while records keep coming,
+ * so they are written in batches. Once a drain finds nothing it sleeps
+ * until log_formatted_input wakes it, an idle server never wakes it.
+ **/
+static void *log_flusher_thread (void *arg) {
+
+    (void) arg;
+    struct timespec nap = {.tv_sec = 0, .tv_nsec = log_flush_interval_ns};
+
+    while (true) {
+        pthread_mutex_lock(&flush_lock);
+        bool wrote = drain_rings();
+        pthread_mutex_unlock(&flush_lock);
+
+        if (wrote) {
+            nanosleep(&nap, NULL);
+            continue;
+        }
+
+        pthread_mutex_lock(&flusher_lock);
+        atomic_store(&flusher_idle, true);
+        /* Pairs with the fence in log_formatted_input: either it sees the
+           flag and wakes us, or we see its record here */
+        atomic_thread_fence(memory_order_seq_cst);
+        while (atomic_load(&flusher_idle) && rings_empty()) {
+            pthread_cond_wait(&flusher_wake, &flusher_lock);
+        }
+        atomic_store(&flusher_idle, false);
+        pthread_mutex_unlock(&flusher_lock);
+    }
+    return NULL;
+}
+
+/* Frees the ring of an exiting thread for the next one to take */
+static void release_ring (void *ring) {
+    atomic_store(&((log_ring *) ring)->owned, false);
+}
+
+static void start_logging (void) {
+
+    pthread_key_create(&ring_key, release_ring);
+
+    /* Whatever is still queued when the process exits is written then */
+    atexit(log_flush);
+
+    pthread_t flusher;
+    if (pthread_create(&flusher, NULL, log_flusher_thread, NULL) == 0) {
+        pthread_detach(flusher);
+    } else {
+        perror("Could not start the log flusher");
+    }
+}
+
+/* The calling thread's ring, taken over from an exited thread if possible */
+static log_ring *claim_ring (void) {
+
+    pthread_once(&logging_once, start_logging);
+
+    log_ring *ring = atomic_load(&log_rings);
+    for (; ring; ring = ring->next) {
+        bool free_ring = false;
+        if (atomic_compare_exchange_strong(&ring->owned, &free_ring, true)) {
+            break;
+        }
+    }
+
+    if (!ring) {
+        ring = calloc(1, sizeof(log_ring));
+        if (!ring) {
+            return NULL;
+        }
+        atomic_init(&ring->owned, true);
+        ring->next = atomic_load(&log_rings);
+        while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring)) {
+        }
+    }
+
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
 /**
  * @brief      Opens/creates a file to append logs.
  *
@@ -63,20 +363,23 @@ const char *yama_get_severity_colour (log_type_e log_type) {
  */
 int yama_log_init_file (FILE *file) {
 
+    pthread_mutex_lock(&flush_lock);
+
+    /* Records logged so far belong to the old file */
+    drain_rings();
+
     if (file) {
         log_opts.log_file = file;
     } else {
         log_opts.log_file = stderr;
     }
 
-    if (log_opts.log_file == NULL) {
-        perror("Failed to open or create a log file.");
-        return -1;
-    }
     char timebuffer[time_buff_size];
     yama_get_human_time(timebuffer, time_buff_size);
 
     int worked = fprintf(log_opts.log_file, "===LOG AT %s===\n\n", timebuffer);
+    pthread_mutex_unlock(&flush_lock);
+
     if (worked < 0) {
         perror("Failed to print the initial header!\n");
     }
@@ -84,9 +387,37 @@ int yama_log_init_file (FILE *file) {
 #undef time_buff_size
 }
 
+/* Sets the least severe level written, nothing past COMPLAIN_LOG_LEVEL can
+   be turned back on */
+void log_set_level (log_type_e log_type) {
+    atomic_store_explicit(&log_level, (int) log_type, memory_order_relaxed);
+}
+
+/* Writes out everything logged so far, blocking until it is written */
+void log_flush (void) {
+
+    pthread_mutex_lock(&flush_lock);
+    drain_rings();
+    pthread_mutex_unlock(&flush_lock);
+}
+
+/* Records dropped because a thread's ring was full, over all threads */
+uint64_t log_dropped (void) {
+
+    uint64_t dropped = 0;
+    for (log_ring *ring = atomic_load(&log_rings); ring; ring = ring->next) {
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    return dropped;
+}
+
 void log_close_file (void) {
 
+    pthread_mutex_lock(&flush_lock);
+    drain_rings();
+
     if (log_opts.log_file == NULL) {
+        pthread_mutex_unlock(&flush_lock);
         return;
     }
 
@@ -95,107 +426,60 @@ void log_close_file (void) {
         perror("Error closing file");
     }
     log_opts.log_file = NULL;
+    pthread_mutex_unlock(&flush_lock);
 }
 
+/**
+ * log_formatted_input
+ * Queues a record on the calling thread's ring. Only the message is
+ * formatted here, the background flusher does the rest and the writing.
+ * Never blocks, when the ring is full the record is dropped and counted.
+ **/
 void log_formatted_input (const char *filename, const char *func_name,
-                          size_t line_num, log_type_e log_type, char *format,
-                          ...) {
-
-    if (log_opts.log_file == NULL) {
-        log_opts.log_file = stderr;
-    }
-
-    fflush(log_opts.log_file);
-
-    /* Get current time */
-    time_t now = time(NULL);
-    struct tm *timeinfo = NULL;
-    time_t time_result = time(&now);
-    if (time_result == -1) {
-        perror("Could not retrieve time\n");
-    }
-    timeinfo = localtime(&now);
-
-    char time_buffer[max_time_buf_size];
-    memset(time_buffer, 0, max_time_buf_size);
-    size_t success =
-        strftime(time_buffer, max_time_buf_size, "%H:%M:%S", timeinfo);
-    if (!success) {
-        perror("Could not write the time...\n");
-    }
-
-    char log_type_str[log_t_str_max_len];
-
-    switch (log_type) {
-        case (LOG_TYPE_INFO):
-            {
-                sprintf(log_type_str, "INFO");
-                break;
-            }
-        case (LOG_TYPE_DEBUG):
-            {
-                sprintf(log_type_str, "DEBUG");
-                break;
-            }
-        case (LOG_TYPE_WARNING):
-            {
-                sprintf(log_type_str, "WARNING");
-                break;
-            }
-        case (LOG_TYPE_ERROR):
-            {
-                sprintf(log_type_str, "ERROR");
-                break;
-            }
-        case (LOG_TYPE_NONE):
-            {
-                sprintf(log_type_str, "");
-                break;
-            }
-        default:
-            sprintf(log_type_str, "");
-    }
+                          size_t line_num, log_type_e log_type,
+                          const char *format, ...) {
 
-    /* Get the color code */
-    const char *color_code = yama_get_severity_colour(log_type);
-
-    // Check if color output is enabled and if output is to a terminal
-    if (log_opts.log_file == stdout || log_opts.log_file == stderr) {
-        if (log_opts.enable_color_output) {
-            (void) fprintf(log_opts.log_file, "%s", color_code);
-        }
+    log_ring *ring = thread_ring ? thread_ring : claim_ring();
+    if (!ring) {
+        return;
     }
 
-    /* Adjusted fprintf statement */
-    /* int fpr_good = fprintf(log_opts.log_file, "%s:%zu: [%s] %s %s: ",
-     * filename, line_num, time_buffer, log_type_str, func_name);
-     */
-
-    int fpr_good =
-        fprintf(log_opts.log_file, "(%s) %s:%zu [%s] ::: ", log_type_str,
-                filename, line_num, func_name);
-
-    if (!fpr_good) {
-        perror("Could not print to file\n");
-        log_close_file();
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) ==
+        log_ring_len) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
         return;
     }
 
-    /* Print the formatting (variable args) */
+    log_record *record = &ring->records[tail & (log_ring_len - 1)];
+    record->time_ns = log_now();
+    record->file = filename;
+    record->func = func_name;
+    record->line = (uint32_t) line_num;
+    record->type = log_type;
+
     va_list args;
     va_start(args, format);
-    fpr_good = vfprintf(log_opts.log_file, format, args);
-    if (fpr_good < 0) {
-        perror("Variadic args error..\n");
-    }
+    int len = vsnprintf(record->text, sizeof(record->text), format, args);
     va_end(args);
 
-    fprintf(log_opts.log_file, "\n");
-
-    /* Reset color if needed */
-    if (log_opts.enable_color_output) {
-        fprintf(log_opts.log_file, "%s", RESET);
+    if (len < 0) {
+        len = 0;
+    } else if (len >= (int) sizeof(record->text)) {
+        /* Cut short, and say so */
+        len = sizeof(record->text) - 1;
+        memcpy(record->text + len - 3, "...", 3);
     }
+    record->len = (uint32_t) len;
 
-    fflush(log_opts.log_file);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    /* Only the first record after the flusher went idle pays for this */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&flusher_idle, memory_order_relaxed) &&
+        atomic_exchange(&flusher_idle, false)) {
+        pthread_mutex_lock(&flusher_lock);
+        pthread_cond_signal(&flusher_wake);
+        pthread_mutex_unlock(&flusher_lock);
+    }
 }
@@ -1,7 +1,10 @@
 #ifndef LOGGING_H_
 #define LOGGING_H_
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 /* Colour codes */
@@ -18,44 +21,63 @@
 #define BOLD "\x1b[1m"
 #define UNDERLINE "\x1b[4m"
 
+/* Ordered from most to least severe, a level lets through itself and
+   everything before it */
 typedef enum {
     LOG_TYPE_ERROR = 0,
     LOG_TYPE_WARNING = 1,
-    LOG_TYPE_DEBUG = 2,
-    LOG_TYPE_INFO = 3,
+    LOG_TYPE_INFO = 2,
+    LOG_TYPE_DEBUG = 3,
+    /* Records without a severity, see log_none */
     LOG_TYPE_NONE = 4,
+    /* Only a threshold, lets every record through */
+    LOG_TYPE_ALL = LOG_TYPE_NONE,
 } log_type_e;
 
-// NOLINTBEGIN(*-Wincompatible-pointer-types-discards-qualifiers):
-// NOTE: Suppressing lint warnings
-// It keeps warning me about discarding qualifiers if I insert a string literal
-#define log_err(...)                                                  \
-    log_formatted_input(__FILE__, __func__, __LINE__, LOG_TYPE_ERROR, \
-                        __VA_ARGS__);
-#define log_warn(...)                                                   \
-    log_formatted_input(__FILE__, __func__, __LINE__, LOG_TYPE_WARNING, \
-                        __VA_ARGS__);
+/* Least severe level compiled in, calls past it are removed entirely.
+   A plain number so it can be set with -DCOMPLAIN_LOG_LEVEL=2, the
+   default is LOG_TYPE_ALL */
+#ifndef COMPLAIN_LOG_LEVEL
+    #define COMPLAIN_LOG_LEVEL 4
+#endif
 
-#define log_info(...)                                                \
-    log_formatted_input(__FILE__, __func__, __LINE__, LOG_TYPE_INFO, \
-                        __VA_ARGS__);
+/* Least severe level written at run time, see log_set_level */
+extern atomic_int log_level;
 
-#define log_debug(...)                                                \
-    log_formatted_input(__FILE__, __func__, __LINE__, LOG_TYPE_DEBUG, \
-                        __VA_ARGS__);
+static inline bool log_enabled (log_type_e log_type) {
+    return (int) log_type <=
+           atomic_load_explicit(&log_level, memory_order_relaxed);
+}
 
-#define log_none(...)                                                \
-    log_formatted_input(__FILE__, __func__, __LINE__, LOG_TYPE_NONE, \
-                        __VA_ARGS__);
+/* The level is checked before the arguments are evaluated, so a disabled
+   call costs one load and a branch, and nothing when compiled out.
+   The file and function names are kept by pointer until the record is
+   written, so they must be string literals like __FILE__ and __func__ */
+#define log_at(log_type, ...)                                            \
+    do {                                                                 \
+        if ((log_type) <= COMPLAIN_LOG_LEVEL && log_enabled(log_type)) { \
+            log_formatted_input(__FILE__, __func__, __LINE__, log_type,  \
+                                __VA_ARGS__);                            \
+        }                                                                \
+    } while (0);
+
+#define log_err(...) log_at(LOG_TYPE_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_TYPE_WARNING, __VA_ARGS__)
+#define log_info(...) log_at(LOG_TYPE_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_TYPE_DEBUG, __VA_ARGS__)
+#define log_none(...) log_at(LOG_TYPE_NONE, __VA_ARGS__)
 
 int yama_log_init_file(FILE *file);
 
 void log_formatted_input(const char *filename, const char *func_name,
-                         size_t line_num, log_type_e log_type, char *format,
-                         ...);
+                         size_t line_num, log_type_e log_type,
+                         const char *format, ...)
+    __attribute__((format(printf, 5, 6)));
 
+void log_set_level(log_type_e log_type);
+void log_flush(void);
+uint64_t log_dropped(void);
 void log_close_file(void);
-// NOLINTEND
 
 void log_enable_color_output(int enable);
 
@@ -3,12 +3,78 @@
 
 #include <assert.h>
 #include <cjson/cJSON.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
+#include "jscan.h"
 #include "logging.h"
+#include "pool.h"
+#include "tokenize.h"
+
+/* More workers than this is a typo, not a machine */
+#define lsp_max_worker_threads 256
+/* Quiet time after an edit before the document is analysed */
+#define lsp_default_debounce_ms 150
+#define lsp_max_debounce_ms 10000
+/* Past this many a document is mostly noise, the rest are not reported */
+#define lsp_max_diagnostics 1000
+/* Words spell checked between calls to lsp_request_yield */
+#define lsp_spelling_chunk 4096
+/* Lines an edit's paragraph is widened over at most, either way */
+#define lsp_max_paragraph_lines 64
+/* Longer lines are never blank as far as paragraphs go */
+#define lsp_max_blank_line 16
+/* Longest word whose typographic apostrophes are folded for the lookup */
+#define lsp_max_folded_word 128
+/* Fixes offered for one misspelt word */
+#define lsp_max_suggestions 5
+
+/**
+ * trace_log_level
+ * Maps an LSP `TraceValue` onto the log level it asks for: `off` keeps
+ * errors and warnings, `messages` adds information and `verbose` writes
+ * everything.
+ *
+ * Arguments: `const char *value`, `u64 len`, the value without quotes.
+ * Returns: 0 and sets `*level`, -1 if the value is not a `TraceValue`.
+ **/
+static int trace_log_level (const char *value, u64 len, log_type_e *level) {
+
+    if (len == 3 && memcmp(value, "off", 3) == 0) {
+        *level = LOG_TYPE_WARNING;
+    } else if (len == 8 && memcmp(value, "messages", 8) == 0) {
+        *level = LOG_TYPE_INFO;
+    } else if (len == 7 && memcmp(value, "verbose", 7) == 0) {
+        *level = LOG_TYPE_ALL;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* Maps the dictionary at `path`, carrying on without one if it is bad.
+   Only called by the one `initialize` accepted, before any job runs */
+static void load_dictionary (LspClient *client, const char *path) {
+
+    assert(!client->dictionary);
+
+    client->dictionary = malloc(sizeof(dict));
+    if (!client->dictionary) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+
+    dict_status status = dict_open(client->dictionary, path);
+    if (status != DICT_OK) {
+        log_warn("Dictionary `%s` %s, spelling is not checked.", path,
+                 dict_status_str(status));
+        free(client->dictionary);
+        client->dictionary = NULL;
+    }
+}
 
 /* Checks the message to see if it has:
  * 1. jsonrpc object
@@ -32,19 +98,129 @@ bool clients_json_valid (cJSON *message) {
     return validity;
 }
 
-/** Creates a message with the minimal set of features to adhere to the LSP
- *  specification.
+/* Releases what the state owns, not the state itself */
+void lsp_state_free (LspState *state) {
+
+    if (!state) {
+        return;
+    }
+    free(state->client.root_uri);
+    state->client.root_uri = NULL;
+    dict_close(state->client.dictionary);
+    free(state->client.dictionary);
+    state->client.dictionary = NULL;
+    docstore_free(&state->documents);
+    arena_free(&state->scratch);
+}
+
+/**
+ * lsp_request_params
+ * Parses the `params` of a request the first time it is asked for, later
+ * calls return the same tree.
+ *
+ * Returns: The parsed params, NULL if they are absent or not valid JSON.
+ **/
+cJSON *lsp_request_params (LspRequest *request) {
+
+    assert(request);
+
+    if (!request->params_json && request->params) {
+        request->params_json =
+            cJSON_ParseWithLength(request->params, request->params_len);
+        if (!request->params_json) {
+            log_warn("Could not parse `params` of length `%llu`.",
+                     request->params_len);
+        }
+    }
+    return request->params_json;
+}
+
+/**
+ * lsp_reply_begin
+ * Opens the response to `request` in its output, leaving the writer where
+ * the `result` value goes. Closed by lsp_reply_end.
+ **/
+void lsp_reply_begin (jwriter *writer, LspRequest *request) {
+
+    assert(writer && request && request->id && request->out);
+
+    jwriter_begin(writer, request->out);
+    jwriter_object_begin(writer);
+    jwriter_key(writer, "jsonrpc");
+    jwriter_string(writer, "2.0", 3);
+    jwriter_key(writer, "id");
+    jwriter_raw(writer, request->id, request->id_len);
+    jwriter_key(writer, "result");
+}
+
+void lsp_reply_end (jwriter *writer) {
+
+    jwriter_object_end(writer);
+    jwriter_end(writer);
+}
+
+/**
+ * lsp_reply_error
+ * Queues a JSON-RPC error response.
+ *
+ * Arguments: `const char *id`, `u64 id_len`, raw id token of the failed
+ *            request, NULL when it could not be read which is sent as `null`.
+ *            `int code`, `const char *message`, the error.
+ **/
+void lsp_reply_error (pipeline_output *out, const char *id, u64 id_len,
+                      int code, const char *message) {
+
+    jwriter writer;
+
+    jwriter_begin(&writer, out);
+    jwriter_object_begin(&writer);
+    jwriter_key(&writer, "jsonrpc");
+    jwriter_string(&writer, "2.0", 3);
+    jwriter_key(&writer, "id");
+    if (id) {
+        jwriter_raw(&writer, id, id_len);
+    } else {
+        jwriter_null(&writer);
+    }
+    jwriter_key(&writer, "error");
+    jwriter_object_begin(&writer);
+    jwriter_key(&writer, "code");
+    jwriter_int(&writer, code);
+    jwriter_key(&writer, "message");
+    jwriter_cstring(&writer, message);
+    jwriter_object_end(&writer);
+    jwriter_object_end(&writer);
+    jwriter_end(&writer);
+}
+
+void lsp_reply_cancelled (pipeline_output *out, const char *id, u64 id_len) {
+    lsp_reply_error(out, id, id_len, RequestCancelled,
+                    "The request was cancelled.");
+}
+
+/* Compares raw id tokens, `1` and `"1"` are different ids */
+bool lsp_same_id (const char *a, u64 a_len, const char *b, u64 b_len) {
+
+    return a && b && a_len == b_len && memcmp(a, b, a_len) == 0;
+}
+
+/**
+ * lsp_request_cancelled
+ * Polled by long running handlers. Once the client cancelled the request
+ * the error is recorded, so the handler only has to return -1 and the
+ * client is told its request was cancelled.
  **/
-static inline cJSON *base_response (double id) {
-    assert(id > 0);
+bool lsp_request_cancelled (LspState *state, const LspRequest *request) {
+
+    assert(state && request);
 
-    /* response object */
-    cJSON *response = cJSON_CreateObject();
-    cJSON *r_jsonrpc = cJSON_CreateString("2.0");
-    cJSON *r_id = cJSON_CreateNumber(id);
-    cJSON_AddItemToObject(response, "jsonrpc", r_jsonrpc);
-    cJSON_AddItemToObject(response, "id", r_id);
-    return response;
+    if (!request->cancelled ||
+        !atomic_load_explicit(request->cancelled, memory_order_relaxed)) {
+        return false;
+    }
+    state->has_err = true;
+    state->error.code = RequestCancelled;
+    return true;
 }
 
 static int detect_sync_capabilities (cJSON *syncCapabilitiesJSON,
@@ -88,7 +264,7 @@ static int detect_sync_capabilities (cJSON *syncCapabilitiesJSON,
     syncKind = syncChangeKind->valueint;
 
     if (syncKind < 0 || syncKind > 3) {
-        log_info("Unsupported `textDocumentSyncKind` value of `%s`", syncKind);
+        log_info("Unsupported `textDocumentSyncKind` value of `%d`", syncKind);
         return -1;
     }
 
@@ -116,62 +292,105 @@ static int detect_sync_capabilities (cJSON *syncCapabilitiesJSON,
     return 0;
 }
 
-/** Creates a "server capabilities object"
+/* Picks the cheapest encoding out of `general.positionEncodings`: UTF-8
+   positions are byte offsets, UTF-32 ones at least skip the surrogates */
+static rope_encoding detect_position_encoding (cJSON *general) {
+
+    cJSON *encodings = cJSON_GetObjectItem(general, "positionEncodings");
+    rope_encoding best = ROPE_UTF16;
+    cJSON *encoding;
+
+    cJSON_ArrayForEach(encoding, encodings) {
+        const char *name = cJSON_GetStringValue(encoding);
+        if (!name) {
+            continue;
+        }
+        if (strcmp(name, "utf-8") == 0) {
+            best = ROPE_UTF8;
+        } else if (strcmp(name, "utf-32") == 0 && best != ROPE_UTF8) {
+            best = ROPE_UTF32;
+        }
+    }
+    return best;
+}
+
+/** Writes the "server capabilities object"
  *
+  "positionEncoding": "utf-8",
   "textDocumentSync": {
     "change": 2,
     "openClose": true,
     "save": true
     },
 
- * NOTE: Currently we only support 'textDocumentSync'
+ * NOTE: Currently we only support 'textDocumentSync'. The position encoding
+ * is left out when it is the UTF-16 default.
  */
-static inline cJSON *server_capabilities (void) {
-
-    cJSON *capabilities = cJSON_CreateObject();
-    cJSON *doc_sync = cJSON_CreateObject();
+static inline void server_capabilities (jwriter *writer,
+                                        const LspClient *client) {
+
+    jwriter_object_begin(writer);
+    if (client->position_encoding == ROPE_UTF8) {
+        jwriter_key(writer, "positionEncoding");
+        jwriter_string(writer, "utf-8", 5);
+    } else if (client->position_encoding == ROPE_UTF32) {
+        jwriter_key(writer, "positionEncoding");
+        jwriter_string(writer, "utf-32", 6);
+    }
+    jwriter_key(writer, "textDocumentSync");
+    jwriter_object_begin(writer);
 
     /* Tell client we want a full copy of the document per sync */
-    cJSON_AddNumberToObject(doc_sync, "change", 2);
-    cJSON_AddBoolToObject(doc_sync, "openClose", true);
-    cJSON_AddBoolToObject(doc_sync, "didSave", true);
-    cJSON_AddItemToObject(capabilities, "textDocumentSync", doc_sync);
+    jwriter_key(writer, "change");
+    jwriter_int(writer, 2);
+    jwriter_key(writer, "openClose");
+    jwriter_bool(writer, true);
+    jwriter_key(writer, "didSave");
+    jwriter_bool(writer, true);
+
+    jwriter_object_end(writer);
+
+    /* Spelling fixes, only offered when there is something to suggest */
+    if (client->dictionary && client->dictionary->suggest) {
+        jwriter_key(writer, "codeActionProvider");
+        jwriter_object_begin(writer);
+        jwriter_key(writer, "codeActionKinds");
+        jwriter_array_begin(writer);
+        jwriter_cstring(writer, "quickfix");
+        jwriter_array_end(writer);
+        jwriter_object_end(writer);
+    }
 
-    return capabilities;
+    jwriter_object_end(writer);
 }
 
-int lsp_initialize (LspState *state, cJSON *message) {
-    log_debug("");
+int lsp_initialize (LspState *state, LspRequest *request) {
+    log_debug("initialize");
 
     /* Read necessary information from the init message */
     int error_code = 0;
-    double msg_id = -1;
 
-    cJSON *id_json = cJSON_GetObjectItem(message, "id");
-    if (!cJSON_IsNumber(id_json)) {
-        log_err("`id` is not a valid number.");
+    if (!request->id) {
+        log_err("`initialize` was sent without an `id`.");
         error_code = RPC_InvalidRequest;
         goto failed;
     }
 
-    /* Get id value */
-    msg_id = cJSON_GetNumberValue(id_json);
-
-    /* Exit if id is invalid */
-    if (msg_id < 0) {
-        log_err("Id received was less than 0.");
+    /* Only a successful `initialize` sets the root. Running jobs still read
+       the dictionary it loaded, so it is never swapped out from under them */
+    if (state->client.root_uri) {
+        log_err("`initialize` was sent twice.");
         error_code = RPC_InvalidRequest;
         goto failed;
     }
 
-    if (!cJSON_HasObjectItem(message, "params")) {
+    cJSON *params = lsp_request_params(request);
+    if (!cJSON_IsObject(params)) {
         log_err("JSON received does not contain `params` object.");
         error_code = RPC_InvalidParams;
         goto failed;
     }
 
-    cJSON *params = cJSON_GetObjectItem(message, "params");
-
     /* Process ID */
     size_t process_id = 0;
     cJSON *json_processID = cJSON_GetObjectItem(params, "processId");
@@ -179,9 +398,9 @@ int lsp_initialize (LspState *state, cJSON *message) {
     if (cJSON_IsNumber(json_processID) && json_processID->valueint > 0) {
         process_id = json_processID->valueint;
     }
+    /* `null` when the client was not started by another process */
     if (process_id == 0) {
-        log_warn("Process ID is invalid.");
-        goto failed;
+        log_info("Client did not send a process ID.");
     }
 
     cJSON *root_uri = cJSON_GetObjectItem(params, "rootUri");
@@ -251,6 +470,42 @@ int lsp_initialize (LspState *state, cJSON *message) {
         }
     }
 
+    state->client.position_encoding = detect_position_encoding(
+        cJSON_GetObjectItem(client_capabilities, "general"));
+    log_info("Using `%s` positions.",
+             state->client.position_encoding == ROPE_UTF8    ? "utf-8"
+             : state->client.position_encoding == ROPE_UTF32 ? "utf-32"
+                                                             : "utf-16");
+
+    /* Options are ours to define, anything unexpected is ignored */
+    cJSON *options = cJSON_GetObjectItem(params, "initializationOptions");
+    cJSON *worker_threads = cJSON_GetObjectItem(options, "workerThreads");
+    state->client.worker_threads = pool_default_threads();
+    if (cJSON_IsNumber(worker_threads) && worker_threads->valuedouble >= 0 &&
+        worker_threads->valuedouble <= lsp_max_worker_threads) {
+        state->client.worker_threads = (u32) worker_threads->valuedouble;
+    }
+    cJSON *debounce = cJSON_GetObjectItem(options, "debounceMs");
+    u64 debounce_ms = lsp_default_debounce_ms;
+    if (cJSON_IsNumber(debounce) && debounce->valuedouble >= 0 &&
+        debounce->valuedouble <= lsp_max_debounce_ms) {
+        debounce_ms = (u64) debounce->valuedouble;
+    }
+    state->analysis.debounce_ns = debounce_ms * 1000 * 1000;
+
+    cJSON *dictionary = cJSON_GetObjectItem(options, "dictionary");
+    if (cJSON_IsString(dictionary)) {
+        load_dictionary(&state->client, dictionary->valuestring);
+    }
+
+    /* Without a `trace` the level stays as it was built */
+    const char *trace =
+        cJSON_GetStringValue(cJSON_GetObjectItem(params, "trace"));
+    log_type_e level;
+    if (trace && trace_log_level(trace, strlen(trace), &level) == 0) {
+        log_set_level(level);
+    }
+
     /* We must wait for 'initialized' notification */
     state->client.shutdown_requested = false;
     state->client.initialized = false;
@@ -259,45 +514,25 @@ int lsp_initialize (LspState *state, cJSON *message) {
 
     /* For debugging sake */
 #ifndef NDEBUG
-    char *debug_printing = cJSON_Print(text_document_capabilities);
-    log_debug(
-        "Initialised with values:\nprocess id: %d,\ntextDoc capabilities: "
-        "%s\n",
-        process_id, debug_printing);
-    free(debug_printing);
+    /* Printing the capabilities is the expensive part, skip it as well */
+    if (log_enabled(LOG_TYPE_DEBUG)) {
+        char *debug_printing = cJSON_Print(text_document_capabilities);
+        log_debug("Initialised with values:\nprocess id: %zu,\ntextDoc "
+                  "capabilities: %s\n",
+                  process_id, debug_printing);
+        cJSON_free(debug_printing);
+    }
 #endif  // NDEBUG
     /* end */
 
-    /* Prepare our response: */
-
-    cJSON *response = base_response(msg_id);
-
-    /* result subobject */
-    cJSON *result_object = cJSON_CreateObject();
-
-    cJSON *server_capability = server_capabilities();
-    cJSON_AddItemToObject(result_object, "capabilities", server_capability);
-    cJSON_AddItemToObject(response, "result", result_object);
-
-    char *str_response = cJSON_Print(response);
-    log_debug("Our response: `%s`", str_response);
-    size_t str_response_len = strlen(str_response);
-
-    state->reply.msg_len = str_response_len;
-
-    char temp_header[128] = {0};
-    sprintf(temp_header, "Content-Length: %zu\r\n\r\n", str_response_len);
-
-    u32 header_len = strlen(temp_header);
-    state->reply.header = malloc(sizeof(char) * header_len + 1);
-    memcpy(state->reply.header, temp_header, header_len + 1);
-
-    state->reply.msg = malloc(sizeof(char) * str_response_len + 1);
-    sprintf(state->reply.msg, "%s", str_response);
-
-    state->has_msg = true;
-    free(str_response);
-    cJSON_Delete(response);
+    /* Prepare our response, written straight into the output */
+    jwriter writer;
+    lsp_reply_begin(&writer, request);
+    jwriter_object_begin(&writer);
+    jwriter_key(&writer, "capabilities");
+    server_capabilities(&writer, &state->client);
+    jwriter_object_end(&writer);
+    lsp_reply_end(&writer);
 
     return 0;
 
@@ -309,13 +544,9 @@ failed:
     }
 }
 
-int lsp_initialized (LspState *state, cJSON *message) {
-
-    if (!cJSON_IsObject(message)) {
-        log_err("Message was not a valid object.");
-        return -1;
-    };
+int lsp_initialized (LspState *state, LspRequest *request) {
 
+    (void) request;
     log_debug("Received initialized notification from client.");
     if (state->client.initialized == true) {
         log_warn("We are already initialised.");
@@ -325,8 +556,9 @@ int lsp_initialized (LspState *state, cJSON *message) {
     return 0;
 }
 
-int lsp_exit (LspState *state, cJSON *message) {
+int lsp_exit (LspState *state, LspRequest *request) {
 
+    (void) request;
     assert(state);
     if (state->client.shutdown_requested == false) {
         log_warn("Abrupt shutdown is in process now.");
@@ -336,7 +568,7 @@ int lsp_exit (LspState *state, cJSON *message) {
     return 999;
 }
 
-int lsp_shutdown (LspState *state, cJSON *message) {
+int lsp_shutdown (LspState *state, LspRequest *request) {
 
     assert(state);
     if (state->client.shutdown_requested) {
@@ -344,15 +576,24 @@ int lsp_shutdown (LspState *state, cJSON *message) {
     }
     state->client.shutdown_requested = true;
     log_info("shutdown_requested set to TRUE.");
+
+    /* The dispatcher drained the workers, this is the last reply */
+    if (request->id) {
+        jwriter writer;
+        lsp_reply_begin(&writer, request);
+        jwriter_null(&writer);
+        lsp_reply_end(&writer);
+    }
     return 998;
 }
 
-int lsp_textDocument_didOpen (LspState *state, cJSON *message) {
+int lsp_textDocument_didOpen (LspState *state, LspRequest *request) {
 
     log_debug("didOpen");
 
-    /* textDocument Object */
-    cJSON *textDocJSON = cJSON_GetObjectItem(message, "textDocument");
+    /* params.textDocument Object */
+    cJSON *textDocJSON =
+        cJSON_GetObjectItem(lsp_request_params(request), "textDocument");
 
     if (!cJSON_IsObject(textDocJSON)) {
         log_warn("Text document is empty. Returning.");
@@ -390,27 +631,33 @@ int lsp_textDocument_didOpen (LspState *state, cJSON *message) {
     double ver = cJSON_GetNumberValue(verJSON);
     char *text = cJSON_GetStringValue(textJSON);
 
-    assert(ver > 0);
+    /* Versions start at 0 and only increase */
+    if (ver < 0) {
+        log_warn("version `%f` is negative.", ver);
+        return -1;
+    }
 
-    Document doc = {
-        .open = true, .uri = uri, .text = text, .version = (u64) ver};
+    /* The tree goes away with the message, the store keeps its own copy */
+    Document *doc = docstore_open(&state->documents, uri, strlen(uri), langId,
+                                  (i64) ver, text, strlen(text));
 
     log_info(
         "Successful textDocument_didOpen parsing. Document info:\n"
         "langId: `%s`\n"
         "uri: `%s`\n"
-        "version:`%llu`\n"
-        "text:`%s`\n",
-        langId, doc.uri, doc.version, doc.text);
+        "version:`%lld`\n"
+        "length:`%llu`\n",
+        doc->language_id, doc->uri, doc->version, rope_length(&doc->text));
 
+    analysis_request(&state->analysis, doc, analysis_now());
     return 0;
 }
 
-int lsp_textDocument_didChange (cJSON *message) {
+int lsp_textDocument_didChange (LspState *state, LspRequest *request) {
     log_debug("didChange");
 
     /* message.params */
-    cJSON *paramsJSON = cJSON_GetObjectItem(message, "params");
+    cJSON *paramsJSON = lsp_request_params(request);
     if (!cJSON_IsObject(paramsJSON)) {
         log_warn("Invalid params object in didChange message");
         return -1;
@@ -441,21 +688,43 @@ int lsp_textDocument_didChange (cJSON *message) {
         return 0;
     }
 
-    /* We must create a change object */
-    DocChange *changes = (DocChange *) malloc(change_count * sizeof(DocChange));
-    if (!changes) {
-        log_err("Failed to allocate memory.");
-        (void) abort;
+    char *uri = uriJSON->valuestring;
+    Document *doc = docstore_find(&state->documents, uri, strlen(uri));
+    if (!doc) {
+        log_warn("didChange for `%s`, which is not open.", uri);
+        return -1;
     }
 
+    /* Changes only live as long as the message, they go into its arena and
+       point at the text in the parsed params instead of copying it */
+    arena *scratch = arena_current();
+    assert(scratch);
+    DocChange *changes = arena_alloc(scratch, change_count * sizeof(DocChange));
+
     /* Index of change */
     int i = 0;
+    /* Everything before the last full replacement is overwritten anyway */
+    int first = 0;
     /* Parse incremental changes */
-    cJSON *rangeJSON;
+    cJSON *changeJSON;
     /* Iterate for each item in `contentChanges` */
-    cJSON_ArrayForEach(rangeJSON, changesJSON) {
+    cJSON_ArrayForEach(changeJSON, changesJSON) {
 
-        rangeJSON = cJSON_GetObjectItem(rangeJSON, "range");
+        cJSON *rangeTextJSON = cJSON_GetObjectItem(changeJSON, "text");
+        if (!cJSON_IsString(rangeTextJSON)) {
+            log_warn("Received invalid `text`.");
+            goto failed_changes;
+        }
+        changes[i].text = rangeTextJSON->valuestring;
+        changes[i].text_len = strlen(rangeTextJSON->valuestring);
+
+        /* Without a range the text replaces the whole document */
+        cJSON *rangeJSON = cJSON_GetObjectItem(changeJSON, "range");
+        changes[i].full = rangeJSON == NULL;
+        if (changes[i].full) {
+            first = i++;
+            continue;
+        }
         if (!cJSON_IsObject(rangeJSON)) {
             log_warn("Missing or invalid range object");
             goto failed_changes;
@@ -473,81 +742,771 @@ int lsp_textDocument_didChange (cJSON *message) {
         cJSON *endLineJSON = cJSON_GetObjectItem(rangeEndJSON, "line");
         cJSON *endCharJSON = cJSON_GetObjectItem(rangeEndJSON, "character");
         if (!cJSON_IsNumber(startLineJSON) || !cJSON_IsNumber(startCharJSON) ||
-            !cJSON_IsNumber(endLineJSON) || !cJSON_IsNumber(endCharJSON)) {
+            !cJSON_IsNumber(endLineJSON) || !cJSON_IsNumber(endCharJSON) ||
+            startLineJSON->valuedouble < 0 || startCharJSON->valuedouble < 0 ||
+            endLineJSON->valuedouble < 0 || endCharJSON->valuedouble < 0) {
             log_warn("Invalid line or character values in range");
             goto failed_changes;
         }
 
-        cJSON *rangeLenJSON = cJSON_GetObjectItem(rangeJSON, "rangeLength");
-        cJSON *rangeTextJSON = cJSON_GetObjectItem(rangeJSON, "text");
-
-        if (!cJSON_IsNumber(rangeLenJSON)) {
+        /* Deprecated and only informative, the range is what counts */
+        cJSON *rangeLenJSON = cJSON_GetObjectItem(changeJSON, "rangeLength");
+        if (rangeLenJSON && !cJSON_IsNumber(rangeLenJSON)) {
             log_warn("Received a bad `rangeLength`.");
             goto failed_changes;
         }
 
-        if (!cJSON_IsString(rangeTextJSON)) {
-            log_warn("Received invalid `text`.");
-            goto failed_changes;
-        }
-
         changes[i].start.line = startLineJSON->valueint;
-        changes[i].start.pos = startLineJSON->valueint;
+        changes[i].start.pos = startCharJSON->valueint;
         changes[i].end.line = endLineJSON->valueint;
-        changes[i].end.pos = endLineJSON->valueint;
-        changes[i].range_len = rangeLenJSON->valueint;
+        changes[i].end.pos = endCharJSON->valueint;
+        changes[i].range_len = rangeLenJSON ? rangeLenJSON->valueint : 0;
+        ++i;
+    }
 
-        /* Allocate memory for the text and copy it */
-        char *text = rangeTextJSON->valuestring;
-        size_t textLen = strlen(text) + 1;
-        changes[i].text = (char *) malloc(textLen);
+    /* Each change applies to the text the previous ones left behind. The
+       rope keeps its line index current as it goes, the dirty span is only
+       stored once all of them are in. */
+    dirty_span dirty = doc->dirty;
 
-        if (!changes[i].text) {
-            log_err("Failed to allocate memory for change text");
+    for (int c = first; c < i; ++c) {
 
-            /* Clean up previously allocated text */
-            for (int j = 0; j < i; j++) {
-                free(changes[j].text);
-            }
-            free(changes);
-            return -1;
+        if (changes[c].full) {
+            rope_set(&doc->text, changes[c].text, changes[c].text_len);
+            dirty = (dirty_span){
+                .start = 0, .end = changes[c].text_len, .set = true};
+            continue;
         }
-        /* Copy changes text to our object */
-        memcpy(changes[i].text, text, textLen);
-        ++i;
+
+        u64 start = rope_offset_of(&doc->text, changes[c].start.line,
+                                   changes[c].start.pos,
+                                   state->client.position_encoding);
+        u64 end = rope_offset_of(&doc->text, changes[c].end.line,
+                                 changes[c].end.pos,
+                                 state->client.position_encoding);
+        if (end < start) {
+            log_warn("Change %d of `%s` ends before it starts.", c, uri);
+            end = start;
+        }
+        rope_replace(&doc->text, start, end - start, changes[c].text,
+                     changes[c].text_len);
+        dirty_span_edit(&dirty, start, end - start, changes[c].text_len);
+    }
+
+    doc->dirty = dirty;
+    docstore_set_version(doc, versionJSON->valueint);
+
+    /* Typing sends one of these per key, analysis waits for a pause */
+    analysis_request(&state->analysis, doc, analysis_now());
+    return 0;
+
+failed_changes:
+    {
+        /* The changes made so far go away with the arena */
+        return -1;
+    }
+}
+
+int lsp_textDocument_didClose (LspState *state, LspRequest *request) {
+    log_debug("didClose");
+
+    /* params.textDocument.uri */
+    cJSON *textDocJSON =
+        cJSON_GetObjectItem(lsp_request_params(request), "textDocument");
+    cJSON *uriJSON = cJSON_GetObjectItem(textDocJSON, "uri");
+
+    if (!cJSON_IsString(uriJSON)) {
+        log_warn("uri is not a valid string.");
+        return -1;
     }
 
     char *uri = uriJSON->valuestring;
-    int version = versionJSON->valueint;
+    if (!docstore_close(&state->documents, uri, strlen(uri))) {
+        log_warn("didClose for `%s`, which is not open.", uri);
+    }
+    return 0;
+}
+
+/* Background handlers call this between chunks of work, urgent requests
+   waiting for a worker run before it returns */
+bool lsp_request_yield (LspRequest *request) {
 
-    /* Apply our document changes here... */
-    /* apply_document_changes(uri, version, changes, changeCount) */
+    assert(request);
 
-    /* Clean up allocated memory */
-    for (int j = 0; j < change_count; j++) {
-        free(changes[j].text);
+    return request->worker && pool_yield(request->worker);
+}
+
+/**
+ * lsp_cancelRequest
+ * `$/cancelRequest`, answers a request still waiting for a worker right
+ * away and flags a running one for its handler to notice. Requests still
+ * in the input queue were flagged by the reader thread already.
+ **/
+int lsp_cancelRequest (LspState *state, LspRequest *request) {
+
+    const char *id;
+    u64 id_len;
+
+    if (!request->params || jscan_find_key(request->params,
+                                           request->params_len, "id", &id,
+                                           &id_len) != 1) {
+        log_warn("`$/cancelRequest` without an `id`.");
+        return -1;
     }
-    free(changes);
 
+    if (!state->pool || state->pool->count == 0) {
+        log_debug("Nothing to cancel, `%.*s` has been answered.", (int) id_len,
+                  id);
+        return 0;
+    }
+
+    pool_job *job = pool_cancel(state->pool, id, id_len);
+    if (job) {
+        lsp_reply_cancelled(request->out, job->id, job->id_len);
+        pool_job_free(job);
+    }
     return 0;
+}
 
-failed_changes:
-    {
-        /* Clean up allocated memory for the changes we have made so far */
-        for (int j = 0; j < i; j++) {
-            free(changes[j].text);
-        }
-        free(changes);
+/* `$/setTrace`, changes how much is logged from now on */
+int lsp_setTrace (LspState *state, LspRequest *request) {
+
+    (void) state;
+    const char *value;
+    u64 value_len;
+    log_type_e level;
+
+    if (!request->params ||
+        jscan_find_key(request->params, request->params_len, "value", &value,
+                       &value_len) != 1 ||
+        value_len < 2 || value[0] != '"' ||
+        trace_log_level(value + 1, value_len - 2, &level) != 0) {
+        log_warn("`$/setTrace` without a valid `value`.");
         return -1;
     }
+
+    log_set_level(level);
+    return 0;
 }
 
-int lsp_textDocument_didClose (cJSON *message) {
-    log_debug("didClose");
+/* Runs on the worker pool against `request->snapshot`. No completions yet,
+   every request gets an empty list. */
+int lsp_textDocument_completion (LspState *state, LspRequest *request) {
+
+    if (!request->id) {
+        state->has_err = true;
+        state->error.code = RPC_InvalidRequest;
+        return -1;
+    }
+
+    if (lsp_request_cancelled(state, request)) {
+        return -1;
+    }
+
+    if (request->snapshot) {
+        log_debug("completion in `%s` at version `%lld`",
+                  request->snapshot->uri, request->snapshot->version);
+    } else {
+        log_debug("completion in a document which is not open");
+    }
+
+    jwriter writer;
+    lsp_reply_begin(&writer, request);
+    jwriter_object_begin(&writer);
+    jwriter_key(&writer, "isIncomplete");
+    jwriter_bool(&writer, false);
+    jwriter_key(&writer, "items");
+    jwriter_array_begin(&writer);
+    jwriter_array_end(&writer);
+    jwriter_object_end(&writer);
+    lsp_reply_end(&writer);
+
     return 0;
 }
 
-int lsp_textDocument_completion (cJSON *message) {
-    log_debug("completion");
+/**
+ * spelled_right
+ * Checks one word, folding typographic apostrophes to ASCII ones the way
+ * dictionaries spell them. A hyphenated word is right if the whole is in
+ * the dictionary or each of its parts is.
+ **/
+static bool spelled_right (const dict *d, const char *word, u64 len) {
+
+    char folded[lsp_max_folded_word];
+    if (len <= sizeof(folded) && memchr(word, 0xe2, len)) {
+        u64 folded_len = 0;
+        for (u64 i = 0; i < len; ++i) {
+            if (i + 2 < len && memcmp(word + i, "\xe2\x80\x99", 3) == 0) {
+                folded[folded_len++] = '\'';
+                i += 2;
+            } else {
+                folded[folded_len++] = word[i];
+            }
+        }
+        word = folded;
+        len = folded_len;
+    }
+
+    if (dict_check(d, word, len)) {
+        return true;
+    }
+    if (!memchr(word, '-', len)) {
+        return false;
+    }
+
+    u64 part = 0;
+    for (u64 i = 0; i <= len; ++i) {
+        if (i < len && word[i] != '-') {
+            continue;
+        }
+        if (i > part && !dict_check(d, word + part, i - part)) {
+            return false;
+        }
+        part = i + 1;
+    }
+    return true;
+}
+
+static void write_range (jwriter *writer, const rope *text,
+                         rope_encoding encoding, u64 start, u64 end) {
+
+    u64 line, character;
+
+    jwriter_object_begin(writer);
+    jwriter_key(writer, "start");
+    rope_position_of(text, start, encoding, &line, &character);
+    jwriter_object_begin(writer);
+    jwriter_key(writer, "line");
+    jwriter_int(writer, (i64) line);
+    jwriter_key(writer, "character");
+    jwriter_int(writer, (i64) character);
+    jwriter_object_end(writer);
+    jwriter_key(writer, "end");
+    rope_position_of(text, end, encoding, &line, &character);
+    jwriter_object_begin(writer);
+    jwriter_key(writer, "line");
+    jwriter_int(writer, (i64) line);
+    jwriter_key(writer, "character");
+    jwriter_int(writer, (i64) character);
+    jwriter_object_end(writer);
+    jwriter_object_end(writer);
+}
+
+/* Whether `line` holds nothing but white space, which ends a paragraph */
+static bool blank_line (const rope *text, u64 line) {
+
+    u64 start = rope_line_start(text, line);
+    u64 end = rope_line_start(text, line + 1);
+    char bytes[lsp_max_blank_line];
+
+    if (end - start > sizeof(bytes)) {
+        return false;
+    }
+    rope_copy(text, start, end - start, bytes);
+    for (u64 i = 0; i < end - start; ++i) {
+        if (bytes[i] != ' ' && bytes[i] != '\t' && bytes[i] != '\r' &&
+            bytes[i] != '\n') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * widen_to_paragraphs
+ * Grows `[start, end)` to the paragraphs around it. Words never cross a
+ * line, so a paragraph running past lsp_max_paragraph_lines is cut at a
+ * line instead, which keeps text without blank lines cheap to recheck.
+ **/
+static void widen_to_paragraphs (const rope *text, u64 *start, u64 *end) {
+
+    u64 first, last, character;
+
+    rope_position_of(text, *start, ROPE_UTF8, &first, &character);
+    for (u64 n = 0; first > 0 && n < lsp_max_paragraph_lines &&
+                    !blank_line(text, first - 1);
+         ++n) {
+        first--;
+    }
+
+    u64 lines = rope_line_count(text);
+    rope_position_of(text, *end, ROPE_UTF8, &last, &character);
+    for (u64 n = 0; last + 1 < lines && n < lsp_max_paragraph_lines &&
+                    !blank_line(text, last);
+         ++n) {
+        last++;
+    }
+
+    *start = rope_line_start(text, first);
+    *end = rope_line_start(text, last + 1);
+}
+
+static void reserve_spans (DocDiagnostics *diagnostics, u64 count) {
+
+    if (count <= diagnostics->capacity) {
+        return;
+    }
+    u64 capacity = diagnostics->capacity ? diagnostics->capacity * 2 : 64;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    diagnostic_span *spans =
+        realloc(diagnostics->spans, capacity * sizeof(diagnostic_span));
+    if (!spans) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+    diagnostics->spans = spans;
+    diagnostics->capacity = capacity;
+}
+
+/**
+ * check_spelling
+ * Appends the words between `start` and `end` of the snapshot missing from
+ * the dictionary to `found`. Gives way to urgent requests between chunks
+ * of words.
+ **/
+static void check_spelling (DocDiagnostics *found, const dict *d,
+                            LspRequest *request, u64 start, u64 end) {
+
+    char *text = malloc(end - start + 1);
+    if (!text) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+    rope_copy(&request->snapshot->text, start, end - start, text);
+
+    word_spans words = {0};
+    tokenize_words(text, end - start, &words);
+
+    for (u64 i = 0; i < words.count; ++i) {
+
+        if (i > 0 && i % lsp_spelling_chunk == 0) {
+            lsp_request_yield(request);
+        }
+
+        const word_span *word = &words.spans[i];
+        /* Single letters are initials and list markers as often as words */
+        if (word->len < 2 || spelled_right(d, text + word->offset, word->len)) {
+            continue;
+        }
+        reserve_spans(found, found->count + 1);
+        found->spans[found->count++] = (diagnostic_span){
+            .start = start + word->offset,
+            .end = start + word->offset + word->len};
+    }
+
+    word_spans_free(&words);
+    free(text);
+}
+
+/* Index of the first span starting at or after `offset` */
+static u64 first_span_from (const DocDiagnostics *diagnostics, u64 offset) {
+
+    u64 low = 0;
+    u64 high = diagnostics->count;
+    while (low < high) {
+        u64 mid = low + (high - low) / 2;
+        if (diagnostics->spans[mid].start < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * update_diagnostics
+ * Brings the snapshot's diagnostics up to its version. Only the paragraphs
+ * around the edits handed over since the last analysis are checked again,
+ * what was found before them is kept and what was found after them moves
+ * by however much the text grew or shrank. Everything is checked the first
+ * time.
+ *
+ * Returns: Whether the diagnostics were for this snapshot's version, they
+ *          are left alone otherwise.
+ **/
+static bool update_diagnostics (DocDiagnostics *diagnostics, const dict *d,
+                                LspRequest *request) {
+
+    const DocSnapshot *snapshot = request->snapshot;
+    u64 len = rope_length(&snapshot->text);
+
+    pthread_mutex_lock(&diagnostics->lock);
+    dirty_span edited = diagnostics->edited;
+    bool current = diagnostics->edited_version == snapshot->version &&
+                   diagnostics->edited_len == len;
+    pthread_mutex_unlock(&diagnostics->lock);
+
+    /* Analysed without its edits being handed over, or behind a version
+       which was */
+    if (!current) {
+        return false;
+    }
+
+    if (!diagnostics->valid) {
+        diagnostics->count = 0;
+        diagnostics->len = len;
+        edited = (dirty_span){.start = 0, .end = len, .set = true};
+    }
+    diagnostics->checked = 0;
+
+    if (edited.set) {
+        u64 start = edited.start;
+        u64 end = edited.end;
+        widen_to_paragraphs(&snapshot->text, &start, &end);
+
+        /* Where the end of the checked paragraphs was before the edits */
+        u64 old_end = end + diagnostics->len - len;
+        u64 head = first_span_from(diagnostics, start);
+        u64 tail = first_span_from(diagnostics, old_end);
+        u64 after = diagnostics->count - tail;
+
+        DocDiagnostics found = {0};
+        check_spelling(&found, d, request, start, end);
+
+        reserve_spans(diagnostics, head + found.count + after);
+        diagnostic_span *spans = diagnostics->spans;
+        memmove(spans + head + found.count, spans + tail,
+                after * sizeof(diagnostic_span));
+        for (u64 i = head + found.count; i < head + found.count + after;
+             ++i) {
+            spans[i].start = spans[i].start + len - diagnostics->len;
+            spans[i].end = spans[i].end + len - diagnostics->len;
+        }
+        if (found.count) {
+            memcpy(spans + head, found.spans,
+                   found.count * sizeof(diagnostic_span));
+        }
+        free(found.spans);
+
+        diagnostics->count = head + found.count + after;
+        diagnostics->checked = end - start;
+    }
+    diagnostics->len = len;
+    diagnostics->valid = true;
+
+    /* Edits handed over meanwhile are for a later version, and still
+       cover everything changed since this one */
+    pthread_mutex_lock(&diagnostics->lock);
+    if (diagnostics->edited_version == snapshot->version) {
+        diagnostics->edited.set = false;
+    }
+    pthread_mutex_unlock(&diagnostics->lock);
+    return true;
+}
+
+static void write_diagnostics (jwriter *writer, const DocDiagnostics *found,
+                               const rope *text, rope_encoding encoding) {
+
+    char small[lsp_max_folded_word];
+
+    for (u64 i = 0; i < found->count && i < lsp_max_diagnostics; ++i) {
+
+        const diagnostic_span *span = &found->spans[i];
+        u64 len = span->end - span->start;
+        char *word = len <= sizeof(small) ? small : malloc(len);
+        if (!word) {
+            log_err(COMPLAIN_Err_OutOfMem);
+            exit(-1);
+        }
+        rope_copy(text, span->start, len, word);
+
+        jwriter_object_begin(writer);
+        jwriter_key(writer, "range");
+        write_range(writer, text, encoding, span->start, span->end);
+        jwriter_key(writer, "severity");
+        jwriter_int(writer, 3);
+        jwriter_key(writer, "code");
+        jwriter_cstring(writer, "spelling");
+        jwriter_key(writer, "source");
+        jwriter_cstring(writer, "complain");
+        jwriter_key(writer, "message");
+        jwriter_string(writer, word, len);
+        jwriter_object_end(writer);
+
+        if (word != small) {
+            free(word);
+        }
+    }
+}
+
+/**
+ * lsp_analyse_document
+ * Analyses `request->snapshot` once its document went quiet, on a worker
+ * when there is a pool. Publishes the words missing from the dictionary,
+ * an empty list without one, which also clears what the client showed.
+ * Only what changed since the last analysis is checked again, see
+ * update_diagnostics. Nothing is published for a stale snapshot.
+ **/
+int lsp_analyse_document (LspState *state, LspRequest *request) {
+
+    assert(request->snapshot);
+
+    DocSnapshot *snapshot = request->snapshot;
+
+    /* The document moved on, a later analysis is on its way */
+    if (docstore_snapshot_stale(snapshot)) {
+        log_debug("Skipping `%s` at stale version `%lld`", snapshot->uri,
+                  snapshot->version);
+        return 0;
+    }
+    log_debug("Analysing `%s` at version `%lld`", snapshot->uri,
+              snapshot->version);
+
+    /* A snapshot the diagnostics are not kept for is checked from scratch */
+    DocDiagnostics scratch = {0};
+    DocDiagnostics *found = &scratch;
+    const dict *d = state->client.dictionary;
+
+    if (d && !update_diagnostics(snapshot->diagnostics, d, request)) {
+        check_spelling(&scratch, d, request, 0, rope_length(&snapshot->text));
+    } else if (d) {
+        found = snapshot->diagnostics;
+    }
+
+    /* Edited while it was checked, publishing would show the old text's
+       diagnostics over the new one */
+    if (docstore_snapshot_stale(snapshot)) {
+        log_debug("Dropping diagnostics of `%s` at stale version `%lld`",
+                  snapshot->uri, snapshot->version);
+        free(scratch.spans);
+        return 0;
+    }
+
+    jwriter writer;
+    jwriter_begin(&writer, request->out);
+    jwriter_object_begin(&writer);
+    jwriter_key(&writer, "jsonrpc");
+    jwriter_string(&writer, "2.0", 3);
+    jwriter_key(&writer, "method");
+    jwriter_cstring(&writer, "textDocument/publishDiagnostics");
+    jwriter_key(&writer, "params");
+    jwriter_object_begin(&writer);
+    jwriter_key(&writer, "uri");
+    jwriter_string(&writer, snapshot->uri, snapshot->uri_len);
+    jwriter_key(&writer, "version");
+    jwriter_int(&writer, snapshot->version);
+    jwriter_key(&writer, "diagnostics");
+    jwriter_array_begin(&writer);
+    write_diagnostics(&writer, found, &snapshot->text,
+                      state->client.position_encoding);
+    jwriter_array_end(&writer);
+    jwriter_object_end(&writer);
+    jwriter_object_end(&writer);
+    jwriter_end(&writer);
+
+    free(scratch.spans);
+    return 0;
+}
+
+/* Byte offset of an LSP `Position`, false if it is not one */
+static bool read_position (const cJSON *position, const rope *text,
+                           rope_encoding encoding, u64 *offset) {
+
+    cJSON *line = cJSON_GetObjectItem(position, "line");
+    cJSON *character = cJSON_GetObjectItem(position, "character");
+    if (!cJSON_IsNumber(line) || !cJSON_IsNumber(character) ||
+        line->valuedouble < 0 || character->valuedouble < 0) {
+        return false;
+    }
+    *offset = rope_offset_of(text, (u64) line->valuedouble,
+                             (u64) character->valuedouble, encoding);
+    return true;
+}
+
+typedef enum word_case {
+    CASE_AS_IS,
+    /* First letter a capital, some lower case after it */
+    CASE_TITLE,
+    /* Capitals and no lower case, more than one letter */
+    CASE_UPPER,
+} word_case;
+
+/* How `word` is capitalised, only ASCII letters are considered */
+static word_case case_of (const char *word, u64 len) {
+
+    u64 upper = 0;
+    u64 lower = 0;
+    for (u64 i = 0; i < len; ++i) {
+        upper += word[i] >= 'A' && word[i] <= 'Z';
+        lower += word[i] >= 'a' && word[i] <= 'z';
+    }
+    if (upper > 1 && lower == 0) {
+        return CASE_UPPER;
+    }
+    if (upper == 1 && word[0] >= 'A' && word[0] <= 'Z') {
+        return CASE_TITLE;
+    }
+    return CASE_AS_IS;
+}
+
+/* Changes the case of `word` in place, lower case for CASE_AS_IS */
+static void apply_case (char *word, u64 len, word_case to) {
+
+    for (u64 i = 0; i < len; ++i) {
+        bool up = to == CASE_UPPER || (to == CASE_TITLE && i == 0);
+        if (up && word[i] >= 'a' && word[i] <= 'z') {
+            word[i] = (char) (word[i] - 'a' + 'A');
+        } else if (!up && word[i] >= 'A' && word[i] <= 'Z') {
+            word[i] = (char) (word[i] - 'A' + 'a');
+        }
+    }
+}
+
+/**
+ * spelling_actions
+ * Writes a quick fix per suggestion for one diagnostic of ours, nothing
+ * for anyone else's. The word is read back from the snapshot rather than
+ * trusted from the message, and looked up in lower case when it is
+ * capitalised, the suggestions then capitalised the same way.
+ **/
+static void spelling_actions (jwriter *writer, const dict *d,
+                              const LspClient *client,
+                              const DocSnapshot *snapshot, const char *uri,
+                              const cJSON *diagnostic) {
+
+    cJSON *code = cJSON_GetObjectItem(diagnostic, "code");
+    cJSON *range = cJSON_GetObjectItem(diagnostic, "range");
+    if (!cJSON_IsString(code) || strcmp(code->valuestring, "spelling") != 0 ||
+        !cJSON_IsObject(range)) {
+        return;
+    }
+
+    u64 start, end;
+    if (!read_position(cJSON_GetObjectItem(range, "start"), &snapshot->text,
+                       client->position_encoding, &start) ||
+        !read_position(cJSON_GetObjectItem(range, "end"), &snapshot->text,
+                       client->position_encoding, &end) ||
+        end <= start || end - start > lsp_max_folded_word) {
+        return;
+    }
+
+    char word[lsp_max_folded_word];
+    u64 len = end - start;
+    rope_copy(&snapshot->text, start, len, word);
+
+    word_case original = case_of(word, len);
+    if (original != CASE_AS_IS) {
+        apply_case(word, len, CASE_AS_IS);
+    }
+
+    dict_suggestion found[lsp_max_suggestions];
+    u32 count = dict_suggest(d, word, len, DICT_SUGGEST_MAX_DISTANCE, found,
+                             lsp_max_suggestions);
+    if (count == 0) {
+        return;
+    }
+
+    char *echo = cJSON_PrintUnformatted(diagnostic);
+    char *range_echo = cJSON_PrintUnformatted(range);
+    if (!echo || !range_echo) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+
+    for (u32 i = 0; i < count; ++i) {
+
+        char fixed[UINT8_MAX];
+        memcpy(fixed, found[i].word, found[i].len);
+        if (original != CASE_AS_IS) {
+            apply_case(fixed, found[i].len, original);
+        }
+        char title[sizeof(fixed) + 16];
+        int title_len = snprintf(title, sizeof(title), "Change to `%.*s`",
+                                 (int) found[i].len, fixed);
+
+        jwriter_object_begin(writer);
+        jwriter_key(writer, "title");
+        jwriter_string(writer, title, (u64) title_len);
+        jwriter_key(writer, "kind");
+        jwriter_cstring(writer, "quickfix");
+        jwriter_key(writer, "diagnostics");
+        jwriter_array_begin(writer);
+        jwriter_raw(writer, echo, strlen(echo));
+        jwriter_array_end(writer);
+        if (i == 0) {
+            jwriter_key(writer, "isPreferred");
+            jwriter_bool(writer, true);
+        }
+        jwriter_key(writer, "edit");
+        jwriter_object_begin(writer);
+        jwriter_key(writer, "changes");
+        jwriter_object_begin(writer);
+        jwriter_key(writer, uri);
+        jwriter_array_begin(writer);
+        jwriter_object_begin(writer);
+        jwriter_key(writer, "range");
+        jwriter_raw(writer, range_echo, strlen(range_echo));
+        jwriter_key(writer, "newText");
+        jwriter_string(writer, fixed, found[i].len);
+        jwriter_object_end(writer);
+        jwriter_array_end(writer);
+        jwriter_object_end(writer);
+        jwriter_object_end(writer);
+        jwriter_object_end(writer);
+    }
+
+    cJSON_free(echo);
+    cJSON_free(range_echo);
+}
+
+/**
+ * lsp_textDocument_codeAction
+ * Offers the closest dictionary words as quick fixes for the spelling
+ * diagnostics in the request's context. Runs on the worker pool against
+ * `request->snapshot`, or on the dispatcher against the open document.
+ **/
+int lsp_textDocument_codeAction (LspState *state, LspRequest *request) {
+
+    if (!request->id) {
+        state->has_err = true;
+        state->error.code = RPC_InvalidRequest;
+        return -1;
+    }
+
+    if (lsp_request_cancelled(state, request)) {
+        return -1;
+    }
+
+    cJSON *params = lsp_request_params(request);
+    cJSON *uri = cJSON_GetObjectItem(cJSON_GetObjectItem(params, "textDocument"),
+                                     "uri");
+    cJSON *diagnostics = cJSON_GetObjectItem(
+        cJSON_GetObjectItem(params, "context"), "diagnostics");
+    if (!cJSON_IsString(uri) || !cJSON_IsArray(diagnostics)) {
+        log_warn("`codeAction` without a document or a context.");
+        return -1;
+    }
+
+    /* Workers were handed a snapshot, the dispatcher takes its own */
+    DocSnapshot *snapshot = request->snapshot;
+    bool own_snapshot = false;
+    if (!snapshot && !request->worker) {
+        Document *doc = docstore_find(&state->documents, uri->valuestring,
+                                      strlen(uri->valuestring));
+        if (doc) {
+            snapshot = docstore_snapshot(doc);
+            own_snapshot = true;
+        }
+    }
+
+    jwriter writer;
+    lsp_reply_begin(&writer, request);
+    jwriter_array_begin(&writer);
+    if (snapshot && state->client.dictionary) {
+        cJSON *diagnostic;
+        cJSON_ArrayForEach(diagnostic, diagnostics) {
+            spelling_actions(&writer, state->client.dictionary, &state->client,
+                             snapshot, uri->valuestring, diagnostic);
+        }
+    }
+    jwriter_array_end(&writer);
+    lsp_reply_end(&writer);
+
+    if (own_snapshot) {
+        docstore_snapshot_release(snapshot);
+    }
     return 0;
 }
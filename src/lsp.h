@@ -2,8 +2,16 @@
 #define LSP_H_
 
 #include <cjson/cJSON.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 
+#include "analysis.h"
+#include "arena.h"
 #include "common.h"
+#include "dict.h"
+#include "docstore.h"
+#include "jwriter.h"
+#include "output.h"
 
 enum lspErrCode {
 
@@ -86,12 +94,18 @@ typedef struct LspClient {
     u32 processID;
     bool initialized;
     bool shutdown_requested;
+    /* What `character` in positions counts, UTF-16 unless negotiated */
+    rope_encoding position_encoding;
+    /* Size of the worker pool, `initializationOptions.workerThreads` */
+    u32 worker_threads;
+    /* Words spelled right, `initializationOptions.dictionary`. NULL when
+       none was given, owned by the dispatcher's state */
+    dict *dictionary;
 } LspClient;
 
 typedef struct LspError {
     char *msg;
     int code;
-    int msg_id;
 } LspError;
 
 typedef struct changeRange {
@@ -103,40 +117,68 @@ typedef struct DocChange {
     changeRange start;
     changeRange end;
     size_t range_len;
-    char *text;
+    /* Borrowed from the parsed params */
+    const char *text;
+    u64 text_len;
+    /* No range, `text` replaces the whole document */
+    bool full;
 } DocChange;
 
-typedef struct Document {
-    char *uri;
-    bool open;
-    u64 version;
-    char *text;
-    DocChange **changes;
-} Document;
-
-typedef struct LspReply {
-    char *header;
-    char *msg;
-    size_t msg_len;
-} LspReply;
+/* One incoming message, `params` is only parsed once a handler asks for it */
+typedef struct LspRequest {
+    /* Raw `id` token, a number or a quoted string, NULL for notifications */
+    const char *id;
+    u64 id_len;
+    /* Raw `params` value, NULL when absent */
+    const char *params;
+    u64 params_len;
+    /* Set by lsp_request_params, freed by the dispatcher */
+    cJSON *params_json;
+    /* Where the reply is written */
+    pipeline_output *out;
+    /* Document named by a worker method, NULL when it is not open or the
+       request runs on the dispatcher */
+    DocSnapshot *snapshot;
+    /* Set once the client cancels the request, NULL if it cannot be */
+    const atomic_bool *cancelled;
+    /* Worker running the request, NULL on the dispatcher */
+    struct pool_worker *worker;
+} LspRequest;
 
 typedef struct LspState {
     LspClient client;
     bool has_err;
-    bool has_msg;
     LspError error;
-    Document **documents;
-    DocChange **changes;
-    LspReply reply;
+    docstore documents;
+    /* Scratch memory of the message being handled, reset after each one */
+    arena scratch;
+    /* Runs worker methods, NULL to run everything on the dispatcher */
+    struct worker_pool *pool;
+    /* Documents waiting to be analysed */
+    analysis_sched analysis;
 } LspState;
 
-int lsp_initialize(LspState *state, cJSON *message);
-int lsp_initialized(LspState *state, cJSON *message);
-int lsp_exit(LspState *state, cJSON *message);
-int lsp_shutdown(LspState *state, cJSON *message);
-int lsp_textDocument_didOpen(LspState *state, cJSON *message);
-int lsp_textDocument_didChange(cJSON *message);
-int lsp_textDocument_didClose(cJSON *message);
-int lsp_textDocument_completion(cJSON *message);
+void lsp_state_free(LspState *state);
+cJSON *lsp_request_params(LspRequest *request);
+void lsp_reply_begin(jwriter *writer, LspRequest *request);
+void lsp_reply_end(jwriter *writer);
+void lsp_reply_error(pipeline_output *out, const char *id, u64 id_len,
+                     int code, const char *message);
+void lsp_reply_cancelled(pipeline_output *out, const char *id, u64 id_len);
+bool lsp_same_id(const char *a, u64 a_len, const char *b, u64 b_len);
+bool lsp_request_cancelled(LspState *state, const LspRequest *request);
+bool lsp_request_yield(LspRequest *request);
+int lsp_initialize(LspState *state, LspRequest *request);
+int lsp_initialized(LspState *state, LspRequest *request);
+int lsp_exit(LspState *state, LspRequest *request);
+int lsp_shutdown(LspState *state, LspRequest *request);
+int lsp_cancelRequest(LspState *state, LspRequest *request);
+int lsp_setTrace(LspState *state, LspRequest *request);
+int lsp_textDocument_didOpen(LspState *state, LspRequest *request);
+int lsp_textDocument_didChange(LspState *state, LspRequest *request);
+int lsp_textDocument_didClose(LspState *state, LspRequest *request);
+int lsp_textDocument_completion(LspState *state, LspRequest *request);
+int lsp_textDocument_codeAction(LspState *state, LspRequest *request);
+int lsp_analyse_document(LspState *state, LspRequest *request);
 
 #endif  // LSP_H_
@@ -0,0 +1,62 @@
+#include "method.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "common.h"
+#include "lsp.h"
+#include "method_hash.h"
+/* Generated from methods.def by tools/gen_methods.c */
+#include "method_table.h"
+
+static const method_desc method_table[METHOD_COUNT] = {
+    [UNKNOWN] = {0},
+#define METHOD(id, str, fn, method_kind, init, on_worker)              \
+    [id] = {.name = str,                                               \
+            .name_len = sizeof(str) - 1,                               \
+            .type = id,                                                \
+            .handler = fn,                                             \
+            .kind = method_kind,                                       \
+            .needs_init = init,                                        \
+            .worker = on_worker},
+#include "methods.def"
+#undef METHOD
+};
+
+/**
+ * method_lookup
+ * Finds the descriptor of a method string with a single probe of the
+ * generated perfect hash table and one string compare.
+ *
+ * Arguments: `const char *name`, the method string, need not be terminated.
+ *            `u64 len`, its length.
+ * Returns: The descriptor, NULL for methods outside the LSP method set.
+ **/
+const method_desc *method_lookup (const char *name, u64 len) {
+
+    if (!name) {
+        return NULL;
+    }
+
+    u32 slot = method_hash(name, len, METHOD_HASH_SEED) &
+               ((1u << METHOD_TABLE_BITS) - 1);
+    method_type type = method_slots[slot];
+
+    if (type == UNKNOWN) {
+        return NULL;
+    }
+
+    const method_desc *desc = &method_table[type];
+    if (desc->name_len != len || memcmp(desc->name, name, len) != 0) {
+        return NULL;
+    }
+    return desc;
+}
+
+const method_desc *method_by_type (method_type type) {
+
+    if (type <= UNKNOWN || type >= METHOD_COUNT) {
+        return NULL;
+    }
+    return &method_table[type];
+}
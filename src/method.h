@@ -0,0 +1,42 @@
+#ifndef METHOD_H_
+#define METHOD_H_
+
+#include <cjson/cJSON.h>
+#include <stdbool.h>
+
+#include "common.h"
+#include "lsp.h"
+
+typedef enum method_type {
+    UNKNOWN = 0,
+#define METHOD(id, name, handler, kind, needs_init, worker) id,
+#include "methods.def"
+#undef METHOD
+    METHOD_COUNT,
+} method_type;
+
+typedef enum method_kind {
+    METHOD_REQUEST = 0,
+    METHOD_NOTIFICATION,
+} method_kind;
+
+typedef int (*method_handler)(LspState *state, LspRequest *request);
+
+/* Everything the dispatcher needs to know about a method */
+typedef struct method_desc {
+    const char *name;
+    u32 name_len;
+    method_type type;
+    /* NULL when the method is known but not implemented */
+    method_handler handler;
+    method_kind kind;
+    /* Rejected until the client sent `initialized` */
+    bool needs_init;
+    /* Runs on the worker pool, see methods.def */
+    bool worker;
+} method_desc;
+
+const method_desc *method_lookup(const char *name, u64 len);
+const method_desc *method_by_type(method_type type);
+
+#endif  // METHOD_H_
@@ -0,0 +1,30 @@
+#ifndef METHOD_HASH_H_
+#define METHOD_HASH_H_
+
+#include "common.h"
+
+/**
+ * method_hash
+ * Seeded FNV-1a with a murmur style finaliser so the low bits, which pick
+ * the table slot, depend on every byte. Shared with tools/gen_methods.c,
+ * which searches for a seed that makes it collision free over methods.def.
+ **/
+static inline u32 method_hash (const char *str, u64 len, u32 seed) {
+
+    u32 hash = 2166136261u ^ seed;
+
+    for (u64 i = 0; i < len; ++i) {
+        hash ^= (u8) str[i];
+        hash *= 16777619u;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+#endif  // METHOD_HASH_H_
@@ -0,0 +1,228 @@
+#include "output.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "logging.h"
+
+#ifdef NDEBUG
+    #define output_initial_cap (64 * 1024)
+    #define output_initial_frames 16
+#else
+    #define output_initial_cap 64
+    #define output_initial_frames 1
+#endif
+
+#ifndef IOV_MAX
+    #define IOV_MAX 1024
+#endif
+
+void output_init (pipeline_output *out, int fd) {
+
+    assert(out);
+
+    memset(out, 0, sizeof(*out));
+    out->fd = fd;
+    out->cap = output_initial_cap;
+    out->frame_cap = output_initial_frames;
+    out->data = malloc(out->cap);
+    out->frames = malloc(sizeof(output_frame) * out->frame_cap);
+    out->iov = malloc(sizeof(struct iovec) * out->frame_cap);
+
+    if (!out->data || !out->frames || !out->iov) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+}
+
+void output_free (pipeline_output *out) {
+
+    if (!out) {
+        return;
+    }
+    free(out->data);
+    free(out->frames);
+    free(out->iov);
+    memset(out, 0, sizeof(*out));
+}
+
+/**
+ * output_reserve
+ * Appends `len` uninitialised bytes to the open frame, growing the buffer
+ * when needed.
+ *
+ * Returns: Pointer to the bytes, valid until the next call on `out`.
+ **/
+char *output_reserve (pipeline_output *out, u64 len) {
+
+    assert(out);
+
+    if (out->len + len > out->cap) {
+        u64 new_cap = out->cap * 2;
+        while (new_cap < out->len + len) {
+            new_cap *= 2;
+        }
+        char *grown = realloc(out->data, new_cap);
+        if (!grown) {
+            log_err(COMPLAIN_Err_OutOfMem);
+            exit(-1);
+        }
+        out->data = grown;
+        out->cap = new_cap;
+    }
+
+    char *at = out->data + out->len;
+    out->len += len;
+    return at;
+}
+
+void output_append (pipeline_output *out, const char *bytes, u64 len) {
+
+    assert(bytes || len == 0);
+
+    if (len == 0) {
+        return;
+    }
+    memcpy(output_reserve(out, len), bytes, len);
+}
+
+/* Opens a new frame, leaving a gap for its header */
+void output_begin (pipeline_output *out) {
+
+    assert(out && !out->frame_open);
+
+    out->frame_start = out->len;
+    out->frame_open = true;
+    output_reserve(out, OUTPUT_HEADER_MAX);
+}
+
+/* Closes the open frame, backfilling its Content-Length header */
+void output_end (pipeline_output *out) {
+
+    assert(out && out->frame_open);
+
+    u64 body_off = out->frame_start + OUTPUT_HEADER_MAX;
+    u64 body_len = out->len - body_off;
+
+    char header[OUTPUT_HEADER_MAX + 1];
+    int header_len = snprintf(header, sizeof(header),
+                              "Content-Length: %llu\r\n\r\n", body_len);
+
+    if (header_len <= 0 || header_len > OUTPUT_HEADER_MAX) {
+        COMPLAIN_UNREACHABLE("Header does not fit in the reserved gap.");
+    }
+
+    /* Right align the header against the body, the gap before it is skipped
+       when writing */
+    u64 header_off = body_off - header_len;
+    memcpy(out->data + header_off, header, header_len);
+
+    if (out->frame_count == out->frame_cap) {
+        out->frame_cap *= 2;
+        output_frame *frames =
+            realloc(out->frames, sizeof(output_frame) * out->frame_cap);
+        struct iovec *iov =
+            realloc(out->iov, sizeof(struct iovec) * out->frame_cap);
+        if (!frames || !iov) {
+            log_err(COMPLAIN_Err_OutOfMem);
+            exit(-1);
+        }
+        out->frames = frames;
+        out->iov = iov;
+    }
+
+    out->frames[out->frame_count].off = header_off;
+    out->frames[out->frame_count].len = header_len + body_len;
+    out->frame_count++;
+    out->frame_open = false;
+}
+
+/* Queues an already serialised body */
+void output_queue_reply (pipeline_output *out, const char *body, u64 len) {
+
+    assert(body && len > 0);
+
+    output_begin(out);
+    output_append(out, body, len);
+    output_end(out);
+}
+
+bool output_pending (pipeline_output *out) {
+
+    assert(out);
+
+    return out->frame_count > 0;
+}
+
+/**
+ * output_flush
+ * Writes every queued frame with as few writev calls as possible, retrying
+ * on partial writes. With a shared lock the frames go out as one unit, so
+ * replies from different outputs never interleave.
+ *
+ * Returns: 0 on success, -1 if writing failed. Queued frames are dropped
+ *          either way.
+ **/
+int output_flush (pipeline_output *out) {
+
+    assert(out && !out->frame_open);
+
+    int result = 0;
+    u64 first = 0;
+
+    for (u64 i = 0; i < out->frame_count; ++i) {
+        out->iov[i].iov_base = out->data + out->frames[i].off;
+        out->iov[i].iov_len = out->frames[i].len;
+    }
+
+    if (out->lock && out->frame_count > 0) {
+        pthread_mutex_lock(out->lock);
+    }
+
+    while (first < out->frame_count) {
+
+        u64 count = out->frame_count - first;
+        if (count > IOV_MAX) {
+            count = IOV_MAX;
+        }
+
+        ssize_t written = writev(out->fd, out->iov + first, (int) count);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            log_err("Failed to write replies to fd `%d`.", out->fd);
+            result = -1;
+            break;
+        }
+        out->writes++;
+
+        /* Skip over whatever was written completely, trim the rest */
+        u64 done = written;
+        while (first < out->frame_count && done >= out->iov[first].iov_len) {
+            done -= out->iov[first].iov_len;
+            out->frames_written++;
+            first++;
+        }
+        if (done > 0) {
+            out->iov[first].iov_base = (char *) out->iov[first].iov_base + done;
+            out->iov[first].iov_len -= done;
+        }
+    }
+
+    if (out->lock && out->frame_count > 0) {
+        pthread_mutex_unlock(out->lock);
+    }
+
+    out->len = 0;
+    out->frame_count = 0;
+    return result;
+}
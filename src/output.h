@@ -0,0 +1,58 @@
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include "common.h"
+
+/* Room reserved in front of every reply for its Content-Length header */
+#define OUTPUT_HEADER_MAX 40
+
+/* A framed reply: right aligned header followed by the body */
+typedef struct output_frame {
+    u64 off;
+    u64 len;
+} output_frame;
+
+/**
+ * Output stage for replies. Bodies are written into one reusable buffer
+ * behind a reserved header gap which is backfilled once the body length is
+ * known. Frames queued during a dispatch cycle go out in a single writev.
+ **/
+typedef struct pipeline_output {
+    int fd;
+    /* Held while flushing when several outputs share `fd`, NULL if not */
+    pthread_mutex_t *lock;
+    char *data;
+    u64 len;
+    u64 cap;
+
+    output_frame *frames;
+    u64 frame_count;
+    u64 frame_cap;
+    struct iovec *iov;
+
+    /* Start of the header gap of the frame being written */
+    u64 frame_start;
+    bool frame_open;
+
+    /* Statistics */
+    u64 writes;
+    u64 frames_written;
+} pipeline_output;
+
+void output_init(pipeline_output *out, int fd);
+void output_free(pipeline_output *out);
+
+void output_begin(pipeline_output *out);
+char *output_reserve(pipeline_output *out, u64 len);
+void output_append(pipeline_output *out, const char *bytes, u64 len);
+void output_end(pipeline_output *out);
+
+void output_queue_reply(pipeline_output *out, const char *body, u64 len);
+bool output_pending(pipeline_output *out);
+int output_flush(pipeline_output *out);
+
+#endif  // OUTPUT_H_
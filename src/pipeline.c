@@ -2,17 +2,28 @@
 
 #include <assert.h>
 #include <cjson/cJSON.h>
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/cdefs.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "analysis.h"
+#include "arena.h"
 #include "common.h"
+#include "jscan.h"
 #include "logging.h"
 #include "lsp.h"
+#include "output.h"
+#include "pool.h"
+#include "queue.h"
+#include "scan.h"
 
 #define COMPLAIN_REQ_AFTER_SDN 998
 #define COMPLAIN_GOOD_EXIT 999
@@ -20,14 +31,41 @@
 
 #ifdef NDEBUG
     #define buffer_size 1024
+    #define reader_initial_cap (64 * 1024)
+    #define pipeline_queue_len 64
 #else
     #define buffer_size 64
+    #define reader_initial_cap 64
+    #define pipeline_queue_len 4
 #endif
 
-static void pipeline_send(FILE *dest, LspState *state);
-static inline int is_header_break_line(char *line);
+/* Largest header block we accept before giving up on the stream */
+#define reader_max_header 4096
+/* Longest method name accepted once its escapes are decoded */
+#define pipeline_method_max 64
+
 static inline int valid_message(msg_t *message);
 
+/* Longest URI used to pick the document of a worker method */
+#define pipeline_uri_max 4096
+/* Documents handed out per pass over the store when analyses are due */
+#define pipeline_analysis_batch 16
+
+/* Not a method clients can call, analyses run through the pool like one */
+static const method_desc analysis_desc = {
+    .name = "complain/analyse",
+    .handler = lsp_analyse_document,
+    .kind = METHOD_NOTIFICATION,
+    .worker = true,
+};
+
+/* Jobs for one document share their key, 0 is for unordered jobs */
+static inline u64 document_key (const char *uri, u64 uri_len) {
+
+    u64 key = docstore_uri_hash(uri, uri_len);
+    return key ? key : 1;
+}
+
 /**
  * pipeline_parse_content_len
  * Parses a `Content-Length: x` string, and returns the number value x.
@@ -78,127 +116,195 @@ u64 pipeline_parse_content_len (char *text) {
 }
 
 /**
- * is_header_break_line
- * Searches for `\r\n\r\n` within `char *`.
+ * reader_fill
+ * Reads from the reader's file descriptor until at least `want` unconsumed
+ * bytes are buffered. The buffer is compacted or grown when it runs out of
+ * room, so pointers into it are only stable between calls.
  *
- * Arguments: `char *` the string to search.
- * Returns: true if found, false otherwise.
+ * Arguments: `pipeline_reader *reader`, the reader to fill.
+ *            `u64 want`, number of unconsumed bytes required.
+ * Returns: 0 on success, -1 on EOF or read failure.
  **/
-static inline int is_header_break_line (char *line) {
+static int reader_fill (pipeline_reader *reader, u64 want) {
+
+    /* Nothing framed by pipeline_read is ever this big */
+    if (want > reader_max_header + SCAN_MAX_CONTENT_LEN) {
+        log_warn("Refusing to buffer `%llu` bytes.", want);
+        return -1;
+    }
+
+    while ((reader->tail - reader->head) < want) {
+
+        /* Always keep one spare byte at the end for NUL termination */
+        if (reader->tail + 1 >= reader->cap) {
+            u64 pending = reader->tail - reader->head;
+
+            if (reader->head > 0) {
+                memmove(reader->buf, reader->buf + reader->head, pending);
+                reader->head = 0;
+                reader->tail = pending;
+            }
 
-    assert(line);
+            u64 needed = (want > pending ? want : pending) + 1;
+            if (reader->tail + 1 >= reader->cap || reader->cap < needed) {
+                u64 new_cap = reader->cap * 2;
+                while (new_cap < needed) {
+                    new_cap *= 2;
+                }
+                char *grown = realloc(reader->buf, new_cap);
+                if (!grown) {
+                    log_err(COMPLAIN_Err_OutOfMem);
+                    exit(-1);
+                }
+                reader->buf = grown;
+                reader->cap = new_cap;
+            }
+        }
 
-    const char *header_break = "\r\n";
+        ssize_t got = read(reader->fd, reader->buf + reader->tail,
+                           reader->cap - 1 - reader->tail);
 
-    /* If it matches, return true */
-    if (strcmp(header_break, (line)) == 0) {
-        return true;
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            log_debug("Could not read from file descriptor `%d`.", reader->fd);
+            return -1;
+        }
+        reader->tail += got;
     }
-    return false;
+
+    return 0;
+}
+
+void pipeline_reader_init (pipeline_reader *reader, int fd) {
+
+    assert(reader);
+
+    reader->fd = fd;
+    reader->cap = reader_initial_cap;
+    reader->head = 0;
+    reader->tail = 0;
+    reader->term_pos = 0;
+    reader->term_byte = '\0';
+    reader->has_term = false;
+    reader->buf = malloc(reader->cap);
+
+    if (!reader->buf) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+}
+
+void pipeline_reader_free (pipeline_reader *reader) {
+
+    if (!reader) {
+        return;
+    }
+    free(reader->buf);
+    reader->buf = NULL;
+    reader->cap = 0;
+    reader->head = 0;
+    reader->tail = 0;
+    reader->has_term = false;
 }
 
 /**
  * pipeline_read
- * Will read from file descriptor indefinitely until it encounters a LSP
- headerbreak,
- * it will then return the contents read to the out parameter.
+ * Frames the next LSP message out of the reader's buffer, reading more from
+ * the file descriptor when the header or body is incomplete.
  *
- * Arguments: `FILE * to_read`, where to read from.
- *            `msg_t *out` , where contents read is stored.
+ * Arguments: `pipeline_reader *reader`, where to read from.
+ *            `msg_t *out` , where the message slice is stored.
  * Returns: Int 0 when success, -1 if failure.
  *
+ * `out->content` points into the reader's buffer and is NUL terminated. It is
+   only valid until the next call to `pipeline_read` on the same reader.
  * It is considered a failure if any of the parameters received are NULL,
-   if the message length does not match with the `Content-Length` given, or if
-   the content length given is invalid.
+   if the stream ends before `Content-Length` bytes were read, or if the
+   content length given is invalid.
  **/
-int pipeline_read (FILE *to_read, msg_t *out) {
+int pipeline_read (pipeline_reader *reader, msg_t *out) {
 
-    if (!to_read || !out) {
-        log_debug("FILE or *out param is NULL.\n");
+    if (!reader || !out) {
+        log_debug("Reader or *out param is NULL.\n");
         return -1;
     }
 
-    /* We keep the previous line because we are searching for the
-    headerbreak which is on the line AFTER the Content-Length. */
-    char prev_line[buffer_size] = {0};
-    /* Current line we are reading */
-    char line[buffer_size] = {0};
+    /* Give back the byte we borrowed to terminate the previous message */
+    if (reader->has_term) {
+        reader->buf[reader->term_pos] = reader->term_byte;
+        reader->has_term = false;
+    }
+    if (reader->head == reader->tail) {
+        reader->head = 0;
+        reader->tail = 0;
+    }
 
+    u64 content_len = 0;
+    i64 body_off = -1;
+
+    /* Find the end of the header block, parsing Content-Length on the way */
     while (true) {
+        u64 pending = reader->tail - reader->head;
+
+        body_off = scan_headers(reader->buf + reader->head, pending,
+                                &content_len);
+        if (body_off >= 0) {
+            break;
+        }
 
-        if (fgets(line, buffer_size, to_read) == NULL) {
-            log_debug("Could not read from file.");
+        if (pending >= reader_max_header) {
+            log_debug("No header break within `%d` bytes.", reader_max_header);
             return -1;
         }
 
-        if (is_header_break_line(line)) {
-            log_debug("Found header break!");
-            break;
+        if (reader_fill(reader, pending + 1) < 0) {
+            return -1;
         }
-        memcpy(prev_line, line, buffer_size);
     }
 
-    /* Try parsing the content length number */
-    u64 content_len = pipeline_parse_content_len(prev_line);
     log_debug("Content length: `%llu`", content_len);
 
-    if (!(content_len > 0)) {
-        log_debug("Content length not bigger than 0.");
+    if (body_off > reader_max_header) {
+        log_warn("Header block longer than `%d` bytes.", reader_max_header);
+        return -1;
+    }
+    /* scan_headers turns lengths above SCAN_MAX_CONTENT_LEN into 0 */
+    if (content_len == 0 || content_len > SCAN_MAX_CONTENT_LEN) {
+        log_warn("Missing, invalid or oversized `Content-Length`.");
         return -1;
     }
 
-    out->content = malloc(sizeof(char) * (content_len + 1));
-
-    /* Read content_len num of bytes from FILE and place into out param */
-    u64 read_len = fread(out->content, 1, content_len, to_read);
-
-    /* Check if we have read the correct size */
-    if (read_len != content_len) {
-        log_debug("Bytes read (`%llu`) does not match content length (`%llu`)",
-                  read_len, content_len);
-        free(out->content);
+    /* Make sure the whole body is buffered */
+    if (reader_fill(reader, body_off + content_len) < 0) {
+        log_debug("Stream ended before `%llu` bytes of content were read.",
+                  content_len);
         return -1;
     }
 
+    out->content = reader->buf + reader->head + body_off;
     out->len = content_len;
-    /* Null terminate */
-    *((out->content) + content_len) = '\0';
+
+    /* Null terminate in place, remembering the byte we overwrite */
+    reader->head += body_off + content_len;
+    reader->term_pos = reader->head;
+    reader->term_byte = reader->buf[reader->head];
+    reader->has_term = true;
+    reader->buf[reader->head] = '\0';
 
     return 0;
 }
 
-int pipeline_determine_method_type (char *method_str) {
+/* Kept for callers which only care about the enum value */
+int pipeline_determine_method_type (const char *method_str) {
 
-    /* When method str is null */
     if (!method_str) {
         return -1;
     }
 
-    if (strcmp(method_str, "initialize") == 0) {
-        return initialize;
-    }
-    if (strcmp(method_str, "initialized") == 0) {
-        return initialized;
-    }
-    if (strcmp(method_str, "shutdown") == 0) {
-        return shutdown;
-    }
-    if (strcmp(method_str, "exit") == 0) {
-        return exit_;
-    }
-    if (strcmp(method_str, "textDocument/didOpen") == 0) {
-        return textDocument_didOpen;
-    }
-    if (strcmp(method_str, "textDocument/didChange") == 0) {
-        return textDocument_didChange;
-    }
-    if (strcmp(method_str, "textDocument/didClose") == 0) {
-        return textDocument_didClose;
-    }
-    if (strcmp(method_str, "textDocument/completion") == 0) {
-        return textDocument_completion;
-    }
-    return -1;
+    const method_desc *desc = method_lookup(method_str, strlen(method_str));
+    return desc ? (int) desc->type : -1;
 }
 
 /* Checks for validity of a message. */
@@ -220,13 +326,98 @@ static inline int valid_message (msg_t *message) {
     return true;
 }
 
-/* Takes a message, and then acts on it. */
-int pipeline_dispatcher (FILE *dest, msg_t *message, LspState *state) {
+/**
+ * submit_to_pool
+ * Hands a worker method to the pool along with a snapshot of the document
+ * in `params.textDocument.uri`. Jobs for one document share a key and so
+ * run in arrival order; without a document the job may run anywhere.
+ **/
+static void submit_to_pool (LspState *state, const method_desc *desc,
+                            const jscan_envelope *env) {
+
+    u64 key = 0;
+    DocSnapshot *snapshot = NULL;
+    const char *text_document;
+    u64 text_document_len;
+    const char *uri;
+    u64 uri_len;
+
+    if (env->params &&
+        jscan_find_key(env->params, env->params_len, "textDocument",
+                       &text_document, &text_document_len) == 1 &&
+        jscan_find_key(text_document, text_document_len, "uri", &uri,
+                       &uri_len) == 1 &&
+        uri_len >= 2 && uri[0] == '"') {
+
+        char *decoded = arena_alloc(&state->scratch, pipeline_uri_max);
+        i64 decoded_len =
+            jscan_unescape(uri + 1, uri_len - 2, decoded, pipeline_uri_max);
+
+        if (decoded_len >= 0) {
+            key = document_key(decoded, decoded_len);
+
+            Document *doc =
+                docstore_find(&state->documents, decoded, decoded_len);
+            if (doc) {
+                snapshot = docstore_snapshot(doc);
+            }
+        }
+    }
+
+    pool_job *job =
+        pool_job_new(desc, POOL_INTERACTIVE, key, &state->client, snapshot,
+                     env->id, env->id_len, env->params, env->params_len);
+    pool_submit(state->pool, job);
+}
+
+/**
+ * pipeline_run_analyses
+ * Starts the analyses whose debounce window ran out by `now`, each against
+ * a snapshot of the document's latest version. They go to the pool when
+ * it runs, otherwise they run right here and write into `dest`.
+ **/
+void pipeline_run_analyses (pipeline_output *dest, LspState *state, u64 now) {
+
+    assert(dest && state);
+
+    Document *due[pipeline_analysis_batch];
+    u64 count;
+
+    while ((count = analysis_take_due(&state->analysis, &state->documents, now,
+                                      due, ARRAY_LENGTH(due))) > 0) {
+
+        for (u64 i = 0; i < count; ++i) {
+
+            docstore_take_dirty(due[i]);
+            DocSnapshot *snapshot = docstore_snapshot(due[i]);
+
+            if (state->pool && state->pool->count > 0) {
+                /* Only the document being typed in is worth hurrying */
+                pool_priority priority =
+                    due[i]->hash == state->analysis.active ? POOL_FOREGROUND
+                                                           : POOL_BACKGROUND;
+                pool_submit(state->pool,
+                            pool_job_new(&analysis_desc, priority,
+                                         document_key(due[i]->uri,
+                                                      due[i]->uri_len),
+                                         &state->client, snapshot, NULL, 0,
+                                         NULL, 0));
+                continue;
+            }
+
+            LspRequest request = {.out = dest, .snapshot = snapshot};
+            lsp_analyse_document(state, &request);
+            docstore_snapshot_release(snapshot);
+        }
+    }
+}
+
+static int dispatch (pipeline_output *dest, msg_t *message, LspState *state) {
 
     /* assert(dest && message && state); */
 
     int return_val = 0;
-    cJSON *json = NULL;
+    state->has_err = false;
 
     if (!valid_message(message)) {
         log_warn("Invalid message, returning.");
@@ -234,106 +425,125 @@ int pipeline_dispatcher (FILE *dest, msg_t *message, LspState *state) {
         goto pre_dispatch_error_cleanup;
     }
 
-#if 0
-    char *fresh_str = NULL;
-    fresh_str = calloc(sizeof(char), message->len + 1);
-    if (!fresh_str) {
-        log_err("Failed to allocate mem. Exiting.");
-        exit(-1);
+    /* Only the envelope is looked at here, handlers parse `params` if and
+       when they need it */
+    if (!message->peeked) {
+        message->peek_result =
+            jscan_peek(message->content, message->len, &message->env);
+        message->peeked = true;
     }
+    jscan_envelope *env = &message->env;
 
-    memcpy(fresh_str, message->content, message->len);
-    fresh_str[message->len] = '\0';
-
-    /* Parse the string into JSON */
-    json = cJSON_Parse(fresh_str);
-    free(fresh_str);
-#endif  // 0
-
-    json = cJSON_Parse(message->content);
-
-    /* Check if JSON has been parsed correctly */
-    if (json == NULL) {
-        log_err("Failed to create JSON object from message: `%s`",
-                message->content);
-
-        /* Get internal error pointer */
-        const char *err_ptr = cJSON_GetErrorPtr();
-
-        if (err_ptr == NULL) {
-            log_err("Unknown cJSON error.");
-            return_val = RPC_InternalError;
-            goto pre_dispatch_error_cleanup;
-        }
-
-        log_warn("Invalid JSON. Error from: `%s`", err_ptr);
+    if (message->peek_result < 0) {
+        log_warn("Invalid JSON in message: `%.64s`", message->content);
         return_val = RPC_ParseError;
         goto pre_dispatch_error_cleanup;
     }
 
-    cJSON *method = cJSON_GetObjectItem(json, "method");
-
-    if (!cJSON_IsString(method)) {
+    if (!env->method) {
         log_debug("Could not retrieve `method` from JSON.");
         return_val = RPC_MethodNotFound;
         goto pre_dispatch_error_cleanup;
     }
 
-    char *method_str = method->valuestring;
+    /* No LSP method needs escapes, but they are allowed */
+    const char *method_str = env->method;
+    i64 method_len = env->method_len;
+    char method_buf[pipeline_method_max];
+    if (env->method_escaped) {
+        method_len = jscan_unescape(env->method, env->method_len, method_buf,
+                                    sizeof(method_buf));
+        method_str = method_buf;
+    }
+
+    /* Notifications carry no id and must never be answered */
+    bool is_request = env->id != NULL;
 
-    int methodtype = pipeline_determine_method_type(method_str);
-    if (methodtype < 0) {
-        log_debug("Received unsupported method type: `%s`", method_str);
-        return_val = RPC_InvalidRequest;
+    if (is_request &&
+        atomic_load_explicit(&message->cancelled, memory_order_relaxed)) {
+        log_debug("Request `%.*s` was cancelled before it was handled",
+                  (int) env->id_len, env->id);
+        return_val = RequestCancelled;
         goto pre_dispatch_error_cleanup;
     }
 
+    const method_desc *desc =
+        method_len < 0 ? NULL : method_lookup(method_str, method_len);
+    if (!desc || !desc->handler) {
+        if (!is_request) {
+            log_debug("Ignoring unhandled notification: `%.*s`",
+                      (int) env->method_len, env->method);
+            return 0;
+        }
+        log_debug("Received unsupported method: `%.*s`",
+                  (int) env->method_len, env->method);
+        return_val = RPC_MethodNotFound;
+        goto pre_dispatch_error_cleanup;
+    }
+    method_str = desc->name;
+
     /* Handle when we are shutting down or when we receive exit method */
     if (state->client.shutdown_requested == true) {
-        if (methodtype != exit_) {
+        if (desc->type != exit_) {
             log_info("Ignoring methods whilst waiting for 'exit'");
             return_val = COMPLAIN_REQ_AFTER_SDN;
             goto pre_dispatch_error_cleanup;
         }
-        cJSON_Delete(json);
         return COMPLAIN_GOOD_EXIT;
     }
 
-    /* Return value */
-    int result = 0;
+    if (desc->needs_init && !state->client.initialized) {
+        if (!is_request) {
+            log_debug("Dropping `%s` received before `initialized`",
+                      method_str);
+            return 0;
+        }
+        log_warn("Received `%s` before `initialized`", method_str);
+        return_val = ServerNotInitialized;
+        goto pre_dispatch_error_cleanup;
+    }
 
     log_info("Message type: `%s`", method_str);
 
-    switch (methodtype) {
+    /* The reply comes from a worker, correlated by the id it echoes */
+    if (desc->worker && state->pool && state->pool->count > 0) {
+        /* Replies queued so far go out first, workers write straight away */
+        if (output_pending(dest)) {
+            output_flush(dest);
+        }
+        submit_to_pool(state, desc, env);
+        return 0;
+    }
 
-        case (initialize):
-            result = lsp_initialize(state, json);
-            break;
-        case (initialized):
-            result = lsp_initialized(state, json);
-            break;
-        case (textDocument_didOpen):
-            result = lsp_textDocument_didOpen(state, json);
-            break;
-        case (textDocument_didChange):
-            result = lsp_textDocument_didChange(json);
-            break;
-        case (textDocument_didClose):
-            result = lsp_textDocument_didClose(json);
-            break;
-        case (textDocument_completion):
-            result = lsp_textDocument_completion(json);
-            break;
-        case (shutdown):
-            result = lsp_shutdown(state, json);
-            break;
-        case (exit_):
-            result = lsp_exit(state, json);
-            break;
-        default:
-            log_debug("Cannot handle method type: `%s`", method_str);
-            result = -1;
-            break;
+    /* Everything answered before `shutdown` is answered before its reply */
+    if (desc->type == shutdown && state->pool) {
+        pool_drain(state->pool);
+    }
+
+    LspRequest request = {
+        .id = env->id,
+        .id_len = env->id_len,
+        .params = env->params,
+        .params_len = env->params_len,
+        .out = dest,
+    };
+
+    int result = desc->handler(state, &request);
+    cJSON_Delete(request.params_json);
+
+    /* Handlers fail with -1, answer requests with the code they recorded */
+    if (result == -1) {
+        if (!is_request) {
+            log_warn("Failed to handle notification `%s`", method_str);
+            state->has_err = false;
+            result = 0;
+        } else {
+            if (!state->has_err) {
+                state->has_err = true;
+                state->error.code = RPC_InvalidParams;
+            }
+            result = state->error.code;
+        }
     }
 
     if (state->has_err) {
@@ -342,83 +552,60 @@ int pipeline_dispatcher (FILE *dest, msg_t *message, LspState *state) {
         /* COMPLAIN_TODO("Have not yet implemented lsp error handling yet."); */
     }
 
-    if (state->has_msg) {
-        pipeline_send(dest, state);
-    }
-
-    cJSON_Delete(json);
-
     return result;
 
 pre_dispatch_error_cleanup:
     {
-        cJSON_Delete(json);
         state->has_err = true;
         state->error.code = return_val;
         return return_val;
     }
 }
 
-static inline void pipeline_send (FILE *dest, LspState *state) {
-
-    assert(state && state->reply.msg);
-    log_debug("Sending message of length `%zu`:\n`%s`", state->reply.msg_len,
-              state->reply.msg);
-
-    /* log_debug("`%s%s`", state->reply.header, state->reply.msg); */
-    fprintf(dest, "%s%s", state->reply.header, state->reply.msg);
-    fflush(dest);
-    state->reply.msg_len = 0;
-    free(state->reply.header);
-    free(state->reply.msg);
-    state->has_msg = false;
-}
-
-cJSON *create_error_object (int client_msg_id, int err_code, char *message) {
-
-    assert(message);
-
-    /* Build error object */
-    cJSON *errJSON = cJSON_CreateObject();
-    cJSON_AddStringToObject(errJSON, "jsonrpc", "2.0");
-    cJSON_AddNumberToObject(errJSON, "code", err_code);
-
-    if (message) {
-        cJSON_AddStringToObject(errJSON, "message", message);
-    }
+/* Takes a message, and then acts on it. */
+int pipeline_dispatcher (pipeline_output *dest, msg_t *message,
+                         LspState *state) {
 
-    return errJSON;
-}
+    assert(state);
 
-void add_content_length_hdr (char *str, size_t len, char *out) {
-    assert(str);
-    assert(len > 0);
+    /* Everything cJSON and the handlers allocate for this message comes out
+       of the scratch arena */
+    arena_hook_cjson();
+    arena *previous = arena_use(&state->scratch);
 
-    char temp[buffer_size] = {0};
-    int tempheader_size = 0;
-    tempheader_size =
-        snprintf(temp, buffer_size, "Content-Length: %zu\r\n\r\n", len);
+    int result = dispatch(dest, message, state);
 
-    if (tempheader_size <= 0) {
-        COMPLAIN_UNREACHABLE("temp header length is invalid... aborting.");
+    /* Answer errors while the id they echo is still around */
+    if (result < 0) {
+        log_err("Dispatcher finished with error code `%d`", result);
+        handle_lsp_code(dest, state, message, result);
     }
 
-    size_t message_size = (tempheader_size + len + 1);
-    out = calloc(sizeof(char), message_size);
-    int final_size = snprintf(out, message_size - 1, "%s%s", temp, str);
+    arena_use(previous);
+    arena_reset(&state->scratch);
 
-    if (final_size <= 0) {
-        COMPLAIN_UNREACHABLE("Our final message is of an invalid size!");
+    /* The envelope is only valid for the content it was found in */
+    if (message) {
+        message->peeked = false;
     }
+    return result;
 }
 
-int handle_lsp_code (LspState *state, int lsp_result) {
+/**
+ * handle_lsp_code
+ * Answers a message the dispatcher failed on with a JSON-RPC error echoing
+ * its id. Failed notifications are only logged, messages whose id could not
+ * be read are answered with a `null` id.
+ *
+ * Arguments: `msg_t *message`, the failed message, may be NULL.
+ *            `int lsp_result`, the error code returned by the dispatcher.
+ **/
+int handle_lsp_code (pipeline_output *dest, LspState *state, msg_t *message,
+                     int lsp_result) {
 
-    assert(state);
+    assert(dest && state);
 
-    int msgID = state->error.msg_id;
-    int err_code = state->error.code;
-    char *msg;
+    const char *msg;
 
     switch (lsp_result) {
 
@@ -456,6 +643,16 @@ int handle_lsp_code (LspState *state, int lsp_result) {
                 msg = "Internal JSON RPC error.";
                 break;
             }
+        case (ServerNotInitialized):
+            {
+                msg = "Server has not been initialised yet.";
+                break;
+            }
+        case (RequestCancelled):
+            {
+                msg = "The request was cancelled.";
+                break;
+            }
 
         /* 998 is for when we are in shutdown mode and we receive a message
            with an irrelevant method  */
@@ -481,38 +678,142 @@ int handle_lsp_code (LspState *state, int lsp_result) {
             }
         default:
             {
-                COMPLAIN_UNREACHABLE("We should never be able to reach this.");
+                msg = "Request failed.";
                 break;
             }
     }
 
-    /* Build error object */
-    cJSON *errJSON = cJSON_CreateObject();
-    cJSON_AddStringToObject(errJSON, "jsonrpc", "2.0");
-    cJSON_AddNumberToObject(errJSON, "code", err_code);
-    cJSON_AddStringToObject(errJSON, "message", msg);
+    bool readable = message && message->peeked && message->peek_result == 0;
 
-    char *err_response = NULL;
-    err_response = cJSON_Print(errJSON);
+    if (readable && !message->env.id) {
+        log_debug("Not answering the failed notification.");
+        return 0;
+    }
 
-    if (!err_response) {
-        log_err("Could not create error object... Exiting.");
-        exit(-1);
+    lsp_reply_error(dest, readable ? message->env.id : NULL,
+                    readable ? message->env.id_len : 0, lsp_result, msg);
+    return 0;
+}
+
+/* Reader thread state, frames and pre-parses messages ahead of dispatch */
+typedef struct pipeline_input {
+    pipeline_reader reader;
+    msg_queue queue;
+    pthread_t thread;
+} pipeline_input;
+
+/**
+ * cancel_queued
+ * Flags the request `id` when it is still waiting in the input queue, so
+ * the dispatcher answers it without running it. Only the reader thread
+ * fills slots, so the ones between head and tail stay put while it looks.
+ **/
+static void cancel_queued (msg_queue *queue, const char *id, u64 id_len) {
+
+    u64 tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    u64 head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    for (u64 i = head; i != tail; ++i) {
+        msg_t *queued = &queue->slots[i & queue->mask].msg;
+        if (queued->peek_result == 0 &&
+            lsp_same_id(queued->env.id, queued->env.id_len, id, id_len)) {
+            atomic_store_explicit(&queued->cancelled, true,
+                                  memory_order_relaxed);
+        }
     }
+}
 
-    state->reply.msg = err_response;
-    state->reply.msg_len = strlen(err_response);
+/* The id a $/cancelRequest cancels, false for any other message */
+static bool cancel_target (const msg_t *message, const char **id,
+                           u64 *id_len) {
 
-    char *final_msg = NULL;
-    add_content_length_hdr(err_response, state->reply.msg_len, final_msg);
+    const jscan_envelope *env = &message->env;
 
-    fprintf(stdout, "%s", final_msg);
+    if (message->peek_result != 0 || !env->method || env->method_escaped ||
+        env->id || !env->params) {
+        return false;
+    }
+    const method_desc *desc = method_lookup(env->method, env->method_len);
+    if (!desc || desc->type != dollar_cancelRequest) {
+        return false;
+    }
+    return jscan_find_key(env->params, env->params_len, "id", id, id_len) ==
+           1;
+}
 
-    cJSON_Delete(errJSON);
-    free(err_response);
-    free(final_msg);
+/**
+ * pipeline_reader_thread
+ * Producer side of the input queue: frames each message, copies it into a
+ * ring slot and parses its JSON while the dispatcher handles earlier ones.
+ * Blocks on `msg_queue_reserve` when the dispatcher falls behind.
+ **/
+static void *pipeline_reader_thread (void *arg) {
 
-    return 0;
+    pipeline_input *input = arg;
+    msg_t framed = {0};
+
+    /* Only cancelled while waiting for input, never while holding the
+       queue's lock */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    while (true) {
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        int read_result = pipeline_read(&input->reader, &framed);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (read_result != 0) {
+            break;
+        }
+
+        msg_t *slot = msg_queue_reserve(&input->queue, framed.len);
+        if (!slot) {
+            break;
+        }
+
+        memcpy(slot->content, framed.content, framed.len);
+        slot->content[framed.len] = '\0';
+
+        /* Find the envelope while the dispatcher handles earlier messages */
+        slot->peek_result = jscan_peek(slot->content, slot->len, &slot->env);
+        slot->peeked = true;
+
+        const char *cancel_id;
+        u64 cancel_id_len;
+        if (cancel_target(slot, &cancel_id, &cancel_id_len)) {
+            cancel_queued(&input->queue, cancel_id, cancel_id_len);
+        }
+
+        msg_queue_commit(&input->queue);
+    }
+
+    log_debug("Reader thread finished, closing the input queue.");
+    msg_queue_close(&input->queue);
+    return NULL;
+}
+
+/**
+ * pipeline_input_stop
+ * Stops the reader thread and frees the input. Once the dispatcher is done
+ * the reader is usually blocked in read() on a stream the client keeps
+ * open, so it is cancelled rather than waited for.
+ **/
+static void pipeline_input_stop (pipeline_input *input) {
+
+    msg_queue_close(&input->queue);
+    pthread_cancel(input->thread);
+    pthread_join(input->thread, NULL);
+
+    msg_queue_destroy(&input->queue);
+    pipeline_reader_free(&input->reader);
+    free(input);
+}
+
+static void log_analysis_stats (const analysis_sched *sched) {
+
+    log_info("Analyses: `%llu` requested, `%llu` run, `%llu` saved by "
+             "coalescing.",
+             sched->requested, sched->run, sched->coalesced);
 }
 
 /* Initialise reading from FILE */
@@ -524,11 +825,11 @@ int init_pipeline (FILE *to_read, FILE *to_send) {
         return -1;
     }
 
-    msg_t message = {0};
-    message.method = UNKNOWN;
-    int io_result;
     int lsp_result;
-    int await_shutdown = 0;
+    pipeline_output output;
+    worker_pool pool;
+    /* Shared by the dispatcher's and the workers' outputs */
+    pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
 
     LspState *state = NULL;
     state = calloc(sizeof(LspState), 1);
@@ -540,33 +841,89 @@ int init_pipeline (FILE *to_read, FILE *to_send) {
     state->client.initialized = false;
     state->has_err = false;
 
-    while (true) {
+    pipeline_input *input = calloc(1, sizeof(pipeline_input));
+    if (!input) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+    pipeline_reader_init(&input->reader, fileno(to_read));
+    msg_queue_init(&input->queue, pipeline_queue_len);
+    output_init(&output, fileno(to_send));
+    output.lock = &write_lock;
+    pool_init(&pool, fileno(to_send), &write_lock);
+    state->pool = &pool;
 
-        /* We read from standard input */
-        io_result = pipeline_read(to_read, &message);
+    if (pthread_create(&input->thread, NULL, pipeline_reader_thread, input)) {
+        log_err("Could not start the reader thread.");
+        exit(-1);
+    }
 
-        /* Check for error */
-        if (io_result < 0) {
-            log_debug("Pipeline IO reading has failed, returning.");
+    while (true) {
 
-            if (message.content) {
-                free(message.content);
+        /* Sleep no longer than the next analysis can wait */
+        u64 due = analysis_next_due(&state->analysis, &state->documents);
+        if (due) {
+            struct timespec deadline = {
+                .tv_sec = due / (1000 * 1000 * 1000),
+                .tv_nsec = due % (1000 * 1000 * 1000),
+            };
+            if (msg_queue_wait(&input->queue, &deadline) == 0) {
+                pipeline_run_analyses(&output, state, analysis_now());
+                output_flush(&output);
+                continue;
             }
+        }
+
+        /* Messages come out in the order they were read */
+        msg_t *message = msg_queue_peek(&input->queue);
+
+        /* Reader has hit EOF or an error and the queue is drained */
+        if (!message) {
+            log_debug("Pipeline IO reading has failed, returning.");
+            pipeline_input_stop(input);
+            pool_stop(&pool);
+            output_flush(&output);
+            output_free(&output);
+            log_analysis_stats(&state->analysis);
+            lsp_state_free(state);
+            free(state);
             return -1;
         }
 
         log_debug("Content read: `%.24s [...]`\nContent-Length: `%llu`",
-                  message.content, message.len);
+                  message->content, (u64) message->len);
 
-        lsp_result = pipeline_dispatcher(to_send, &message, state);
+        lsp_result = pipeline_dispatcher(&output, message, state);
 
-        /* Free the content after processing */
-        free(message.content);
-        message.len = 0;
+        /* Hand the slot back to the reader thread */
+        msg_queue_release(&input->queue);
+
+        /* Workers start once the client said how many it wants */
+        if (pool.count == 0 && state->client.initialized) {
+            pool_start(&pool, state->client.worker_threads);
+        }
+
+        /* Documents nobody types in any more must not wait for the others */
+        if (due && due <= analysis_now()) {
+            pipeline_run_analyses(&output, state, analysis_now());
+        }
+
+        /* Coalesce replies while more input is waiting, one write per burst */
+        if (msg_queue_empty(&input->queue) || lsp_result == COMPLAIN_GOOD_EXIT ||
+            lsp_result == COMPLAIN_EXIT_ABRUPT) {
+            output_flush(&output);
+        }
 
-        if (lsp_result < 0) {
-            log_err("Dispatcher finished with error code `%d`");
-            handle_lsp_code(state, lsp_result);
+        if (lsp_result == COMPLAIN_GOOD_EXIT ||
+            lsp_result == COMPLAIN_EXIT_ABRUPT) {
+            pipeline_input_stop(input);
+            pool_stop(&pool);
+            output_flush(&output);
+            output_free(&output);
+            log_analysis_stats(&state->analysis);
+            lsp_state_free(state);
+            free(state);
+            return lsp_result == COMPLAIN_GOOD_EXIT ? 0 : 1;
         }
     }
 }
@@ -1,36 +1,56 @@
 #ifndef PIPELINE_H_
 #define PIPELINE_H_
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
 #include "common.h"
+#include "jscan.h"
 #include "lsp.h"
+#include "method.h"
+#include "output.h"
 
-typedef enum method_type {
-    UNKNOWN = 0,
-    initialize,
-    initialized,
-    textDocument_didOpen,
-    textDocument_completion,
-    textDocument_didChange,
-    textDocument_didClose,
-    shutdown,
-    exit_,
-} method_type;
+/* Buffered reader framing LSP messages straight out of a file descriptor */
+typedef struct pipeline_reader {
+    int fd;
+    char *buf;
+    u64 cap;
+    /* First unconsumed byte */
+    u64 head;
+    /* One past the last byte read */
+    u64 tail;
+    /* Byte overwritten to NUL terminate the last message handed out */
+    u64 term_pos;
+    char term_byte;
+    bool has_term;
+} pipeline_reader;
 
 typedef struct msg_t {
+    /* Slice into the reader's buffer, valid until the next read */
     char *content;
     uint64_t len;
     method_type method;
+    /* Envelope found ahead of dispatch, slices into `content` */
+    jscan_envelope env;
+    int peek_result;
+    bool peeked;
+    /* Cancelled by a later $/cancelRequest while still queued */
+    atomic_bool cancelled;
 } msg_t;
 
 /* Function declarations */
 u64 pipeline_parse_content_len(char *text);
-int pipeline_read(FILE *to_read, msg_t *out);
-int pipeline_determine_method_type(char *method_str);
-int pipeline_dispatcher(FILE *dest, msg_t *message, LspState *state);
+void pipeline_reader_init(pipeline_reader *reader, int fd);
+void pipeline_reader_free(pipeline_reader *reader);
+int pipeline_read(pipeline_reader *reader, msg_t *out);
+int pipeline_determine_method_type(const char *method_str);
+int pipeline_dispatcher(pipeline_output *dest, msg_t *message,
+                        LspState *state);
+void pipeline_run_analyses(pipeline_output *dest, LspState *state, u64 now);
+int handle_lsp_code(pipeline_output *dest, LspState *state, msg_t *message,
+                    int lsp_result);
 int init_pipeline(FILE *to_read, FILE *to_send);
 
 #endif  // PIPELINE_H_
@@ -0,0 +1,557 @@
+#include "pool.h"
+
+#include <assert.h>
+#include <cjson/cJSON.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "common.h"
+#include "logging.h"
+#include "output.h"
+
+/* Used when the number of cores cannot be found */
+#define pool_fallback_threads 4
+
+u32 pool_default_threads (void) {
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (u32) cores : pool_fallback_threads;
+}
+
+/* Leaves the pool ready to take jobs once started */
+void pool_init (worker_pool *pool, int fd, pthread_mutex_t *write_lock) {
+
+    assert(pool);
+
+    memset(pool, 0, sizeof(*pool));
+    pool->fd = fd;
+    pool->write_lock = write_lock;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    atomic_init(&pool->urgent, 0);
+}
+
+/**
+ * pool_job_new
+ * Packs a request into a job, copying its id and params. The job takes
+ * over the caller's reference to `snapshot`.
+ **/
+pool_job *pool_job_new (const method_desc *desc, pool_priority priority,
+                        u64 key, const LspClient *client,
+                        DocSnapshot *snapshot, const char *id, u64 id_len,
+                        const char *params, u64 params_len) {
+
+    assert(desc && client);
+    assert(id || id_len == 0);
+    assert(params || params_len == 0);
+
+    pool_job *job = malloc(sizeof(pool_job) + id_len + params_len);
+    if (!job) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+
+    job->next = NULL;
+    job->desc = desc;
+    job->priority = priority;
+    job->key = key;
+    job->client = *client;
+    job->snapshot = snapshot;
+    atomic_init(&job->cancelled, false);
+
+    if (id_len > 0) {
+        memcpy(job->data, id, id_len);
+    }
+    if (params_len > 0) {
+        memcpy(job->data + id_len, params, params_len);
+    }
+    job->id = id ? job->data : NULL;
+    job->id_len = id_len;
+    job->params = params ? job->data + id_len : NULL;
+    job->params_len = params_len;
+
+    return job;
+}
+
+void pool_job_free (pool_job *job) {
+
+    if (!job) {
+        return;
+    }
+    docstore_snapshot_release(job->snapshot);
+    free(job);
+}
+
+static inline bool is_urgent (pool_priority priority) {
+    return priority != POOL_BACKGROUND;
+}
+
+/* Whether a worker runs a job with `key`, must hold the lock */
+static bool key_busy (const worker_pool *pool, u64 key) {
+
+    if (key == 0) {
+        return false;
+    }
+    for (u32 i = 0; i < pool->count; ++i) {
+        const pool_worker *worker = &pool->workers[i];
+        if ((worker->lane.job && worker->lane.job->key == key) ||
+            (worker->yield_lane.job && worker->yield_lane.job->key == key)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void unlink_job (pool_queue *queue, pool_job *prev, pool_job *job) {
+
+    if (prev) {
+        prev->next = job->next;
+    } else {
+        queue->head = job->next;
+    }
+    if (queue->tail == job) {
+        queue->tail = prev;
+    }
+    job->next = NULL;
+}
+
+/**
+ * oldest_with_key
+ * Finds the oldest queued job sharing `*job`'s key, which has to run before
+ * it, and points `job`, `queue` and `prev` at it. Must hold the lock.
+ **/
+static void oldest_with_key (worker_pool *pool, pool_job **job,
+                             pool_queue **queue, pool_job **prev) {
+
+    u64 key = (*job)->key;
+
+    for (int priority = 0; priority < POOL_PRIORITY_COUNT; ++priority) {
+
+        pool_queue *other = &pool->queues[priority];
+        pool_job *before = NULL;
+
+        /* Queues are in submission order, so the first match is the oldest
+           of its class */
+        for (pool_job *candidate = other->head; candidate;
+             before = candidate, candidate = candidate->next) {
+
+            if (candidate->key != key) {
+                continue;
+            }
+            if (candidate->seq < (*job)->seq) {
+                *job = candidate;
+                *queue = other;
+                *prev = before;
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * background_allowed
+ * Whether a background job may start, never on a yield lane and never on
+ * the last free worker, which is left for whatever urgent work comes in.
+ * Must hold the lock.
+ **/
+static bool background_allowed (const worker_pool *pool,
+                                pool_priority least) {
+    return least == POOL_BACKGROUND &&
+           !(pool->count > 1 && pool->background_running + 1 >= pool->count);
+}
+
+/**
+ * take_job
+ * Unlinks the oldest job of the most urgent class whose key is free. When
+ * an older job with that key waits in a less urgent class, that one comes
+ * out instead, so a key's jobs always run in the order they went in and
+ * a newer analysis never runs before the one it superseded. An older
+ * background job still only starts where background jobs may, otherwise
+ * the newer job keeps waiting for it. Must hold the lock.
+ *
+ * Arguments: `pool_priority least`, the least urgent class to look at.
+ * Returns: The job, NULL if every queued job waits on a busy key.
+ **/
+static pool_job *take_job (worker_pool *pool, pool_priority least) {
+
+    for (int priority = POOL_INTERACTIVE; priority <= (int) least;
+         ++priority) {
+
+        if (priority == POOL_BACKGROUND && !background_allowed(pool, least)) {
+            break;
+        }
+
+        pool_queue *queue = &pool->queues[priority];
+        pool_job *prev = NULL;
+
+        for (pool_job *job = queue->head; job; prev = job, job = job->next) {
+
+            if (key_busy(pool, job->key)) {
+                continue;
+            }
+
+            pool_job *taken = job;
+            pool_queue *from = queue;
+            pool_job *before = prev;
+            if (job->key != 0) {
+                oldest_with_key(pool, &taken, &from, &before);
+            }
+            if (!is_urgent(taken->priority) &&
+                !background_allowed(pool, least)) {
+                continue;
+            }
+
+            unlink_job(from, before, taken);
+            if (is_urgent(taken->priority)) {
+                atomic_fetch_sub_explicit(&pool->urgent, 1,
+                                          memory_order_relaxed);
+            } else {
+                pool->background_running++;
+            }
+            return taken;
+        }
+    }
+    return NULL;
+}
+
+static bool jobs_queued (const worker_pool *pool) {
+
+    for (int priority = 0; priority < POOL_PRIORITY_COUNT; ++priority) {
+        if (pool->queues[priority].head) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Runs one job the way the dispatcher runs a request, minus the checks it
+   already made before submitting */
+static void run_job (pool_worker *worker, pool_lane *lane) {
+
+    pool_job *job = lane->job;
+
+    /* Cancelled between being taken and started */
+    if (atomic_load_explicit(&job->cancelled, memory_order_relaxed)) {
+        lsp_reply_cancelled(&lane->out, job->id, job->id_len);
+        return;
+    }
+
+    LspState state = {.client = job->client};
+
+    LspRequest request = {
+        .id = job->id,
+        .id_len = job->id_len,
+        .params = job->params,
+        .params_len = job->params_len,
+        .out = &lane->out,
+        .snapshot = job->snapshot,
+        .cancelled = &job->cancelled,
+        .worker = worker,
+    };
+
+    int result = job->desc->handler(&state, &request);
+    cJSON_Delete(request.params_json);
+
+    if (result == -1 && job->id) {
+        int code = state.has_err ? state.error.code : RPC_InvalidParams;
+        if (code == RequestCancelled) {
+            log_debug("`%s` was cancelled while running", job->desc->name);
+            lsp_reply_cancelled(&lane->out, job->id, job->id_len);
+            return;
+        }
+        log_warn("Worker failed to handle `%s`", job->desc->name);
+        lsp_reply_error(&lane->out, job->id, job->id_len, code,
+                        "Request failed.");
+    }
+}
+
+/**
+ * run_lane
+ * Runs the job on `lane` with the lane's arena, then retires it. Called
+ * without the lock, returns with it held.
+ **/
+static void run_lane (pool_worker *worker, pool_lane *lane) {
+
+    worker_pool *pool = worker->pool;
+    pool_job *job = lane->job;
+
+    arena *previous = arena_use(&lane->scratch);
+    run_job(worker, lane);
+    output_flush(&lane->out);
+    arena_use(previous);
+    arena_reset(&lane->scratch);
+
+    /* Only the id is needed until the job is gone, the snapshot may be the
+       last reference to a whole text */
+    docstore_snapshot_release(job->snapshot);
+    job->snapshot = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    lane->job = NULL;
+    if (!is_urgent(job->priority)) {
+        pool->background_running--;
+    }
+    pool->completed[job->priority]++;
+    pool->pending--;
+    pool_job_free(job);
+
+    /* Jobs behind the key we held may be runnable now */
+    if (jobs_queued(pool)) {
+        pthread_cond_broadcast(&pool->work);
+    }
+    pthread_cond_broadcast(&pool->idle);
+}
+
+static void lane_init (pool_lane *lane, worker_pool *pool) {
+
+    memset(lane, 0, sizeof(*lane));
+    output_init(&lane->out, pool->fd);
+    lane->out.lock = pool->write_lock;
+}
+
+static void lane_free (pool_lane *lane) {
+
+    arena_free(&lane->scratch);
+    output_free(&lane->out);
+}
+
+static void *pool_worker_thread (void *arg) {
+
+    pool_worker *self = arg;
+    worker_pool *pool = self->pool;
+
+    /* Like the dispatcher, each job parses into its lane's scratch arena */
+    arena_hook_cjson();
+    lane_init(&self->lane, pool);
+    lane_init(&self->yield_lane, pool);
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (true) {
+
+        pool_job *job = take_job(pool, POOL_BACKGROUND);
+        if (!job) {
+            if (pool->stopping && !jobs_queued(pool)) {
+                break;
+            }
+            pthread_cond_wait(&pool->work, &pool->lock);
+            continue;
+        }
+        self->lane.job = job;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_lane(self, &self->lane);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    lane_free(&self->lane);
+    lane_free(&self->yield_lane);
+    return NULL;
+}
+
+/**
+ * pool_start
+ * Starts the worker threads. With no threads the pool stays empty and
+ * callers are expected to run the work themselves.
+ *
+ * Arguments: `worker_pool *pool`, an initialised pool.
+ *            `u32 threads`, number of workers.
+ **/
+void pool_start (worker_pool *pool, u32 threads) {
+
+    assert(pool && pool->count == 0);
+
+    if (threads == 0) {
+        return;
+    }
+
+    pool->workers = calloc(threads, sizeof(pool_worker));
+    if (!pool->workers) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+
+    /* The workers look at each other's keys, all of them exist before any
+       starts */
+    pool->count = threads;
+    for (u32 i = 0; i < threads; ++i) {
+        pool->workers[i].pool = pool;
+    }
+    for (u32 i = 0; i < threads; ++i) {
+        if (pthread_create(&pool->workers[i].thread, NULL, pool_worker_thread,
+                           &pool->workers[i])) {
+            log_err("Could not start worker thread `%u`.", i);
+            exit(-1);
+        }
+    }
+    log_info("Started `%u` worker threads.", threads);
+}
+
+/* Queues a job, the pool owns it from here on */
+void pool_submit (worker_pool *pool, pool_job *job) {
+
+    assert(pool && pool->count > 0 && job);
+    assert(job->priority < POOL_PRIORITY_COUNT);
+
+    pthread_mutex_lock(&pool->lock);
+
+    pool_queue *queue = &pool->queues[job->priority];
+    if (queue->tail) {
+        queue->tail->next = job;
+    } else {
+        queue->head = job;
+    }
+    queue->tail = job;
+    job->seq = pool->submitted++;
+    pool->pending++;
+    if (is_urgent(job->priority)) {
+        atomic_fetch_add_explicit(&pool->urgent, 1, memory_order_relaxed);
+    }
+
+    /* Any idle worker may be the one whose turn it is for this key */
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * pool_yield
+ * Called by background jobs between chunks of work. Runs whatever urgent
+ * jobs are waiting on the calling worker before the background job goes
+ * on, so they never wait for it to finish. Cheap when nothing is waiting.
+ *
+ * Returns: Whether any job ran.
+ **/
+bool pool_yield (pool_worker *worker) {
+
+    assert(worker);
+
+    worker_pool *pool = worker->pool;
+
+    /* Only background jobs step aside, and only one level deep */
+    if (!worker->lane.job || is_urgent(worker->lane.job->priority) ||
+        worker->yield_lane.job ||
+        atomic_load_explicit(&pool->urgent, memory_order_relaxed) == 0) {
+        return false;
+    }
+
+    bool ran = false;
+    pthread_mutex_lock(&pool->lock);
+
+    pool_job *job;
+    while ((job = take_job(pool, POOL_FOREGROUND))) {
+        worker->yield_lane.job = job;
+        pool->yielded_to++;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_lane(worker, &worker->yield_lane);
+        ran = true;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return ran;
+}
+
+/**
+ * pool_cancel
+ * Cancels the job answering request `id`. A job still queued is taken out
+ * of the pool, one being run has its token set and is answered by its
+ * worker.
+ *
+ * Returns: The job if it was still queued, the caller answers and frees
+ *          it. NULL if it is running or no job has that id.
+ **/
+pool_job *pool_cancel (worker_pool *pool, const char *id, u64 id_len) {
+
+    assert(pool && id);
+
+    pool_job *found = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (u32 i = 0; i < pool->count; ++i) {
+        pool_job *running[] = {pool->workers[i].lane.job,
+                               pool->workers[i].yield_lane.job};
+        for (size_t j = 0; j < ARRAY_LENGTH(running); ++j) {
+            if (running[j] && lsp_same_id(running[j]->id, running[j]->id_len,
+                                          id, id_len)) {
+                atomic_store_explicit(&running[j]->cancelled, true,
+                                      memory_order_relaxed);
+                pool->cancelled++;
+                goto done;
+            }
+        }
+    }
+
+    for (int priority = 0; priority < POOL_PRIORITY_COUNT && !found;
+         ++priority) {
+
+        pool_queue *queue = &pool->queues[priority];
+        pool_job *prev = NULL;
+
+        for (pool_job *job = queue->head; job; prev = job, job = job->next) {
+
+            if (!lsp_same_id(job->id, job->id_len, id, id_len)) {
+                continue;
+            }
+            unlink_job(queue, prev, job);
+            if (is_urgent(job->priority)) {
+                atomic_fetch_sub_explicit(&pool->urgent, 1,
+                                          memory_order_relaxed);
+            }
+
+            found = job;
+            pool->pending--;
+            pool->cancelled++;
+            pthread_cond_broadcast(&pool->idle);
+            break;
+        }
+    }
+
+done:
+    pthread_mutex_unlock(&pool->lock);
+    return found;
+}
+
+/* Waits until every submitted job has finished and its reply is written */
+void pool_drain (worker_pool *pool) {
+
+    assert(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Finishes the queued jobs, then joins the workers */
+void pool_stop (worker_pool *pool) {
+
+    if (!pool) {
+        return;
+    }
+
+    if (pool->count > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stopping = true;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (u32 i = 0; i < pool->count; ++i) {
+            pthread_join(pool->workers[i].thread, NULL);
+        }
+    }
+
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->count = 0;
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->idle);
+}
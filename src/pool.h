@@ -0,0 +1,130 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "arena.h"
+#include "common.h"
+#include "docstore.h"
+#include "lsp.h"
+#include "method.h"
+#include "output.h"
+
+/* Scheduling classes, a worker always takes from the lowest one first */
+typedef enum pool_priority {
+    /* Requests the user is waiting on: completion, hover, code actions */
+    POOL_INTERACTIVE = 0,
+    /* Analysis of the document being edited */
+    POOL_FOREGROUND,
+    /* Everything else. Runs in chunks and gives way to the classes above
+       between them, see pool_yield */
+    POOL_BACKGROUND,
+    POOL_PRIORITY_COUNT,
+} pool_priority;
+
+/**
+ * A request handed to the worker pool. Everything it needs is copied or
+ * referenced here, the message it came from is gone by the time it runs.
+ **/
+typedef struct pool_job {
+    struct pool_job *next;
+    const method_desc *desc;
+    pool_priority priority;
+    /* Jobs with the same key never run at the same time, and run in
+       submission order whatever their class. 0 for jobs which may run
+       alongside anything */
+    u64 key;
+    /* Position in submission order, set by pool_submit */
+    u64 seq;
+    /* The client as it was when the request arrived */
+    LspClient client;
+    /* Document the request names, NULL if it is not open */
+    DocSnapshot *snapshot;
+    /* Raw `id` and `params`, pointing into `data` */
+    const char *id;
+    u64 id_len;
+    const char *params;
+    u64 params_len;
+    /* Set by $/cancelRequest, polled by the handler */
+    atomic_bool cancelled;
+    char data[];
+} pool_job;
+
+/* Everything a job runs with: where its replies and its memory go */
+typedef struct pool_lane {
+    /* Job being run, NULL when idle */
+    pool_job *job;
+    pipeline_output out;
+    arena scratch;
+} pool_lane;
+
+typedef struct pool_worker {
+    struct worker_pool *pool;
+    pthread_t thread;
+    /* The job the worker took */
+    pool_lane lane;
+    /* Jobs run while a background job on `lane` yields */
+    pool_lane yield_lane;
+} pool_worker;
+
+typedef struct pool_queue {
+    pool_job *head;
+    pool_job *tail;
+} pool_queue;
+
+/**
+ * Fixed set of threads running worker methods. Jobs wait in one FIFO list
+ * per class, a worker takes the oldest job of the most urgent class whose
+ * key no other worker holds. An older job with the same key queued in a
+ * less urgent class runs first, in its place, and the newer one waits for
+ * it. Background jobs never take the last free worker, and step aside for
+ * urgent ones whenever they call pool_yield.
+ * Each worker writes replies into its own output, flushed under the lock
+ * shared with the dispatcher's output so frames never interleave.
+ * A zeroed pool with no threads runs nothing, callers handle work inline.
+ **/
+typedef struct worker_pool {
+    pool_worker *workers;
+    u32 count;
+
+    pthread_mutex_t lock;
+    /* Signalled when a job is queued or a key is released */
+    pthread_cond_t work;
+    /* Signalled when a job finishes */
+    pthread_cond_t idle;
+    pool_queue queues[POOL_PRIORITY_COUNT];
+    /* Queued and running jobs */
+    u64 pending;
+    u32 background_running;
+    /* Queued interactive and foreground jobs, read without the lock */
+    atomic_uint urgent;
+    bool stopping;
+
+    int fd;
+    pthread_mutex_t *write_lock;
+
+    /* Statistics */
+    u64 submitted;
+    u64 completed[POOL_PRIORITY_COUNT];
+    u64 cancelled;
+    /* Jobs run while a background job yielded */
+    u64 yielded_to;
+} worker_pool;
+
+u32 pool_default_threads(void);
+void pool_init(worker_pool *pool, int fd, pthread_mutex_t *write_lock);
+void pool_start(worker_pool *pool, u32 threads);
+pool_job *pool_job_new(const method_desc *desc, pool_priority priority,
+                       u64 key, const LspClient *client,
+                       DocSnapshot *snapshot, const char *id, u64 id_len,
+                       const char *params, u64 params_len);
+void pool_job_free(pool_job *job);
+void pool_submit(worker_pool *pool, pool_job *job);
+bool pool_yield(pool_worker *worker);
+pool_job *pool_cancel(worker_pool *pool, const char *id, u64 id_len);
+void pool_drain(worker_pool *pool);
+void pool_stop(worker_pool *pool);
+
+#endif  // POOL_H_
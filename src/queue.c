@@ -0,0 +1,243 @@
+#include "queue.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "logging.h"
+
+/**
+ * msg_queue_init
+ * Sets up an empty ring.
+ *
+ * Arguments: `msg_queue *queue`, the queue to initialise.
+ *            `u64 capacity`, number of slots, must be a power of two.
+ **/
+void msg_queue_init (msg_queue *queue, u64 capacity) {
+
+    assert(queue);
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+
+    queue->slots = calloc(capacity, sizeof(msg_slot));
+    if (!queue->slots) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+    queue->capacity = capacity;
+    queue->mask = capacity - 1;
+
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->closed, false);
+    atomic_init(&queue->producer_waiting, false);
+    atomic_init(&queue->consumer_waiting, false);
+
+    /* Timed waits count against the monotonic clock */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_full, &attr);
+    pthread_cond_init(&queue->not_empty, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/* Must only be called once neither end uses the queue anymore */
+void msg_queue_destroy (msg_queue *queue) {
+
+    if (!queue || !queue->slots) {
+        return;
+    }
+
+    for (u64 i = 0; i < queue->capacity; ++i) {
+        free(queue->slots[i].storage);
+    }
+    free(queue->slots);
+    queue->slots = NULL;
+
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+}
+
+/* Wakes up both ends, nothing more will be produced */
+void msg_queue_close (msg_queue *queue) {
+
+    assert(queue);
+
+    atomic_store(&queue->closed, true);
+
+    pthread_mutex_lock(&queue->lock);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+bool msg_queue_empty (msg_queue *queue) {
+
+    assert(queue);
+
+    return atomic_load_explicit(&queue->head, memory_order_relaxed) ==
+           atomic_load_explicit(&queue->tail, memory_order_acquire);
+}
+
+/**
+ * msg_queue_reserve
+ * Hands the producer the next free slot, blocking while the ring is full.
+ * The slot's content buffer is grown to hold `content_len` bytes plus a NUL.
+ *
+ * Returns: The slot's message, NULL if the queue was closed.
+ **/
+msg_t *msg_queue_reserve (msg_queue *queue, u64 content_len) {
+
+    assert(queue);
+
+    u64 tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    if ((tail - atomic_load_explicit(&queue->head, memory_order_acquire)) ==
+        queue->capacity) {
+
+        /* Full: announce that we wait, then re-check before sleeping. Pairs
+           with the seq_cst store of `head` in msg_queue_release. */
+        pthread_mutex_lock(&queue->lock);
+        atomic_store(&queue->producer_waiting, true);
+        while ((tail - atomic_load(&queue->head)) == queue->capacity &&
+               !atomic_load(&queue->closed)) {
+            pthread_cond_wait(&queue->not_full, &queue->lock);
+        }
+        atomic_store(&queue->producer_waiting, false);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    if (atomic_load(&queue->closed)) {
+        return NULL;
+    }
+
+    msg_slot *slot = &queue->slots[tail & queue->mask];
+
+    if (slot->storage_cap < content_len + 1) {
+        u64 new_cap = slot->storage_cap ? slot->storage_cap : 256;
+        while (new_cap < content_len + 1) {
+            new_cap *= 2;
+        }
+        char *grown = realloc(slot->storage, new_cap);
+        if (!grown) {
+            log_err(COMPLAIN_Err_OutOfMem);
+            exit(-1);
+        }
+        slot->storage = grown;
+        slot->storage_cap = new_cap;
+    }
+
+    slot->msg.content = slot->storage;
+    slot->msg.len = content_len;
+    slot->msg.method = UNKNOWN;
+    slot->msg.peeked = false;
+    atomic_store_explicit(&slot->msg.cancelled, false, memory_order_relaxed);
+
+    return &slot->msg;
+}
+
+/* Publishes the slot handed out by the last msg_queue_reserve */
+void msg_queue_commit (msg_queue *queue) {
+
+    assert(queue);
+
+    u64 tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    atomic_store(&queue->tail, tail + 1);
+
+    if (atomic_load(&queue->consumer_waiting)) {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_signal(&queue->not_empty);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+/**
+ * msg_queue_wait
+ * Waits for a message to consume, giving up at `deadline` on the
+ * CLOCK_MONOTONIC clock.
+ *
+ * Returns: 1 when a message is ready, 0 on timeout, -1 once the queue is
+ *          closed and drained.
+ **/
+int msg_queue_wait (msg_queue *queue, const struct timespec *deadline) {
+
+    assert(queue && deadline);
+
+    u64 head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    if (atomic_load_explicit(&queue->tail, memory_order_acquire) != head) {
+        return 1;
+    }
+
+    int waited = 0;
+    pthread_mutex_lock(&queue->lock);
+    atomic_store(&queue->consumer_waiting, true);
+    while (atomic_load(&queue->tail) == head && !atomic_load(&queue->closed) &&
+           waited != ETIMEDOUT) {
+        waited = pthread_cond_timedwait(&queue->not_empty, &queue->lock,
+                                        deadline);
+    }
+    atomic_store(&queue->consumer_waiting, false);
+    pthread_mutex_unlock(&queue->lock);
+
+    if (atomic_load(&queue->tail) != head) {
+        return 1;
+    }
+    return atomic_load(&queue->closed) ? -1 : 0;
+}
+
+/**
+ * msg_queue_peek
+ * Returns the oldest message without removing it, blocking while the ring is
+ * empty. Messages come out in the order they were committed.
+ *
+ * Returns: The message, NULL once the queue is closed and drained.
+ **/
+msg_t *msg_queue_peek (msg_queue *queue) {
+
+    assert(queue);
+
+    u64 head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    if (atomic_load_explicit(&queue->tail, memory_order_acquire) == head) {
+
+        pthread_mutex_lock(&queue->lock);
+        atomic_store(&queue->consumer_waiting, true);
+        while (atomic_load(&queue->tail) == head &&
+               !atomic_load(&queue->closed)) {
+            pthread_cond_wait(&queue->not_empty, &queue->lock);
+        }
+        atomic_store(&queue->consumer_waiting, false);
+        pthread_mutex_unlock(&queue->lock);
+
+        /* Closed, but anything committed before closing is still handed out */
+        if (atomic_load(&queue->tail) == head) {
+            return NULL;
+        }
+    }
+
+    return &queue->slots[head & queue->mask].msg;
+}
+
+/* Frees the slot returned by the last msg_queue_peek for reuse */
+void msg_queue_release (msg_queue *queue) {
+
+    assert(queue);
+
+    u64 head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    atomic_store(&queue->head, head + 1);
+
+    if (atomic_load(&queue->producer_waiting)) {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_signal(&queue->not_full);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef QUEUE_H_
+#define QUEUE_H_
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "common.h"
+#include "pipeline.h"
+
+#define QUEUE_CACHE_LINE 64
+
+/* A ring slot, owns a content buffer which is reused between messages */
+typedef struct msg_slot {
+    msg_t msg;
+    char *storage;
+    u64 storage_cap;
+} msg_slot;
+
+/**
+ * Bounded single producer / single consumer ring of messages.
+ * Both ends are lock free while the ring is neither full nor empty, the
+ * mutex and condition variables are only used to sleep on those edges.
+ **/
+typedef struct msg_queue {
+    msg_slot *slots;
+    u64 capacity;
+    u64 mask;
+
+    /* Next slot to consume, only written by the consumer */
+    alignas(QUEUE_CACHE_LINE) _Atomic u64 head;
+    /* Next slot to fill, only written by the producer */
+    alignas(QUEUE_CACHE_LINE) _Atomic u64 tail;
+
+    alignas(QUEUE_CACHE_LINE) _Atomic bool closed;
+    _Atomic bool producer_waiting;
+    _Atomic bool consumer_waiting;
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+} msg_queue;
+
+void msg_queue_init(msg_queue *queue, u64 capacity);
+void msg_queue_destroy(msg_queue *queue);
+void msg_queue_close(msg_queue *queue);
+bool msg_queue_empty(msg_queue *queue);
+
+/* Producer side */
+msg_t *msg_queue_reserve(msg_queue *queue, u64 content_len);
+void msg_queue_commit(msg_queue *queue);
+
+/* Consumer side */
+int msg_queue_wait(msg_queue *queue, const struct timespec *deadline);
+msg_t *msg_queue_peek(msg_queue *queue);
+void msg_queue_release(msg_queue *queue);
+
+#endif  // QUEUE_H_
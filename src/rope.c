@@ -0,0 +1,748 @@
+#include "rope.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "logging.h"
+#include "scan.h"
+
+#ifdef NDEBUG
+    #define rope_chunk_max 1024
+#else
+    #define rope_chunk_max 16
+#endif
+
+/* Chunks are built this full, the rest absorbs small inserts in place */
+#define rope_chunk_fill (rope_chunk_max * 3 / 4)
+
+static u32 next_priority (rope *r) {
+
+    if (r->seed == 0) {
+        r->seed = 0x9E3779B97F4A7C15ull;
+    }
+    /* xorshift64* */
+    r->seed ^= r->seed >> 12;
+    r->seed ^= r->seed << 25;
+    r->seed ^= r->seed >> 27;
+    return (u32) ((r->seed * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+static inline u64 size_of (const rope_node *node) {
+    return node ? node->size : 0;
+}
+
+static inline u64 lines_of (const rope_node *node) {
+    return node ? node->lines : 0;
+}
+
+static inline u64 chunks_of (const rope_node *node) {
+    return node ? node->chunks : 0;
+}
+
+static inline void update (rope_node *node) {
+    node->size = size_of(node->left) + node->len + size_of(node->right);
+    node->lines =
+        lines_of(node->left) + node->newlines + lines_of(node->right);
+    node->chunks = chunks_of(node->left) + 1 + chunks_of(node->right);
+}
+
+static rope_node *alloc_node (void) {
+
+    rope_node *node = malloc(sizeof(rope_node) + rope_chunk_max);
+    if (!node) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+    atomic_init(&node->refs, 1);
+    return node;
+}
+
+static rope_node *new_node (rope *r, const char *text, u64 len) {
+
+    assert(len > 0 && len <= rope_chunk_max);
+
+    rope_node *node = alloc_node();
+    node->left = NULL;
+    node->right = NULL;
+    node->priority = next_priority(r);
+    node->len = (u32) len;
+    node->cap = rope_chunk_max;
+    node->newlines = (u32) scan_count_byte(text, len, '\n');
+    node->size = len;
+    node->lines = node->newlines;
+    node->chunks = 1;
+    memcpy(node->text, text, len);
+    return node;
+}
+
+static inline void retain (rope_node *node) {
+
+    if (node) {
+        atomic_fetch_add_explicit(&node->refs, 1, memory_order_relaxed);
+    }
+}
+
+/* Drops one reference, the last one frees the node and releases its
+   children. Snapshots may do this from any thread. */
+static void release (rope_node *node) {
+
+    while (node) {
+        if (atomic_fetch_sub_explicit(&node->refs, 1, memory_order_acq_rel) !=
+            1) {
+            return;
+        }
+        rope_node *right = node->right;
+        release(node->left);
+        free(node);
+        node = right;
+    }
+}
+
+/**
+ * own
+ * Makes `node` safe to modify before an edit. A node only this rope refers
+ * to is returned as is; one a snapshot shares is copied, the copy taking
+ * over the caller's reference. Edits own every node on their path from the
+ * root down, so a copied parent hands its children an extra reference and
+ * they get copied in turn.
+ **/
+static rope_node *own (rope_node *node) {
+
+    if (atomic_load_explicit(&node->refs, memory_order_acquire) == 1) {
+        return node;
+    }
+
+    rope_node *copy = alloc_node();
+    memcpy(copy, node, sizeof(rope_node) + node->len);
+    atomic_init(&copy->refs, 1);
+    retain(copy->left);
+    retain(copy->right);
+    release(node);
+    return copy;
+}
+
+void rope_free (rope *r) {
+
+    if (!r) {
+        return;
+    }
+    release(r->root);
+    r->root = NULL;
+}
+
+u64 rope_length (const rope *r) {
+
+    assert(r);
+    return size_of(r->root);
+}
+
+/* Number of lines, a text without newlines is one line */
+u64 rope_line_count (const rope *r) {
+
+    assert(r);
+    return lines_of(r->root) + 1;
+}
+
+u64 rope_chunk_count (const rope *r) {
+
+    assert(r);
+    return chunks_of(r->root);
+}
+
+/**
+ * rope_snapshot
+ * Takes a read-only view of the text as it is now. It shares every chunk
+ * with `r`, which copies whatever it edits from then on, and stays valid
+ * until given to rope_free, from any thread.
+ **/
+rope rope_snapshot (const rope *r) {
+
+    assert(r);
+
+    retain(r->root);
+    return (rope){.root = r->root, .seed = r->seed};
+}
+
+/* Joins two treaps, every byte of `a` comes before those of `b` */
+static rope_node *merge (rope_node *a, rope_node *b) {
+
+    if (!a) {
+        return b;
+    }
+    if (!b) {
+        return a;
+    }
+    if (a->priority >= b->priority) {
+        a = own(a);
+        a->right = merge(a->right, b);
+        update(a);
+        return a;
+    }
+    b = own(b);
+    b->left = merge(a, b->left);
+    update(b);
+    return b;
+}
+
+/* Splits off the first `offset` bytes, cutting a chunk in two if needed */
+static void split (rope *r, rope_node *node, u64 offset, rope_node **left,
+                   rope_node **right) {
+
+    if (!node) {
+        *left = NULL;
+        *right = NULL;
+        return;
+    }
+
+    node = own(node);
+    u64 left_size = size_of(node->left);
+
+    if (offset <= left_size) {
+        split(r, node->left, offset, left, &node->left);
+        update(node);
+        *right = node;
+    } else if (offset >= left_size + node->len) {
+        split(r, node->right, offset - left_size - node->len, &node->right,
+              right);
+        update(node);
+        *left = node;
+    } else {
+        u64 cut = offset - left_size;
+        rope_node *tail = new_node(r, node->text + cut, node->len - cut);
+        rope_node *after = node->right;
+
+        node->len = (u32) cut;
+        node->newlines -= tail->newlines;
+        node->right = NULL;
+        update(node);
+
+        *left = node;
+        *right = merge(tail, after);
+    }
+}
+
+/**
+ * build
+ * Turns `text` into a treap in linear time: chunks are created in order and
+ * hung into a Cartesian tree along its right spine.
+ **/
+static rope_node *build (rope *r, const char *text, u64 len) {
+
+    if (len == 0) {
+        return NULL;
+    }
+
+    u64 count = (len + rope_chunk_fill - 1) / rope_chunk_fill;
+    rope_node **spine = malloc(sizeof(rope_node *) * count);
+    if (!spine) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+    u64 top = 0;
+
+    for (u64 off = 0; off < len; off += rope_chunk_fill) {
+        u64 chunk = len - off < rope_chunk_fill ? len - off : rope_chunk_fill;
+        rope_node *node = new_node(r, text + off, chunk);
+
+        /* Whatever has a lower priority becomes the new node's left child,
+           its subtree is complete at that point */
+        rope_node *last = NULL;
+        while (top > 0 && spine[top - 1]->priority < node->priority) {
+            last = spine[--top];
+            update(last);
+        }
+        node->left = last;
+        if (top > 0) {
+            spine[top - 1]->right = node;
+        }
+        spine[top++] = node;
+    }
+
+    while (top > 1) {
+        update(spine[--top]);
+    }
+    rope_node *root = spine[0];
+    update(root);
+
+    free(spine);
+    return root;
+}
+
+/* Rebuilds the rope once edits left it with far more chunks than needed */
+static void maybe_compact (rope *r) {
+
+    u64 len = rope_length(r);
+    u64 needed = len / rope_chunk_fill + 1;
+    u64 chunks = rope_chunk_count(r);
+
+    if (chunks < 64 || chunks < needed * 4) {
+        return;
+    }
+
+    char *flat = rope_flatten(r);
+    rope_free(r);
+    r->root = build(r, flat, len);
+    free(flat);
+}
+
+/* Replaces the whole text */
+void rope_set (rope *r, const char *text, u64 len) {
+
+    assert(r && (text || len == 0));
+
+    rope_free(r);
+    r->root = build(r, text, len);
+}
+
+/**
+ * insert_in_place
+ * Puts a small insert into the chunk it lands in when that has room left,
+ * which is what typing does. At a chunk boundary the previous chunk is
+ * preferred so appended text stays together. The path is first walked to
+ * see whether the chunk has room, then owned and updated on the way down.
+ *
+ * Returns: false if the chunk is full and the treap has to be split.
+ **/
+static bool insert_in_place (rope *r, u64 offset, const char *text, u64 len) {
+
+    rope_node *target = NULL;
+    u64 local = 0;
+    u64 newlines = 0;
+
+    for (int pass = 0; pass < 2; ++pass) {
+        rope_node **link = &r->root;
+        u64 at = offset;
+
+        while (*link) {
+            rope_node *node = *link;
+
+            if (pass == 1) {
+                node = own(node);
+                *link = node;
+                node->size += len;
+                node->lines += newlines;
+            }
+
+            u64 left_size = size_of(node->left);
+            if (at < left_size || (at == left_size && node->left)) {
+                link = &node->left;
+                continue;
+            }
+            at -= left_size;
+            if (at <= node->len) {
+                target = node;
+                local = at;
+                break;
+            }
+            at -= node->len;
+            link = &node->right;
+        }
+
+        if (!target || target->len + len > target->cap) {
+            assert(pass == 0);
+            return false;
+        }
+        if (pass == 0) {
+            newlines = scan_count_byte(text, len, '\n');
+            target = NULL;
+        }
+    }
+
+    memmove(target->text + local + len, target->text + local,
+            target->len - local);
+    memcpy(target->text + local, text, len);
+    target->len += (u32) len;
+    target->newlines += (u32) newlines;
+    return true;
+}
+
+void rope_insert (rope *r, u64 offset, const char *text, u64 len) {
+
+    assert(r && (text || len == 0));
+    assert(offset <= rope_length(r));
+
+    if (len == 0) {
+        return;
+    }
+    if (len <= rope_chunk_max && insert_in_place(r, offset, text, len)) {
+        return;
+    }
+
+    rope_node *left;
+    rope_node *right;
+    split(r, r->root, offset, &left, &right);
+    r->root = merge(merge(left, build(r, text, len)), right);
+    maybe_compact(r);
+}
+
+void rope_delete (rope *r, u64 offset, u64 len) {
+
+    assert(r);
+    assert(offset + len <= rope_length(r));
+
+    if (len == 0) {
+        return;
+    }
+
+    rope_node *left;
+    rope_node *middle;
+    rope_node *right;
+    split(r, r->root, offset, &left, &right);
+    split(r, right, len, &middle, &right);
+    release(middle);
+    r->root = merge(left, right);
+    maybe_compact(r);
+}
+
+/* Replaces `len` bytes at `offset` with `text`, as one LSP change does */
+void rope_replace (rope *r, u64 offset, u64 len, const char *text,
+                   u64 text_len) {
+
+    rope_delete(r, offset, len);
+    rope_insert(r, offset, text, text_len);
+}
+
+/* Copies `len` bytes starting at `offset` into `out` */
+void rope_copy (const rope *r, u64 offset, u64 len, char *out) {
+
+    assert(r && (out || len == 0));
+    assert(offset + len <= rope_length(r));
+
+    rope_iter it;
+    const char *chunk;
+    u64 chunk_len;
+
+    rope_iter_init(&it, r, offset);
+    while (len > 0 && rope_iter_next(&it, &chunk, &chunk_len)) {
+        u64 n = chunk_len < len ? chunk_len : len;
+        memcpy(out, chunk, n);
+        out += n;
+        len -= n;
+    }
+    rope_iter_free(&it);
+}
+
+/* Returns the whole text as a NUL terminated string to be freed */
+char *rope_flatten (const rope *r) {
+
+    u64 len = rope_length(r);
+    char *flat = malloc(len + 1);
+    if (!flat) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+    rope_copy(r, 0, len, flat);
+    flat[len] = '\0';
+    return flat;
+}
+
+/* Finds the `nth` newline of a chunk, counting from 1 */
+static u64 nth_newline (const rope_node *node, u64 nth) {
+
+    const char *at = node->text;
+    const char *end = node->text + node->len;
+
+    for (;;) {
+        const char *newline = scan_find_byte(at, end - at, '\n');
+        assert(newline);
+        if (--nth == 0) {
+            return newline - node->text;
+        }
+        at = newline + 1;
+    }
+}
+
+/**
+ * rope_line_start
+ * Descends by the newline counts to the byte that starts `line`.
+ *
+ * Returns: Its offset, the length of the text if there is no such line.
+ **/
+u64 rope_line_start (const rope *r, u64 line) {
+
+    assert(r);
+
+    if (line == 0) {
+        return 0;
+    }
+    if (line > lines_of(r->root)) {
+        return rope_length(r);
+    }
+
+    const rope_node *node = r->root;
+    u64 offset = 0;
+
+    while (node) {
+        u64 left_lines = lines_of(node->left);
+
+        if (line <= left_lines) {
+            node = node->left;
+            continue;
+        }
+        line -= left_lines;
+        offset += size_of(node->left);
+
+        if (line <= node->newlines) {
+            return offset + nth_newline(node, line) + 1;
+        }
+        line -= node->newlines;
+        offset += node->len;
+        node = node->right;
+    }
+
+    COMPLAIN_UNREACHABLE("Newline counts do not add up.");
+    return rope_length(r);
+}
+
+static char byte_at (const rope *r, u64 offset) {
+
+    const rope_node *node = r->root;
+
+    while (node) {
+        u64 left_size = size_of(node->left);
+
+        if (offset < left_size) {
+            node = node->left;
+        } else if (offset < left_size + node->len) {
+            return node->text[offset - left_size];
+        } else {
+            offset -= left_size + node->len;
+            node = node->right;
+        }
+    }
+    COMPLAIN_UNREACHABLE("Offset past the end of the rope.");
+    return '\0';
+}
+
+/**
+ * rope_offset_of
+ * Converts an LSP position into a byte offset. The line is found through
+ * the newline counts. In UTF-8 `character` is a byte count and needs no
+ * further work, in UTF-16 and UTF-32 the code units of that one line are
+ * counted, skipping ASCII runs a vector at a time. Positions past the end
+ * of a line are clamped to it, lines past the end of the text to its
+ * length.
+ **/
+u64 rope_offset_of (const rope *r, u64 line, u64 character,
+                    rope_encoding encoding) {
+
+    assert(r);
+
+    if (line > lines_of(r->root)) {
+        return rope_length(r);
+    }
+
+    u64 offset = rope_line_start(r, line);
+
+    if (encoding == ROPE_UTF8) {
+        u64 end = rope_length(r);
+        if (line < lines_of(r->root)) {
+            end = rope_line_start(r, line + 1) - 1;
+            if (end > offset && byte_at(r, end - 1) == '\r') {
+                end--;
+            }
+        }
+        return character < end - offset ? offset + character : end;
+    }
+
+    bool surrogates = encoding == ROPE_UTF16;
+    u64 units = 0;
+    char last = '\0';
+    rope_iter it;
+    const char *chunk;
+    u64 len;
+
+    rope_iter_init(&it, r, offset);
+    while (rope_iter_next(&it, &chunk, &len)) {
+        const char *newline = scan_find_byte(chunk, len, '\n');
+        u64 line_len = newline ? (u64) (newline - chunk) : len;
+        u64 i = 0;
+
+        while (i < line_len && units < character) {
+            u64 ascii = scan_ascii_prefix(chunk + i, line_len - i);
+            if (ascii > character - units) {
+                ascii = character - units;
+            }
+            units += ascii;
+            i += ascii;
+            if (i == line_len || units >= character) {
+                break;
+            }
+
+            u8 c = (u8) chunk[i];
+            units += ((c & 0xC0) != 0x80) + (surrogates && c >= 0xF0);
+            i++;
+        }
+
+        /* Continuation bytes belong to the code point before them, which
+           may have started in the previous chunk */
+        while (i < line_len && ((u8) chunk[i] & 0xC0) == 0x80) {
+            i++;
+        }
+        if (i < line_len) {
+            offset += i;
+            break;
+        }
+        offset += line_len;
+        if (newline) {
+            /* Clamped to the line end, which `\r\n` starts early */
+            last = line_len ? chunk[line_len - 1] : last;
+            if (last == '\r') {
+                offset--;
+            }
+            break;
+        }
+        last = len ? chunk[len - 1] : last;
+    }
+
+    rope_iter_free(&it);
+    return offset;
+}
+
+/**
+ * rope_position_of
+ * Converts a byte offset back into an LSP position. The newlines before
+ * the offset are summed up on the way down to its chunk, the code units are
+ * then counted from the start of its line unless they are bytes anyway.
+ **/
+void rope_position_of (const rope *r, u64 offset, rope_encoding encoding,
+                       u64 *line, u64 *character) {
+
+    assert(r && line && character);
+    assert(offset <= rope_length(r));
+
+    const rope_node *node = r->root;
+    u64 at = offset;
+    u64 lines = 0;
+
+    while (node) {
+        u64 left_size = size_of(node->left);
+
+        if (at < left_size) {
+            node = node->left;
+            continue;
+        }
+        lines += lines_of(node->left);
+        at -= left_size;
+
+        if (at <= node->len) {
+            lines += scan_count_byte(node->text, at, '\n');
+            break;
+        }
+        lines += node->newlines;
+        at -= node->len;
+        node = node->right;
+    }
+
+    u64 start = rope_line_start(r, lines);
+    *line = lines;
+
+    if (encoding == ROPE_UTF8) {
+        *character = offset - start;
+        return;
+    }
+
+    u64 units = 0;
+    u64 remaining = offset - start;
+    rope_iter it;
+    const char *chunk;
+    u64 len;
+
+    rope_iter_init(&it, r, start);
+    while (remaining > 0 && rope_iter_next(&it, &chunk, &len)) {
+        u64 n = len < remaining ? len : remaining;
+        units += encoding == ROPE_UTF16 ? scan_utf16_count(chunk, n)
+                                        : scan_utf32_count(chunk, n);
+        remaining -= n;
+    }
+    rope_iter_free(&it);
+
+    *character = units;
+}
+
+static void iter_push (rope_iter *it, rope_node *node) {
+
+    if (it->depth == it->cap) {
+        u32 cap = it->cap * 2;
+        rope_node **stack = malloc(sizeof(rope_node *) * cap);
+        if (!stack) {
+            log_err(COMPLAIN_Err_OutOfMem);
+            exit(-1);
+        }
+        memcpy(stack, it->stack, sizeof(rope_node *) * it->depth);
+        if (it->stack != it->inline_stack) {
+            free(it->stack);
+        }
+        it->stack = stack;
+        it->cap = cap;
+    }
+    it->stack[it->depth++] = node;
+}
+
+/* Positions `it` so the first chunk returned starts at byte `offset` */
+void rope_iter_init (rope_iter *it, const rope *r, u64 offset) {
+
+    assert(it && r);
+
+    it->stack = it->inline_stack;
+    it->cap = ARRAY_LENGTH(it->inline_stack);
+    it->depth = 0;
+    it->skip = 0;
+
+    rope_node *node = r->root;
+    while (node) {
+        u64 left_size = size_of(node->left);
+
+        if (offset < left_size) {
+            iter_push(it, node);
+            node = node->left;
+        } else if (offset < left_size + node->len) {
+            iter_push(it, node);
+            it->skip = offset - left_size;
+            break;
+        } else {
+            offset -= left_size + node->len;
+            node = node->right;
+        }
+    }
+}
+
+/**
+ * rope_iter_next
+ * Hands out the next chunk. The pointer stays valid until the rope is
+ * edited.
+ *
+ * Returns: false once the text is exhausted.
+ **/
+bool rope_iter_next (rope_iter *it, const char **chunk, u64 *len) {
+
+    assert(it && chunk && len);
+
+    if (it->depth == 0) {
+        return false;
+    }
+
+    rope_node *node = it->stack[--it->depth];
+    *chunk = node->text + it->skip;
+    *len = node->len - it->skip;
+    it->skip = 0;
+
+    for (rope_node *next = node->right; next; next = next->left) {
+        iter_push(it, next);
+    }
+    return true;
+}
+
+void rope_iter_free (rope_iter *it) {
+
+    if (it && it->stack != it->inline_stack) {
+        free(it->stack);
+    }
+    if (it) {
+        it->stack = it->inline_stack;
+        it->depth = 0;
+    }
+}
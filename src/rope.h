@@ -0,0 +1,82 @@
+#ifndef ROPE_H_
+#define ROPE_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "common.h"
+
+/* One chunk of text, with the byte, newline and chunk counts of the subtree
+   below it. Nodes are shared between a rope and its snapshots, so they are
+   reference counted and only modified by the one holding the sole
+   reference. */
+typedef struct rope_node {
+    struct rope_node *left;
+    struct rope_node *right;
+    u64 size;
+    u64 lines;
+    u64 chunks;
+    _Atomic u32 refs;
+    u32 priority;
+    u32 len;
+    u32 cap;
+    u32 newlines;
+    char text[];
+} rope_node;
+
+/**
+ * Document text as an implicit treap of chunks ordered by position. Edits
+ * split the treap at the edit and merge it back together, so their cost
+ * depends on the size of the edit and the depth of the treap, not on the
+ * size of the document. Newline counts are kept alongside the byte counts,
+ * so the treap doubles as the line index and LSP positions convert to byte
+ * offsets in O(log n). Edits copy the nodes they touch when they are
+ * shared, which makes snapshots a matter of taking a reference to the root.
+ * A zeroed rope is an empty text.
+ **/
+typedef struct rope {
+    rope_node *root;
+    /* Priority generator state */
+    u64 seed;
+} rope;
+
+/* Units LSP positions count characters in, negotiated at initialisation */
+typedef enum rope_encoding {
+    ROPE_UTF16 = 0,
+    ROPE_UTF8,
+    ROPE_UTF32,
+} rope_encoding;
+
+/* Walks the chunks of a rope in order */
+typedef struct rope_iter {
+    rope_node **stack;
+    u32 depth;
+    u32 cap;
+    /* Skipped bytes of the first chunk when starting mid chunk */
+    u64 skip;
+    rope_node *inline_stack[48];
+} rope_iter;
+
+void rope_free(rope *r);
+u64 rope_length(const rope *r);
+u64 rope_line_count(const rope *r);
+u64 rope_chunk_count(const rope *r);
+rope rope_snapshot(const rope *r);
+void rope_set(rope *r, const char *text, u64 len);
+void rope_insert(rope *r, u64 offset, const char *text, u64 len);
+void rope_delete(rope *r, u64 offset, u64 len);
+void rope_replace(rope *r, u64 offset, u64 len, const char *text,
+                  u64 text_len);
+void rope_copy(const rope *r, u64 offset, u64 len, char *out);
+char *rope_flatten(const rope *r);
+u64 rope_line_start(const rope *r, u64 line);
+u64 rope_offset_of(const rope *r, u64 line, u64 character,
+                   rope_encoding encoding);
+void rope_position_of(const rope *r, u64 offset, rope_encoding encoding,
+                      u64 *line, u64 *character);
+
+void rope_iter_init(rope_iter *it, const rope *r, u64 offset);
+bool rope_iter_next(rope_iter *it, const char **chunk, u64 *len);
+void rope_iter_free(rope_iter *it);
+
+#endif  // ROPE_H_
@@ -0,0 +1,534 @@
+#include "scan.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define SCAN_HAVE_X86 1
+    #include <immintrin.h>
+#endif
+
+/* Searching for something like this: 'Content-Length: 12345' */
+#define content_len_prefix "content-length:"
+#define content_len_prefix_len 15
+
+static _Atomic int active_impl = SCAN_IMPL_AUTO;
+
+static scan_impl detect_impl (void) {
+#ifdef SCAN_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return SCAN_IMPL_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return SCAN_IMPL_SSE2;
+    }
+#endif
+    return SCAN_IMPL_SCALAR;
+}
+
+/**
+ * scan_use_impl
+ * Selects which scanning implementation is used. Requests for an
+ * implementation the CPU does not support fall back to the best one it does.
+ *
+ * Arguments: `scan_impl impl`, wanted implementation, `SCAN_IMPL_AUTO` for
+ *            the best available one.
+ * Returns: The implementation now in use.
+ **/
+scan_impl scan_use_impl (scan_impl impl) {
+
+    scan_impl best = detect_impl();
+
+    if (impl == SCAN_IMPL_AUTO || impl > best) {
+        impl = best;
+    }
+    atomic_store_explicit(&active_impl, impl, memory_order_relaxed);
+    return impl;
+}
+
+scan_impl scan_active_impl (void) {
+
+    scan_impl impl = atomic_load_explicit(&active_impl, memory_order_relaxed);
+
+    if (impl == SCAN_IMPL_AUTO) {
+        impl = scan_use_impl(SCAN_IMPL_AUTO);
+    }
+    return impl;
+}
+
+const char *scan_impl_name (scan_impl impl) {
+    switch (impl) {
+        case SCAN_IMPL_SCALAR:
+            return "scalar";
+        case SCAN_IMPL_SSE2:
+            return "sse2";
+        case SCAN_IMPL_AVX2:
+            return "avx2";
+        case SCAN_IMPL_AUTO:
+        default:
+            return "auto";
+    }
+}
+
+/* Scalar implementations, also used for the tails of the vector loops */
+
+static const char *find_byte_scalar (const char *buf, u64 len, char byte) {
+
+    for (u64 i = 0; i < len; ++i) {
+        if (buf[i] == byte) {
+            return buf + i;
+        }
+    }
+    return NULL;
+}
+
+static u64 count_byte_scalar (const char *buf, u64 len, char byte) {
+
+    u64 count = 0;
+    for (u64 i = 0; i < len; ++i) {
+        count += buf[i] == byte;
+    }
+    return count;
+}
+
+static u64 ascii_prefix_scalar (const char *buf, u64 len) {
+
+    u64 i = 0;
+    while (i < len && (u8) buf[i] < 0x80) {
+        ++i;
+    }
+    return i;
+}
+
+/* Every byte but a continuation byte starts a code point, in UTF-16 the 4
+   byte ones need a surrogate pair */
+static u64 utf_count_scalar (const char *buf, u64 len, bool surrogates) {
+
+    u64 units = 0;
+    for (u64 i = 0; i < len; ++i) {
+        u8 c = (u8) buf[i];
+        units += ((c & 0xC0) != 0x80) + (surrogates && c >= 0xF0);
+    }
+    return units;
+}
+
+static i64 find_header_break_scalar (const char *buf, u64 len) {
+
+    for (u64 i = 0; i + 4 <= len; ++i) {
+        if (buf[i] == '\r' && buf[i + 1] == '\n' && buf[i + 2] == '\r' &&
+            buf[i + 3] == '\n') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool match_content_len_scalar (const char *line) {
+
+    for (int i = 0; i < content_len_prefix_len; ++i) {
+        char want = content_len_prefix[i];
+        char got = line[i];
+
+        /* Only fold the case of letters, '-' and ':' must match exactly */
+        if (want >= 'a' && want <= 'z') {
+            got |= 0x20;
+        }
+        if (got != want) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef SCAN_HAVE_X86
+
+__attribute__((target("sse2"))) static const char *find_byte_sse2 (
+    const char *buf, u64 len, char byte) {
+
+    const __m128i needle = _mm_set1_epi8(byte);
+    u64 i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (buf + i));
+        u32 mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return buf + i + __builtin_ctz(mask);
+        }
+    }
+    return find_byte_scalar(buf + i, len - i, byte);
+}
+
+__attribute__((target("avx2"))) static const char *find_byte_avx2 (
+    const char *buf, u64 len, char byte) {
+
+    const __m256i needle = _mm256_set1_epi8(byte);
+    u64 i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (buf + i));
+        u32 mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return buf + i + __builtin_ctz(mask);
+        }
+    }
+    return find_byte_scalar(buf + i, len - i, byte);
+}
+
+__attribute__((target("sse2"))) static u64 count_byte_sse2 (const char *buf,
+                                                           u64 len,
+                                                           char byte) {
+
+    const __m128i needle = _mm_set1_epi8(byte);
+    u64 count = 0;
+    u64 i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (buf + i));
+        count += __builtin_popcount(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)));
+    }
+    return count + count_byte_scalar(buf + i, len - i, byte);
+}
+
+__attribute__((target("avx2"))) static u64 count_byte_avx2 (
+    const char *buf, u64 len, char byte) {
+
+    const __m256i needle = _mm256_set1_epi8(byte);
+    u64 count = 0;
+    u64 i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (buf + i));
+        count += __builtin_popcount(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle)));
+    }
+    return count + count_byte_scalar(buf + i, len - i, byte);
+}
+
+/* The high bit of every byte is set outside of ASCII */
+__attribute__((target("sse2"))) static u64 ascii_prefix_sse2 (const char *buf,
+                                                             u64 len) {
+
+    u64 i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        u32 mask = _mm_movemask_epi8(
+            _mm_loadu_si128((const __m128i *) (buf + i)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + ascii_prefix_scalar(buf + i, len - i);
+}
+
+/* Pure ASCII blocks count 16 units straight away, others subtract the
+   continuation bytes and add one for every 4 byte lead */
+__attribute__((target("sse2"))) static u64 utf_count_sse2 (const char *buf,
+                                                          u64 len,
+                                                          bool surrogates) {
+
+    /* As signed bytes continuations are below -64, 4 byte leads negative
+       but above -17 */
+    const __m128i cont_max = _mm_set1_epi8(-64);
+    const __m128i lead4_min = _mm_set1_epi8(-17);
+    u64 units = 0;
+    u64 i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (buf + i));
+        u32 high = _mm_movemask_epi8(chunk);
+        if (!high) {
+            units += 16;
+            continue;
+        }
+        u32 cont = _mm_movemask_epi8(_mm_cmplt_epi8(chunk, cont_max));
+        units += 16 - __builtin_popcount(cont);
+        if (surrogates) {
+            u32 lead4 =
+                _mm_movemask_epi8(_mm_cmpgt_epi8(chunk, lead4_min)) & high;
+            units += __builtin_popcount(lead4);
+        }
+    }
+    return units + utf_count_scalar(buf + i, len - i, surrogates);
+}
+
+/* Matches `\r\n\r\n` by comparing four shifted loads at once */
+__attribute__((target("sse2"))) static i64 find_header_break_sse2 (
+    const char *buf, u64 len) {
+
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    u64 i = 0;
+
+    for (; i + 3 + 16 <= len; i += 16) {
+        const char *at = buf + i;
+        __m128i m0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) at), cr);
+        __m128i m1 =
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (at + 1)), lf);
+        __m128i m2 =
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (at + 2)), cr);
+        __m128i m3 =
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (at + 3)), lf);
+        __m128i all = _mm_and_si128(_mm_and_si128(m0, m1), _mm_and_si128(m2, m3));
+        u32 mask = _mm_movemask_epi8(all);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    i64 rest = find_header_break_scalar(buf + i, len - i);
+    return rest < 0 ? -1 : (i64) i + rest;
+}
+
+__attribute__((target("avx2"))) static i64 find_header_break_avx2 (
+    const char *buf, u64 len) {
+
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    u64 i = 0;
+
+    for (; i + 3 + 32 <= len; i += 32) {
+        const char *at = buf + i;
+        __m256i m0 =
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) at), cr);
+        __m256i m1 = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *) (at + 1)), lf);
+        __m256i m2 = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *) (at + 2)), cr);
+        __m256i m3 = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *) (at + 3)), lf);
+        __m256i all = _mm256_and_si256(_mm256_and_si256(m0, m1),
+                                       _mm256_and_si256(m2, m3));
+        u32 mask = _mm256_movemask_epi8(all);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    i64 rest = find_header_break_scalar(buf + i, len - i);
+    return rest < 0 ? -1 : (i64) i + rest;
+}
+
+/* Case folds letters only, then compares the 15 prefix bytes in one go */
+__attribute__((target("sse2"))) static bool match_content_len_sse2 (
+    const char *line) {
+
+    const __m128i fold = _mm_setr_epi8(0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+                                       0x20, 0, 0x20, 0x20, 0x20, 0x20, 0x20,
+                                       0x20, 0, 0);
+    const __m128i want = _mm_loadu_si128((const __m128i *) content_len_prefix);
+
+    __m128i chunk = _mm_loadu_si128((const __m128i *) line);
+    __m128i eq = _mm_cmpeq_epi8(_mm_or_si128(chunk, fold), want);
+
+    return (_mm_movemask_epi8(eq) & 0x7FFF) == 0x7FFF;
+}
+
+#endif  // SCAN_HAVE_X86
+
+/**
+ * scan_find_byte
+ * Finds the first occurrence of `byte` within `buf`.
+ *
+ * Returns: Pointer to the byte, NULL if it is not found.
+ **/
+const char *scan_find_byte (const char *buf, u64 len, char byte) {
+
+    assert(buf || len == 0);
+
+    switch (scan_active_impl()) {
+#ifdef SCAN_HAVE_X86
+        case SCAN_IMPL_AVX2:
+            return find_byte_avx2(buf, len, byte);
+        case SCAN_IMPL_SSE2:
+            return find_byte_sse2(buf, len, byte);
+#endif
+        default:
+            return find_byte_scalar(buf, len, byte);
+    }
+}
+
+/* Counts the occurrences of `byte` within `buf` */
+u64 scan_count_byte (const char *buf, u64 len, char byte) {
+
+    assert(buf || len == 0);
+
+    switch (scan_active_impl()) {
+#ifdef SCAN_HAVE_X86
+        case SCAN_IMPL_AVX2:
+            return count_byte_avx2(buf, len, byte);
+        case SCAN_IMPL_SSE2:
+            return count_byte_sse2(buf, len, byte);
+#endif
+        default:
+            return count_byte_scalar(buf, len, byte);
+    }
+}
+
+/* Returns the number of leading ASCII bytes of `buf` */
+u64 scan_ascii_prefix (const char *buf, u64 len) {
+
+    assert(buf || len == 0);
+
+#ifdef SCAN_HAVE_X86
+    if (scan_active_impl() != SCAN_IMPL_SCALAR) {
+        return ascii_prefix_sse2(buf, len);
+    }
+#endif
+    return ascii_prefix_scalar(buf, len);
+}
+
+/**
+ * scan_utf16_count
+ * Counts the UTF-16 code units LSP positions would use for the UTF-8 text
+ * in `buf`. Continuation bytes count for nothing, so `buf` may start or end
+ * inside a code point.
+ **/
+u64 scan_utf16_count (const char *buf, u64 len) {
+
+    assert(buf || len == 0);
+
+#ifdef SCAN_HAVE_X86
+    if (scan_active_impl() != SCAN_IMPL_SCALAR) {
+        return utf_count_sse2(buf, len, true);
+    }
+#endif
+    return utf_count_scalar(buf, len, true);
+}
+
+/* Counts the code points of the UTF-8 text in `buf`, like scan_utf16_count */
+u64 scan_utf32_count (const char *buf, u64 len) {
+
+    assert(buf || len == 0);
+
+#ifdef SCAN_HAVE_X86
+    if (scan_active_impl() != SCAN_IMPL_SCALAR) {
+        return utf_count_sse2(buf, len, false);
+    }
+#endif
+    return utf_count_scalar(buf, len, false);
+}
+
+/**
+ * scan_find_header_break
+ * Searches for `\r\n\r\n` within `buf`.
+ *
+ * Returns: Offset of the header break, or -1 if it is not found.
+ **/
+i64 scan_find_header_break (const char *buf, u64 len) {
+
+    assert(buf || len == 0);
+
+    switch (scan_active_impl()) {
+#ifdef SCAN_HAVE_X86
+        case SCAN_IMPL_AVX2:
+            return find_header_break_avx2(buf, len);
+        case SCAN_IMPL_SSE2:
+            return find_header_break_sse2(buf, len);
+#endif
+        default:
+            return find_header_break_scalar(buf, len);
+    }
+}
+
+/* Parses the digits after the `Content-Length:` prefix, 0 when invalid or
+   above SCAN_MAX_CONTENT_LEN */
+static u64 parse_content_len_value (const char *text, const char *end) {
+
+    u64 value = 0;
+    const char *digits;
+
+    while (text < end && (*text == ' ' || *text == '\t')) {
+        ++text;
+    }
+    digits = text;
+
+    while (text < end && *text >= '0' && *text <= '9') {
+        value = (value * 10) + (*text - '0');
+        if (value > SCAN_MAX_CONTENT_LEN) {
+            return 0;
+        }
+        ++text;
+    }
+    if (text == digits) {
+        return 0;
+    }
+
+    while (text < end && (*text == ' ' || *text == '\t')) {
+        ++text;
+    }
+
+    /* Anything but the end of the line makes the header malformed */
+    if (text < end && *text != '\r') {
+        return 0;
+    }
+    return value;
+}
+
+/**
+ * scan_headers
+ * Finds the end of a buffered header block with scan_find_header_break,
+ * then walks its lines parsing `Content-Length` (case insensitively). Other
+ * headers are skipped.
+ *
+ * Arguments: `const char *buf`, buffered bytes starting at a header line.
+ *            `u64 len`, number of buffered bytes.
+ *            `u64 *content_len`, set to the Content-Length, 0 if missing or
+ *            invalid.
+ * Returns: Offset of the message body, or -1 if the header block is not
+ *          complete within `len` bytes.
+ **/
+i64 scan_headers (const char *buf, u64 len, u64 *content_len) {
+
+    assert(content_len);
+    assert(buf || len == 0);
+
+    *content_len = 0;
+
+    /* A block without any headers is only its empty line */
+    if (len >= 2 && buf[0] == '\r' && buf[1] == '\n') {
+        return 2;
+    }
+
+    i64 header_break = scan_find_header_break(buf, len);
+    if (header_break < 0) {
+        return -1;
+    }
+
+    /* The header lines, up to and including the last one's line feed */
+    u64 block_end = (u64) header_break + 2;
+    scan_impl impl = scan_active_impl();
+    u64 pos = 0;
+
+    while (pos < block_end) {
+
+        const char *line_end = scan_find_byte(buf + pos, block_end - pos, '\n');
+        u64 line_len = line_end - (buf + pos);
+
+        if (line_len > content_len_prefix_len) {
+            bool matched;
+#ifdef SCAN_HAVE_X86
+            if (impl != SCAN_IMPL_SCALAR && pos + 16 <= len) {
+                matched = match_content_len_sse2(buf + pos);
+            } else {
+                matched = match_content_len_scalar(buf + pos);
+            }
+#else
+            (void) impl;
+            matched = match_content_len_scalar(buf + pos);
+#endif
+            if (matched) {
+                *content_len = parse_content_len_value(
+                    buf + pos + content_len_prefix_len, line_end);
+            }
+        }
+
+        pos += line_len + 1;
+    }
+
+    return header_break + 4;
+}
@@ -0,0 +1,29 @@
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include "common.h"
+
+/* Largest Content-Length accepted, anything bigger is a malformed header */
+#define SCAN_MAX_CONTENT_LEN (256ull << 20)
+
+/* Byte scanning implementations, picked at runtime from the CPU features */
+typedef enum scan_impl {
+    SCAN_IMPL_AUTO = 0,
+    SCAN_IMPL_SCALAR,
+    SCAN_IMPL_SSE2,
+    SCAN_IMPL_AVX2,
+} scan_impl;
+
+scan_impl scan_use_impl(scan_impl impl);
+scan_impl scan_active_impl(void);
+const char *scan_impl_name(scan_impl impl);
+
+const char *scan_find_byte(const char *buf, u64 len, char byte);
+u64 scan_count_byte(const char *buf, u64 len, char byte);
+u64 scan_ascii_prefix(const char *buf, u64 len);
+u64 scan_utf16_count(const char *buf, u64 len);
+u64 scan_utf32_count(const char *buf, u64 len);
+i64 scan_find_header_break(const char *buf, u64 len);
+i64 scan_headers(const char *buf, u64 len, u64 *content_len);
+
+#endif  // SCAN_H_
@@ -0,0 +1,551 @@
+#include "tokenize.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "logging.h"
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define TOKENIZE_HAVE_X86 1
+    #include <immintrin.h>
+#endif
+
+/* Bytes classified at once, one bit each in a u64 */
+#define block_size 64
+
+#ifdef NDEBUG
+    #define word_spans_initial_cap 1024
+#else
+    #define word_spans_initial_cap 4
+#endif
+
+typedef enum char_class {
+    CHAR_SEPARATOR,
+    CHAR_LETTER,
+    CHAR_DIGIT,
+    /* Apostrophes and hyphens, part of a word only between letters */
+    CHAR_JOINER,
+} char_class;
+
+void word_spans_free (word_spans *words) {
+
+    if (!words) {
+        return;
+    }
+    free(words->spans);
+    words->spans = NULL;
+    words->count = 0;
+    words->cap = 0;
+}
+
+/* Makes room for `extra` more words */
+static void reserve_words (word_spans *words, u64 extra) {
+
+    if (words->count + extra <= words->cap) {
+        return;
+    }
+    u64 cap = words->cap ? words->cap * 2 : word_spans_initial_cap;
+    while (cap < words->count + extra) {
+        cap *= 2;
+    }
+    word_span *spans = realloc(words->spans, cap * sizeof(word_span));
+    if (!spans) {
+        log_err(COMPLAIN_Err_OutOfMem);
+        exit(-1);
+    }
+    words->spans = spans;
+    words->cap = cap;
+}
+
+static inline void push_word (word_spans *words, u64 offset, u64 len) {
+
+    if (words->count == words->cap) {
+        reserve_words(words, 1);
+    }
+    words->spans[words->count++] = (word_span) {offset, len};
+}
+
+/**
+ * classify_utf8
+ * Classes a non-ASCII character. Anything that is not punctuation or a
+ * space is taken to be a letter, which is right for the scripts prose is
+ * written in without a table of every letter.
+ *
+ * Arguments: `u64 *width`, set to the length of the character in bytes,
+ *            1 for a byte which does not start valid UTF-8.
+ **/
+static char_class classify_utf8 (const u8 *text, u64 len, u64 *width) {
+
+    u32 cp;
+    u64 need;
+    if ((text[0] & 0xe0) == 0xc0) {
+        cp = text[0] & 0x1f;
+        need = 2;
+    } else if ((text[0] & 0xf0) == 0xe0) {
+        cp = text[0] & 0x0f;
+        need = 3;
+    } else if ((text[0] & 0xf8) == 0xf0) {
+        cp = text[0] & 0x07;
+        need = 4;
+    } else {
+        *width = 1;
+        return CHAR_SEPARATOR;
+    }
+    if (need > len) {
+        *width = 1;
+        return CHAR_SEPARATOR;
+    }
+    for (u64 i = 1; i < need; ++i) {
+        if ((text[i] & 0xc0) != 0x80) {
+            *width = 1;
+            return CHAR_SEPARATOR;
+        }
+        cp = (cp << 6) | (text[i] & 0x3f);
+    }
+    *width = need;
+
+    /* Right single quotation mark, the typographic apostrophe */
+    if (cp == 0x2019) {
+        return CHAR_JOINER;
+    }
+    /* Latin-1 punctuation, general punctuation and spaces, CJK symbols */
+    if ((cp >= 0x80 && cp <= 0xbf) || cp == 0xd7 || cp == 0xf7 ||
+        (cp >= 0x2000 && cp <= 0x206f) || (cp >= 0x3000 && cp <= 0x303f) ||
+        cp == 0xfeff) {
+        return CHAR_SEPARATOR;
+    }
+    return CHAR_LETTER;
+}
+
+static inline char_class classify (const u8 *text, u64 len, u64 *width) {
+
+    u8 c = text[0];
+    if (c >= 0x80) {
+        return classify_utf8(text, len, width);
+    }
+    *width = 1;
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+        return CHAR_LETTER;
+    }
+    if (c >= '0' && c <= '9') {
+        return CHAR_DIGIT;
+    }
+    if (c == '\'' || c == '-') {
+        return CHAR_JOINER;
+    }
+    return CHAR_SEPARATOR;
+}
+
+/* The byte at a time reference, also the fallback without vectors */
+static u64 tokenize_scalar (const u8 *bytes, u64 len, word_spans *words) {
+
+    u64 i = 0;
+    while (i < len) {
+
+        u64 width;
+        char_class cls = classify(bytes + i, len - i, &width);
+        if (cls != CHAR_LETTER && cls != CHAR_DIGIT) {
+            i += width;
+            continue;
+        }
+
+        u64 start = i;
+        u64 end = i;
+        bool digits = false;
+
+        while (i < len) {
+            cls = classify(bytes + i, len - i, &width);
+            if (cls == CHAR_LETTER || cls == CHAR_DIGIT) {
+                digits |= cls == CHAR_DIGIT;
+                i += width;
+                end = i;
+                continue;
+            }
+            if (cls == CHAR_JOINER && i + width < len) {
+                u64 next_width;
+                char_class next = classify(bytes + i + width,
+                                           len - i - width, &next_width);
+                if (next == CHAR_LETTER || next == CHAR_DIGIT) {
+                    i += width;
+                    continue;
+                }
+            }
+            break;
+        }
+
+        if (!digits) {
+            push_word(words, start, end - start);
+        }
+        /* A trailing joiner is skipped as a separator */
+        i = end;
+    }
+
+    return words->count;
+}
+
+/* One bit per byte of a block, bit 0 the first byte */
+typedef struct block_masks {
+    /* Letters and digits */
+    u64 word;
+    u64 digit;
+    /* Apostrophes and hyphens */
+    u64 joiner;
+    /* Bytes outside ASCII, classified by the scalar path */
+    u64 high;
+    /* First bytes of typographic apostrophes, which are three bytes long */
+    u64 wide_joiner;
+} block_masks;
+
+/* The word being read when a block or a character ends */
+typedef struct token_state {
+    bool in_word;
+    bool digits;
+    u64 start;
+    /* Just past its last letter, a joiner may have been taken after it */
+    u64 end;
+} token_state;
+
+static inline void finish_word (token_state *state, word_spans *words) {
+
+    if (state->in_word && !state->digits) {
+        push_word(words, state->start, state->end - state->start);
+    }
+    state->in_word = false;
+}
+
+static inline bool word_char_at (const u8 *bytes, u64 len, u64 i) {
+
+    if (i >= len) {
+        return false;
+    }
+    u64 width;
+    char_class cls = classify(bytes + i, len - i, &width);
+    return cls == CHAR_LETTER || cls == CHAR_DIGIT;
+}
+
+/**
+ * classify_high
+ * Classifies the characters outside ASCII of a block one at a time,
+ * adding them to its masks. Only a block with such characters pays.
+ *
+ * Returns: How many bytes of the block are classified, short of a block
+ *          when its last character runs into the next.
+ **/
+static u64 classify_high (const u8 *bytes, u64 len, u64 base,
+                          block_masks *masks) {
+
+    u64 high = masks->high;
+    while (high) {
+        u64 at = (u64) __builtin_ctzll(high);
+        u64 width;
+        char_class cls = classify_utf8(bytes + base + at, len - base - at,
+                                       &width);
+        if (at + width > block_size) {
+            return at;
+        }
+
+        u64 bits = ((1ull << width) - 1) << at;
+        if (cls == CHAR_LETTER) {
+            masks->word |= bits;
+        } else if (cls == CHAR_JOINER) {
+            masks->wide_joiner |= 1ull << at;
+        }
+        high &= ~bits;
+    }
+    return block_size;
+}
+
+/* Reads one character the way tokenize_scalar does, returns the next */
+static u64 scalar_step (const u8 *bytes, u64 len, u64 i, token_state *state,
+                        word_spans *words) {
+
+    u64 width;
+    char_class cls = classify(bytes + i, len - i, &width);
+
+    if (cls == CHAR_LETTER || cls == CHAR_DIGIT) {
+        if (!state->in_word) {
+            *state = (token_state) {.in_word = true, .start = i};
+        }
+        state->digits |= cls == CHAR_DIGIT;
+        state->end = i + width;
+        return i + width;
+    }
+    if (cls == CHAR_JOINER && state->in_word && state->end == i &&
+        word_char_at(bytes, len, i + width)) {
+        return i + width;
+    }
+    finish_word(state, words);
+    return i + width;
+}
+
+/* Moves the end of the word still open at the end of a block past its
+   last letter in the block, if it has one there */
+static inline void extend_open_word (u64 letters, u64 base,
+                                     token_state *state) {
+
+    if (letters) {
+        state->end = base + block_size - (u64) __builtin_clzll(letters);
+    }
+}
+
+/**
+ * runs_with_digits
+ * Reads the runs of a block one at a time, tracking whether each has a
+ * digit in it. Only used for blocks with digits, which prose has few of.
+ **/
+static void runs_with_digits (u64 run, u64 word, u64 digit, u64 base,
+                              u64 n, token_state *state, word_spans *words) {
+
+    u64 bit = 0;
+    while (true) {
+        if (!state->in_word) {
+            u64 ahead = bit < block_size ? run & (~0ull << bit) : 0;
+            if (!ahead) {
+                return;
+            }
+            bit = (u64) __builtin_ctzll(ahead);
+            *state = (token_state) {.in_word = true, .start = base + bit};
+        }
+
+        u64 from = run >> bit;
+        u64 length =
+            ~from == 0 ? block_size - bit : (u64) __builtin_ctzll(~from);
+        u64 span =
+            (length == block_size ? ~0ull : (1ull << length) - 1) << bit;
+
+        state->digits |= (digit & span) != 0;
+        extend_open_word(word & span, base, state);
+
+        /* Reaching the end of the block, the word may go on in the next */
+        if (bit + length >= n) {
+            return;
+        }
+        finish_word(state, words);
+        bit += length;
+    }
+}
+
+/**
+ * runs_paired
+ * Reads the runs of a block without digits. Every run but one still open
+ * at either end of the block starts at a bit of `starts` and ends at the
+ * matching bit of `ends`, so they are paired off without a branch per
+ * word, which is what makes the masks pay for short words.
+ **/
+static void runs_paired (u64 run, u64 word, u64 base, u64 n,
+                         token_state *state, word_spans *words) {
+
+    u64 valid = n == block_size ? ~0ull : (1ull << n) - 1;
+    u64 starts = run & ~((run << 1) | state->in_word);
+    /* A run reaching the last byte may go on into the next block */
+    u64 ends = run & ~(run >> 1) & (valid >> 1);
+
+    if (state->in_word) {
+        if (!(run & 1)) {
+            finish_word(state, words);
+        } else if (ends) {
+            state->end = base + (u64) __builtin_ctzll(ends) + 1;
+            finish_word(state, words);
+            ends &= ends - 1;
+        } else {
+            extend_open_word(word, base, state);
+            return;
+        }
+    }
+
+    reserve_words(words, block_size / 2);
+    word_span *spans = words->spans;
+    u64 count = words->count;
+    for (; ends; ends &= ends - 1, starts &= starts - 1) {
+        u64 start = (u64) __builtin_ctzll(starts);
+        u64 end = (u64) __builtin_ctzll(ends) + 1;
+        spans[count++] = (word_span) {base + start, end - start};
+    }
+    words->count = count;
+
+    if (starts) {
+        u64 start = (u64) __builtin_ctzll(starts);
+        *state = (token_state) {.in_word = true, .start = base + start};
+        extend_open_word(word, base, state);
+    }
+}
+
+/**
+ * mask_block
+ * Finds the words of the first `n` bytes of a block from its masks. A
+ * joiner is part of a word when letters are on both sides of it, so the
+ * words are the runs of set bits once those are added to the letters.
+ * A word's end is kept past its last letter, never a joiner.
+ *
+ * Arguments: `u64 base`, offset of the block in the text.
+ *            `bool next_word`, whether a letter follows byte `n - 1`.
+ **/
+static inline void mask_block (const block_masks *masks, u64 base, u64 n,
+                               bool next_word, token_state *state,
+                               word_spans *words) {
+
+    u64 valid = n == block_size ? ~0ull : (1ull << n) - 1;
+    u64 word = masks->word & valid;
+    u64 before = (word << 1) | (state->in_word && state->end == base);
+    u64 after = (word >> 1) | ((u64) next_word << (n - 1));
+    u64 run = word | (masks->joiner & before & after & valid);
+
+    for (u64 wide = masks->wide_joiner & valid; wide; wide &= wide - 1) {
+        u64 at = (u64) __builtin_ctzll(wide);
+        if ((before >> at) & (after >> (at + 2)) & 1) {
+            run |= 7ull << at;
+        }
+    }
+
+    u64 digit = masks->digit & valid;
+    if (digit) {
+        runs_with_digits(run, word, digit, base, n, state, words);
+    } else {
+        runs_paired(run, word, base, n, state, words);
+    }
+}
+
+/**
+ * tokenize_blocks
+ * Classifies the text a block at a time with `classify_block`, and the
+ * few characters outside ASCII with classify_high, then finds the words
+ * from the masks alone. The tail shorter than a block goes through
+ * scalar_step. Inlined into each vector implementation so the
+ * classification is too.
+ **/
+__attribute__((always_inline)) static inline u64 tokenize_blocks (
+    const u8 *bytes, u64 len, word_spans *words,
+    void (*classify_block)(const u8 *, block_masks *)) {
+
+    token_state state = {0};
+    u64 i = 0;
+
+    while (i + block_size <= len) {
+
+        block_masks masks;
+        classify_block(bytes + i, &masks);
+
+        u64 n = block_size;
+        if (masks.high) {
+            n = classify_high(bytes, len, i, &masks);
+        }
+        mask_block(&masks, i, n, word_char_at(bytes, len, i + n), &state,
+                   words);
+        i += n;
+    }
+
+    while (i < len) {
+        i = scalar_step(bytes, len, i, &state, words);
+    }
+    finish_word(&state, words);
+    return words->count;
+}
+
+#ifdef TOKENIZE_HAVE_X86
+
+/* Unsigned `lo <= c <= lo + span` as a byte mask, SSE2 has no unsigned
+   compare but has an unsigned minimum */
+__attribute__((target("sse2"))) static inline __m128i in_range_sse2 (
+    __m128i c, char lo, char span) {
+
+    __m128i offset = _mm_sub_epi8(c, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(span)), offset);
+}
+
+__attribute__((target("sse2"))) static inline void classify_block_sse2 (
+    const u8 *block, block_masks *masks) {
+
+    *masks = (block_masks) {0};
+    for (u64 part = 0; part < block_size; part += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *) (block + part));
+        /* Setting 0x20 lower cases letters and moves nothing else in */
+        __m128i letter = in_range_sse2(_mm_or_si128(c, _mm_set1_epi8(0x20)),
+                                       'a', 'z' - 'a');
+        __m128i digit = in_range_sse2(c, '0', 9);
+        __m128i joiner = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('\'')),
+                                      _mm_cmpeq_epi8(c, _mm_set1_epi8('-')));
+
+        masks->word |= (u64) (u16) _mm_movemask_epi8(_mm_or_si128(letter, digit))
+                       << part;
+        masks->digit |= (u64) (u16) _mm_movemask_epi8(digit) << part;
+        masks->joiner |= (u64) (u16) _mm_movemask_epi8(joiner) << part;
+        masks->high |= (u64) (u16) _mm_movemask_epi8(c) << part;
+    }
+}
+
+__attribute__((target("avx2"))) static inline __m256i in_range_avx2 (
+    __m256i c, char lo, char span) {
+
+    __m256i offset = _mm256_sub_epi8(c, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(span)),
+                             offset);
+}
+
+__attribute__((target("avx2"))) static inline void classify_block_avx2 (
+    const u8 *block, block_masks *masks) {
+
+    *masks = (block_masks) {0};
+    for (u64 part = 0; part < block_size; part += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i *) (block + part));
+        __m256i letter = in_range_avx2(
+            _mm256_or_si256(c, _mm256_set1_epi8(0x20)), 'a', 'z' - 'a');
+        __m256i digit = in_range_avx2(c, '0', 9);
+        __m256i joiner =
+            _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\'')),
+                            _mm256_cmpeq_epi8(c, _mm256_set1_epi8('-')));
+
+        masks->word |=
+            (u64) (u32) _mm256_movemask_epi8(_mm256_or_si256(letter, digit))
+            << part;
+        masks->digit |= (u64) (u32) _mm256_movemask_epi8(digit) << part;
+        masks->joiner |= (u64) (u32) _mm256_movemask_epi8(joiner) << part;
+        masks->high |= (u64) (u32) _mm256_movemask_epi8(c) << part;
+    }
+}
+
+__attribute__((target("sse2"))) static u64 tokenize_sse2 (const u8 *bytes,
+                                                         u64 len,
+                                                         word_spans *words) {
+    return tokenize_blocks(bytes, len, words, classify_block_sse2);
+}
+
+__attribute__((target("avx2"))) static u64 tokenize_avx2 (const u8 *bytes,
+                                                         u64 len,
+                                                         word_spans *words) {
+    return tokenize_blocks(bytes, len, words, classify_block_avx2);
+}
+
+#endif  // TOKENIZE_HAVE_X86
+
+/**
+ * tokenize_words
+ * Splits prose into words. A word is a run of letters, joined across
+ * single apostrophes and hyphens ("don't", "well-known"). Runs with
+ * digits in them are numbers or identifiers and are left out. ASCII is
+ * classified 64 bytes at a time with the vector instructions scan.c
+ * picked, other characters one at a time.
+ *
+ * Arguments: `word_spans *words`, emptied and filled with offsets into
+ *            `text`.
+ * Returns: How many words were found.
+ **/
+u64 tokenize_words (const char *text, u64 len, word_spans *words) {
+
+    assert(words && (text || len == 0));
+
+    const u8 *bytes = (const u8 *) text;
+    words->count = 0;
+
+    switch (scan_active_impl()) {
+#ifdef TOKENIZE_HAVE_X86
+        case SCAN_IMPL_AVX2:
+            return tokenize_avx2(bytes, len, words);
+        case SCAN_IMPL_SSE2:
+            return tokenize_sse2(bytes, len, words);
+#endif
+        default:
+            return tokenize_scalar(bytes, len, words);
+    }
+}
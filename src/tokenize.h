@@ -0,0 +1,26 @@
+#ifndef TOKENIZE_H_
+#define TOKENIZE_H_
+
+#include "common.h"
+
+/* One word, in byte offsets of the text it was found in */
+typedef struct word_span {
+    u64 offset;
+    u64 len;
+} word_span;
+
+/**
+ * Words found in a text, reused between calls so a document is split
+ * without allocating once the buffer has grown to fit. A zeroed buffer is
+ * ready to use.
+ **/
+typedef struct word_spans {
+    word_span *spans;
+    u64 count;
+    u64 cap;
+} word_spans;
+
+void word_spans_free(word_spans *words);
+u64 tokenize_words(const char *text, u64 len, word_spans *words);
+
+#endif  // TOKENIZE_H_
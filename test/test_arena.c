@@ -0,0 +1,122 @@
+#include <cjson/cJSON.h>
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/arena.h"
+#include "../src/lsp.h"
+#include "../src/pipeline.h"
+
+Test (arena, alignment_and_growth) {
+
+    arena a;
+    arena_init(&a, 64);
+
+    char *prev = NULL;
+    for (u64 i = 1; i <= 100; ++i) {
+        char *p = arena_alloc(&a, i);
+        cr_assert_eq((uintptr_t) p % sizeof(max_align_t), 0);
+        cr_assert(arena_owns(&a, p));
+        memset(p, 0xAB, i);
+        cr_assert_neq(p, prev);
+        prev = p;
+    }
+    cr_assert_eq(a.allocs, 100);
+    cr_assert_not_null(a.blocks->next, "Should have spilled into blocks");
+
+    u64 used = a.bytes;
+    arena_reset(&a);
+    cr_assert_eq(a.allocs, 0);
+    cr_assert_eq(a.bytes, 0);
+    cr_assert_eq(a.last_allocs, 100);
+    cr_assert_eq(a.last_bytes, used);
+    cr_assert_eq(a.peak_bytes, used);
+
+    /* The same cycle fits in the single block left behind */
+    cr_assert_null(a.blocks->next);
+    for (u64 i = 1; i <= 100; ++i) {
+        arena_alloc(&a, i);
+    }
+    cr_assert_null(a.blocks->next, "Reset did not coalesce the blocks");
+    cr_assert_eq(a.total_allocs, 200);
+
+    /* Larger than any block */
+    char *big = arena_alloc(&a, 1 << 20);
+    cr_assert(arena_owns(&a, big + (1 << 20) - 1));
+
+    int on_stack;
+    cr_assert_not(arena_owns(&a, &on_stack));
+
+    char *copy = arena_strndup(&a, "hello world", 5);
+    cr_assert_str_eq(copy, "hello");
+
+    arena_free(&a);
+}
+
+/* cJSON trees built while an arena is in use never touch the heap */
+Test (arena, cjson_hooks) {
+
+    arena_hook_cjson();
+
+    /* Allocated on the heap before any arena is in use */
+    cJSON *heap_tree = cJSON_Parse("{\"a\":[1,2,3]}");
+
+    arena a;
+    arena_init(&a, 0);
+    arena *previous = arena_use(&a);
+    cr_assert_eq(arena_current(), &a);
+
+    cJSON *tree = cJSON_Parse("{\"method\":\"x\",\"params\":{\"a\":[1,2]}}");
+    cr_assert_not_null(tree);
+    cr_assert(arena_owns(&a, tree));
+    cr_assert_gt(a.allocs, 5);
+
+    /* Freeing arena nodes is a no-op, heap nodes are really freed */
+    cJSON_Delete(tree);
+    cJSON_Delete(heap_tree);
+
+    arena_use(previous);
+    arena_reset(&a);
+    arena_free(&a);
+}
+
+Test (arena, dispatch_resets) {
+
+    pipeline_output out;
+    output_init(&out, -1);
+
+    char content[] =
+        "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\",\"params\":"
+        "{\"textDocument\":{\"uri\":\"file:///a.md\",\"version\":2},"
+        "\"contentChanges\":[{\"range\":{\"start\":{\"line\":0,\"character\":"
+        "0},\"end\":{\"line\":0,\"character\":1},\"rangeLength\":1,"
+        "\"text\":\"abc\"}}]}}";
+    msg_t message = {.content = content, .len = strlen(content)};
+    LspState state = {0};
+    state.client.initialized = true;
+
+    cr_assert_eq(pipeline_dispatcher(&out, &message, &state), 0);
+
+    /* Everything went into the arena and was dropped with the message */
+    cr_assert_null(arena_current());
+    cr_assert_eq(state.scratch.resets, 1);
+    cr_assert_eq(state.scratch.bytes, 0);
+    cr_assert_gt(state.scratch.last_allocs, 0);
+
+    /* Regression guard, the tree of this message is about 30 nodes */
+    cr_assert_leq(state.scratch.last_allocs, 128,
+                  "`%llu` allocations for one didChange",
+                  state.scratch.last_allocs);
+    u64 peak = state.scratch.peak_bytes;
+    cr_assert_gt(peak, 0);
+
+    /* The same message again needs no more memory */
+    cr_assert_eq(pipeline_dispatcher(&out, &message, &state), 0);
+    cr_assert_eq(state.scratch.peak_bytes, peak);
+    cr_assert_null(state.scratch.blocks->next);
+
+    lsp_state_free(&state);
+    output_free(&out);
+}
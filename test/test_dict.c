@@ -0,0 +1,400 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/dict.h"
+#include "../src/dict_build.h"
+#include "../src/dict_format.h"
+#include "../src/lsp.h"
+#include "../src/output.h"
+
+#define tiny_edges 5
+#define tiny_size \
+    (sizeof(dict_header) + sizeof(dict_section) + tiny_edges * sizeof(u32))
+
+/* Everything a hand built image needs, 8 byte aligned */
+typedef union tiny_image {
+    u64 align;
+    u8 bytes[tiny_size + 4];
+} tiny_image;
+
+/**
+ * The automaton for "car", "cat" and "cats", built by hand:
+ *
+ *   0: c -> 1
+ *   1: a -> 2
+ *   2: r (word)  3: t (word) -> 4
+ *   4: s (word)
+ **/
+static void build_tiny (tiny_image *image) {
+
+    memset(image, 0, sizeof(*image));
+
+    u32 edges[tiny_edges] = {
+        dict_edge_make('c', false, true, 1),
+        dict_edge_make('a', false, true, 2),
+        dict_edge_make('r', true, false, 0),
+        dict_edge_make('t', true, true, 4),
+        dict_edge_make('s', true, true, 0),
+    };
+    dict_section section = {
+        .kind = DICT_SECTION_DAWG,
+        .offset = sizeof(dict_header) + sizeof(dict_section),
+        .length = sizeof(edges),
+    };
+    memcpy(image->bytes + sizeof(dict_header), &section, sizeof(section));
+    memcpy(image->bytes + section.offset, edges, sizeof(edges));
+
+    dict_header header = {
+        .magic = DICT_MAGIC,
+        .version = DICT_VERSION,
+        .section_count = 1,
+        .file_size = tiny_size,
+        .word_count = 3,
+    };
+    header.checksum = dict_checksum(image->bytes + sizeof(header),
+                                    tiny_size - sizeof(header));
+    memcpy(image->bytes, &header, sizeof(header));
+}
+
+/* Rewrites the checksum after the image was changed on purpose */
+static void reseal (tiny_image *image) {
+
+    dict_header header;
+    memcpy(&header, image->bytes, sizeof(header));
+    header.checksum = dict_checksum(image->bytes + sizeof(header),
+                                    header.file_size - sizeof(header));
+    memcpy(image->bytes, &header, sizeof(header));
+}
+
+Test (dict, lookups) {
+
+    tiny_image image;
+    build_tiny(&image);
+
+    dict d;
+    cr_assert_eq(dict_load(&d, image.bytes, tiny_size), DICT_OK);
+    cr_assert_eq(d.word_count, 3);
+
+    cr_assert(dict_contains(&d, "car", 3));
+    cr_assert(dict_contains(&d, "cat", 3));
+    cr_assert(dict_contains(&d, "cats", 4));
+
+    /* Prefixes, extensions and strangers */
+    cr_assert_not(dict_contains(&d, "", 0));
+    cr_assert_not(dict_contains(&d, "c", 1));
+    cr_assert_not(dict_contains(&d, "ca", 2));
+    cr_assert_not(dict_contains(&d, "cart", 4));
+    cr_assert_not(dict_contains(&d, "catsu", 5));
+    cr_assert_not(dict_contains(&d, "dog", 3));
+    cr_assert_not(dict_contains(&d, "Cat", 3));
+
+    /* Capitalised prose */
+    cr_assert(dict_check(&d, "Cat", 3));
+    cr_assert(dict_check(&d, "CATS", 4));
+    cr_assert_not(dict_check(&d, "cAt", 3));
+    cr_assert_not(dict_check(&d, "CAt", 3));
+
+    dict_close(&d);
+}
+
+/* A bad file is refused before any of it is trusted */
+Test (dict, refuses_bad_images) {
+
+    tiny_image image;
+    dict d;
+
+    build_tiny(&image);
+    image.bytes[0] = 'X';
+    cr_assert_eq(dict_load(&d, image.bytes, tiny_size), DICT_ERR_FORMAT);
+    cr_assert_null(d.edges);
+
+    build_tiny(&image);
+    image.bytes[DICT_MAGIC_LEN] = DICT_VERSION + 1;
+    cr_assert_eq(dict_load(&d, image.bytes, tiny_size), DICT_ERR_VERSION);
+
+    cr_assert_eq(dict_load(&d, image.bytes, 16), DICT_ERR_FORMAT);
+
+    /* Truncated */
+    build_tiny(&image);
+    cr_assert_eq(dict_load(&d, image.bytes, tiny_size - 4),
+                 DICT_ERR_CHECKSUM);
+
+    /* One flipped bit in the automaton */
+    build_tiny(&image);
+    image.bytes[tiny_size - 2] ^= 0x10;
+    cr_assert_eq(dict_load(&d, image.bytes, tiny_size), DICT_ERR_CHECKSUM);
+
+    /* Intact, but leading out of the automaton */
+    build_tiny(&image);
+    u32 edge = dict_edge_make('s', true, true, 99);
+    memcpy(image.bytes + tiny_size - sizeof(u32), &edge, sizeof(edge));
+    reseal(&image);
+    cr_assert_eq(dict_load(&d, image.bytes, tiny_size), DICT_ERR_FORMAT);
+
+    /* A node running off the end */
+    build_tiny(&image);
+    edge = dict_edge_make('s', true, false, 0);
+    memcpy(image.bytes + tiny_size - sizeof(u32), &edge, sizeof(edge));
+    reseal(&image);
+    cr_assert_eq(dict_load(&d, image.bytes, tiny_size), DICT_ERR_FORMAT);
+}
+
+/* Writes the tiny dictionary to a file, `path` must end in XXXXXX */
+static void write_tiny (char *path) {
+
+    tiny_image image;
+    build_tiny(&image);
+
+    int fd = mkstemp(path);
+    cr_assert_geq(fd, 0);
+    cr_assert_eq(write(fd, image.bytes, tiny_size), (ssize_t) tiny_size);
+    close(fd);
+}
+
+Test (dict, open_mapped) {
+
+    char path[] = "/tmp/complain_dict_XXXXXX";
+    write_tiny(path);
+
+    dict d;
+    cr_assert_eq(dict_open(&d, path), DICT_OK);
+    cr_assert(d.mapped);
+    cr_assert(dict_contains(&d, "cats", 4));
+    dict_close(&d);
+    cr_assert_null(d.data);
+
+    unlink(path);
+    cr_assert_eq(dict_open(&d, path), DICT_ERR_IO);
+}
+
+/* Every word missing from the dictionary is published where it is */
+Test (dict, spelling_diagnostics) {
+
+    char path[] = "/tmp/complain_dict_XXXXXX";
+    write_tiny(path);
+
+    LspState state = {0};
+    state.client.position_encoding = ROPE_UTF16;
+    state.client.dictionary = malloc(sizeof(dict));
+    cr_assert_eq(dict_open(state.client.dictionary, path), DICT_OK);
+    unlink(path);
+
+    const char *uri = "file:///a.md";
+    const char *text = "Cats cat dgo\n\xe2\x80\x9c" "caar\xe2\x80\x9d car-cat 2cat";
+    Document *doc = docstore_open(&state.documents, uri, strlen(uri), NULL, 7,
+                                  text, strlen(text));
+
+    int fds[2];
+    cr_assert_eq(pipe(fds), 0);
+    pipeline_output out;
+    output_init(&out, fds[1]);
+
+    LspRequest request = {.out = &out, .snapshot = docstore_snapshot(doc)};
+    cr_assert_eq(lsp_analyse_document(&state, &request), 0);
+    cr_assert_eq(output_flush(&out), 0);
+    docstore_snapshot_release(request.snapshot);
+
+    char got[2048] = {0};
+    cr_assert_gt(read(fds[0], got, sizeof(got) - 1), 0);
+
+    const char *body = strstr(got, "\r\n\r\n") + 4;
+    const char *expected =
+        "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\","
+        "\"params\":{\"uri\":\"file:///a.md\",\"version\":7,\"diagnostics\":["
+        "{\"range\":{\"start\":{\"line\":0,\"character\":9},"
+        "\"end\":{\"line\":0,\"character\":12}},\"severity\":3,"
+        "\"code\":\"spelling\",\"source\":\"complain\",\"message\":\"dgo\"},"
+        "{\"range\":{\"start\":{\"line\":1,\"character\":1},"
+        "\"end\":{\"line\":1,\"character\":5}},\"severity\":3,"
+        "\"code\":\"spelling\",\"source\":\"complain\",\"message\":\"caar\"}"
+        "]}}";
+    cr_assert_str_eq(body, expected);
+
+    lsp_state_free(&state);
+    output_free(&out);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* Analyses `doc` as the scheduler would, output going to `out` */
+static DocDiagnostics *analyse (LspState *state, Document *doc,
+                                pipeline_output *out) {
+
+    docstore_take_dirty(doc);
+    LspRequest request = {.out = out, .snapshot = docstore_snapshot(doc)};
+    cr_assert_eq(lsp_analyse_document(state, &request), 0);
+    cr_assert_eq(output_flush(out), 0);
+    docstore_snapshot_release(request.snapshot);
+    return doc->diagnostics;
+}
+
+/* Types into `doc` the way didChange does */
+static void edit (Document *doc, u64 at, u64 removed, const char *text) {
+
+    rope_replace(&doc->text, at, removed, text, strlen(text));
+    dirty_span_edit(&doc->dirty, at, removed, strlen(text));
+    docstore_set_version(doc, doc->version + 1);
+}
+
+/* The spans of `doc` match those of a fresh copy checked from scratch */
+static void assert_as_if_fresh (LspState *state, Document *doc,
+                                pipeline_output *out) {
+
+    char *text = rope_flatten(&doc->text);
+    const char *uri = "file:///fresh.md";
+    Document *fresh = docstore_open(&state->documents, uri, strlen(uri), NULL,
+                                    1, text, rope_length(&doc->text));
+    DocDiagnostics *want = analyse(state, fresh, out);
+    DocDiagnostics *got = doc->diagnostics;
+
+    cr_assert_eq(got->count, want->count);
+    cr_assert_eq(memcmp(got->spans, want->spans,
+                        got->count * sizeof(diagnostic_span)),
+                 0);
+    docstore_close(&state->documents, uri, strlen(uri));
+    free(text);
+}
+
+/* An edit only has its own paragraph checked again, wherever it is */
+Test (dict, incremental_diagnostics) {
+
+    char path[] = "/tmp/complain_dict_XXXXXX";
+    write_tiny(path);
+
+    LspState state = {0};
+    state.client.position_encoding = ROPE_UTF16;
+    state.client.dictionary = malloc(sizeof(dict));
+    cr_assert_eq(dict_open(state.client.dictionary, path), DICT_OK);
+    unlink(path);
+
+    /* About 1.1 MiB, two misspellings a paragraph */
+    const char *paragraph = "Cats cat dgo\ncar caar cats\n\n";
+    u64 paragraph_len = strlen(paragraph);
+    u64 paragraphs = 40000;
+    char *text = malloc(paragraphs * paragraph_len);
+    for (u64 i = 0; i < paragraphs; ++i) {
+        memcpy(text + i * paragraph_len, paragraph, paragraph_len);
+    }
+
+    const char *uri = "file:///huge.md";
+    Document *doc = docstore_open(&state.documents, uri, strlen(uri), NULL, 1,
+                                  text, paragraphs * paragraph_len);
+    free(text);
+
+    int null = open("/dev/null", O_WRONLY);
+    cr_assert_geq(null, 0);
+    pipeline_output out;
+    output_init(&out, null);
+
+    DocDiagnostics *found = analyse(&state, doc, &out);
+    cr_assert_eq(found->count, 2 * paragraphs);
+    cr_assert_eq(found->checked, paragraphs * paragraph_len);
+
+    /* "cat" becomes "caat" three paragraphs from the end */
+    edit(doc, (paragraphs - 3) * paragraph_len + 6, 0, "a");
+    found = analyse(&state, doc, &out);
+    cr_assert_eq(found->count, 2 * paragraphs + 1);
+    cr_assert_leq(found->checked, 2 * paragraph_len);
+    assert_as_if_fresh(&state, doc, &out);
+
+    /* Everything after an edit at the start moves back */
+    edit(doc, 0, 5, "");
+    found = analyse(&state, doc, &out);
+    cr_assert_leq(found->checked, 2 * paragraph_len);
+    assert_as_if_fresh(&state, doc, &out);
+
+    /* Nothing changed, nothing is checked */
+    found = analyse(&state, doc, &out);
+    cr_assert_eq(found->checked, 0);
+    cr_assert_eq(found->count, 2 * paragraphs + 1);
+
+    lsp_state_free(&state);
+    output_free(&out);
+    close(null);
+}
+
+/* Misspellings get the closest words as fixes, in the word's case */
+Test (dict, spelling_code_actions) {
+
+    const char *list = "the 10\ncat\nand\nreceive\nit\n";
+    dict_builder builder = {.suggest_distance = 2};
+    dict_builder_add_list(&builder, list, strlen(list));
+    u64 size;
+    u8 *image = dict_builder_finish(&builder, &size, NULL);
+    dict_builder_free(&builder);
+
+    LspState state = {0};
+    state.client.position_encoding = ROPE_UTF16;
+    state.client.dictionary = malloc(sizeof(dict));
+    cr_assert_eq(dict_load(state.client.dictionary, image, size), DICT_OK);
+
+    const char *uri = "file:///a.md";
+    const char *text = "Teh cat and RECIEVE it\n";
+    docstore_open(&state.documents, uri, strlen(uri), NULL, 1, text,
+                  strlen(text));
+
+    const char *params =
+        "{\"textDocument\":{\"uri\":\"file:///a.md\"},"
+        "\"range\":{\"start\":{\"line\":0,\"character\":0},"
+        "\"end\":{\"line\":0,\"character\":0}},"
+        "\"context\":{\"diagnostics\":["
+        "{\"range\":{\"start\":{\"line\":0,\"character\":0},"
+        "\"end\":{\"line\":0,\"character\":3}},"
+        "\"code\":\"spelling\",\"message\":\"Teh\"},"
+        "{\"range\":{\"start\":{\"line\":0,\"character\":4},"
+        "\"end\":{\"line\":0,\"character\":7}},"
+        "\"code\":\"other\",\"message\":\"cat\"},"
+        "{\"range\":{\"start\":{\"line\":0,\"character\":12},"
+        "\"end\":{\"line\":0,\"character\":19}},"
+        "\"code\":\"spelling\",\"message\":\"RECIEVE\"}]}}";
+
+    int fds[2];
+    cr_assert_eq(pipe(fds), 0);
+    pipeline_output out;
+    output_init(&out, fds[1]);
+
+    LspRequest request = {
+        .id = "4",
+        .id_len = 1,
+        .params = params,
+        .params_len = strlen(params),
+        .out = &out,
+    };
+    cr_assert_eq(lsp_textDocument_codeAction(&state, &request), 0);
+    cJSON_Delete(request.params_json);
+    cr_assert_eq(output_flush(&out), 0);
+
+    char got[4096] = {0};
+    cr_assert_gt(read(fds[0], got, sizeof(got) - 1), 0);
+
+    const char *body = strstr(got, "\r\n\r\n") + 4;
+    const char *expected =
+        "{\"jsonrpc\":\"2.0\",\"id\":4,\"result\":["
+        "{\"title\":\"Change to `The`\",\"kind\":\"quickfix\","
+        "\"diagnostics\":[{\"range\":{\"start\":{\"line\":0,"
+        "\"character\":0},\"end\":{\"line\":0,\"character\":3}},"
+        "\"code\":\"spelling\",\"message\":\"Teh\"}],\"isPreferred\":true,"
+        "\"edit\":{\"changes\":{\"file:///a.md\":[{\"range\":{\"start\":"
+        "{\"line\":0,\"character\":0},\"end\":{\"line\":0,"
+        "\"character\":3}},\"newText\":\"The\"}]}}},"
+        "{\"title\":\"Change to `RECEIVE`\",\"kind\":\"quickfix\","
+        "\"diagnostics\":[{\"range\":{\"start\":{\"line\":0,"
+        "\"character\":12},\"end\":{\"line\":0,\"character\":19}},"
+        "\"code\":\"spelling\",\"message\":\"RECIEVE\"}],"
+        "\"isPreferred\":true,\"edit\":{\"changes\":{\"file:///a.md\":["
+        "{\"range\":{\"start\":{\"line\":0,\"character\":12},"
+        "\"end\":{\"line\":0,\"character\":19}},"
+        "\"newText\":\"RECEIVE\"}]}}}]}";
+    cr_assert_str_eq(body, expected);
+
+    lsp_state_free(&state);
+    free(image);
+    output_free(&out);
+    close(fds[0]);
+    close(fds[1]);
+}
@@ -0,0 +1,350 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/dict.h"
+#include "../src/dict_build.h"
+
+#define random_words 5000
+#define random_probes 20000
+
+static u64 seed = 1;
+
+static u32 next_random (void) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    return (u32) (seed >> 33);
+}
+
+/* Short words over a small alphabet, so they share prefixes and suffixes */
+static u64 random_word (char *out) {
+
+    u64 len = 1 + next_random() % 9;
+    for (u64 i = 0; i < len; ++i) {
+        out[i] = "abcdeo"[next_random() % 6];
+    }
+    return len;
+}
+
+static const char *sorted_text;
+
+static int compare_key (const void *key, const void *element) {
+
+    const dict_word *a = key;
+    const dict_word *b = element;
+    u32 len = a->len < b->len ? a->len : b->len;
+    int order = memcmp(sorted_text + a->offset, sorted_text + b->offset, len);
+    return order ? order : (a->len > b->len) - (a->len < b->len);
+}
+
+/* The image accepts exactly the words that went in */
+Test (dict_build, round_trip) {
+
+    dict_builder builder = {0};
+    char word[16];
+
+    for (int i = 0; i < random_words; ++i) {
+        u64 len = random_word(word);
+        dict_builder_add(&builder, word, len);
+    }
+    /* Duplicates and junk the builder must cope with */
+    dict_builder_add(&builder, "abc", 3);
+    dict_builder_add(&builder, "abc", 3);
+    dict_builder_add(&builder, "", 0);
+
+    u64 size;
+    dict_build_stats stats;
+    u8 *image = dict_builder_finish(&builder, &size, &stats);
+    cr_assert_not_null(image);
+    cr_assert_eq(stats.words, random_words + 2);
+    cr_assert_lt(stats.unique, stats.words);
+    cr_assert_eq(stats.bytes, size);
+
+    dict d;
+    cr_assert_eq(dict_load(&d, image, size), DICT_OK);
+    cr_assert_eq(d.word_count, stats.unique);
+
+    /* Minimised, far fewer edges than letters */
+    u64 letters = 0;
+    for (u64 i = 0; i < builder.count; ++i) {
+        letters += builder.words[i].len;
+    }
+    cr_assert_lt(d.edge_count * 2, letters, "`%llu` edges for `%llu` letters",
+                 d.edge_count, letters);
+
+    for (u64 i = 0; i < builder.count; ++i) {
+        const dict_word *w = &builder.words[i];
+        cr_assert(dict_contains(&d, builder.text + w->offset, w->len),
+                  "Missing `%.*s`", (int) w->len, builder.text + w->offset);
+    }
+
+    /* Anything else is refused, checked against the sorted words. A probe
+       is added to the text for the comparison, then taken off the list */
+    char probe_text[16];
+    for (int i = 0; i < random_probes; ++i) {
+        u64 len = random_word(probe_text);
+        dict_builder_add(&builder, probe_text, len);
+        dict_word key = builder.words[--builder.count];
+        sorted_text = builder.text;
+        bool listed = bsearch(&key, builder.words, builder.count,
+                              sizeof(dict_word), compare_key) != NULL;
+        cr_assert_eq(dict_contains(&d, probe_text, len), listed,
+                     "`%.*s`", (int) len, probe_text);
+    }
+
+    free(image);
+    dict_builder_free(&builder);
+}
+
+Test (dict_build, empty) {
+
+    dict_builder builder = {0};
+    u64 size;
+    u8 *image = dict_builder_finish(&builder, &size, NULL);
+    cr_assert_not_null(image);
+
+    dict d;
+    cr_assert_eq(dict_load(&d, image, size), DICT_OK);
+    cr_assert_eq(d.word_count, 0);
+    cr_assert_not(dict_contains(&d, "a", 1));
+
+    free(image);
+    dict_builder_free(&builder);
+}
+
+/* Affixes expanded the way Hunspell reads them */
+Test (dict_build, hunspell) {
+
+    const char *aff = "# A comment\n"
+                      "SET UTF-8\n"
+                      "NEEDAFFIX X\n"
+                      "FORBIDDENWORD F\n"
+                      "\n"
+                      "PFX U Y 1\n"
+                      "PFX U 0 un .\n"
+                      "\n"
+                      "SFX S Y 3\n"
+                      "SFX S y ies [^aeiou]y\n"
+                      "SFX S 0 s [aeiou]y\n"
+                      "SFX S 0 s [^y]\n"
+                      "\n"
+                      "SFX D N 1\n"
+                      "SFX D 0 ed/S [^y]\n"
+                      "\n"
+                      "SFX C Y 1\n"
+                      "SFX C 0 \xc3\xa9 [^\xc3\xa9]\n";
+    const char *dic = "6\n"
+                      "try/SD\n"
+                      "play/SU\n"
+                      "walk/DS\r\n"
+                      "stem/XS\n"
+                      "bad/F\n"
+                      "caf/C\tpo:noun\n"
+                      "either/1/2\n";
+
+    dict_builder builder = {0};
+    cr_assert_eq(dict_builder_add_hunspell(&builder, aff, strlen(aff), dic,
+                                           strlen(dic)),
+                 0);
+
+    u64 size;
+    dict_build_stats stats;
+    u8 *image = dict_builder_finish(&builder, &size, &stats);
+    cr_assert_not_null(image);
+
+    dict d;
+    cr_assert_eq(dict_load(&d, image, size), DICT_OK);
+
+    const char *words[] = {"try",     "tries",  "play",     "plays",
+                           "unplay",  "unplays", "walk",    "walked",
+                           "walks",   "stems",  "caf",      "caf\xc3\xa9",
+                           "either"};
+    for (u64 i = 0; i < ARRAY_LENGTH(words); ++i) {
+        cr_assert(dict_contains(&d, words[i], strlen(words[i])), "Missing `%s`",
+                  words[i]);
+    }
+    cr_assert_eq(stats.unique, ARRAY_LENGTH(words));
+
+    const char *not_words[] = {"stem", "bad",   "trys",   "tryed",
+                               "untry", "plaies", "walkeds", "unwalk"};
+    for (u64 i = 0; i < ARRAY_LENGTH(not_words); ++i) {
+        cr_assert_not(dict_contains(&d, not_words[i], strlen(not_words[i])),
+                      "Unexpected `%s`", not_words[i]);
+    }
+
+    free(image);
+    dict_builder_free(&builder);
+}
+
+/* `FLAG long` and `AF` aliases */
+Test (dict_build, hunspell_flag_formats) {
+
+    const char *aff = "FLAG long\n"
+                      "AF 2\n"
+                      "AF AaBb\n"
+                      "AF Bb\n"
+                      "SFX Aa Y 1\n"
+                      "SFX Aa 0 s .\n"
+                      "PFX Bb Y 1\n"
+                      "PFX Bb 0 re .\n";
+    const char *dic = "2\n"
+                      "read/1\n"
+                      "do/2\n";
+
+    dict_builder builder = {0};
+    cr_assert_eq(dict_builder_add_hunspell(&builder, aff, strlen(aff), dic,
+                                           strlen(dic)),
+                 0);
+
+    u64 size;
+    u8 *image = dict_builder_finish(&builder, &size, NULL);
+    dict d;
+    cr_assert_eq(dict_load(&d, image, size), DICT_OK);
+
+    const char *words[] = {"read", "reads", "reread", "rereads", "do",
+                           "redo"};
+    for (u64 i = 0; i < ARRAY_LENGTH(words); ++i) {
+        cr_assert(dict_contains(&d, words[i], strlen(words[i])), "Missing `%s`",
+                  words[i]);
+    }
+    cr_assert_eq(d.word_count, ARRAY_LENGTH(words));
+
+    free(image);
+    dict_builder_free(&builder);
+}
+
+Test (dict_build, distance) {
+
+    const struct {
+        const char *a;
+        const char *b;
+        u32 distance;
+    } cases[] = {
+        {"cat", "cat", 0},  {"cat", "act", 1},      {"cat", "cats", 1},
+        {"cat", "cut", 1},  {"cat", "at", 1},       {"", "ab", 2},
+        {"ab", "ba", 1},    {"abcd", "badc", 2},    {"recieve", "receive", 1},
+        {"ca", "abc", 3},   {"kitten", "sitting", 3},
+    };
+
+    for (u64 i = 0; i < ARRAY_LENGTH(cases); ++i) {
+        const u8 *a = (const u8 *) cases[i].a;
+        const u8 *b = (const u8 *) cases[i].b;
+        u32 a_len = (u32) strlen(cases[i].a);
+        u32 b_len = (u32) strlen(cases[i].b);
+        u32 expected = cases[i].distance > 2 ? 3 : cases[i].distance;
+        cr_assert_eq(dict_distance(a, a_len, b, b_len, 2), expected,
+                     "`%s` to `%s`", cases[i].a, cases[i].b);
+        cr_assert_eq(dict_distance(b, b_len, a, a_len, 2), expected,
+                     "`%s` to `%s`", cases[i].b, cases[i].a);
+    }
+}
+
+/* Closest first, then most common */
+Test (dict_build, suggest) {
+
+    const char *list = "the 500\n"
+                       "then 20\n"
+                       "than 30\n"
+                       "this 40\n"
+                       "the 7\n"
+                       "hello\n"
+                       "receive 5\n"
+                       "recipe 3\n"
+                       "abcdefghij 1\n";
+
+    dict_builder builder = {.suggest_distance = 2};
+    dict_builder_add_list(&builder, list, strlen(list));
+    u64 size;
+    dict_build_stats stats;
+    u8 *image = dict_builder_finish(&builder, &size, &stats);
+    cr_assert_not_null(image);
+    cr_assert_gt(stats.postings, 0);
+
+    dict d;
+    cr_assert_eq(dict_load(&d, image, size), DICT_OK);
+    cr_assert_not_null(d.suggest);
+
+    dict_suggestion found[5];
+    u32 count = dict_suggest(&d, "thn", 3, 2, found, 5);
+    const char *expected[] = {"the", "than", "then", "this"};
+    cr_assert_eq(count, ARRAY_LENGTH(expected));
+    for (u32 i = 0; i < count; ++i) {
+        cr_assert_eq(found[i].len, strlen(expected[i]));
+        cr_assert_eq(memcmp(found[i].word, expected[i], found[i].len), 0,
+                     "`%.*s` in place of `%s`", (int) found[i].len,
+                     found[i].word, expected[i]);
+    }
+    /* The larger of two frequencies given for one word */
+    cr_assert_eq(found[0].frequency, 500);
+    cr_assert_eq(found[3].distance, 2);
+
+    cr_assert_eq(dict_suggest(&d, "thn", 3, 2, found, 2), 2);
+    cr_assert_eq(memcmp(found[1].word, "than", 4), 0);
+    cr_assert_eq(dict_suggest(&d, "thn", 3, 0, found, 5), 0);
+
+    cr_assert_eq(dict_suggest(&d, "teh", 3, 2, found, 1), 1);
+    cr_assert_eq(memcmp(found[0].word, "the", 3), 0);
+    cr_assert_eq(dict_suggest(&d, "recieve", 7, 2, found, 1), 1);
+    cr_assert_eq(memcmp(found[0].word, "receive", 7), 0);
+
+    /* Edits inside and past the indexed prefix */
+    cr_assert_eq(dict_suggest(&d, "xbcdefghij", 10, 2, found, 1), 1);
+    cr_assert_eq(found[0].distance, 1);
+    cr_assert_eq(dict_suggest(&d, "abcdefghjix", 11, 2, found, 1), 1);
+    cr_assert_eq(found[0].distance, 2);
+    cr_assert_eq(dict_suggest(&d, "zzzzz", 5, 2, found, 5), 0);
+
+    free(image);
+    dict_builder_free(&builder);
+
+    /* No index unless asked for */
+    dict_builder plain = {0};
+    dict_builder_add_list(&plain, list, strlen(list));
+    image = dict_builder_finish(&plain, &size, NULL);
+    cr_assert_eq(dict_load(&d, image, size), DICT_OK);
+    cr_assert_null(d.suggest);
+    cr_assert_eq(dict_suggest(&d, "thn", 3, 2, found, 5), 0);
+    free(image);
+    dict_builder_free(&plain);
+}
+
+/* The index finds every word a brute force search does */
+Test (dict_build, suggest_finds_all) {
+
+    dict_builder builder = {.suggest_distance = 2};
+    char word[16];
+    for (int i = 0; i < 1000; ++i) {
+        u64 len = 1 + next_random() % 9;
+        for (u64 c = 0; c < len; ++c) {
+            word[c] = "abcdefghij"[next_random() % 10];
+        }
+        dict_builder_add(&builder, word, len);
+    }
+
+    u64 size;
+    u8 *image = dict_builder_finish(&builder, &size, NULL);
+    dict d;
+    cr_assert_eq(dict_load(&d, image, size), DICT_OK);
+
+    static dict_suggestion found[1024];
+    for (int i = 0; i < 300; ++i) {
+        u64 len = 1 + next_random() % 10;
+        for (u64 c = 0; c < len; ++c) {
+            word[c] = "abcdefghij"[next_random() % 10];
+        }
+
+        u32 within = 0;
+        for (u64 w = 0; w < builder.count; ++w) {
+            const dict_word *entry = &builder.words[w];
+            within += dict_distance((const u8 *) word, (u32) len,
+                                    (const u8 *) builder.text + entry->offset,
+                                    entry->len, 2) <= 2;
+        }
+        cr_assert_eq(dict_suggest(&d, word, len, 2, found,
+                                  ARRAY_LENGTH(found)),
+                     within, "`%.*s`", (int) len, word);
+    }
+
+    free(image);
+    dict_builder_free(&builder);
+}
@@ -0,0 +1,163 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/docstore.h"
+
+#define uri_count 1000
+
+static u64 uri_of (int i, char *uri, size_t cap) {
+    return snprintf(uri, cap, "file:///project/notes/%d.md", i);
+}
+
+Test (docstore, open_find_close) {
+
+    docstore store = {0};
+    const char *uri = "file:///a.md";
+
+    cr_assert_null(docstore_find(&store, uri, strlen(uri)));
+    cr_assert_not(docstore_close(&store, uri, strlen(uri)));
+
+    Document *doc = docstore_open(&store, uri, strlen(uri), "markdown", 0,
+                                  "hello", 5);
+    cr_assert_eq(docstore_find(&store, uri, strlen(uri)), doc);
+    char *text = rope_flatten(&doc->text);
+    cr_assert_str_eq(text, "hello");
+    free(text);
+    cr_assert_str_eq(doc->language_id, "markdown");
+    cr_assert_eq(doc->version, 0);
+
+    /* Keys are copied, not borrowed */
+    char key[] = "file:///a.md";
+    cr_assert_eq(docstore_find(&store, key, strlen(key)), doc);
+    cr_assert_neq(doc->uri, key);
+
+    /* A prefix is a different document */
+    cr_assert_null(docstore_find(&store, uri, strlen(uri) - 1));
+
+    docstore_set_text(doc, "bye", 3);
+    text = rope_flatten(&doc->text);
+    cr_assert_str_eq(text, "bye");
+    cr_assert_eq(rope_length(&doc->text), 3);
+    free(text);
+
+    /* Reopening replaces the contents in place */
+    Document *again = docstore_open(&store, uri, strlen(uri), NULL, 3, "x", 1);
+    cr_assert_eq(again, doc);
+    cr_assert_eq(store.count, 1);
+    cr_assert_eq(again->version, 3);
+
+    cr_assert(docstore_close(&store, uri, strlen(uri)));
+    cr_assert_null(docstore_find(&store, uri, strlen(uri)));
+    cr_assert_eq(store.count, 0);
+
+    docstore_free(&store);
+}
+
+/* Growth and backward shift deletion keep every other entry reachable */
+Test (docstore, many_documents) {
+
+    docstore store = {0};
+    char uri[64];
+    Document *docs[uri_count];
+
+    for (int i = 0; i < uri_count; ++i) {
+        u64 len = uri_of(i, uri, sizeof(uri));
+        docs[i] = docstore_open(&store, uri, len, NULL, i, uri, len);
+    }
+    cr_assert_eq(store.count, uri_count);
+    cr_assert_leq(store.count * 4, store.capacity * 3);
+
+    /* Documents did not move while the table grew */
+    for (int i = 0; i < uri_count; ++i) {
+        u64 len = uri_of(i, uri, sizeof(uri));
+        cr_assert_eq(docstore_find(&store, uri, len), docs[i]);
+    }
+
+    for (int i = 1; i < uri_count; i += 2) {
+        u64 len = uri_of(i, uri, sizeof(uri));
+        cr_assert(docstore_close(&store, uri, len));
+    }
+    cr_assert_eq(store.count, uri_count / 2);
+
+    for (int i = 0; i < uri_count; ++i) {
+        u64 len = uri_of(i, uri, sizeof(uri));
+        Document *doc = docstore_find(&store, uri, len);
+        if (i % 2) {
+            cr_assert_null(doc, "Closed document %d still found", i);
+        } else {
+            cr_assert_eq(doc, docs[i], "Lost document %d", i);
+            cr_assert_eq(doc->version, i);
+        }
+    }
+
+    docstore_free(&store);
+    cr_assert_eq(store.count, 0);
+}
+
+Test (docstore, dirty_span) {
+
+    dirty_span span = {0};
+
+    /* The first edit starts the span at its inserted text */
+    dirty_span_edit(&span, 10, 2, 5);
+    cr_assert(span.set && span.start == 10 && span.end == 15);
+
+    /* Edits behind it stretch it to cover them */
+    dirty_span_edit(&span, 20, 3, 0);
+    cr_assert(span.start == 10 && span.end == 20);
+
+    /* Edits in front shift it */
+    dirty_span_edit(&span, 0, 4, 1);
+    cr_assert(span.start == 7 && span.end == 17);
+
+    /* Deleting across its start pulls it in */
+    dirty_span_edit(&span, 5, 4, 0);
+    cr_assert(span.start == 5 && span.end == 13);
+
+    /* Deleting its end cuts it to the edit */
+    dirty_span_edit(&span, 8, 10, 2);
+    cr_assert(span.start == 5 && span.end == 10);
+}
+
+Test (docstore, snapshots) {
+
+    docstore store = {0};
+    const char *uri = "file:///s.md";
+    Document *doc = docstore_open(&store, uri, strlen(uri), "markdown", 1,
+                                  "first", 5);
+
+    DocSnapshot *first = docstore_snapshot(doc);
+    cr_assert_eq(first->version, 1);
+    cr_assert_not(docstore_snapshot_stale(first));
+    /* Unchanged text, same snapshot */
+    DocSnapshot *again = docstore_snapshot(doc);
+    cr_assert_eq(again, first);
+    docstore_snapshot_release(again);
+
+    /* Editing leaves the snapshot as it was */
+    rope_insert(&doc->text, 5, " edit", 5);
+    docstore_set_version(doc, 2);
+    cr_assert(docstore_snapshot_stale(first));
+
+    char *text = rope_flatten(&first->text);
+    cr_assert_str_eq(text, "first");
+    free(text);
+
+    DocSnapshot *second = docstore_snapshot(doc);
+    cr_assert_neq(second, first);
+    text = rope_flatten(&second->text);
+    cr_assert_str_eq(text, "first edit");
+    free(text);
+
+    /* Snapshots outlive their document */
+    cr_assert(docstore_close(&store, uri, strlen(uri)));
+    cr_assert(docstore_snapshot_stale(second));
+    cr_assert_eq(second->version, 2);
+
+    docstore_snapshot_release(first);
+    docstore_snapshot_release(second);
+    docstore_free(&store);
+}
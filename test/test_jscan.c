@@ -0,0 +1,135 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/jscan.h"
+
+static bool span_is (const char *span, u64 len, const char *want) {
+    return span && len == strlen(want) && memcmp(span, want, len) == 0;
+}
+
+Test (jscan, envelope) {
+
+    const char *text =
+        " {\"jsonrpc\": \"2.0\", \"params\" : {\"a\": [1, \"}\\\"]\"], "
+        "\"b\": {}}, \"id\":\"abc\" ,\r\n\"method\":\"textDocument/hover\"} ";
+    jscan_envelope env;
+
+    cr_assert_eq(jscan_peek(text, strlen(text), &env), 0);
+    cr_assert(span_is(env.method, env.method_len, "textDocument/hover"));
+    cr_assert_not(env.method_escaped);
+    cr_assert(span_is(env.id, env.id_len, "\"abc\""));
+    cr_assert(span_is(env.params, env.params_len,
+                      "{\"a\": [1, \"}\\\"]\"], \"b\": {}}"));
+}
+
+Test (jscan, missing_and_duplicate_keys) {
+
+    jscan_envelope env;
+
+    const char *notification = "{\"method\":\"exit\"}";
+    cr_assert_eq(jscan_peek(notification, strlen(notification), &env), 0);
+    cr_assert(span_is(env.method, env.method_len, "exit"));
+    cr_assert_null(env.id);
+    cr_assert_null(env.params);
+
+    const char *duplicate = "{\"id\":1,\"id\":2,\"method\":7,\"x\":null}";
+    cr_assert_eq(jscan_peek(duplicate, strlen(duplicate), &env), 0);
+    cr_assert(span_is(env.id, env.id_len, "1"));
+    /* A method which is not a string is no method */
+    cr_assert_null(env.method);
+
+    cr_assert_eq(jscan_peek("{}", 2, &env), 0);
+}
+
+Test (jscan, malformed) {
+
+    const char *bad[] = {
+        "",
+        "[]",
+        "{",
+        "{\"method\"}",
+        "{\"method\":}",
+        "{\"method\":\"exit\"",
+        "{\"method\":\"exit\\\"}",
+        "{\"params\":{\"a\":[1,2}",
+        "{\"id\":1 \"method\":\"exit\"}",
+        "{\"id\":1} trailing",
+    };
+    jscan_envelope env;
+
+    for (size_t i = 0; i < ARRAY_LENGTH(bad); ++i) {
+        cr_assert_eq(jscan_peek(bad[i], strlen(bad[i]), &env), -1,
+                     "Accepted malformed `%s`", bad[i]);
+    }
+}
+
+/* Long strings are skipped without looking at every byte's meaning */
+Test (jscan, long_params) {
+
+    u64 text_len = 1 << 20;
+    char *msg = malloc(text_len + 128);
+    u64 len = sprintf(msg, "{\"params\":{\"text\":\"");
+    memset(msg + len, 'x', text_len);
+    len += text_len;
+    /* Escaped quotes and backslashes right before the real end */
+    len += sprintf(msg + len, "\\\\\\\"\\\\\"},\"id\":42,\"method\":\"m\"}");
+
+    jscan_envelope env;
+    cr_assert_eq(jscan_peek(msg, len, &env), 0);
+    cr_assert(span_is(env.id, env.id_len, "42"));
+    cr_assert(span_is(env.method, env.method_len, "m"));
+    cr_assert_eq(env.params_len, text_len + 17);
+
+    free(msg);
+}
+
+Test (jscan, unescape) {
+
+    char out[32];
+
+    const char *method = "textDocument\\/did\\u004fpen";
+    i64 len = jscan_unescape(method, strlen(method), out, sizeof(out));
+    cr_assert_eq(len, 20);
+    cr_assert(span_is(out, len, "textDocument/didOpen"));
+
+    /* U+00E9, U+20AC and U+1F600 as a surrogate pair */
+    const char *wide = "\\u00e9\\u20AC\\ud83d\\ude00";
+    len = jscan_unescape(wide, strlen(wide), out, sizeof(out));
+    cr_assert(span_is(out, len, "\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80"));
+
+    const char *bad[] = {"\\", "\\x", "\\u12", "\\ud83d", "\\ude00",
+                         "\\ud83d\\u0041"};
+    for (size_t i = 0; i < ARRAY_LENGTH(bad); ++i) {
+        cr_assert_eq(jscan_unescape(bad[i], strlen(bad[i]), out, sizeof(out)),
+                     -1, "Accepted bad escape `%s`", bad[i]);
+    }
+
+    /* Does not write past the buffer */
+    cr_assert_eq(jscan_unescape("abcd", 4, out, 3), -1);
+}
+
+Test (jscan, find_key) {
+
+    const char *params = "{ \"context\": {\"uri\": \"no\"}, \"textDocument\" :"
+                         " {\"uri\": \"file:///a\\u0020b\"} , \"x\": [] }";
+    const char *value;
+    u64 value_len;
+
+    cr_assert_eq(jscan_find_key(params, strlen(params), "textDocument",
+                                &value, &value_len), 1);
+    cr_assert(span_is(value, value_len, "{\"uri\": \"file:///a\\u0020b\"}"));
+
+    /* Only the top level is searched */
+    cr_assert_eq(jscan_find_key(value, value_len, "uri", &value, &value_len),
+                 1);
+    cr_assert(span_is(value, value_len, "\"file:///a\\u0020b\""));
+    cr_assert_eq(jscan_find_key(params, strlen(params), "uri",
+                                &value, &value_len), 0);
+
+    cr_assert_eq(jscan_find_key("{}", 2, "uri", &value, &value_len), 0);
+    cr_assert_eq(jscan_find_key("[1]", 3, "uri", &value, &value_len), -1);
+    cr_assert_eq(jscan_find_key("{\"a\" 1}", 7, "uri", &value, &value_len),
+                 -1);
+}
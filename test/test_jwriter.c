@@ -0,0 +1,133 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/jwriter.h"
+#include "../src/lsp.h"
+#include "../src/output.h"
+
+/* Flushes `out` into a pipe and returns the body of its single frame */
+static void read_body (pipeline_output *out, int fds[2], char *body,
+                       size_t cap) {
+
+    cr_assert_eq(output_flush(out), 0);
+
+    char got[4096] = {0};
+    ssize_t n = read(fds[0], got, sizeof(got) - 1);
+    cr_assert_gt(n, 0);
+
+    size_t body_len = 0;
+    int header_len = 0;
+    cr_assert_eq(sscanf(got, "Content-Length: %zu\r\n\r\n%n", &body_len,
+                        &header_len),
+                 1);
+    cr_assert_eq((size_t) n, header_len + body_len, "Header does not match");
+    cr_assert_lt(body_len, cap);
+
+    memcpy(body, got + header_len, body_len);
+    body[body_len] = '\0';
+}
+
+Test (jwriter, compact_nesting) {
+
+    int fds[2];
+    cr_assert_eq(pipe(fds), 0);
+    pipeline_output out;
+    output_init(&out, fds[1]);
+
+    jwriter writer;
+    jwriter_begin(&writer, &out);
+    jwriter_object_begin(&writer);
+    jwriter_key(&writer, "items");
+    jwriter_array_begin(&writer);
+    for (int i = 0; i < 3; ++i) {
+        jwriter_object_begin(&writer);
+        jwriter_key(&writer, "n");
+        jwriter_int(&writer, i - 1);
+        jwriter_object_end(&writer);
+    }
+    jwriter_array_begin(&writer);
+    jwriter_array_end(&writer);
+    jwriter_object_begin(&writer);
+    jwriter_object_end(&writer);
+    jwriter_array_end(&writer);
+    jwriter_key(&writer, "flags");
+    jwriter_array_begin(&writer);
+    jwriter_bool(&writer, true);
+    jwriter_bool(&writer, false);
+    jwriter_null(&writer);
+    jwriter_cstring(&writer, NULL);
+    jwriter_array_end(&writer);
+    jwriter_key(&writer, "id");
+    jwriter_raw(&writer, "\"abc\"", 5);
+    jwriter_key(&writer, "max");
+    jwriter_int(&writer, INT64_MIN);
+    jwriter_object_end(&writer);
+    jwriter_end(&writer);
+
+    char body[512];
+    read_body(&out, fds, body, sizeof(body));
+    cr_assert_str_eq(body,
+                     "{\"items\":[{\"n\":-1},{\"n\":0},{\"n\":1},[],{}],"
+                     "\"flags\":[true,false,null,null],\"id\":\"abc\","
+                     "\"max\":-9223372036854775808}");
+
+    output_free(&out);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+Test (jwriter, escaping) {
+
+    int fds[2];
+    cr_assert_eq(pipe(fds), 0);
+    pipeline_output out;
+    output_init(&out, fds[1]);
+
+    const char text[] = "a\"b\\c\nd\te\x01\x1f\r\b\f/\xC3\xA9";
+
+    jwriter writer;
+    jwriter_begin(&writer, &out);
+    jwriter_array_begin(&writer);
+    jwriter_string(&writer, text, sizeof(text) - 1);
+    /* Embedded NUL bytes are written as escapes too */
+    jwriter_string(&writer, "x\0y", 3);
+    jwriter_array_end(&writer);
+    jwriter_end(&writer);
+
+    char body[512];
+    read_body(&out, fds, body, sizeof(body));
+    cr_assert_str_eq(body, "[\"a\\\"b\\\\c\\nd\\te\\u0001\\u001f\\r\\b\\f/"
+                           "\xC3\xA9\",\"x\\u0000y\"]");
+
+    output_free(&out);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+Test (jwriter, error_reply) {
+
+    int fds[2];
+    cr_assert_eq(pipe(fds), 0);
+    pipeline_output out;
+    output_init(&out, fds[1]);
+
+    char body[512];
+
+    lsp_reply_error(&out, "17", 2, RPC_MethodNotFound, "Not \"here\".");
+    read_body(&out, fds, body, sizeof(body));
+    cr_assert_str_eq(body, "{\"jsonrpc\":\"2.0\",\"id\":17,\"error\":{\"code\":"
+                           "-32601,\"message\":\"Not \\\"here\\\".\"}}");
+
+    lsp_reply_error(&out, NULL, 0, RPC_ParseError, "Bad.");
+    read_body(&out, fds, body, sizeof(body));
+    cr_assert_str_eq(body, "{\"jsonrpc\":\"2.0\",\"id\":null,\"error\":{"
+                           "\"code\":-32700,\"message\":\"Bad.\"}}");
+
+    output_free(&out);
+    close(fds[0]);
+    close(fds[1]);
+}
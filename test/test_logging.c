@@ -0,0 +1,164 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/common.h"
+#include "../src/logging.h"
+
+#define logging_threads 4
+#define logging_lines 2000
+
+static void *log_lines (void *arg) {
+
+    int thread = *(int *) arg;
+    for (int i = 0; i < logging_lines; ++i) {
+        log_info("thread %d line %d", thread, i);
+    }
+    return NULL;
+}
+
+/* Count the lines of `file` which start with `prefix` */
+static u64 count_lines (FILE *file, const char *prefix) {
+
+    char line[1024];
+    u64 count = 0;
+
+    fseek(file, 0, SEEK_SET);
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, prefix, strlen(prefix)) == 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Every record is written or counted as dropped, none goes missing */
+Test (logging, threads_and_drops) {
+
+    FILE *file = tmpfile();
+    cr_assert_not_null(file);
+    yama_log_init_file(file);
+
+    u64 dropped_before = log_dropped();
+
+    pthread_t threads[logging_threads];
+    int ids[logging_threads];
+    for (int i = 0; i < logging_threads; ++i) {
+        ids[i] = i;
+        pthread_create(&threads[i], NULL, log_lines, &ids[i]);
+    }
+    for (int i = 0; i < logging_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    log_flush();
+
+    u64 written = count_lines(file, "(INFO) test/test_logging.c");
+    u64 dropped = log_dropped() - dropped_before;
+    cr_assert_eq(written + dropped, logging_threads * logging_lines,
+                 "`%llu` written and `%llu` dropped", written, dropped);
+
+    if (dropped > 0) {
+        cr_assert_gt(count_lines(file, "(WARNING) logging: dropped"), 0);
+    }
+
+    /* Back to stderr for the other tests, which closes nothing */
+    yama_log_init_file(NULL);
+    fclose(file);
+}
+
+/* Long messages are cut short rather than dropped */
+Test (logging, truncated) {
+
+    FILE *file = tmpfile();
+    cr_assert_not_null(file);
+    yama_log_init_file(file);
+
+    char long_text[2048];
+    memset(long_text, 'x', sizeof(long_text) - 1);
+    long_text[sizeof(long_text) - 1] = '\0';
+    log_warn("%s", long_text);
+    log_flush();
+
+    char line[4096] = {0};
+    fseek(file, 0, SEEK_SET);
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, "(WARNING)", 9) == 0) {
+            break;
+        }
+    }
+    cr_assert_not_null(strstr(line, "xxx...\n"), "Line `%s`", line);
+
+    yama_log_init_file(NULL);
+    fclose(file);
+}
+
+/* A prefix longer than the whole batch buffer is cut short too */
+Test (logging, long_prefix) {
+
+    FILE *file = tmpfile();
+    cr_assert_not_null(file);
+    yama_log_init_file(file);
+
+    static char long_file[200 * 1024];
+    memset(long_file, 'f', sizeof(long_file) - 1);
+    log_formatted_input(long_file, __func__, __LINE__, LOG_TYPE_WARNING,
+                        "cut");
+    log_warn("after");
+    log_flush();
+
+    cr_assert_eq(count_lines(file, "(WARNING) ffff"), 1);
+    cr_assert_eq(count_lines(file, "(WARNING) test/test_logging.c"), 1);
+
+    yama_log_init_file(NULL);
+    fclose(file);
+}
+
+static int evaluated = 0;
+
+static int count_evaluation (void) {
+    return ++evaluated;
+}
+
+/* Below the runtime level not even the arguments are evaluated */
+Test (logging, disabled_skips_arguments) {
+
+    evaluated = 0;
+    log_set_level(LOG_TYPE_WARNING);
+
+    log_debug("%d", count_evaluation());
+    log_info("%d", count_evaluation());
+    cr_assert_eq(evaluated, 0);
+
+    log_warn("%d", count_evaluation());
+    cr_assert_eq(evaluated, 1);
+
+    log_set_level(LOG_TYPE_ALL);
+    log_flush();
+}
+
+#define disabled_calls (1000 * 1000)
+
+/* A disabled call is a load and a branch, nowhere near the cost of
+   formatting even in a sanitised debug build */
+Test (logging, disabled_costs_nothing) {
+
+    log_set_level(LOG_TYPE_ERROR);
+
+    struct timespec start, end;
+    char text[] = "some long message text which is never formatted";
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < disabled_calls; ++i) {
+        log_debug("Content read: `%s` `%d` `%f`", text, i, (double) i);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    log_set_level(LOG_TYPE_ALL);
+
+    u64 elapsed = (u64) (end.tv_sec - start.tv_sec) * 1000 * 1000 * 1000 +
+                  (u64) end.tv_nsec - (u64) start.tv_nsec;
+    cr_assert_lt(elapsed / disabled_calls, 50, "`%llu` ns per call",
+                 elapsed / disabled_calls);
+}
@@ -2,13 +2,18 @@
 #include <criterion/logging.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "../src/logging.h"
 #include "../src/lsp.h"
 #include "../src/pipeline.h"
 
 Test (test_lsp, test_initialize) {
+    pipeline_output out;
+    output_init(&out, STDOUT_FILENO);
 
-    msg_t* initialize = malloc(sizeof(msg_t));
+
+    msg_t* initialize = calloc(1, sizeof(msg_t));
     char* content =
         "{\n"
         "  \"jsonrpc\": \"2.0\",\n"
@@ -40,18 +45,23 @@ Test (test_lsp, test_initialize) {
 
     strcpy(initialize->content, content);
     initialize->len = strlen(initialize->content);
-    LspState state;
+    LspState state = {0};
     state.client.shutdown_requested = false;
 
-    pipeline_dispatcher(stdout, initialize, &state);
+    pipeline_dispatcher(&out, initialize, &state);
 
     free(initialize->content);
     free(initialize);
-    free(state.client.root_uri);
+    lsp_state_free(&state);
+    output_flush(&out);
+    output_free(&out);
 }
 
 
 Test (test_lsp, test_initialize_w_sync) {
+    pipeline_output out;
+    output_init(&out, STDOUT_FILENO);
+
 
     const char* content =
         "{\n"
@@ -100,7 +110,7 @@ Test (test_lsp, test_initialize_w_sync) {
         "    }\n"
         "}";
 
-    msg_t* initialize = malloc(sizeof(msg_t));
+    msg_t* initialize = calloc(1, sizeof(msg_t));
     initialize->content = malloc(strlen(content) + 10);
     if (initialize->content == NULL) {
         /* Handle allocation failure */
@@ -110,17 +120,22 @@ Test (test_lsp, test_initialize_w_sync) {
 
     strcpy(initialize->content, content);
     initialize->len = strlen(initialize->content);
-    LspState state;
+    LspState state = {0};
     state.client.shutdown_requested = false;
 
-    pipeline_dispatcher(stdout, initialize, &state);
+    pipeline_dispatcher(&out, initialize, &state);
 
     free(initialize->content);
     free(initialize);
-    free(state.client.root_uri);
+    lsp_state_free(&state);
     free(state.error.msg);
+    output_flush(&out);
+    output_free(&out);
 }
 Test (test_lsp, test_initialized) {
+    pipeline_output out;
+    output_init(&out, STDOUT_FILENO);
+
 
     const char* content =
         "{\n"
@@ -169,7 +184,7 @@ Test (test_lsp, test_initialized) {
         "    }\n"
         "}";
 
-    msg_t* initialize = malloc(sizeof(msg_t));
+    msg_t* initialize = calloc(1, sizeof(msg_t));
     initialize->content = malloc(strlen(content) + 10);
     if (initialize->content == NULL) {
         /* Handle allocation failure */
@@ -184,7 +199,7 @@ Test (test_lsp, test_initialized) {
 
     fprintf(stderr, "Sendine initialize method!\n");
     /* Send our initialise method */
-    pipeline_dispatcher(stdout, initialize, &state);
+    pipeline_dispatcher(&out, initialize, &state);
 
 
     free(initialize->content);
@@ -192,7 +207,7 @@ Test (test_lsp, test_initialized) {
 
     char *initialized_msg =  "{\n  \"jsonrpc\": \"2.0\",\n  \"method\": \"initialized\",\n  \"params\": {}\n}\n";
 
-    initialize = malloc(sizeof(msg_t));
+    initialize = calloc(1, sizeof(msg_t));
     initialize->content = malloc(strlen(initialized_msg) + 1);
     if (initialize->content == NULL) {
         /* Handle allocation failure */
@@ -204,18 +219,23 @@ Test (test_lsp, test_initialized) {
     initialize->len = strlen(initialize->content);
 
     fprintf(stderr, "Sendine client initialized method!\n");
-    pipeline_dispatcher(stdout, initialize, &state);
+    pipeline_dispatcher(&out, initialize, &state);
 
     free(initialize->content);
     free(initialize);
-    free(state.client.root_uri);
+    lsp_state_free(&state);
     free(state.error.msg);
+    output_flush(&out);
+    output_free(&out);
 }
 
 
 Test (test_lsp, test_doc_DidOpen) {
+    pipeline_output out;
+    output_init(&out, STDOUT_FILENO);
 
-    msg_t* didOpen = malloc(sizeof(msg_t));
+
+    msg_t* didOpen = calloc(1, sizeof(msg_t));
     char* content =
         "{\r\n"
         "  \"jsonrpc\": \"2.0"
@@ -224,6 +244,7 @@ Test (test_lsp, test_doc_DidOpen) {
         "  \"method\": \"text"
         "Document/didOpen\","
         "\r\n"
+        "  \"params\": {\r\n"
         "  \"textDocument\": "
         "{\r\n"
         "    \"uri\": \"/abc/"
@@ -238,6 +259,7 @@ Test (test_lsp, test_doc_DidOpen) {
         "blahline2and line 3!"
         "\"\r\n"
         "  }\r\n"
+        "  }\r\n"
         "}";
 
     didOpen->content = malloc(strlen(content) + 10);
@@ -250,11 +272,284 @@ Test (test_lsp, test_doc_DidOpen) {
     strcpy(didOpen->content, content);
     didOpen->len = strlen(didOpen->content);
 
-    LspState state;
+    LspState state = {0};
     state.client.shutdown_requested = false;
-    pipeline_dispatcher(stdout, didOpen, &state);
+    state.client.initialized = true;
+    int result = pipeline_dispatcher(&out, didOpen, &state);
+    cr_assert_eq(result, 0, "didOpen failed with `%d`", result);
+
+    const char *uri = "/abc/uri/to/no/where/";
+    Document *doc = docstore_find(&state.documents, uri, strlen(uri));
+    cr_assert_not_null(doc, "didOpen did not store the document");
+    cr_assert_eq(doc->version, 9000);
+    char *text = rope_flatten(&doc->text);
+    cr_assert_str_eq(text, "blahblahline2and line 3!");
+    free(text);
+
+    /* The store owns its copy, closing frees it */
+    char close_msg[] =
+        "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didClose\",\"params\":"
+        "{\"textDocument\":{\"uri\":\"/abc/uri/to/no/where/\"}}}";
+    msg_t close_message = {.content = close_msg, .len = strlen(close_msg)};
+    cr_assert_eq(pipeline_dispatcher(&out, &close_message, &state), 0);
+    cr_assert_null(docstore_find(&state.documents, uri, strlen(uri)));
     puts("Finished pipeline dispatcher");
 
     free(didOpen->content);
     free(didOpen);
+    lsp_state_free(&state);
+    output_flush(&out);
+    output_free(&out);
+}
+
+/* The cheapest encoding the client offers is advertised and used */
+Test (test_lsp, test_position_encoding) {
+
+    int fds[2];
+    cr_assert_eq(pipe(fds), 0);
+    pipeline_output out;
+    output_init(&out, fds[1]);
+
+    char content[] =
+        "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"initialize\","
+        "\"params\":{\"processId\":null,\"rootUri\":\"file:///p\","
+        "\"capabilities\":{\"general\":{\"positionEncodings\":"
+        "[\"utf-16\",\"utf-32\",\"utf-8\"]}}}}";
+    msg_t message = {.content = content, .len = strlen(content)};
+    LspState state = {0};
+
+    cr_assert_eq(pipeline_dispatcher(&out, &message, &state), 0);
+    cr_assert_eq(state.client.position_encoding, ROPE_UTF8);
+    cr_assert_eq(output_flush(&out), 0);
+
+    char got[512] = {0};
+    cr_assert_gt(read(fds[0], got, sizeof(got) - 1), 0);
+    cr_assert_not_null(strstr(got, "{\"capabilities\":{\"positionEncoding\":"
+                                   "\"utf-8\",\"textDocumentSync\""));
+
+    /* Columns are bytes from now on */
+    state.client.initialized = true;
+    char open_msg[] =
+        "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\",\"params\":"
+        "{\"textDocument\":{\"uri\":\"file:///e.md\",\"languageId\":\"md\","
+        "\"version\":1,\"text\":\"caf\u00e9 au lait\"}}}";
+    message = (msg_t){.content = open_msg, .len = strlen(open_msg)};
+    cr_assert_eq(pipeline_dispatcher(&out, &message, &state), 0);
+
+    char change_msg[] =
+        "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\","
+        "\"params\":{\"textDocument\":{\"uri\":\"file:///e.md\",\"version\":2},"
+        "\"contentChanges\":[{\"range\":{\"start\":{\"line\":0,"
+        "\"character\":5},\"end\":{\"line\":0,\"character\":9}},"
+        "\"text\":\"_\"}]}}";
+    message = (msg_t){.content = change_msg, .len = strlen(change_msg)};
+    cr_assert_eq(pipeline_dispatcher(&out, &message, &state), 0);
+
+    Document *doc = docstore_find(&state.documents, "file:///e.md", 12);
+    char *text = rope_flatten(&doc->text);
+    cr_assert_str_eq(text, "caf\xC3\xA9_lait");
+    free(text);
+
+    lsp_state_free(&state);
+    output_free(&out);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* Incremental changes land in the stored text, a change without a range
+   replaces all of it */
+Test (test_lsp, test_doc_DidChange) {
+
+    pipeline_output out;
+    output_init(&out, STDOUT_FILENO);
+    LspState state = {0};
+    state.client.initialized = true;
+
+    char open_msg[] =
+        "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\",\"params\":"
+        "{\"textDocument\":{\"uri\":\"file:///c.md\",\"languageId\":\"md\","
+        "\"version\":1,\"text\":\"first line\\nsecond line\\n\"}}}";
+    msg_t message = {.content = open_msg, .len = strlen(open_msg)};
+    cr_assert_eq(pipeline_dispatcher(&out, &message, &state), 0);
+
+    Document *doc = docstore_find(&state.documents, "file:///c.md", 12);
+    cr_assert_not_null(doc);
+    cr_assert(doc->dirty.set && doc->dirty.end == 23);
+    doc->dirty = (dirty_span){0};
+
+    char change_msg[] =
+        "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\","
+        "\"params\":{\"textDocument\":{\"uri\":\"file:///c.md\",\"version\":2},"
+        "\"contentChanges\":["
+        "{\"range\":{\"start\":{\"line\":0,\"character\":0},"
+        "\"end\":{\"line\":0,\"character\":5}},\"rangeLength\":5,"
+        "\"text\":\"1st\"},"
+        "{\"range\":{\"start\":{\"line\":1,\"character\":6},"
+        "\"end\":{\"line\":1,\"character\":6}},\"text\":\"!\"}]}}";
+    message = (msg_t){.content = change_msg, .len = strlen(change_msg)};
+    cr_assert_eq(pipeline_dispatcher(&out, &message, &state), 0);
+
+    cr_assert_eq(doc->version, 2);
+    char *text = rope_flatten(&doc->text);
+    cr_assert_str_eq(text, "1st line\nsecond! line\n");
+    free(text);
+    /* One span over both changes */
+    cr_assert(doc->dirty.set);
+    cr_assert_eq(doc->dirty.start, 0);
+    cr_assert_eq(doc->dirty.end, 16);
+
+    char full_msg[] =
+        "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\","
+        "\"params\":{\"textDocument\":{\"uri\":\"file:///c.md\",\"version\":3},"
+        "\"contentChanges\":["
+        "{\"range\":{\"start\":{\"line\":0,\"character\":0},"
+        "\"end\":{\"line\":0,\"character\":1}},\"text\":\"gone\"},"
+        "{\"text\":\"all new\"},"
+        "{\"range\":{\"start\":{\"line\":0,\"character\":7},"
+        "\"end\":{\"line\":0,\"character\":7}},\"text\":\"er\"}]}}";
+    message = (msg_t){.content = full_msg, .len = strlen(full_msg)};
+    cr_assert_eq(pipeline_dispatcher(&out, &message, &state), 0);
+    text = rope_flatten(&doc->text);
+    cr_assert_str_eq(text, "all newer");
+    free(text);
+    cr_assert_eq(doc->dirty.start, 0);
+    cr_assert_eq(doc->dirty.end, 9);
+
+    lsp_state_free(&state);
+    output_flush(&out);
+    output_free(&out);
+}
+
+/* The reply is compact and echoes the id exactly as the client sent it */
+Test (test_lsp, test_initialize_reply) {
+
+    int fds[2];
+    cr_assert_eq(pipe(fds), 0);
+    pipeline_output out;
+    output_init(&out, fds[1]);
+
+    char content[] =
+        "{\"jsonrpc\":\"2.0\",\"id\":\"init-1\",\"method\":\"initialize\","
+        "\"params\":{\"processId\":null,\"rootUri\":\"file:///p\","
+        "\"capabilities\":{}}}";
+    msg_t message = {.content = content, .len = strlen(content)};
+    LspState state = {0};
+
+    cr_assert_eq(pipeline_dispatcher(&out, &message, &state), 0);
+    cr_assert_eq(output_flush(&out), 0);
+
+    const char *body =
+        "{\"jsonrpc\":\"2.0\",\"id\":\"init-1\",\"result\":{\"capabilities\":"
+        "{\"textDocumentSync\":{\"change\":2,\"openClose\":true,"
+        "\"didSave\":true}}}}";
+    char expected[512];
+    snprintf(expected, sizeof(expected), "Content-Length: %zu\r\n\r\n%s",
+             strlen(body), body);
+
+    char got[512] = {0};
+    cr_assert_gt(read(fds[0], got, sizeof(got) - 1), 0);
+    cr_assert_str_eq(got, expected);
+
+    lsp_state_free(&state);
+    output_free(&out);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* A second `initialize` is refused and changes nothing */
+Test (test_lsp, test_initialize_twice) {
+
+    int fds[2];
+    cr_assert_eq(pipe(fds), 0);
+    pipeline_output out;
+    output_init(&out, fds[1]);
+
+    char first[] =
+        "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"initialize\","
+        "\"params\":{\"processId\":null,\"rootUri\":\"file:///p\","
+        "\"capabilities\":{}}}";
+    msg_t message = {.content = first, .len = strlen(first)};
+    LspState state = {0};
+    cr_assert_eq(pipeline_dispatcher(&out, &message, &state), 0);
+    cr_assert_eq(output_flush(&out), 0);
+
+    char got[512] = {0};
+    cr_assert_gt(read(fds[0], got, sizeof(got) - 1), 0);
+    char *root = state.client.root_uri;
+
+    char second[] =
+        "{\"jsonrpc\":\"2.0\",\"id\":2,\"method\":\"initialize\","
+        "\"params\":{\"processId\":null,\"rootUri\":\"file:///q\","
+        "\"capabilities\":{}}}";
+    message = (msg_t){.content = second, .len = strlen(second)};
+    pipeline_dispatcher(&out, &message, &state);
+    cr_assert_eq(output_flush(&out), 0);
+
+    memset(got, 0, sizeof(got));
+    cr_assert_gt(read(fds[0], got, sizeof(got) - 1), 0);
+    cr_assert_not_null(strstr(got, "\"id\":2,\"error\":{\"code\":-32600"),
+                       "Got `%s`", got);
+    cr_assert_eq(state.client.root_uri, root);
+    cr_assert_str_eq(state.client.root_uri, "file:///p");
+
+    lsp_state_free(&state);
+    output_free(&out);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* `$/setTrace` changes the runtime log level, before `initialize` too */
+Test (test_lsp, test_set_trace) {
+
+    pipeline_output out;
+    output_init(&out, STDOUT_FILENO);
+    LspState state = {0};
+
+    char off[] = "{\"jsonrpc\":\"2.0\",\"method\":\"$/setTrace\","
+                 "\"params\":{\"value\":\"off\"}}";
+    msg_t message = {.content = off, .len = strlen(off)};
+    cr_assert_eq(pipeline_dispatcher(&out, &message, &state), 0);
+    cr_assert_not(log_enabled(LOG_TYPE_INFO));
+    cr_assert(log_enabled(LOG_TYPE_WARNING));
+
+    char verbose[] = "{\"jsonrpc\":\"2.0\",\"method\":\"$/setTrace\","
+                     "\"params\":{\"value\":\"verbose\"}}";
+    message = (msg_t) {.content = verbose, .len = strlen(verbose)};
+    cr_assert_eq(pipeline_dispatcher(&out, &message, &state), 0);
+    cr_assert(log_enabled(LOG_TYPE_DEBUG));
+
+    lsp_state_free(&state);
+    output_free(&out);
+}
+
+/* An analysis of a version the document already left publishes nothing,
+   not even the empty list a document without a dictionary gets */
+Test (test_lsp, test_stale_analysis_dropped) {
+
+    LspState state = {0};
+    const char *uri = "file:///a.md";
+    Document *doc = docstore_open(&state.documents, uri, strlen(uri), NULL, 1,
+                                  "dgo", 3);
+    DocSnapshot *snapshot = docstore_snapshot(doc);
+
+    FILE *replies = tmpfile();
+    pipeline_output out;
+    output_init(&out, fileno(replies));
+
+    docstore_set_version(doc, 2);
+    LspRequest request = {.out = &out, .snapshot = snapshot};
+    cr_assert_eq(lsp_analyse_document(&state, &request), 0);
+
+    /* Nor once it is closed, even at the version it was taken at */
+    docstore_set_version(doc, 1);
+    docstore_close(&state.documents, uri, strlen(uri));
+    cr_assert_eq(lsp_analyse_document(&state, &request), 0);
+
+    cr_assert_eq(output_flush(&out), 0);
+    cr_assert_eq(lseek(fileno(replies), 0, SEEK_END), 0);
+
+    docstore_snapshot_release(snapshot);
+    lsp_state_free(&state);
+    output_free(&out);
+    fclose(replies);
 }
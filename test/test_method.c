@@ -0,0 +1,64 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <string.h>
+
+#include "../src/method.h"
+
+static const char *def_names[] = {
+#define METHOD(id, name, handler, kind, needs_init, worker) name,
+#include "../src/methods.def"
+#undef METHOD
+};
+
+/* Every method in methods.def hashes to its own descriptor */
+Test (method, lookup_all) {
+
+    for (size_t i = 0; i < ARRAY_LENGTH(def_names); ++i) {
+        const method_desc *desc =
+            method_lookup(def_names[i], strlen(def_names[i]));
+
+        cr_assert_not_null(desc, "Method `%s` not found", def_names[i]);
+        cr_assert_str_eq(desc->name, def_names[i]);
+        cr_assert_eq(desc->type, (method_type) (i + 1));
+        cr_assert_eq(method_by_type(desc->type), desc);
+    }
+}
+
+Test (method, lookup_unknown) {
+
+    const char *unknown[] = {
+        "", "exit_", "Initialize", "textDocument/didOpen ", "textDocument",
+        "workspace/", "$/", "textDocument/didOpenX",
+    };
+
+    for (size_t i = 0; i < ARRAY_LENGTH(unknown); ++i) {
+        cr_assert_null(method_lookup(unknown[i], strlen(unknown[i])),
+                       "Matched unknown method `%s`", unknown[i]);
+    }
+    cr_assert_null(method_lookup(NULL, 0));
+
+    /* Only the length given counts, not the terminator */
+    cr_assert_not_null(method_lookup("exit_", 4));
+    cr_assert_null(method_by_type(UNKNOWN));
+    cr_assert_null(method_by_type(METHOD_COUNT));
+}
+
+Test (method, descriptors) {
+
+    const method_desc *exit_desc = method_lookup("exit", 4);
+    cr_assert_eq(exit_desc->kind, METHOD_NOTIFICATION);
+    cr_assert_not(exit_desc->needs_init);
+    cr_assert_not_null(exit_desc->handler);
+
+    const char *hover = "textDocument/hover";
+    const method_desc *hover_desc = method_lookup(hover, strlen(hover));
+    cr_assert_not_null(hover_desc);
+    cr_assert_eq(hover_desc->kind, METHOD_REQUEST);
+    cr_assert(hover_desc->needs_init);
+    cr_assert_null(hover_desc->handler);
+
+    const char *action = "textDocument/codeAction";
+    const method_desc *action_desc = method_lookup(action, strlen(action));
+    cr_assert_not_null(action_desc->handler);
+    cr_assert(action_desc->worker);
+}
@@ -0,0 +1,80 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/output.h"
+
+/* Replies queued in one cycle are framed and leave in a single write */
+Test (output, coalesced_flush) {
+
+    int fds[2];
+    cr_assert_eq(pipe(fds), 0);
+
+    pipeline_output out;
+    output_init(&out, fds[1]);
+
+    const char *bodies[] = {
+        "{\"id\":1}",
+        "{\"id\":2,\"result\":null}",
+        "{\"jsonrpc\":\"2.0\",\"id\":3,\"result\":{\"items\":[]}}",
+    };
+
+    for (size_t i = 0; i < ARRAY_LENGTH(bodies); ++i) {
+        output_queue_reply(&out, bodies[i], strlen(bodies[i]));
+    }
+    cr_assert(output_pending(&out));
+    cr_assert_eq(output_flush(&out), 0);
+    cr_assert_not(output_pending(&out));
+
+    cr_assert_eq(out.writes, 1, "Replies were not coalesced");
+    cr_assert_eq(out.frames_written, 3);
+
+    char expected[512] = {0};
+    for (size_t i = 0; i < ARRAY_LENGTH(bodies); ++i) {
+        size_t used = strlen(expected);
+        snprintf(expected + used, sizeof(expected) - used,
+                 "Content-Length: %zu\r\n\r\n%s", strlen(bodies[i]),
+                 bodies[i]);
+    }
+
+    char got[512] = {0};
+    ssize_t n = read(fds[0], got, sizeof(got) - 1);
+    cr_assert_eq(n, (ssize_t) strlen(expected));
+    cr_assert_str_eq(got, expected);
+
+    /* Nothing queued, nothing written */
+    cr_assert_eq(output_flush(&out), 0);
+    cr_assert_eq(out.writes, 1);
+
+    output_free(&out);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* Bodies written piecewise into the buffer get their header backfilled */
+Test (output, backfilled_header) {
+
+    int fds[2];
+    cr_assert_eq(pipe(fds), 0);
+
+    pipeline_output out;
+    output_init(&out, fds[1]);
+
+    output_begin(&out);
+    for (int i = 0; i < 100; ++i) {
+        output_append(&out, "0123456789", 10);
+    }
+    output_end(&out);
+    cr_assert_eq(output_flush(&out), 0);
+
+    char got[1100] = {0};
+    ssize_t n = read(fds[0], got, sizeof(got) - 1);
+    cr_assert_eq(n, 1000 + strlen("Content-Length: 1000\r\n\r\n"));
+    cr_assert_eq(strncmp(got, "Content-Length: 1000\r\n\r\n0123", 28), 0);
+
+    output_free(&out);
+    close(fds[0]);
+    close(fds[1]);
+}
@@ -2,6 +2,7 @@
 #include <criterion/logging.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "../src/lsp.h"
 #include "../src/pipeline.h"
@@ -26,20 +27,119 @@ Test (pipeline_utils, pipeline_read) {
     fputs(test_content, temp);
     fseek(temp, 0, SEEK_SET);
 
-    msg_t message;
-    int result = pipeline_read(temp, &message);
+    pipeline_reader reader;
+    pipeline_reader_init(&reader, fileno(temp));
+
+    msg_t message = {0};
+    int result = pipeline_read(&reader, &message);
 
     cr_assert_eq(result, 0, "pipeline_read failed");
     cr_assert_eq(message.len, 13, "Incorrect message length");
     cr_assert_str_eq(message.content, "Hello, World!",
                      "Incorrect message content");
 
-    free(message.content);
+    /* Nothing left to read */
+    cr_assert_eq(pipeline_read(&reader, &message), -1,
+                 "pipeline_read should fail at end of stream");
+
+    pipeline_reader_free(&reader);
     fclose(temp);
 }
 
+/* Several messages in one burst, with extra headers */
+Test (pipeline_utils, pipeline_read_burst) {
+    FILE *temp = tmpfile();
+    cr_assert_not_null(temp, "Failed to create temporary file");
+
+    const char *test_content =
+        "Content-Length: 5\r\n\r\nfirst"
+        "Content-Length: 6\r\n"
+        "Content-Type: application/vscode-jsonrpc; charset=utf-8\r\n\r\n"
+        "second"
+        "Content-Type: application/vscode-jsonrpc; charset=utf-8\r\n"
+        "Content-Length: 80\r\n\r\n"
+        "a body that is longer than the initial reader buffer in debug builds"
+        "............";
+    fputs(test_content, temp);
+    fseek(temp, 0, SEEK_SET);
+
+    pipeline_reader reader;
+    pipeline_reader_init(&reader, fileno(temp));
+    msg_t message = {0};
+
+    cr_assert_eq(pipeline_read(&reader, &message), 0);
+    cr_assert_eq(message.len, 5);
+    cr_assert_str_eq(message.content, "first");
+
+    cr_assert_eq(pipeline_read(&reader, &message), 0);
+    cr_assert_eq(message.len, 6);
+    cr_assert_str_eq(message.content, "second");
+
+    cr_assert_eq(pipeline_read(&reader, &message), 0);
+    cr_assert_eq(message.len, 80);
+    cr_assert_eq(strncmp(message.content, "a body that is longer", 21), 0);
+    cr_assert_eq(strlen(message.content), 80);
+
+    cr_assert_eq(pipeline_read(&reader, &message), -1);
+
+    pipeline_reader_free(&reader);
+    fclose(temp);
+}
+
+/* Body shorter than the advertised Content-Length */
+Test (pipeline_utils, pipeline_read_truncated) {
+    FILE *temp = tmpfile();
+    cr_assert_not_null(temp, "Failed to create temporary file");
+
+    fputs("Content-Length: 50\r\n\r\n{\"truncated\": true}", temp);
+    fseek(temp, 0, SEEK_SET);
+
+    pipeline_reader reader;
+    pipeline_reader_init(&reader, fileno(temp));
+    msg_t message = {0};
+
+    cr_assert_eq(pipeline_read(&reader, &message), -1,
+                 "Truncated body should fail");
+
+    pipeline_reader_free(&reader);
+    fclose(temp);
+}
+
+/* Lengths past the cap are framing errors, not allocations */
+Test (pipeline_utils, pipeline_read_oversized) {
+
+    const char *headers[] = {
+        "Content-Length: 18446744073709551615\r\n\r\n{}",
+        "Content-Length: 9223372036854775808\r\n\r\n{}",
+        "Content-Length: 1000000000000\r\n\r\n{}",
+        "Content-Length: 268435457\r\n\r\n{}",
+        "Content-Length: -2\r\n\r\n{}",
+    };
+
+    for (size_t i = 0; i < ARRAY_LENGTH(headers); ++i) {
+        FILE *temp = tmpfile();
+        cr_assert_not_null(temp, "Failed to create temporary file");
+        fputs(headers[i], temp);
+        fseek(temp, 0, SEEK_SET);
+
+        pipeline_reader reader;
+        pipeline_reader_init(&reader, fileno(temp));
+        msg_t message = {0};
+
+        cr_assert_eq(pipeline_read(&reader, &message), -1,
+                     "Header %zu should be rejected", i);
+        cr_assert_eq(reader.head, 0);
+
+        pipeline_reader_free(&reader);
+        fclose(temp);
+    }
+}
+
 /* Test dispatcher */
 Test (pipeline_utils, pipeline_dispatcher_exit) {
+    pipeline_output out;
+    output_init(&out, STDOUT_FILENO);
+
     const char *json_str = "{\"method\":\"exit\", \"id\":1}";
     msg_t message = {0};
     message.len = strlen(json_str);
@@ -47,22 +147,27 @@ Test (pipeline_utils, pipeline_dispatcher_exit) {
     strcpy(message.content, json_str);
     message.content[message.len] = '\0';
 
-    LspState state;
+    LspState state = {0};
     state.client.shutdown_requested = true;
 
-    int result = pipeline_dispatcher(stderr, &message, &state);
+    int result = pipeline_dispatcher(&out, &message, &state);
     cr_assert_eq(result, 999, "Dispatcher failed for exit with a shutdown");
 
     state.client.shutdown_requested = false;
 
-    result = pipeline_dispatcher(stderr, &message, &state);
+    result = pipeline_dispatcher(&out, &message, &state);
     cr_assert_eq(result, 1000, "Dispatcher failed for early exit method");
 
     free(message.content);
+    output_flush(&out);
+    output_free(&out);
 }
 
 Test (pipeline_utils, pipeline_dispatcher_shutdown) {
-    msg_t message;
+    pipeline_output out;
+    output_init(&out, STDOUT_FILENO);
+
+    msg_t message = {0};
     char *sdn_str = "{\"method\":\"shutdown\", \"id\":1}";
     char *exit_str = "{\"method\":\"exit\", \"id\":1}";
     char *any_str = "{\"method\":\"initialize\", \"id\":1}";
@@ -71,17 +176,17 @@ Test (pipeline_utils, pipeline_dispatcher_shutdown) {
     /* Shutdown method */
     curr_str = sdn_str;
 
-    LspState state;
+    LspState state = {0};
     state.client.shutdown_requested = false;
 
     message.len = strlen(curr_str);
     message.content = calloc(sizeof(char), message.len + 1);
     strcpy(message.content, curr_str);
     message.content[message.len] = '\0';
-    int result = pipeline_dispatcher(stderr, &message, &state);
+    int result = pipeline_dispatcher(&out, &message, &state);
     cr_assert_eq(result, 998, "Dispatcher failed for shutdown method.");
 
-    result = pipeline_dispatcher(stderr, &message, &state);
+    result = pipeline_dispatcher(&out, &message, &state);
     cr_assert_eq(result, 998,
                  "Dispatcher failed for repeated shutdown method.");
 
@@ -95,7 +200,7 @@ Test (pipeline_utils, pipeline_dispatcher_shutdown) {
     message.content[message.len] = '\0';
 
     state.client.shutdown_requested = true;
-    result = pipeline_dispatcher(stderr, &message, &state);
+    result = pipeline_dispatcher(&out, &message, &state);
     cr_assert_eq(
         result, 999,
         "Dispatcher failed to handle exit method whilst shutting down.");
@@ -109,34 +214,42 @@ Test (pipeline_utils, pipeline_dispatcher_shutdown) {
     message.content = calloc(sizeof(char), message.len + 1);
     strcpy(message.content, curr_str);
     message.content[message.len] = '\0';
-    result = pipeline_dispatcher(stderr, &message, &state);
+    result = pipeline_dispatcher(&out, &message, &state);
     cr_assert_eq(
         result, 998,
         "Dispatcher failed for irrelevant method whilst shutting down.");
 
     free(message.content);
+    output_flush(&out);
+    output_free(&out);
 }
 
 /* Test error cases */
 Test (pipeline_utils, test_error_cases) {
+    pipeline_output out;
+    output_init(&out, STDOUT_FILENO);
+
     /* Test NULL file pointer */
     cr_assert_eq(init_pipeline(NULL, NULL), -1,
                  "Should fail with NULL file pointer");
 
-    LspState state;
+    LspState state = {0};
     int err = RPC_ParseError;
 
     /* Test NULL message */
-    cr_assert_eq(pipeline_dispatcher(stderr, NULL, &state), err,
+    cr_assert_eq(pipeline_dispatcher(&out, NULL, &state), err,
                  "Should fail with NULL message");
 
     /* Test pipeline_read with NULL parameters */
     msg_t msg;
     cr_assert_eq(pipeline_read(NULL, &msg), -1,
-                 "Should fail with NULL file pointer");
+                 "Should fail with NULL reader");
 
-    cr_assert_eq(pipeline_read(tmpfile(), NULL), -1,
+    pipeline_reader reader;
+    pipeline_reader_init(&reader, fileno(stdin));
+    cr_assert_eq(pipeline_read(&reader, NULL), -1,
                  "Should fail with NULL message struct");
+    pipeline_reader_free(&reader);
 
     /* Test invalid JSON */
     /* msg_t message2;
@@ -147,4 +260,181 @@ Test (pipeline_utils, test_error_cases) {
      * int result2 = pipeline_dispatcher(&message2);
      * cr_expect_eq(result2, -1, "Dispatcher should fail for invalid method");
      */
+    output_flush(&out);
+    output_free(&out);
+}
+
+static void write_framed (FILE *to, const char *body) {
+    fprintf(to, "Content-Length: %zu\r\n\r\n%s", strlen(body), body);
+}
+
+/* Completions run on two workers, every one of them is answered before the
+   reply to `shutdown` */
+Test (pipeline_utils, worker_replies_before_shutdown) {
+    FILE *in = tmpfile();
+    FILE *out = tmpfile();
+    cr_assert(in && out);
+
+    write_framed(in, "{\"jsonrpc\":\"2.0\",\"id\":0,\"method\":\"initialize\","
+                     "\"params\":{\"processId\":1,\"rootUri\":\"file:///r\","
+                     "\"capabilities\":{},"
+                     "\"initializationOptions\":{\"workerThreads\":2}}}");
+    write_framed(in, "{\"jsonrpc\":\"2.0\",\"method\":\"initialized\","
+                     "\"params\":{}}");
+    write_framed(in, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\","
+                     "\"params\":{\"textDocument\":{\"uri\":\"file:///a\","
+                     "\"languageId\":\"text\",\"version\":1,\"text\":\"ab\"}}}");
+    for (int id = 1; id <= 8; ++id) {
+        char body[256];
+        snprintf(body, sizeof(body),
+                 "{\"jsonrpc\":\"2.0\",\"id\":%d,"
+                 "\"method\":\"textDocument/completion\",\"params\":{"
+                 "\"textDocument\":{\"uri\":\"file:///%c\"},"
+                 "\"position\":{\"line\":0,\"character\":1}}}",
+                 id, id % 2 ? 'a' : 'b');
+        write_framed(in, body);
+    }
+    write_framed(in, "{\"jsonrpc\":\"2.0\",\"id\":9,\"method\":\"shutdown\"}");
+    write_framed(in, "{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}");
+    fflush(in);
+    fseek(in, 0, SEEK_SET);
+
+    cr_assert_eq(init_pipeline(in, out), 0);
+
+    char replies[8192] = {0};
+    fseek(out, 0, SEEK_SET);
+    fread(replies, 1, sizeof(replies) - 1, out);
+
+    const char *shutdown_reply = strstr(replies, "\"id\":9");
+    cr_assert_not_null(shutdown_reply, "No reply to shutdown in `%s`",
+                       replies);
+    for (int id = 1; id <= 8; ++id) {
+        char want[64];
+        snprintf(want, sizeof(want),
+                 "\"id\":%d,\"result\":{\"isIncomplete\":false", id);
+        const char *reply = strstr(replies, want);
+        cr_assert_not_null(reply, "No reply to completion %d in `%s`", id,
+                           replies);
+        cr_assert_lt(reply, shutdown_reply);
+    }
+
+    fclose(in);
+    fclose(out);
+}
+
+/* A request cancelled while queued is answered without being handled */
+Test (pipeline_utils, cancelled_while_queued) {
+    FILE *replies = tmpfile();
+    cr_assert_not_null(replies);
+
+    pipeline_output out;
+    output_init(&out, fileno(replies));
+
+    char json_str[] = "{\"jsonrpc\":\"2.0\",\"id\":\"c1\","
+                      "\"method\":\"textDocument/completion\","
+                      "\"params\":{\"textDocument\":{\"uri\":\"file:///a\"},"
+                      "\"position\":{\"line\":0,\"character\":0}}}";
+    msg_t message = {0};
+    message.content = json_str;
+    message.len = strlen(json_str);
+    atomic_store(&message.cancelled, true);
+
+    LspState state = {0};
+    state.client.initialized = true;
+
+    cr_assert_eq(pipeline_dispatcher(&out, &message, &state),
+                 RequestCancelled);
+
+    /* Nothing is running, so cancelling again is a no-op */
+    char cancel_str[] = "{\"jsonrpc\":\"2.0\",\"method\":\"$/cancelRequest\","
+                        "\"params\":{\"id\":\"c1\"}}";
+    msg_t cancel = {0};
+    cancel.content = cancel_str;
+    cancel.len = strlen(cancel_str);
+    cr_assert_eq(pipeline_dispatcher(&out, &cancel, &state), 0);
+
+    output_flush(&out);
+    output_free(&out);
+    lsp_state_free(&state);
+
+    char written[512] = {0};
+    fseek(replies, 0, SEEK_SET);
+    fread(written, 1, sizeof(written) - 1, replies);
+    cr_assert_not_null(strstr(written, "{\"jsonrpc\":\"2.0\",\"id\":\"c1\","
+                                       "\"error\":{\"code\":-32800"),
+                       "Unexpected replies `%s`", written);
+    cr_assert_null(strstr(written, "isIncomplete"));
+    fclose(replies);
+}
+
+static int dispatch_str (pipeline_output *out, LspState *state,
+                         const char *json) {
+    msg_t message = {0};
+    message.len = strlen(json);
+    message.content = calloc(message.len + 1, 1);
+    memcpy(message.content, json, message.len);
+    int result = pipeline_dispatcher(out, &message, state);
+    free(message.content);
+    return result;
+}
+
+/* A burst of edits is applied one by one but analysed once, at the end */
+Test (pipeline_utils, analysis_coalesced) {
+    FILE *replies = tmpfile();
+    cr_assert_not_null(replies);
+
+    pipeline_output out;
+    output_init(&out, fileno(replies));
+
+    LspState state = {0};
+    state.client.initialized = true;
+    state.analysis.debounce_ns = 1000ull * 1000 * 1000;
+
+    cr_assert_eq(dispatch_str(&out, &state,
+                              "{\"jsonrpc\":\"2.0\","
+                              "\"method\":\"textDocument/didOpen\","
+                              "\"params\":{\"textDocument\":{"
+                              "\"uri\":\"file:///a\",\"languageId\":\"text\","
+                              "\"version\":1,\"text\":\"\"}}}"),
+                 0);
+    for (int version = 2; version <= 4; ++version) {
+        char change[256];
+        snprintf(change, sizeof(change),
+                 "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\","
+                 "\"params\":{\"textDocument\":{\"uri\":\"file:///a\","
+                 "\"version\":%d},\"contentChanges\":[{\"range\":{"
+                 "\"start\":{\"line\":0,\"character\":0},"
+                 "\"end\":{\"line\":0,\"character\":0}},\"text\":\"x\"}]}}",
+                 version);
+        cr_assert_eq(dispatch_str(&out, &state, change), 0);
+    }
+
+    u64 due = analysis_next_due(&state.analysis, &state.documents);
+    cr_assert_gt(due, 0);
+
+    /* Still inside the debounce window */
+    pipeline_run_analyses(&out, &state, due - 1);
+    cr_assert_not(output_pending(&out));
+
+    pipeline_run_analyses(&out, &state, due);
+    cr_assert(output_pending(&out));
+    cr_assert_eq(analysis_next_due(&state.analysis, &state.documents), 0);
+
+    cr_assert_eq(state.analysis.requested, 4);
+    cr_assert_eq(state.analysis.coalesced, 3);
+    cr_assert_eq(state.analysis.run, 1);
+
+    output_flush(&out);
+    output_free(&out);
+    lsp_state_free(&state);
+
+    char written[512] = {0};
+    fseek(replies, 0, SEEK_SET);
+    fread(written, 1, sizeof(written) - 1, replies);
+    cr_assert_not_null(
+        strstr(written, "\"method\":\"textDocument/publishDiagnostics\","
+                        "\"params\":{\"uri\":\"file:///a\",\"version\":4,"
+                        "\"diagnostics\":[]}"),
+        "Unexpected output `%s`", written);
+    fclose(replies);
 }
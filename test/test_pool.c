@@ -0,0 +1,405 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/pool.h"
+
+#define job_count 64
+#define key_count 4
+
+/* What the test handler saw, in the order it ran */
+static pthread_mutex_t seen_lock = PTHREAD_MUTEX_INITIALIZER;
+static int seen[job_count];
+static int seen_count;
+static atomic_int running;
+static atomic_int most_running;
+
+/* `params` is the job's number, jobs sleep a little to overlap */
+static int record_job (LspState *state, LspRequest *request) {
+
+    char number[16] = {0};
+    memcpy(number, request->params, request->params_len);
+
+    int now = atomic_fetch_add(&running, 1) + 1;
+    int most = atomic_load(&most_running);
+    while (now > most &&
+           !atomic_compare_exchange_weak(&most_running, &most, now)) {
+    }
+
+    struct timespec nap = {.tv_sec = 0, .tv_nsec = 200 * 1000};
+    nanosleep(&nap, NULL);
+
+    pthread_mutex_lock(&seen_lock);
+    seen[seen_count++] = atoi(number);
+    pthread_mutex_unlock(&seen_lock);
+
+    atomic_fetch_sub(&running, 1);
+    return 0;
+}
+
+static const method_desc record_desc = {
+    .name = "test/record",
+    .handler = record_job,
+    .kind = METHOD_NOTIFICATION,
+    .worker = true,
+};
+
+static void submit_all (worker_pool *pool) {
+
+    LspClient client = {0};
+    seen_count = 0;
+    atomic_store(&running, 0);
+    atomic_store(&most_running, 0);
+
+    for (int i = 0; i < job_count; ++i) {
+        char number[16];
+        int len = snprintf(number, sizeof(number), "%d", i);
+        /* Keys are never 0 here, 0 would let a key's jobs run in any order */
+        pool_submit(pool, pool_job_new(&record_desc, POOL_INTERACTIVE,
+                                       i % key_count + 1, &client, NULL, NULL,
+                                       0, number, len));
+    }
+}
+
+Test (pool, same_key_in_order) {
+
+    worker_pool pool;
+    pool_init(&pool, -1, NULL);
+    pool_start(&pool, 4);
+
+    submit_all(&pool);
+    pool_drain(&pool);
+
+    cr_assert_eq(seen_count, job_count);
+    cr_assert_eq(pool.completed[POOL_INTERACTIVE], job_count);
+
+    /* Within a key the jobs ran in the order they were submitted */
+    int last[key_count] = {-1, -1, -1, -1};
+    for (int i = 0; i < seen_count; ++i) {
+        int key = seen[i] % key_count;
+        cr_assert_gt(seen[i], last[key], "Job %d ran after job %d", seen[i],
+                     last[key]);
+        last[key] = seen[i];
+    }
+
+    /* Never more at once than there are keys or workers */
+    cr_assert_leq(atomic_load(&most_running), key_count);
+
+    pool_stop(&pool);
+}
+
+Test (pool, stop_finishes_queued) {
+
+    worker_pool pool;
+    pool_init(&pool, -1, NULL);
+    pool_start(&pool, 2);
+
+    submit_all(&pool);
+    pool_stop(&pool);
+
+    cr_assert_eq(seen_count, job_count);
+    cr_assert_leq(atomic_load(&most_running), 2);
+}
+
+/* Spins until released or cancelled */
+static atomic_bool blocker_started;
+static atomic_bool blocker_release;
+
+static int block_job (LspState *state, LspRequest *request) {
+
+    atomic_store(&blocker_started, true);
+    while (!atomic_load(&blocker_release)) {
+        if (lsp_request_cancelled(state, request)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static const method_desc block_desc = {
+    .name = "test/block",
+    .handler = block_job,
+    .kind = METHOD_REQUEST,
+    .worker = true,
+};
+
+Test (pool, cancel) {
+
+    FILE *replies = tmpfile();
+    cr_assert_not_null(replies);
+
+    worker_pool pool;
+    pool_init(&pool, fileno(replies), NULL);
+    pool_start(&pool, 1);
+
+    LspClient client = {0};
+    atomic_store(&blocker_started, false);
+    atomic_store(&blocker_release, false);
+    pool_submit(&pool, pool_job_new(&block_desc, POOL_INTERACTIVE, 1,
+                                    &client, NULL, "1", 1, NULL, 0));
+    pool_submit(&pool, pool_job_new(&block_desc, POOL_INTERACTIVE, 1,
+                                    &client, NULL, "2", 1, NULL, 0));
+    while (!atomic_load(&blocker_started)) {
+    }
+
+    /* The queued job comes back to be answered by the caller */
+    pool_job *queued = pool_cancel(&pool, "2", 1);
+    cr_assert_not_null(queued);
+    cr_assert_eq(queued->id_len, 1);
+    cr_assert_eq(queued->id[0], '2');
+    pool_job_free(queued);
+
+    /* The running one notices its token and is answered by its worker */
+    cr_assert_null(pool_cancel(&pool, "1", 1));
+    cr_assert_null(pool_cancel(&pool, "3", 1));
+    pool_drain(&pool);
+    cr_assert_eq(pool.cancelled, 2);
+    pool_stop(&pool);
+
+    char written[256] = {0};
+    fseek(replies, 0, SEEK_SET);
+    fread(written, 1, sizeof(written) - 1, replies);
+    cr_assert_not_null(strstr(written, "{\"jsonrpc\":\"2.0\",\"id\":1,"
+                                       "\"error\":{\"code\":-32800"),
+                       "Unexpected replies `%s`", written);
+    cr_assert_null(strstr(written, "\"id\":2"));
+    fclose(replies);
+}
+
+static void submit_keyed (worker_pool *pool, const method_desc *desc,
+                          pool_priority priority, u64 key, int number) {
+
+    LspClient client = {0};
+    char text[16];
+    int len = snprintf(text, sizeof(text), "%d", number);
+    pool_submit(pool, pool_job_new(desc, priority, key, &client, NULL, NULL,
+                                   0, text, len));
+}
+
+static void submit_numbered (worker_pool *pool, const method_desc *desc,
+                             pool_priority priority, int number) {
+    submit_keyed(pool, desc, priority, 0, number);
+}
+
+/* Queued jobs come out most urgent first, whatever order they went in */
+Test (pool, priority_order) {
+
+    worker_pool pool;
+    pool_init(&pool, -1, NULL);
+    pool_start(&pool, 1);
+
+    LspClient client = {0};
+    atomic_store(&blocker_started, false);
+    atomic_store(&blocker_release, false);
+    pool_submit(&pool, pool_job_new(&block_desc, POOL_INTERACTIVE, 0,
+                                    &client, NULL, "0", 1, NULL, 0));
+    while (!atomic_load(&blocker_started)) {
+    }
+
+    seen_count = 0;
+    submit_numbered(&pool, &record_desc, POOL_BACKGROUND, 3);
+    submit_numbered(&pool, &record_desc, POOL_FOREGROUND, 2);
+    submit_numbered(&pool, &record_desc, POOL_INTERACTIVE, 1);
+    atomic_store(&blocker_release, true);
+    pool_drain(&pool);
+
+    cr_assert_eq(seen_count, 3);
+    for (int i = 0; i < 3; ++i) {
+        cr_assert_eq(seen[i], i + 1);
+    }
+    pool_stop(&pool);
+}
+
+/* A key's jobs keep their order across classes, an urgent one waits for
+   the older background one, which runs first */
+Test (pool, same_key_across_classes) {
+
+    worker_pool pool;
+    pool_init(&pool, -1, NULL);
+    pool_start(&pool, 1);
+
+    LspClient client = {0};
+    atomic_store(&blocker_started, false);
+    atomic_store(&blocker_release, false);
+    pool_submit(&pool, pool_job_new(&block_desc, POOL_INTERACTIVE, 0,
+                                    &client, NULL, "0", 1, NULL, 0));
+    while (!atomic_load(&blocker_started)) {
+    }
+
+    seen_count = 0;
+    submit_keyed(&pool, &record_desc, POOL_BACKGROUND, 5, 1);
+    submit_keyed(&pool, &record_desc, POOL_FOREGROUND, 5, 2);
+    submit_keyed(&pool, &record_desc, POOL_FOREGROUND, 6, 3);
+    atomic_store(&blocker_release, true);
+    pool_drain(&pool);
+
+    cr_assert_eq(seen_count, 3);
+    cr_assert_eq(seen[0], 1);
+    cr_assert_eq(seen[1], 2);
+    cr_assert_eq(seen[2], 3);
+    pool_stop(&pool);
+}
+
+/* A foreground job waiting on an older background one with its key does
+   not let that one take the worker left for urgent work */
+Test (pool, same_key_keeps_a_worker) {
+
+    worker_pool pool;
+    pool_init(&pool, -1, NULL);
+    pool_start(&pool, 2);
+
+    atomic_store(&blocker_started, false);
+    atomic_store(&blocker_release, false);
+    submit_keyed(&pool, &block_desc, POOL_BACKGROUND, 1, 0);
+    while (!atomic_load(&blocker_started)) {
+    }
+
+    seen_count = 0;
+    submit_keyed(&pool, &block_desc, POOL_BACKGROUND, 5, 1);
+    submit_keyed(&pool, &record_desc, POOL_FOREGROUND, 5, 2);
+    /* Time for the free worker to take the wrong one */
+    struct timespec nap = {.tv_sec = 0, .tv_nsec = 20 * 1000 * 1000};
+    nanosleep(&nap, NULL);
+    submit_keyed(&pool, &record_desc, POOL_INTERACTIVE, 0, 3);
+
+    /* Runs while the first background job still blocks */
+    for (int tries = 0; tries < 1000; ++tries) {
+        pthread_mutex_lock(&seen_lock);
+        int count = seen_count;
+        pthread_mutex_unlock(&seen_lock);
+        if (count > 0) {
+            break;
+        }
+        nanosleep(&nap, NULL);
+    }
+    pthread_mutex_lock(&pool.lock);
+    cr_assert_eq(pool.background_running, 1);
+    pthread_mutex_unlock(&pool.lock);
+    cr_assert_eq(seen_count, 1, "The interactive job waited");
+    cr_assert_eq(seen[0], 3);
+
+    atomic_store(&blocker_release, true);
+    pool_drain(&pool);
+    cr_assert_eq(seen_count, 2);
+    cr_assert_eq(seen[1], 2);
+    cr_assert_eq(pool.completed[POOL_BACKGROUND], 2);
+    pool_stop(&pool);
+}
+
+/* Background work which yields between chunks until urgent work ran */
+static atomic_bool urgent_ran;
+static atomic_int background_running;
+
+static int chunked_job (LspState *state, LspRequest *request) {
+
+    atomic_fetch_add(&background_running, 1);
+    atomic_store(&blocker_started, true);
+    while (!atomic_load(&urgent_ran) && !atomic_load(&blocker_release)) {
+        lsp_request_yield(request);
+    }
+    atomic_fetch_sub(&background_running, 1);
+    return 0;
+}
+
+static int urgent_job (LspState *state, LspRequest *request) {
+
+    /* Runs inside the background job on the only worker */
+    cr_expect_eq(atomic_load(&background_running), 1);
+    atomic_store(&urgent_ran, true);
+    return 0;
+}
+
+static const method_desc chunked_desc = {
+    .name = "test/chunked",
+    .handler = chunked_job,
+    .kind = METHOD_NOTIFICATION,
+    .worker = true,
+};
+
+static const method_desc urgent_desc = {
+    .name = "test/urgent",
+    .handler = urgent_job,
+    .kind = METHOD_NOTIFICATION,
+    .worker = true,
+};
+
+Test (pool, background_yields) {
+
+    worker_pool pool;
+    pool_init(&pool, -1, NULL);
+    pool_start(&pool, 1);
+
+    atomic_store(&blocker_started, false);
+    atomic_store(&blocker_release, false);
+    atomic_store(&urgent_ran, false);
+    atomic_store(&background_running, 0);
+
+    submit_numbered(&pool, &chunked_desc, POOL_BACKGROUND, 0);
+    while (!atomic_load(&blocker_started)) {
+    }
+    submit_numbered(&pool, &urgent_desc, POOL_INTERACTIVE, 1);
+    pool_drain(&pool);
+
+    cr_assert(atomic_load(&urgent_ran));
+    cr_assert_eq(pool.yielded_to, 1);
+    cr_assert_eq(pool.completed[POOL_BACKGROUND], 1);
+    cr_assert_eq(pool.completed[POOL_INTERACTIVE], 1);
+    pool_stop(&pool);
+}
+
+/* Background jobs leave a worker free for urgent ones */
+Test (pool, background_leaves_a_worker) {
+
+    worker_pool pool;
+    pool_init(&pool, -1, NULL);
+    pool_start(&pool, 2);
+
+    atomic_store(&blocker_started, false);
+    atomic_store(&blocker_release, false);
+    atomic_store(&urgent_ran, false);
+    atomic_store(&background_running, 0);
+
+    /* Both block until released, neither yields anything away: the second
+       worker is the one left free */
+    submit_numbered(&pool, &block_desc, POOL_BACKGROUND, 0);
+    submit_numbered(&pool, &block_desc, POOL_BACKGROUND, 1);
+    while (!atomic_load(&blocker_started)) {
+    }
+
+    seen_count = 0;
+    submit_numbered(&pool, &record_desc, POOL_INTERACTIVE, 7);
+    while (true) {
+        pthread_mutex_lock(&seen_lock);
+        int count = seen_count;
+        pthread_mutex_unlock(&seen_lock);
+        if (count == 1) {
+            break;
+        }
+    }
+    cr_assert_eq(seen[0], 7);
+
+    pthread_mutex_lock(&pool.lock);
+    cr_assert_eq(pool.background_running, 1);
+    pthread_mutex_unlock(&pool.lock);
+
+    atomic_store(&blocker_release, true);
+    pool_drain(&pool);
+    cr_assert_eq(pool.completed[POOL_BACKGROUND], 2);
+    pool_stop(&pool);
+}
+
+Test (pool, no_threads) {
+
+    worker_pool pool;
+    pool_init(&pool, -1, NULL);
+    pool_start(&pool, 0);
+
+    cr_assert_eq(pool.count, 0);
+    cr_assert_gt(pool_default_threads(), 0);
+    pool_stop(&pool);
+}
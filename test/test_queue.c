@@ -0,0 +1,104 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/queue.h"
+
+#define queue_test_messages 20000
+
+static void *produce_numbers (void *arg) {
+
+    msg_queue *queue = arg;
+    char text[32];
+
+    for (int i = 0; i < queue_test_messages; ++i) {
+        int len = snprintf(text, sizeof(text), "%d", i);
+        msg_t *slot = msg_queue_reserve(queue, len);
+        if (!slot) {
+            break;
+        }
+        memcpy(slot->content, text, len + 1);
+        msg_queue_commit(queue);
+    }
+    msg_queue_close(queue);
+    return NULL;
+}
+
+/* A small ring keeps the producer running into backpressure */
+Test (queue, spsc_order) {
+
+    msg_queue queue;
+    msg_queue_init(&queue, 4);
+
+    pthread_t producer;
+    pthread_create(&producer, NULL, produce_numbers, &queue);
+
+    int expected = 0;
+    msg_t *msg;
+    while ((msg = msg_queue_peek(&queue)) != NULL) {
+        cr_assert_eq(atoi(msg->content), expected, "Out of order message");
+        cr_assert_eq(msg->len, strlen(msg->content));
+        msg_queue_release(&queue);
+        ++expected;
+    }
+
+    cr_assert_eq(expected, queue_test_messages, "Messages were lost");
+
+    pthread_join(producer, NULL);
+    msg_queue_destroy(&queue);
+}
+
+Test (queue, close_drains) {
+
+    msg_queue queue;
+    msg_queue_init(&queue, 2);
+
+    msg_t *slot = msg_queue_reserve(&queue, 5);
+    cr_assert_not_null(slot);
+    memcpy(slot->content, "hello", 6);
+    msg_queue_commit(&queue);
+    cr_assert_not(msg_queue_empty(&queue));
+
+    /* Closing keeps what was committed already */
+    msg_queue_close(&queue);
+    cr_assert_null(msg_queue_reserve(&queue, 1));
+
+    msg_t *msg = msg_queue_peek(&queue);
+    cr_assert_not_null(msg);
+    cr_assert_str_eq(msg->content, "hello");
+    msg_queue_release(&queue);
+
+    cr_assert(msg_queue_empty(&queue));
+    cr_assert_null(msg_queue_peek(&queue));
+
+    msg_queue_destroy(&queue);
+}
+
+Test (queue, timed_wait) {
+
+    msg_queue queue;
+    msg_queue_init(&queue, 2);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += 1000 * 1000;
+    if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000 * 1000 * 1000;
+    }
+    cr_assert_eq(msg_queue_wait(&queue, &deadline), 0);
+
+    msg_t *slot = msg_queue_reserve(&queue, 1);
+    memcpy(slot->content, "x", 2);
+    msg_queue_commit(&queue);
+    cr_assert_eq(msg_queue_wait(&queue, &deadline), 1);
+
+    msg_queue_peek(&queue);
+    msg_queue_release(&queue);
+    msg_queue_close(&queue);
+    cr_assert_eq(msg_queue_wait(&queue, &deadline), -1);
+
+    msg_queue_destroy(&queue);
+}
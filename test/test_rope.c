@@ -0,0 +1,302 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/rope.h"
+
+static void assert_text (const rope *r, const char *expected, u64 len) {
+
+    cr_assert_eq(rope_length(r), len);
+    char *flat = rope_flatten(r);
+    cr_assert_eq(memcmp(flat, expected, len), 0, "Rope and model differ");
+    free(flat);
+}
+
+/* Line walk over a flat copy, what the rope's index has to agree with */
+static u64 model_offset_of (const char *text, u64 len, u64 line,
+                            u64 character, rope_encoding encoding) {
+
+    u64 i = 0;
+    for (u64 l = 0; l < line; ++l) {
+        while (i < len && text[i] != '\n') {
+            i++;
+        }
+        if (i == len) {
+            return len;
+        }
+        i++;
+    }
+
+    u64 units = 0;
+    while (i < len && text[i] != '\n' &&
+           !(text[i] == '\r' && i + 1 < len && text[i + 1] == '\n')) {
+        u8 c = (u8) text[i];
+        if (encoding == ROPE_UTF8 || (c & 0xC0) != 0x80) {
+            if (units >= character) {
+                break;
+            }
+            units += encoding == ROPE_UTF16 && c >= 0xF0 ? 2 : 1;
+        }
+        i++;
+    }
+    return i;
+}
+
+/* Random edits against a flat buffer, large enough to split many chunks */
+Test (rope, random_edits) {
+
+    rope r = {0};
+    u64 cap = 1 << 16;
+    char *model = malloc(cap);
+    char insert[300];
+    u64 len = 0;
+
+    srand(42);
+    for (int step = 0; step < 4000; ++step) {
+        u64 at = len ? (u64) rand() % (len + 1) : 0;
+
+        if (len > 0 && rand() % 3 == 0) {
+            u64 n = (u64) rand() % (len - at + 1);
+            if (n > 200) {
+                n = 200;
+            }
+            rope_delete(&r, at, n);
+            memmove(model + at, model + at + n, len - at - n);
+            len -= n;
+        } else {
+            /* Mostly typing, sometimes pastes */
+            u64 n = rand() % 8 ? 1 + rand() % 3 : (u64) rand() % sizeof(insert);
+            if (len + n > cap) {
+                continue;
+            }
+            for (u64 k = 0; k < n; ++k) {
+                insert[k] = 'a' + (step + k) % 26;
+            }
+            rope_insert(&r, at, insert, n);
+            memmove(model + at + n, model + at, len - at);
+            memcpy(model + at, insert, n);
+            len += n;
+        }
+
+        if (step % 97 == 0) {
+            assert_text(&r, model, len);
+        }
+    }
+    assert_text(&r, model, len);
+
+    rope_replace(&r, 0, len, "new", 3);
+    assert_text(&r, "new", 3);
+    cr_assert_eq(rope_chunk_count(&r), 1);
+
+    rope_free(&r);
+    cr_assert_eq(rope_chunk_count(&r), 0);
+    free(model);
+}
+
+Test (rope, iterate_from_offset) {
+
+    char text[1000];
+    for (u64 i = 0; i < sizeof(text); ++i) {
+        text[i] = '0' + i % 10;
+    }
+    rope r = {0};
+    rope_set(&r, text, sizeof(text));
+
+    for (u64 from = 0; from <= sizeof(text); from += 37) {
+        rope_iter it;
+        const char *chunk;
+        u64 chunk_len;
+        u64 at = from;
+
+        rope_iter_init(&it, &r, from);
+        while (rope_iter_next(&it, &chunk, &chunk_len)) {
+            cr_assert_gt(chunk_len, 0);
+            cr_assert_eq(memcmp(chunk, text + at, chunk_len), 0);
+            at += chunk_len;
+        }
+        rope_iter_free(&it);
+        cr_assert_eq(at, sizeof(text));
+    }
+
+    char middle[10] = {0};
+    rope_copy(&r, 123, 9, middle);
+    cr_assert_str_eq(middle, "345678901");
+
+    rope_free(&r);
+}
+
+/* `character` counts UTF-16 code units: é is one, the emoji two */
+Test (rope, offset_of) {
+
+    const char *text = "h\xC3\xA9llo\n"
+                       "\xF0\x9F\x98\x80x\r\n"
+                       "\n"
+                       "last";
+    rope r = {0};
+    rope_set(&r, text, strlen(text));
+
+    cr_assert_eq(rope_offset_of(&r, 0, 0, ROPE_UTF16), 0);
+    cr_assert_eq(rope_offset_of(&r, 0, 1, ROPE_UTF16), 1);
+    cr_assert_eq(rope_offset_of(&r, 0, 2, ROPE_UTF16), 3);
+    cr_assert_eq(rope_offset_of(&r, 0, 5, ROPE_UTF16), 6);
+    cr_assert_eq(rope_offset_of(&r, 1, 0, ROPE_UTF16), 7);
+    cr_assert_eq(rope_offset_of(&r, 1, 2, ROPE_UTF16), 11);
+    cr_assert_eq(rope_offset_of(&r, 1, 3, ROPE_UTF16), 12);
+    cr_assert_eq(rope_offset_of(&r, 3, 4, ROPE_UTF16), 19);
+
+    /* Clamped to the end of the line, then to the end of the text */
+    cr_assert_eq(rope_offset_of(&r, 0, 100, ROPE_UTF16), 6);
+    cr_assert_eq(rope_offset_of(&r, 1, 100, ROPE_UTF16), 12);
+    cr_assert_eq(rope_offset_of(&r, 2, 1, ROPE_UTF16), 14);
+    cr_assert_eq(rope_offset_of(&r, 3, 100, ROPE_UTF16), 19);
+    cr_assert_eq(rope_offset_of(&r, 9, 0, ROPE_UTF16), 19);
+
+    /* UTF-8 counts bytes, UTF-32 code points */
+    cr_assert_eq(rope_offset_of(&r, 0, 3, ROPE_UTF8), 3);
+    cr_assert_eq(rope_offset_of(&r, 0, 100, ROPE_UTF8), 6);
+    cr_assert_eq(rope_offset_of(&r, 1, 5, ROPE_UTF8), 12);
+    cr_assert_eq(rope_offset_of(&r, 1, 1, ROPE_UTF32), 11);
+    cr_assert_eq(rope_offset_of(&r, 1, 2, ROPE_UTF32), 12);
+    cr_assert_eq(rope_offset_of(&r, 3, 2, ROPE_UTF8), 17);
+
+    u64 line, character;
+    rope_position_of(&r, 11, ROPE_UTF16, &line, &character);
+    cr_assert(line == 1 && character == 2);
+    rope_position_of(&r, 11, ROPE_UTF32, &line, &character);
+    cr_assert(line == 1 && character == 1);
+    rope_position_of(&r, 11, ROPE_UTF8, &line, &character);
+    cr_assert(line == 1 && character == 4);
+
+    /* Chunk boundaries may fall inside a UTF-8 sequence */
+    rope_insert(&r, 2, "\xC3\xA9", 2);
+    rope_delete(&r, 2, 2);
+    assert_text(&r, text, strlen(text));
+    cr_assert_eq(rope_offset_of(&r, 0, 2, ROPE_UTF16), 3);
+
+    rope_free(&r);
+}
+
+/* Random edits of mixed width text, positions checked against a line walk */
+Test (rope, positions_random) {
+
+    const char *pieces[] = {"a", "bc", " ", "\n", "\r\n", "\xC3\xA9",
+                            "\xF0\x9F\x98\x80", "\xE2\x82\xAC"};
+    rope r = {0};
+    char model[8192];
+    u64 len = 0;
+
+    srand(7);
+    for (int step = 0; step < 3000; ++step) {
+        u64 at = len ? (u64) rand() % (len + 1) : 0;
+
+        if (len > 64 && rand() % 4 == 0) {
+            u64 n = (u64) rand() % (len - at + 1) % 32;
+            rope_delete(&r, at, n);
+            memmove(model + at, model + at + n, len - at - n);
+            len -= n;
+        } else {
+            const char *piece = pieces[rand() % ARRAY_LENGTH(pieces)];
+            u64 n = strlen(piece);
+            if (len + n > sizeof(model)) {
+                continue;
+            }
+            rope_insert(&r, at, piece, n);
+            memmove(model + at + n, model + at, len - at);
+            memcpy(model + at, piece, n);
+            len += n;
+        }
+
+        if (step % 11) {
+            continue;
+        }
+        u64 lines = 1;
+        for (u64 i = 0; i < len; ++i) {
+            lines += model[i] == '\n';
+        }
+        cr_assert_eq(rope_line_count(&r), lines);
+
+        for (int probe = 0; probe < 20; ++probe) {
+            u64 line = (u64) rand() % (lines + 1);
+            u64 character = (u64) rand() % 40;
+            rope_encoding encoding = probe % 3;
+            cr_assert_eq(
+                rope_offset_of(&r, line, character, encoding),
+                model_offset_of(model, len, line, character, encoding),
+                "Wrong offset for %llu:%llu in encoding %d at step %d", line,
+                character, encoding, step);
+        }
+
+        /* Offsets at code point boundaries survive a round trip, except
+           between `\r` and `\n` where positions are clamped */
+        for (u64 offset = 0; offset <= len; ++offset) {
+            if ((offset < len && ((u8) model[offset] & 0xC0) == 0x80) ||
+                (offset > 0 && model[offset - 1] == '\r')) {
+                continue;
+            }
+            rope_encoding encoding = offset % 3;
+            u64 line, character;
+            rope_position_of(&r, offset, encoding, &line, &character);
+            cr_assert_eq(rope_offset_of(&r, line, character, encoding),
+                         offset, "Offset %llu came back as %llu:%llu", offset,
+                         line, character);
+        }
+    }
+
+    rope_free(&r);
+}
+
+#define snapshot_count 64
+
+static void *release_snapshots (void *arg) {
+
+    rope *snapshots = arg;
+    for (int i = 0; i < snapshot_count; ++i) {
+        rope_free(&snapshots[i]);
+    }
+    return NULL;
+}
+
+/* Snapshots keep their text while the rope is edited, and may be released
+   on another thread meanwhile */
+Test (rope, snapshots) {
+
+    char text[2000];
+    for (u64 i = 0; i < sizeof(text); ++i) {
+        text[i] = 'a' + i % 26;
+    }
+    rope r = {0};
+    rope_set(&r, text, sizeof(text));
+
+    rope first = rope_snapshot(&r);
+    rope snapshots[snapshot_count];
+    u64 lengths[snapshot_count];
+
+    srand(3);
+    for (int i = 0; i < snapshot_count; ++i) {
+        snapshots[i] = rope_snapshot(&r);
+        lengths[i] = rope_length(&r);
+        for (int k = 0; k < 8; ++k) {
+            u64 at = (u64) rand() % rope_length(&r);
+            rope_insert(&r, at, "XY", 2);
+            rope_delete(&r, at / 2, 1);
+        }
+    }
+    for (int i = 0; i < snapshot_count; ++i) {
+        cr_assert_eq(rope_length(&snapshots[i]), lengths[i]);
+    }
+
+    pthread_t thread;
+    cr_assert_eq(pthread_create(&thread, NULL, release_snapshots, snapshots),
+                 0);
+    for (int k = 0; k < 2000; ++k) {
+        rope_insert(&r, (u64) rand() % rope_length(&r), "z", 1);
+    }
+    pthread_join(thread, NULL);
+
+    assert_text(&first, text, sizeof(text));
+    rope_free(&first);
+    rope_free(&r);
+}
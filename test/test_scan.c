@@ -0,0 +1,132 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/scan.h"
+
+static const scan_impl all_impls[] = {
+    SCAN_IMPL_SCALAR,
+    SCAN_IMPL_SSE2,
+    SCAN_IMPL_AVX2,
+};
+
+/* Header break at every offset around the 16 and 32 byte vector widths */
+Test (scan, header_break_offsets) {
+
+    char buf[128];
+
+    for (size_t impl = 0; impl < ARRAY_LENGTH(all_impls); ++impl) {
+        scan_use_impl(all_impls[impl]);
+
+        for (u64 at = 0; at + 4 <= sizeof(buf); ++at) {
+            memset(buf, 'x', sizeof(buf));
+            memcpy(buf + at, "\r\n\r\n", 4);
+
+            cr_assert_eq(scan_find_header_break(buf, sizeof(buf)), (i64) at,
+                         "Wrong header break with `%s` at %llu",
+                         scan_impl_name(scan_active_impl()), at);
+            /* Cut off one byte before the break completes */
+            cr_assert_eq(scan_find_header_break(buf, at + 3), -1,
+                         "Partial header break matched with `%s`",
+                         scan_impl_name(scan_active_impl()));
+        }
+
+        /* A lone `\r\n` is not a header break */
+        memset(buf, 'x', sizeof(buf));
+        memcpy(buf + 40, "\r\nx\r\n", 5);
+        cr_assert_eq(scan_find_header_break(buf, sizeof(buf)), -1);
+    }
+}
+
+Test (scan, find_byte) {
+
+    char buf[100];
+
+    for (size_t impl = 0; impl < ARRAY_LENGTH(all_impls); ++impl) {
+        scan_use_impl(all_impls[impl]);
+
+        for (u64 at = 0; at < sizeof(buf); ++at) {
+            memset(buf, 'a', sizeof(buf));
+            buf[at] = '\n';
+            cr_assert_eq(scan_find_byte(buf, sizeof(buf), '\n'), buf + at);
+        }
+        cr_assert_null(scan_find_byte(buf, 0, '\n'));
+    }
+}
+
+Test (scan, count_and_utf16) {
+
+    char buf[100];
+    /* é, € and an emoji, which needs a surrogate pair */
+    const char *wide = "\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80";
+
+    for (size_t impl = 0; impl < ARRAY_LENGTH(all_impls); ++impl) {
+        scan_use_impl(all_impls[impl]);
+
+        memset(buf, 'a', sizeof(buf));
+        for (u64 at = 0; at < sizeof(buf); at += 7) {
+            buf[at] = '\n';
+        }
+        cr_assert_eq(scan_count_byte(buf, sizeof(buf), '\n'), 15);
+        cr_assert_eq(scan_count_byte(buf, 0, '\n'), 0);
+
+        cr_assert_eq(scan_ascii_prefix(buf, sizeof(buf)), sizeof(buf));
+        cr_assert_eq(scan_utf16_count(buf, sizeof(buf)), sizeof(buf));
+
+        /* Every placement around the vector width */
+        for (u64 at = 0; at + 9 <= sizeof(buf); ++at) {
+            memset(buf, 'a', sizeof(buf));
+            memcpy(buf + at, wide, 9);
+            cr_assert_eq(scan_ascii_prefix(buf, sizeof(buf)), at,
+                         "Wrong ASCII prefix with `%s` at %llu",
+                         scan_impl_name(scan_active_impl()), at);
+            cr_assert_eq(scan_utf16_count(buf, sizeof(buf)),
+                         sizeof(buf) - 9 + 4,
+                         "Wrong UTF-16 count with `%s` at %llu",
+                         scan_impl_name(scan_active_impl()), at);
+        }
+    }
+}
+
+Test (scan, headers) {
+
+    const char *messages[] = {
+        "Content-Length: 123\r\n\r\n{",
+        "content-length:42\r\n\r\n",
+        "Content-Type: application/vscode-jsonrpc; charset=utf-8\r\n"
+        "Content-Length: 7 \r\n\r\n",
+        "Content-Length: 9\r\n"
+        "Content-Type: application/vscode-jsonrpc; charset=utf-8\r\n\r\n",
+        "Content-Length: abc\r\n\r\n",
+        "Content-Length: 12x\r\n\r\n",
+        "Content-Type: text\r\n\r\n",
+        "Content-Length: 99999999999999999999999\r\n\r\n",
+        "Content-Length: 5\r\n",
+        "Content-Length: 18446744073709551615\r\n\r\n",
+        "Content-Length: 268435457\r\n\r\n",
+        "Content-Length: 268435456\r\n\r\n",
+        "\r\n{",
+    };
+    const u64 expected_len[] = {123, 42, 7, 9, 0, 0, 0, 0, 0, 0, 0,
+                                SCAN_MAX_CONTENT_LEN, 0};
+    const i64 expected_body[] = {23, 21, 79, 78, 23, 23, 22, 43, -1, 40, 29,
+                                 29, 2};
+
+    for (size_t impl = 0; impl < ARRAY_LENGTH(all_impls); ++impl) {
+        scan_use_impl(all_impls[impl]);
+
+        for (size_t i = 0; i < ARRAY_LENGTH(messages); ++i) {
+            u64 content_len = 1;
+            i64 body = scan_headers(messages[i], strlen(messages[i]),
+                                    &content_len);
+
+            cr_assert_eq(body, expected_body[i],
+                         "Wrong body offset for message %zu with `%s`", i,
+                         scan_impl_name(scan_active_impl()));
+            cr_assert_eq(content_len, expected_len[i],
+                         "Wrong Content-Length for message %zu with `%s`", i,
+                         scan_impl_name(scan_active_impl()));
+        }
+    }
+}
@@ -0,0 +1,137 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <string.h>
+
+#include "../src/scan.h"
+#include "../src/tokenize.h"
+
+/* Asserts the words of `text` are exactly `expected`, NULL terminated */
+static void expect_words (const char *text, const char **expected) {
+
+    word_spans words = {0};
+    u64 count = tokenize_words(text, strlen(text), &words);
+
+    u64 i = 0;
+    for (; expected[i]; ++i) {
+        cr_assert_lt(i, count, "Missing `%s` in `%s`", expected[i], text);
+        const word_span *word = &words.spans[i];
+        cr_assert_eq(word->len, strlen(expected[i]));
+        cr_assert(memcmp(text + word->offset, expected[i], word->len) == 0,
+                  "`%.*s` instead of `%s`", (int) word->len,
+                  text + word->offset, expected[i]);
+    }
+    cr_assert_eq(count, i, "`%llu` words in `%s`", count, text);
+
+    word_spans_free(&words);
+}
+
+Test (tokenize, words) {
+
+    expect_words("", (const char *[]) {NULL});
+    expect_words("  \n\t ", (const char *[]) {NULL});
+    expect_words("one", (const char *[]) {"one", NULL});
+    expect_words("# One, two; three!\n- four.",
+                 (const char *[]) {"One", "two", "three", "four", NULL});
+}
+
+/* Apostrophes and hyphens only join letters */
+Test (tokenize, joiners) {
+
+    expect_words("don't well-known 'quoted' trailing- -leading",
+                 (const char *[]) {"don't", "well-known", "quoted", "trailing",
+                                   "leading", NULL});
+    expect_words("a--b rock'n'roll",
+                 (const char *[]) {"a", "b", "rock'n'roll", NULL});
+}
+
+/* Anything with a digit in it is not a word */
+Test (tokenize, digits) {
+
+    expect_words("v2 2nd 10 abc123 word",
+                 (const char *[]) {"word", NULL});
+}
+
+/* Non-ASCII letters belong to words, typographic punctuation does not */
+Test (tokenize, utf8) {
+
+    expect_words("na\xc3\xafve caf\xc3\xa9",
+                 (const char *[]) {"na\xc3\xafve", "caf\xc3\xa9", NULL});
+    expect_words("\xe2\x80\x9cquoted\xe2\x80\x9d it\xe2\x80\x99s",
+                 (const char *[]) {"quoted", "it\xe2\x80\x99s", NULL});
+    expect_words("\xc2\xbfqu\xc3\xa9?\xc2\xa0s\xc3\xad",
+                 (const char *[]) {"qu\xc3\xa9", "s\xc3\xad", NULL});
+    /* A stray continuation byte splits words */
+    expect_words("ab\x80" "cd", (const char *[]) {"ab", "cd", NULL});
+}
+
+static const scan_impl all_impls[] = {
+    SCAN_IMPL_SCALAR,
+    SCAN_IMPL_SSE2,
+    SCAN_IMPL_AVX2,
+};
+
+static u64 seed = 1;
+
+static u32 next_random (void) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    return (u32) (seed >> 33);
+}
+
+/* Every vector implementation finds what the scalar one does, with words,
+   joiners and non-ASCII characters falling across the 64 byte blocks */
+Test (tokenize, impls_agree) {
+
+    static const char *pieces[] = {
+        "a",  "Z",  "word", "'",  "-",  " ",  "\n", "1",
+        ".",  "``", "\xc3\xa9", "\xe2\x80\x99", "\xe2\x80\x9c", "\x80",
+        "\xe4\xb8\xad", "\xc3",
+    };
+    char text[512];
+    word_spans expected = {0};
+    word_spans got = {0};
+
+    for (int round = 0; round < 2000; ++round) {
+        u64 len = 0;
+        u64 target = next_random() % 400;
+        /* Mostly letters, so words run long and across blocks */
+        while (len < target) {
+            u32 pick = next_random() % 32;
+            const char *piece = pick < 16 ? pieces[pick] : "abcdefgh";
+            if (pick >= 16) {
+                piece += next_random() % 8;
+            }
+            u64 piece_len = strlen(piece);
+            memcpy(text + len, piece, piece_len);
+            len += piece_len;
+        }
+
+        for (size_t impl = 1; impl < ARRAY_LENGTH(all_impls); ++impl) {
+            if (scan_use_impl(all_impls[impl]) != all_impls[impl]) {
+                continue;
+            }
+            /* Also at every start within the first block */
+            u64 skip = (u64) round % 64 < len ? (u64) round % 64 : 0;
+            scan_use_impl(SCAN_IMPL_SCALAR);
+            tokenize_words(text + skip, len - skip, &expected);
+            scan_use_impl(all_impls[impl]);
+            tokenize_words(text + skip, len - skip, &got);
+
+            cr_assert_eq(got.count, expected.count,
+                         "`%llu` words instead of `%llu` with `%s` in `%.*s`",
+                         got.count, expected.count,
+                         scan_impl_name(all_impls[impl]), (int) (len - skip),
+                         text + skip);
+            for (u64 w = 0; w < got.count; ++w) {
+                cr_assert(got.spans[w].offset == expected.spans[w].offset &&
+                              got.spans[w].len == expected.spans[w].len,
+                          "Word `%llu` differs with `%s` in `%.*s`", w,
+                          scan_impl_name(all_impls[impl]),
+                          (int) (len - skip), text + skip);
+            }
+        }
+    }
+
+    scan_use_impl(SCAN_IMPL_AUTO);
+    word_spans_free(&expected);
+    word_spans_free(&got);
+}
@@ -0,0 +1,77 @@
+/**
+ * gen_methods
+ * Build time generator for the method lookup table. Searches for a hash seed
+ * and the smallest power of two table for which `method_hash` places every
+ * method in methods.def in its own slot, then prints the table as a header.
+ *
+ * Usage: gen_methods > method_table.h
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/common.h"
+#include "../src/method_hash.h"
+
+#define max_table_bits 12
+#define max_seed_tries 2000000
+
+static const char *methods[] = {
+    NULL,
+#define METHOD(id, name, handler, kind, needs_init, worker) name,
+#include "../src/methods.def"
+#undef METHOD
+};
+
+#define method_count ARRAY_LENGTH(methods)
+
+static u16 slots[1 << max_table_bits];
+
+static int try_seed (u32 seed, u32 bits) {
+
+    u32 mask = (1u << bits) - 1;
+    memset(slots, 0, sizeof(u16) << bits);
+
+    for (u32 i = 1; i < method_count; ++i) {
+        u32 slot = method_hash(methods[i], strlen(methods[i]), seed) & mask;
+        if (slots[slot]) {
+            return 0;
+        }
+        slots[slot] = i;
+    }
+    return 1;
+}
+
+int main (void) {
+
+    u32 bits = 1;
+    while ((1u << bits) < method_count) {
+        ++bits;
+    }
+
+    for (; bits <= max_table_bits; ++bits) {
+        for (u32 seed = 1; seed < max_seed_tries; ++seed) {
+
+            if (!try_seed(seed, bits)) {
+                continue;
+            }
+
+            printf("/* Generated by tools/gen_methods.c from src/methods.def, "
+                   "do not edit. */\n");
+            printf("#ifndef METHOD_TABLE_H_\n#define METHOD_TABLE_H_\n\n");
+            printf("#define METHOD_HASH_SEED %uu\n", seed);
+            printf("#define METHOD_TABLE_BITS %u\n\n", bits);
+            printf("static const u16 method_slots[1u << METHOD_TABLE_BITS] "
+                   "= {");
+            for (u32 i = 0; i < (1u << bits); ++i) {
+                printf("%s%u,", (i % 16) ? " " : "\n    ", slots[i]);
+            }
+            printf("\n};\n\n#endif  // METHOD_TABLE_H_\n");
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "No collision free seed found for %zu methods.\n",
+            method_count - 1);
+    return 1;
+}